@@ -3,6 +3,8 @@
 #include <stdlib.h>
 #include <assert.h>
 #include "imgproc.h"
+#include "imgproc_kernels.h"
+#include "imgproc_swar.h"
 
 // Helper functions
 
@@ -78,19 +80,17 @@ uint32_t blur_pixel( struct Image *img, int32_t row, int32_t col, int32_t blur_d
 }
 
 uint32_t rot_pixel( struct Image *img, int32_t index ) { 
-  // Get the pixel at the index
-  uint32_t pixel = img->data[index];
-  // Get the r, g, b, a values of the pixel
-  uint32_t r = get_r(pixel);
-  uint32_t g = get_g(pixel);
-  uint32_t b = get_b(pixel);
-  uint32_t a = get_a(pixel);
-  // return the new pixel with rotated colors
-  return make_pixel(b, r, g, a);
+  // Rotate the r, g, b values of the pixel in place, keeping a
+  return swar_rot(img->data[index]);
 }
 
 // Average the the pixels 
 uint32_t avg_pixels( uint32_t *pixels, int num_pixels) {
+  // Average all four components at once if the sums fit in 16 bits
+  if (num_pixels <= 257) {
+    return swar_avg(pixels, num_pixels);
+  }
+
   uint32_t r_total = 0;
   uint32_t g_total = 0;
   uint32_t b_total = 0;
@@ -145,6 +145,11 @@ uint32_t avg_pixels( uint32_t *pixels, int num_pixels) {
 //! @param xfac factor to downsize the image horizontally; guaranteed to be positive
 //! @param yfac factor to downsize the image vertically; guaranteed to be positive
 void imgproc_squash( struct Image *input_img, struct Image *output_img, int32_t xfac, int32_t yfac ) {
+  // Use the SIMD kernels if this CPU supports them
+  if (imgproc_kernels_squash(input_img, output_img, xfac, yfac)) {
+    return;
+  }
+
   // Loop through the output image and sample from the input image
   for (int32_t row = 0; row < output_img->height; row++) {
     for (int32_t col = 0; col < output_img->width; col++) {
@@ -176,6 +181,11 @@ void imgproc_squash( struct Image *input_img, struct Image *output_img, int32_t
 //! @param output_img pointer to the output Image (in which the
 //!                   transformed pixels should be stored)
 void imgproc_color_rot( struct Image *input_img, struct Image *output_img) {
+  // Use the SIMD kernels if this CPU supports them
+  if (imgproc_kernels_color_rot(input_img, output_img)) {
+    return;
+  }
+
   // With helper function for each pixel, just loop through and output.
   for (int32_t row = 0; row < input_img->height; row++) {
     for (int32_t col = 0; col < input_img->width; col++) {
@@ -213,6 +223,11 @@ void imgproc_color_rot( struct Image *input_img, struct Image *output_img) {
 //!                  component averages used to determine the color
 //!                  components of the output pixel
 void imgproc_blur( struct Image *input_img, struct Image *output_img, int32_t blur_dist ) {
+  // Use the SIMD kernels if this CPU supports them
+  if (imgproc_kernels_blur(input_img, output_img, blur_dist)) {
+    return;
+  }
+
   // With helper function for each pixel, just loop through and output.
   for (int32_t row = 0; row < input_img->height; row++) {
     for (int32_t col = 0; col < input_img->width; col++) {
@@ -262,6 +277,11 @@ void imgproc_blur( struct Image *input_img, struct Image *output_img, int32_t bl
 //! @param output_img pointer to the output Image (in which the
 //!                   transformed pixels should be stored)
 void imgproc_expand( struct Image *input_img, struct Image *output_img) {
+  // Use the SIMD kernels if this CPU supports them
+  if (imgproc_kernels_expand(input_img, output_img)) {
+    return;
+  }
+
   for (int32_t row = 0; row < output_img->height; row++) {
     for (int32_t col = 0; col < output_img->width; col++) {
 
@@ -274,42 +294,39 @@ void imgproc_expand( struct Image *input_img, struct Image *output_img) {
       // Case 2: i (row) even, j odd
       else if (row % 2 == 0 && col % 2 == 1) {
         int32_t indexOut = compute_index(output_img, row, col);
-        uint32_t pixels[2];
-        size_t count = 0;
-        pixels[count++] = input_img->data[compute_index(input_img, row/2, col/2)];
+        uint32_t pixel = input_img->data[compute_index(input_img, row/2, col/2)];
         if (col/2 + 1 < input_img->width) {
-          pixels[count++] = input_img->data[compute_index(input_img, row/2, col/2 + 1)];
+          pixel = swar_avg2(pixel, input_img->data[compute_index(input_img, row/2, col/2 + 1)]);
         } 
-        output_img->data[indexOut] = avg_pixels(pixels, count);
+        output_img->data[indexOut] = pixel;
       }
       // Case 3: i odd, j (col) even
       else if (row % 2 == 1 && col % 2 == 0) {
         int32_t indexOut = compute_index(output_img, row, col);
-        uint32_t pixels[2];
-        size_t count = 0;
-        pixels[count++] = input_img->data[compute_index(input_img, row/2, col/2)];
+        uint32_t pixel = input_img->data[compute_index(input_img, row/2, col/2)];
         if (row/2 + 1 < input_img->height) {
-          pixels[count++] = input_img->data[compute_index(input_img, row/2 + 1, col/2)];
+          pixel = swar_avg2(pixel, input_img->data[compute_index(input_img, row/2 + 1, col/2)]);
         } 
-        output_img->data[indexOut] = avg_pixels(pixels, count);    
+        output_img->data[indexOut] = pixel;    
       }
       // Case 4: both odd
       else {
         int32_t indexOut = compute_index(output_img, row, col);
-        // average of four pixels
-        uint32_t pixels[4];
-        size_t count = 0; 
-        pixels[count++] = input_img->data[compute_index(input_img, row/2, col/2)];
-        if (col/2 + 1 < input_img->width) {
-          pixels[count++] = input_img->data[compute_index(input_img, row/2, col/2 + 1)];
-        } 
-        if (row/2 + 1 < input_img->height) {
-          pixels[count++] = input_img->data[compute_index(input_img, row/2 + 1, col/2)];
-        } 
-        if (col/2 + 1 < input_img->width && row/2 + 1 < input_img->height) {
-          pixels[count++] = input_img->data[compute_index(input_img, row/2 + 1, col/2 + 1)];
-        } 
-        output_img->data[indexOut] = avg_pixels(pixels, count);
+        // average of up to four pixels (always 1, 2 or 4 are in bounds)
+        int right = col/2 + 1 < input_img->width;
+        int below = row/2 + 1 < input_img->height;
+        uint32_t pixel = input_img->data[compute_index(input_img, row/2, col/2)];
+        if (right && below) {
+          pixel = swar_avg4(pixel,
+                            input_img->data[compute_index(input_img, row/2, col/2 + 1)],
+                            input_img->data[compute_index(input_img, row/2 + 1, col/2)],
+                            input_img->data[compute_index(input_img, row/2 + 1, col/2 + 1)]);
+        } else if (right) {
+          pixel = swar_avg2(pixel, input_img->data[compute_index(input_img, row/2, col/2 + 1)]);
+        } else if (below) {
+          pixel = swar_avg2(pixel, input_img->data[compute_index(input_img, row/2 + 1, col/2)]);
+        }
+        output_img->data[indexOut] = pixel;
       }
     }
   }
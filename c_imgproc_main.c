@@ -1,38 +1,66 @@
 // C main function for image processing program
 
+#include <math.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
 #include <assert.h>
+#include <unistd.h>
 #include "imgproc.h"
+#include "imgproc_pipeline.h"
+#include "imgproc_batch.h"
+#include "imgproc_ooc.h"
+#include "imgproc_server.h"
+#include "imgtrace.h"
 
 struct Transformation {
   const char *name;
   int (*apply)( struct Image *input_img, struct Image *output_img, int argc, char **argv );
   int (*out_dimensions)( struct Image *input_img, int argc, char **argv, int32_t *out_w, int32_t *out_h );
+  // Transform the input image's own pixels instead (NULL if the
+  // transformation can't be done in place)
+  int (*apply_in_place)( struct Image *img, int argc, char **argv );
 };
 
 int apply_squash( struct Image *input_img, struct Image *output_img, int argc, char **argv );
 int apply_rot( struct Image *input_img, struct Image *output_img, int argc, char **argv );
 int apply_blur( struct Image *input_img, struct Image *output_img, int argc, char **argv );
 int apply_expand( struct Image *input_img, struct Image *output_img, int argc, char **argv );
+int apply_gaussian( struct Image *input_img, struct Image *output_img, int argc, char **argv );
+int apply_pipeline( struct Image *input_img, struct Image *output_img, int argc, char **argv );
+
+int apply_squash_in_place( struct Image *img, int argc, char **argv );
+int apply_rot_in_place( struct Image *img, int argc, char **argv );
+int apply_blur_in_place( struct Image *img, int argc, char **argv );
 
 int out_dimensions_squash( struct Image *input_img, int argc, char **argv, int32_t *out_w, int32_t *out_h );
 int out_dimensions_expand( struct Image *input_img, int argc, char **argv, int32_t *out_w, int32_t *out_h );
 int out_dimensions_same( struct Image *input_img, int argc, char **argv, int32_t *out_w, int32_t *out_h );
+int out_dimensions_pipeline( struct Image *input_img, int argc, char **argv, int32_t *out_w, int32_t *out_h );
 
 static const struct Transformation s_transformations[] = {
-  { "squash", apply_squash, out_dimensions_squash },
-  { "color_rot", apply_rot, out_dimensions_same },
-  { "blur", apply_blur, out_dimensions_same },
-  { "expand", apply_expand, out_dimensions_expand },
-  { NULL, NULL },
+  { "squash", apply_squash, out_dimensions_squash, apply_squash_in_place },
+  { "color_rot", apply_rot, out_dimensions_same, apply_rot_in_place },
+  { "blur", apply_blur, out_dimensions_same, apply_blur_in_place },
+  { "expand", apply_expand, out_dimensions_expand, NULL },
+  { "gaussian", apply_gaussian, out_dimensions_same, NULL },
+  { "pipeline", apply_pipeline, out_dimensions_pipeline, NULL },
+  { NULL, NULL, NULL, NULL },
 };
 
 void usage( const char *progname ) {
   fprintf( stderr, "Error: invalid command-line arguments\n" );
-  fprintf( stderr, "Usage: %s <transform> <input img> <output img> [args...]\n", progname );
+  fprintf( stderr, "Usage: %s [--trusted] <transform> <input img> <output img> [args...]\n", progname );
+  fprintf( stderr, "       %s [--trusted] pipeline <input img> <output img> <transform> [args...] ...\n", progname );
+  fprintf( stderr, "       %s [--trusted] batch <job file>\n", progname );
+  fprintf( stderr, "       %s [--trusted] serve <socket>\n", progname );
+  fprintf( stderr, "       %s remote <socket> <transform> <input img> <output img> [args...]\n", progname );
+  fprintf( stderr, "       %s stats <socket>\n", progname );
+  fprintf( stderr, "--trusted skips checksum checks of inputs (only use it for files written by %s)\n", progname );
+  fprintf( stderr, "Images are PNG files, or .rimg (raw), .qoi (QOI) or .timg (tiled) files by extension;\n"
+           "a pipeline with no stages converts between formats\n" );
   exit( 1 );
 }
 
@@ -51,6 +79,21 @@ int squash_get_factors( int argc, char **argv, int32_t *xfac, int32_t *yfac ) {
   return 1;
 }
 
+// Get the transformation given on the command line as pipeline stages
+// (a single transformation is a one-stage pipeline). Returns the number
+// of stages, or -1 if the arguments are invalid.
+int get_stages( const struct Transformation *xform, int argc, char **argv, struct ImgprocStage *stages ) {
+  if ( xform->apply == apply_pipeline )
+    return imgproc_parse_stages( argc - 4, argv + 4, stages, IMGPROC_MAX_STAGES );
+
+  char *args[IMGPROC_MAX_STAGES];
+  int num_args = 0;
+  args[num_args++] = argv[1];
+  for ( int i = 4; i < argc && num_args < IMGPROC_MAX_STAGES; i++ )
+    args[num_args++] = argv[i];
+  return imgproc_parse_stages( num_args, args, stages, IMGPROC_MAX_STAGES );
+}
+
 // Make a new empty output Image.
 // Calls the out_dimensions function of the Transformation
 // to determine the dimensions of the output Image.
@@ -92,7 +135,111 @@ void cleanup_image( struct Image *img ) {
   }
 }
 
+// The daemon run by the serve command, stopped by SIGINT and SIGTERM
+static struct ImgprocServer *s_server;
+
+static void stop_server( int sig ) {
+  (void) sig;
+  imgproc_server_stop( s_server );
+}
+
+// Run a daemon on the socket at socket_path until it is interrupted
+int serve( const char *socket_path, int read_flags ) {
+  s_server = imgproc_server_create( socket_path, read_flags );
+  if ( s_server == NULL ) {
+    fprintf( stderr, "Error: couldn't listen on socket '%s'\n", socket_path );
+    return 1;
+  }
+  struct sigaction sa;
+  memset( &sa, 0, sizeof( sa ) );
+  sa.sa_handler = stop_server;
+  sigaction( SIGINT, &sa, NULL );
+  sigaction( SIGTERM, &sa, NULL );
+  int rc = imgproc_server_run( s_server );
+  if ( rc != 0 )
+    fprintf( stderr, "Error: couldn't accept clients on socket '%s'\n", socket_path );
+  imgproc_server_destroy( s_server );
+  return rc == 0 ? 0 : 1;
+}
+
+// Have the daemon at socket_path transform an image, given the rest of
+// the command line as for a local transformation (argv[0] is the
+// transformation). Jobs are given IMGPROC_JOB_TIMEOUT milliseconds, if
+// it is set.
+int remote( const char *socket_path, int argc, char **argv ) {
+  // The stage arguments: the transformation and its arguments, or
+  // just the stages of a pipeline
+  char args[IMGPROC_SERVER_MAX_ARGS] = "";
+  size_t len = 0;
+  for ( int i = 0; i < argc; i++ ) {
+    if ( i == 1 || i == 2 || (i == 0 && strcmp( argv[0], "pipeline" ) == 0) )
+      continue;
+    int n = snprintf( args + len, sizeof( args ) - len, "%s%s", len > 0 ? " " : "", argv[i] );
+    if ( n < 0 || (size_t) n >= sizeof( args ) - len ) {
+      fprintf( stderr, "Error: too many arguments\n" );
+      return 1;
+    }
+    len += n;
+  }
+
+  const char *env = getenv( "IMGPROC_JOB_TIMEOUT" );
+  long timeout_ms = env != NULL ? strtol( env, NULL, 10 ) : 0;
+  int rc = imgproc_client_run( socket_path, argv[1], argv[2], args, timeout_ms > 0 ? (uint32_t) timeout_ms : 0 );
+  if ( rc == IMG_SUCCESS )
+    return 0;
+  if ( rc == IMGPROC_SERVER_BAD_REQUEST )
+    fprintf( stderr, "Error: invalid transformation\n" );
+  else if ( rc == IMG_ERR_CANCELLED )
+    fprintf( stderr, "Error: the daemon ran out of time\n" );
+  else
+    fprintf( stderr, "Error: couldn't transform image through the daemon at '%s' (error %d)\n", socket_path, rc );
+  return 1;
+}
+
 int main( int argc, char **argv ) {
+  // With IMGPROC_TRACE set, a trace of the run is written at exit
+  imgtrace_init();
+
+  // Inputs are trusted to be intact (e.g. written by an earlier run), so
+  // their checksums needn't be checked
+  int read_flags = 0;
+  if ( argc >= 2 && strcmp( argv[1], "--trusted" ) == 0 ) {
+    read_flags = IMG_READ_TRUSTED;
+    argv[1] = argv[0];
+    argv++;
+    argc--;
+  }
+
+  // A batch runs the jobs listed in a file (see imgproc_batch.h)
+  if ( argc >= 2 && strcmp( argv[1], "batch" ) == 0 ) {
+    if ( argc != 3 )
+      usage( argv[0] );
+    return imgproc_batch_run( argv[2], read_flags ) == 0 ? 0 : 1;
+  }
+
+  // The daemon, its clients, and its statistics (see imgproc_server.h)
+  if ( argc >= 2 && strcmp( argv[1], "serve" ) == 0 ) {
+    if ( argc != 3 )
+      usage( argv[0] );
+    return serve( argv[2], read_flags );
+  }
+  if ( argc >= 2 && strcmp( argv[1], "remote" ) == 0 ) {
+    if ( argc < 6 )
+      usage( argv[0] );
+    return remote( argv[2], argc - 3, argv + 3 );
+  }
+  if ( argc >= 2 && strcmp( argv[1], "stats" ) == 0 ) {
+    if ( argc != 3 )
+      usage( argv[0] );
+    int sock = imgproc_client_connect( argv[2] );
+    int ok = sock >= 0 && imgproc_client_stats( sock, stdout );
+    if ( sock >= 0 )
+      close( sock );
+    if ( !ok )
+      fprintf( stderr, "Error: couldn't get statistics from the daemon at '%s'\n", argv[2] );
+    return ok ? 0 : 1;
+  }
+
   if ( argc < 4 )
     usage( argv[0] );
 
@@ -114,18 +261,63 @@ int main( int argc, char **argv ) {
     return 1;
   }
 
-  // Allocate and read the input image
+  // An image too large to transform in memory is processed out of core,
+  // a band of rows at a time
+  struct ImgprocStage stages[IMGPROC_MAX_STAGES];
+  int num_stages = get_stages( xform, argc, argv, stages );
+  if ( num_stages >= 0 && imgproc_ooc_wanted( input_filename, stages, num_stages ) ) {
+    if ( imgproc_ooc_run( input_filename, output_filename, stages, num_stages, read_flags ) != IMG_SUCCESS ) {
+      fprintf( stderr, "Error: couldn't transform image out of core\n" );
+      return 1;
+    }
+    return 0;
+  }
+
+  // Allocate and read the input image. A pipeline that starts with a
+  // crop only needs that region of the input (for tiled images, only
+  // the tiles covering it are decoded), so the region is read and the
+  // crop stage dropped. Likewise a squash only needs some of the pixels.
   struct Image *input_img = (struct Image *) malloc( sizeof( struct Image ) );
   if ( input_img == NULL ) {
     fprintf( stderr, "Error: couldn't allocate input image\n" );
     return 1;
   }
-  if ( img_read( input_filename, input_img ) != IMG_SUCCESS ) {
+  struct ImgprocStage crop;
+  int32_t xfac, yfac;
+  int rc;
+  if ( xform->apply == apply_pipeline && argc >= 9 && strcmp( argv[4], "crop" ) == 0
+       && imgproc_parse_stages( 5, argv + 4, &crop, 1 ) == 1 ) {
+    rc = img_read_region( input_filename, crop.x, crop.y, crop.w, crop.h, input_img, read_flags );
+    memmove( argv + 4, argv + 9, (argc - 9 + 1) * sizeof( char * ) );
+    argc -= 5;
+  } else if ( xform->apply == apply_squash && squash_get_factors( argc, argv, &xfac, &yfac ) ) {
+    // Squashing only samples every xfac-th column of every yfac-th row
+    rc = img_read_sampled( input_filename, xfac, yfac, input_img, read_flags );
+  } else {
+    rc = img_read_flags( input_filename, input_img, read_flags );
+  }
+  if ( rc != IMG_SUCCESS ) {
     fprintf( stderr, "Error: couldn't read input image\n" );
     free( input_img );
     return 1;
   }
 
+  int success;
+
+  // The input isn't needed once it has been transformed, so if possible
+  // it is transformed in place (halving the memory needed) and written
+  if ( xform->apply_in_place != NULL ) {
+    imgtrace_begin( xform->name, -1 );
+    success = xform->apply_in_place( input_img, argc, argv ) != 0;
+    imgtrace_end( xform->name );
+    if ( success && img_write( output_filename, input_img ) != IMG_SUCCESS ) {
+      fprintf( stderr, "Error: couldn't write output image\n" );
+      success = 0;
+    }
+    cleanup_image( input_img );
+    return success ? 0 : 1;
+  }
+
   // Create output Image object
   struct Image *output_img = create_output_img( input_img, argc, argv, xform );
   if ( output_img == NULL ) {
@@ -134,10 +326,10 @@ int main( int argc, char **argv ) {
     return 1;
   }
 
-  int success;
-
   // apply the transformation!
+  imgtrace_begin( xform->name, -1 );
   success = xform->apply( input_img, output_img, argc, argv ) != 0;
+  imgtrace_end( xform->name );
 
   if ( success ) {
     // Write output image
@@ -192,6 +384,44 @@ int apply_expand( struct Image *input_img, struct Image *output_img, int argc, c
   return 1;
 }
 
+int apply_gaussian( struct Image *input_img, struct Image *output_img, int argc, char **argv ) {
+  double sigma;
+  if ( argc != 5 || sscanf( argv[4], "%lf", &sigma ) != 1 || !isfinite( sigma ) || sigma < 0.0 )
+    // invalid arguments
+    return 0;
+  return imgproc_gaussian( input_img, output_img, sigma );
+}
+
+int apply_pipeline( struct Image *input_img, struct Image *output_img, int argc, char **argv ) {
+  struct ImgprocStage stages[IMGPROC_MAX_STAGES];
+  int num_stages = imgproc_parse_stages( argc - 4, argv + 4, stages, IMGPROC_MAX_STAGES );
+  if ( num_stages < 0 )
+    return 0;
+  return imgproc_pipeline_run( input_img, output_img, stages, num_stages ) == IMG_SUCCESS;
+}
+
+int apply_squash_in_place( struct Image *img, int argc, char **argv ) {
+  int32_t xfac, yfac;
+  if ( !squash_get_factors( argc, argv, &xfac, &yfac ) )
+    return 0;
+  return imgproc_squash_in_place( img, xfac, yfac );
+}
+
+int apply_rot_in_place( struct Image *img, int argc, char **argv ) {
+  (void) argc;
+  (void) argv;
+  imgproc_color_rot_in_place( img );
+  return 1;
+}
+
+int apply_blur_in_place( struct Image *img, int argc, char **argv ) {
+  int blur_dist;
+  if ( argc != 5 || sscanf( argv[4], "%d", &blur_dist ) != 1 )
+    // invalid arguments
+    return 0;
+  return imgproc_blur_in_place( img, blur_dist );
+}
+
 int out_dimensions_squash( struct Image *input_img, int argc, char **argv, int32_t *out_w, int32_t *out_h ) {
   // In the squash transformation, the x (width) and y (height) dimensions
   // are divided by an integer factor.
@@ -218,3 +448,14 @@ int out_dimensions_same( struct Image *input_img, int argc, char **argv, int32_t
   *out_h = input_img->height;
   return 1;
 }
+
+int out_dimensions_pipeline( struct Image *input_img, int argc, char **argv, int32_t *out_w, int32_t *out_h ) {
+  // The output dimensions are the result of applying each stage's
+  // dimension change in turn
+  struct ImgprocStage stages[IMGPROC_MAX_STAGES];
+  int num_stages = imgproc_parse_stages( argc - 4, argv + 4, stages, IMGPROC_MAX_STAGES );
+  if ( num_stages < 0 )
+    return 0;
+  imgproc_pipeline_dimensions( stages, num_stages, input_img->width, input_img->height, out_w, out_h );
+  return 1;
+}
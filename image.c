@@ -1,9 +1,25 @@
+// for sync_file_range and O_TMPFILE
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <zlib.h>
 #include "pnglite.h"
+#include "imgexpand.h"
+#include "qoi.h"
+#include "timg.h"
 #include "image.h"
+#include "parallel.h"
+#include "imgtrace.h"
+#include "imgjob.h"
 
-int png_init_called;
+// Rows decoded or encoded between checks of the current job
+#define JOB_CHECK_ROWS 64
 
 int is_little_endian(void) {
   int32_t x = 1;
@@ -16,6 +32,21 @@ uint32_t byteswap(uint32_t val) {
   return result;
 }
 
+// Context for initializing the rows of a new image in parallel
+struct InitRows {
+  uint32_t *data;
+  int32_t width;
+};
+
+static void init_rows(void *ctx, int32_t begin, int32_t end) {
+  const struct InitRows *rows = ctx;
+  uint32_t *p = rows->data + (size_t) begin * rows->width;
+  uint32_t *stop = rows->data + (size_t) end * rows->width;
+  while (p < stop) {
+    *p++ = 0x000000FFU;
+  }
+}
+
 int img_init(struct Image *img, int32_t width, int32_t height) {
   int num_pixels = width * height;
 
@@ -24,93 +55,913 @@ int img_init(struct Image *img, int32_t width, int32_t height) {
     return IMG_ERR_MALLOC_FAILED;
   }
 
-  // initialize every pixel to opaque black
-  for (int32_t i = 0; i < num_pixels; i++) {
-    pixel_data[i] = 0x000000FFU;
-  }
+  // initialize every pixel to opaque black. This is done in row bands
+  // by the same threads that later process those rows, so on NUMA
+  // machines each band's pages are allocated on that thread's node.
+  struct InitRows rows = { pixel_data, width };
+  par_for(height, init_rows, &rows);
 
   // success
   img->width = width;
   img->height = height;
   img->data = pixel_data;
+  img->map = NULL;
+  img->map_len = 0;
   return IMG_SUCCESS;
 }
 
-int img_read(const char *filename, struct Image *img) {
-  if (!png_init_called) {
-    png_init(0, 0);
-    png_init_called = 1;
+// Memory buffer read by mem_read
+struct MemReader {
+  const unsigned char *data;
+  size_t len;
+  size_t pos;
+};
+
+// Growable memory buffer written by mem_write
+struct MemWriter {
+  unsigned char *data;
+  size_t len;
+  size_t cap;
+};
+
+// pnglite read callback for PNG data in memory; a NULL output
+// buffer means the bytes should be skipped
+static unsigned mem_read(void *output, size_t size, size_t numel, void *user_pointer) {
+  struct MemReader *r = user_pointer;
+  size_t avail = (r->len - r->pos) / size;
+  size_t n = numel < avail ? numel : avail;
+  if (output != NULL) {
+    memcpy(output, r->data + r->pos, n * size);
   }
+  r->pos += n * size;
+  return (unsigned) n;
+}
 
-  png_t png;
+// pnglite write callback appending to a memory buffer
+static unsigned mem_write(void *input, size_t size, size_t numel, void *user_pointer) {
+  struct MemWriter *w = user_pointer;
+  size_t bytes = size * numel;
+  if (w->len + bytes > w->cap) {
+    size_t cap = w->cap == 0 ? 4096 : w->cap;
+    while (cap < w->len + bytes) {
+      cap *= 2;
+    }
+    unsigned char *data = realloc(w->data, cap);
+    if (data == NULL) {
+      return 0;
+    }
+    w->data = data;
+    w->cap = cap;
+  }
+  memcpy(w->data + w->len, input, bytes);
+  w->len += bytes;
+  return (unsigned) numel;
+}
 
-  if (png_open_file_read(&png, filename) != PNG_NO_ERROR) {
+// Adapts par_for to the parallel loop that pnglite uses for restart bands
+static void png_par_for(int n, png_range_fn_t fn, void *ctx) {
+  par_for(n, fn, ctx);
+}
+
+// Adapts the tracer to the phase callback of pnglite
+static void trace_png_phase(const char *name, int begin) {
+  if (begin) {
+    imgtrace_begin(name, -1);
+  } else {
+    imgtrace_end(name);
+  }
+}
+
+// Have an opened PNG trace its phases, if tracing is on, and stop when
+// the current job is stopped
+static void png_set_tracing(png_t *png) {
+  png_set_trace(png, imgtrace_on ? trace_png_phase : NULL);
+  png_set_cancel(png, imgjob_check);
+}
+
+// Rows per restart band when writing PNGs (IMGPROC_PNG_RESTART), 0 for none
+static unsigned png_restart_rows(void) {
+  const char *env = getenv("IMGPROC_PNG_RESTART");
+  long rows = env != NULL ? strtol(env, NULL, 10) : 0;
+  return rows > 0 ? (unsigned) rows : 0;
+}
+
+// Rows of a decoded PNG to expand to packed pixels. Only the pixels in
+// every block_h-th row and block_w-th column may be decoded, in which
+// case each of them fills its block_w x block_h block.
+struct ExpandRows {
+  const struct ExpandFormat *format;
+  const unsigned char *raw;
+  size_t row_bytes;
+  struct Image *img;
+  int32_t block_w, block_h;
+};
+
+// Expand the decoded rows with indices [begin, end) (row i is image row
+// i * block_h), filling out each block horizontally
+static void expand_rows(void *arg, int32_t begin, int32_t end) {
+  struct ExpandRows *rows = arg;
+  int32_t width = rows->img->width;
+  for (int32_t i = begin; i < end; i++) {
+    int32_t row = i * rows->block_h;
+    uint32_t *dst = rows->img->data + (size_t) row * width;
+    img_expand_row(rows->format, rows->raw + (size_t) row * rows->row_bytes, dst, width);
+    if (rows->block_w > 1) {
+      for (int32_t x = 0; x < width; x++) {
+        dst[x] = dst[x - x % rows->block_w];
+      }
+    }
+  }
+}
+
+// Fill out the blocks vertically by copying the rows [begin, end) that
+// weren't decoded from the first row of their block
+static void fill_block_rows(void *arg, int32_t begin, int32_t end) {
+  struct ExpandRows *rows = arg;
+  int32_t width = rows->img->width;
+  for (int32_t row = begin; row < end; row++) {
+    if (row % rows->block_h != 0) {
+      memcpy(rows->img->data + (size_t) row * width,
+             rows->img->data + (size_t) (row - row % rows->block_h) * width, width * sizeof(uint32_t));
+    }
+  }
+}
+
+// Size of the blocks filled by each pixel once the first 1 to 7 Adam7
+// passes of an interlaced PNG are decoded
+static const int32_t s_adam7_block_w[7] = { 8, 4, 4, 2, 2, 1, 1 };
+static const int32_t s_adam7_block_h[7] = { 8, 8, 4, 4, 2, 2, 1 };
+
+// Describe the layout of the rows decoded from an opened PNG (whose
+// chunks before the image data have been read) in format, with its
+// palette converted to packed pixels in palette
+static void png_expand_format(const png_t *png, uint32_t palette[256], struct ExpandFormat *format) {
+  // palette entries past the ones in the file are opaque black
+  for (unsigned i = 0; i < 256; i++) {
+    const unsigned char *entry = png->palette + i * 4;
+    palette[i] = i < png->palette_size
+               ? ((uint32_t) entry[0] << 24) | (entry[1] << 16) | (entry[2] << 8) | entry[3] : 0xFF;
+  }
+
+  format->color_type = png->color_type;
+  format->depth = png->depth;
+  format->palette = palette;
+  format->has_key = png->has_transparent;
+  memcpy(format->key, png->transparent, sizeof(format->key));
+}
+
+// Decode the pixel data of an opened PNG into img (flags are IMG_READ_* values).
+// Any color type and bit depth is expanded to 8-bit RGBA. Only the pixels
+// in every ystep-th row and xstep-th column have to be exact: for
+// interlaced PNGs, only the passes containing them are decoded.
+static int read_png(png_t *png, struct Image *img, int flags, int32_t xstep, int32_t ystep) {
+  if (png->width == 0 || png->height == 0 || png->width > INT32_MAX / png->height) {
+    return IMG_ERR_CORRUPT;
+  }
+
+  // bands after restart points (if the file has them) are decoded in parallel
+  png_set_parallel(png, png_par_for);
+  png_set_crc_checks(png, !(flags & IMG_READ_TRUSTED));
+  png_set_tracing(png);
+
+  int passes = 7;
+  if (png->interlace_method) {
+    passes = 1;
+    while (passes < 7 && (xstep % s_adam7_block_w[passes - 1] != 0 || ystep % s_adam7_block_h[passes - 1] != 0)) {
+      passes++;
+    }
+  }
+
+  int32_t width = png->width, height = png->height;
+  uint32_t *pixel_data = (uint32_t *) malloc((size_t) width * height * sizeof(uint32_t));
+  if (pixel_data == NULL) {
+    return IMG_ERR_MALLOC_FAILED;
+  }
+  img->data = pixel_data;
+  img->width = width;
+  img->height = height;
+  img->map = NULL;
+  img->map_len = 0;
+
+  // 8-bit RGBA rows are the size of the packed pixels, so they are
+  // decoded in place; other rows are decoded to a separate buffer
+  size_t row_bytes = png_get_row_bytes(png);
+  // (pixels left out of partly decoded rows are zero, as they are
+  // expanded before being overwritten)
+  int in_place = png->color_type == PNG_TRUECOLOR_ALPHA && png->depth == 8;
+  unsigned char *raw = in_place ? (unsigned char *) pixel_data
+                     : passes < 7 ? (unsigned char *) calloc(height, row_bytes)
+                     : (unsigned char *) malloc(row_bytes * height);
+  if (raw == NULL) {
+    free(pixel_data);
+    return IMG_ERR_MALLOC_FAILED;
+  }
+
+  int rc = png_get_passes(png, raw, passes);
+  if (rc != PNG_NO_ERROR) {
+    if (!in_place) {
+      free(raw);
+    }
+    free(pixel_data);
+    return rc == PNG_MEMORY_ERROR ? IMG_ERR_MALLOC_FAILED
+         : rc == PNG_CANCELLED ? IMG_ERR_CANCELLED : IMG_ERR_CORRUPT;
+  }
+
+  uint32_t palette[256];
+  struct ExpandFormat format;
+  png_expand_format(png, palette, &format);
+  struct ExpandRows rows = { &format, raw, row_bytes, img, s_adam7_block_w[passes - 1], s_adam7_block_h[passes - 1] };
+  imgtrace_begin("convert", -1);
+  par_for((height + rows.block_h - 1) / rows.block_h, expand_rows, &rows);
+  if (rows.block_h > 1) {
+    par_for(height, fill_block_rows, &rows);
+  }
+  imgtrace_end("convert");
+
+  if (!in_place) {
+    free(raw);
+  }
+  return IMG_SUCCESS;
+}
+
+// Pack the pixels of img as RGB bytes (in PNG order) into out, as long
+// as they are opaque. Returns 1 if every pixel was opaque, 0 as soon as
+// one isn't (leaving out partly written).
+static int pack_opaque_rgb(const struct Image *img, unsigned char *out) {
+  int32_t num_pixels = img->width * img->height;
+  for (int32_t row = 0; row < num_pixels; row += img->width) {
+    const uint32_t *in = img->data + row;
+    uint32_t alpha = 0xFF;
+    for (int32_t i = 0; i < img->width; i++) {
+      uint32_t px = in[i];
+      out[0] = px >> 24;
+      out[1] = px >> 16;
+      out[2] = px >> 8;
+      alpha &= px;
+      out += 3;
+    }
+    // checked per row, so the scan stops soon after a translucent pixel
+    if ((alpha & 0xFF) != 0xFF) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Encode the pixel data of img into an opened PNG. Fully opaque images
+// are written as RGB, which leaves a quarter fewer bytes to compress.
+static int write_png(png_t *png, struct Image *img) {
+  int32_t num_pixels = img->width * img->height;
+  unsigned char *data_to_write = (unsigned char *) malloc(num_pixels * sizeof(uint32_t));
+  if (data_to_write == NULL) {
+    return IMG_ERR_MALLOC_FAILED;
+  }
+
+  imgtrace_begin("convert", -1);
+  int color = PNG_TRUECOLOR;
+  if (!pack_opaque_rgb(img, data_to_write)) {
+    // PNG wants RGBA bytes, i.e. big-endian pixels, so on a little
+    // endian system every uint32_t must be byteswapped
+    uint32_t *out = (uint32_t *) data_to_write;
+    int need_byteswap = is_little_endian();
+    for (int32_t i = 0; i < num_pixels; i++) {
+      out[i] = need_byteswap ? byteswap(img->data[i]) : img->data[i];
+    }
+    color = PNG_TRUECOLOR_ALPHA;
+  }
+  imgtrace_end("convert");
+
+  png_set_restart_interval(png, png_restart_rows());
+  png_set_tracing(png);
+  int rc = png_set_data(png, img->width, img->height, 8, color, data_to_write);
+
+  free(data_to_write);
+
+  if (rc == PNG_CANCELLED) {
+    return IMG_ERR_CANCELLED;
+  }
+  return rc == PNG_NO_ERROR ? IMG_SUCCESS : IMG_ERR_COULD_NOT_WRITE;
+}
+
+////////////////////////////////////////////////////////////////////////
+// .rimg format
+////////////////////////////////////////////////////////////////////////
+
+// A .rimg file is a RIMG_HEADER_SIZE-byte header of little-endian
+// 32-bit fields, followed by the pixel rows:
+//
+//   offset  field
+//        0  magic "RIMG"
+//        4  version (1)
+//        8  width
+//       12  height
+//       16  stride (bytes from the start of one row to the next)
+//       20  pixel format (RIMG_FORMAT_RGBA32)
+//       24  CRC-32 of the pixel rows (width * 4 bytes of each)
+//       28  offset of the first row (a multiple of RIMG_ALIGN)
+//
+// Files are written with the rows packed (stride = width * 4) so that
+// on little-endian machines they map straight onto a struct Image.
+
+#define RIMG_HEADER_SIZE 64
+#define RIMG_ALIGN 64
+#define RIMG_VERSION 1
+// Each pixel is a little-endian uint32_t 0xRRGGBBAA
+#define RIMG_FORMAT_RGBA32 1
+
+static void put_le32(unsigned char *p, uint32_t val) {
+  p[0] = val & 0xFF;
+  p[1] = (val >> 8) & 0xFF;
+  p[2] = (val >> 16) & 0xFF;
+  p[3] = val >> 24;
+}
+
+static uint32_t get_le32(const unsigned char *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+int img_is_rimg(const char *filename) {
+  size_t len = strlen(filename);
+  return len >= 5 && strcmp(filename + len - 5, ".rimg") == 0;
+}
+
+// Return the pixel data of img in file order (little-endian); on
+// big-endian machines this is a byteswapped copy, which the caller
+// frees if it isn't img->data. Returns NULL if memory runs out.
+static uint32_t *rimg_pixels(const struct Image *img) {
+  if (is_little_endian()) {
+    return img->data;
+  }
+  size_t num_pixels = (size_t) img->width * img->height;
+  uint32_t *swapped = malloc(num_pixels * sizeof(uint32_t));
+  if (swapped != NULL) {
+    for (size_t i = 0; i < num_pixels; i++) {
+      swapped[i] = byteswap(img->data[i]);
+    }
+  }
+  return swapped;
+}
+
+// CRC-32 of the rows of img, whose pixels (in file order) are pixels
+static uLong rimg_crc(const struct Image *img, const uint32_t *pixels) {
+  size_t row_bytes = (size_t) img->width * sizeof(uint32_t);
+  uLong crc = crc32(0L, Z_NULL, 0);
+  for (int32_t i = 0; i < img->height; i++) {
+    crc = crc32(crc, (const Bytef *) (pixels + (size_t) i * img->width), (uInt) row_bytes);
+  }
+  return crc;
+}
+
+// Fill in the header of a .rimg file with the dimensions of img and
+// the CRC of its rows
+static void rimg_header(const struct Image *img, uLong crc, unsigned char *hdr) {
+  size_t row_bytes = (size_t) img->width * sizeof(uint32_t);
+
+  memset(hdr, 0, RIMG_HEADER_SIZE);
+  memcpy(hdr, "RIMG", 4);
+  put_le32(hdr + 4, RIMG_VERSION);
+  put_le32(hdr + 8, (uint32_t) img->width);
+  put_le32(hdr + 12, (uint32_t) img->height);
+  put_le32(hdr + 16, (uint32_t) row_bytes);
+  put_le32(hdr + 20, RIMG_FORMAT_RGBA32);
+  put_le32(hdr + 24, (uint32_t) crc);
+  put_le32(hdr + 28, RIMG_HEADER_SIZE);
+}
+
+// Check the header of the .rimg data in buf (len bytes long, the rows
+// included) and get the image's dimensions, row stride and the offset
+// of the first row
+static int rimg_parse(const unsigned char *buf, size_t len, uint32_t *width, uint32_t *height,
+                      uint32_t *stride, uint32_t *offset) {
+  if (len < RIMG_HEADER_SIZE || memcmp(buf, "RIMG", 4) != 0
+      || get_le32(buf + 4) != RIMG_VERSION || get_le32(buf + 20) != RIMG_FORMAT_RGBA32) {
+    return IMG_ERR_CORRUPT;
+  }
+
+  *width = get_le32(buf + 8);
+  *height = get_le32(buf + 12);
+  *stride = get_le32(buf + 16);
+  *offset = get_le32(buf + 28);
+  size_t row_bytes = (size_t) *width * sizeof(uint32_t);
+  if (*width == 0 || *height == 0 || *width > INT32_MAX / *height || *stride < row_bytes
+      || *offset < RIMG_HEADER_SIZE || *offset % sizeof(uint32_t) != 0
+      || *offset > len || len - *offset < row_bytes || (len - *offset - row_bytes) / *stride < *height - 1) {
+    return IMG_ERR_CORRUPT;
+  }
+  return IMG_SUCCESS;
+}
+
+// Check the header and checksum of the .rimg data in buf and initialize
+// img from it. If in_place is nonzero and the rows can be used where
+// they are, img->data points into buf; otherwise the pixels are copied.
+// With IMG_READ_TRUSTED in flags, the checksum isn't checked.
+static int rimg_decode(const unsigned char *buf, size_t len, struct Image *img, int in_place, int flags) {
+  uint32_t width, height, stride, offset;
+  if (rimg_parse(buf, len, &width, &height, &stride, &offset) != IMG_SUCCESS) {
+    return IMG_ERR_CORRUPT;
+  }
+  size_t row_bytes = (size_t) width * sizeof(uint32_t);
+
+  const unsigned char *rows = buf + offset;
+  if (!(flags & IMG_READ_TRUSTED)) {
+    uLong crc = crc32(0L, Z_NULL, 0);
+    for (uint32_t i = 0; i < height; i++) {
+      crc = crc32(crc, rows + (size_t) i * stride, (uInt) row_bytes);
+    }
+    if ((uint32_t) crc != get_le32(buf + 24)) {
+      return IMG_ERR_CORRUPT;
+    }
+  }
+
+  img->width = (int32_t) width;
+  img->height = (int32_t) height;
+  img->map = NULL;
+  img->map_len = 0;
+
+  if (in_place && stride == row_bytes && is_little_endian()) {
+    img->data = (uint32_t *) rows;
+    return IMG_SUCCESS;
+  }
+
+  uint32_t *pixel_data = malloc((size_t) width * height * sizeof(uint32_t));
+  if (pixel_data == NULL) {
+    return IMG_ERR_MALLOC_FAILED;
+  }
+  for (uint32_t i = 0; i < height; i++) {
+    uint32_t *dst = pixel_data + (size_t) i * width;
+    memcpy(dst, rows + (size_t) i * stride, row_bytes);
+    if (!is_little_endian()) {
+      for (uint32_t j = 0; j < width; j++) {
+        dst[j] = byteswap(dst[j]);
+      }
+    }
+  }
+  img->data = pixel_data;
+  return IMG_SUCCESS;
+}
+
+// Map the whole named file into memory, privately (so it can be
+// modified without changing the file)
+static int map_file(const char *filename, void **map, size_t *len) {
+  imgtrace_begin("read", -1);
+  int rc = IMG_ERR_COULD_NOT_OPEN;
+  int fd = open(filename, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size != 0) {
+    *len = (size_t) st.st_size;
+    *map = mmap(NULL, *len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    rc = *map == MAP_FAILED ? IMG_ERR_COULD_NOT_OPEN : IMG_SUCCESS;
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  imgtrace_end("read");
+  return rc;
+}
+
+// Write len bytes from buf to the named file
+static int write_file(const char *filename, const void *buf, size_t len) {
+  int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (fd < 0) {
     return IMG_ERR_COULD_NOT_OPEN;
   }
+  imgtrace_begin("write", -1);
+  int rc = IMG_SUCCESS;
+  const unsigned char *p = buf;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0) {
+      rc = IMG_ERR_COULD_NOT_WRITE;
+      break;
+    }
+    p += n;
+    len -= n;
+  }
+  if (close(fd) != 0) {
+    rc = IMG_ERR_COULD_NOT_WRITE;
+  }
+  imgtrace_end("write");
+  return rc;
+}
 
-  // only allow truecolor 8bpp images
-  if (!(png.color_type == PNG_TRUECOLOR && png.bpp == 3) &&
-      !(png.color_type == PNG_TRUECOLOR_ALPHA && png.bpp == 4)) {
-    png_close_file(&png);
-    return IMG_ERR_NOT_TRUECOLOR;
+// Decode the .rimg data in a mapping, using its pixel rows in place
+// if possible, in which case the image keeps the mapping
+static int rimg_decode_mapped(void *map, size_t len, struct Image *img, int flags) {
+  int rc = rimg_decode(map, len, img, 1, flags);
+  if (rc == IMG_SUCCESS && (void *) img->data > map && (unsigned char *) img->data < (unsigned char *) map + len) {
+    img->map = map;
+    img->map_len = len;
+  } else {
+    munmap(map, len);
   }
-  
-  int num_pixels = png.width * png.height;
+  return rc;
+}
 
-  // allocate buffer for pixel data in truecolor RGBA format
-  uint32_t *pixel_data = (uint32_t *) malloc(num_pixels * sizeof(uint32_t));
+// Map a .rimg file into memory and use its pixel rows in place
+static int read_rimg(const char *filename, struct Image *img, int flags) {
+  void *map;
+  size_t len;
+  int rc = map_file(filename, &map, &len);
+  if (rc != IMG_SUCCESS) {
+    return rc;
+  }
+  return rimg_decode_mapped(map, len, img, flags);
+}
 
-  if (png.color_type == PNG_TRUECOLOR) {
-    // PNG pixel data is in RGB form, expand it to add the alpha channel
+// Write a .rimg file with a single system call (unless it is short)
+static int write_rimg(const char *filename, struct Image *img) {
+  uint32_t *pixels = rimg_pixels(img);
+  if (pixels == NULL) {
+    return IMG_ERR_MALLOC_FAILED;
+  }
+  unsigned char hdr[RIMG_HEADER_SIZE];
+  rimg_header(img, rimg_crc(img, pixels), hdr);
 
-    unsigned char *pixel_data_raw = (unsigned char *) malloc(num_pixels * 3);
-    if (png_get_data(&png, pixel_data_raw) != PNG_NO_ERROR) {
-      png_close_file(&png);
-      free(pixel_data);
-      return IMG_ERR_MALLOC_FAILED;
+  int rc = IMG_SUCCESS;
+  int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (fd < 0) {
+    rc = IMG_ERR_COULD_NOT_OPEN;
+  } else {
+    struct iovec iov[2] = {
+      { hdr, RIMG_HEADER_SIZE },
+      { pixels, (size_t) img->width * img->height * sizeof(uint32_t) },
+    };
+    int i = 0;
+    while (i < 2) {
+      ssize_t n = writev(fd, iov + i, 2 - i);
+      if (n < 0) {
+        rc = IMG_ERR_COULD_NOT_WRITE;
+        break;
+      }
+      for (; i < 2 && (size_t) n >= iov[i].iov_len; i++) {
+        n -= iov[i].iov_len;
+      }
+      if (i < 2) {
+        iov[i].iov_base = (unsigned char *) iov[i].iov_base + n;
+        iov[i].iov_len -= n;
+      }
+    }
+    if (close(fd) != 0) {
+      rc = IMG_ERR_COULD_NOT_WRITE;
+    }
+  }
+
+  if (pixels != img->data) {
+    free(pixels);
+  }
+  return rc;
+}
+
+int img_write_rimg_mem(struct Image *img, void **buf, size_t *len) {
+  size_t pixel_bytes = (size_t) img->width * img->height * sizeof(uint32_t);
+  unsigned char *data = malloc(RIMG_HEADER_SIZE + pixel_bytes);
+  if (data == NULL) {
+    return IMG_ERR_MALLOC_FAILED;
+  }
+
+  uint32_t *pixels = rimg_pixels(img);
+  if (pixels == NULL) {
+    free(data);
+    return IMG_ERR_MALLOC_FAILED;
+  }
+  rimg_header(img, rimg_crc(img, pixels), data);
+  memcpy(data + RIMG_HEADER_SIZE, pixels, pixel_bytes);
+  if (pixels != img->data) {
+    free(pixels);
+  }
+
+  *buf = data;
+  *len = RIMG_HEADER_SIZE + pixel_bytes;
+  return IMG_SUCCESS;
+}
+
+size_t img_rimg_size(int32_t width, int32_t height) {
+  return RIMG_HEADER_SIZE + (size_t) width * height * sizeof(uint32_t);
+}
+
+void img_init_rimg_at(struct Image *img, int32_t width, int32_t height, void *buf) {
+  img->width = width;
+  img->height = height;
+  img->data = (uint32_t *) ((unsigned char *) buf + RIMG_HEADER_SIZE);
+  img->map = NULL;
+  img->map_len = 0;
+}
+
+void img_finish_rimg_at(struct Image *img, void *buf) {
+  // the pixels are stored little-endian
+  if (!is_little_endian()) {
+    size_t num_pixels = (size_t) img->width * img->height;
+    for (size_t i = 0; i < num_pixels; i++) {
+      img->data[i] = byteswap(img->data[i]);
     }
+  }
+  rimg_header(img, rimg_crc(img, img->data), buf);
+}
 
-    for (int i = 0; i < num_pixels; i++) {
-      unsigned char r = pixel_data_raw[i*3 + 0];
-      unsigned char g = pixel_data_raw[i*3 + 1];
-      unsigned char b = pixel_data_raw[i*3 + 2];
-      unsigned char a = 255;
+////////////////////////////////////////////////////////////////////////
+// QOI format
+////////////////////////////////////////////////////////////////////////
 
-      pixel_data[i] = (r << 24) | (g << 16) | (b << 8) | a;
+int img_is_qoi(const char *filename) {
+  size_t len = strlen(filename);
+  return len >= 4 && strcmp(filename + len - 4, ".qoi") == 0;
+}
+
+static int qoi_decode(const void *buf, size_t len, struct Image *img) {
+  struct QoiDecoder dec;
+  if (qoi_decode_init(&dec, buf, len) != QOI_OK || dec.width > INT32_MAX) {
+    return IMG_ERR_CORRUPT;
+  }
+
+  uint32_t *pixel_data = malloc((size_t) dec.width * dec.height * sizeof(uint32_t));
+  if (pixel_data == NULL) {
+    return IMG_ERR_MALLOC_FAILED;
+  }
+  for (uint32_t i = 0; i < dec.height; i++) {
+    if (i % JOB_CHECK_ROWS == 0 && imgjob_check()) {
+      free(pixel_data);
+      return IMG_ERR_CANCELLED;
     }
+    if (qoi_decode_row(&dec, pixel_data + (size_t) i * dec.width) != QOI_OK) {
+      free(pixel_data);
+      return IMG_ERR_CORRUPT;
+    }
+  }
+
+  img->width = (int32_t) dec.width;
+  img->height = (int32_t) dec.height;
+  img->data = pixel_data;
+  img->map = NULL;
+  img->map_len = 0;
+  return IMG_SUCCESS;
+}
 
-    free(pixel_data_raw);
+static int read_qoi(const char *filename, struct Image *img) {
+  void *map;
+  size_t len;
+  int rc = map_file(filename, &map, &len);
+  if (rc != IMG_SUCCESS) {
+    return rc;
+  }
+  rc = qoi_decode(map, len, img);
+  munmap(map, len);
+  return rc;
+}
+
+int img_write_qoi_mem(struct Image *img, void **buf, size_t *len) {
+  struct QoiEncoder enc;
+  int rc = qoi_encode_init(&enc, (uint32_t) img->width, (uint32_t) img->height, 4);
+  if (rc != QOI_OK) {
+    return rc == QOI_ERR_MEMORY ? IMG_ERR_MALLOC_FAILED : IMG_ERR_COULD_NOT_WRITE;
+  }
+  int cancelled = 0;
+  for (int32_t i = 0; i < img->height && rc == QOI_OK && !cancelled; i++) {
+    cancelled = i % JOB_CHECK_ROWS == 0 && imgjob_check();
+    if (!cancelled) {
+      rc = qoi_encode_row(&enc, img->data + (size_t) i * img->width);
+    }
+  }
+  if (rc == QOI_OK && !cancelled) {
+    rc = qoi_encode_finish(&enc, buf, len);
   } else {
-    // PNG pixel data is already in the correct format,
-    // except that the RGBA data is in big-endian form, so we
-    // need to byteswap if on a little endian system
-    if (png_get_data(&png, (unsigned char *) pixel_data) != PNG_NO_ERROR) {
-      png_close_file(&png);
+    qoi_encode_abort(&enc);
+  }
+  if (cancelled) {
+    return IMG_ERR_CANCELLED;
+  }
+  return rc == QOI_OK ? IMG_SUCCESS : IMG_ERR_MALLOC_FAILED;
+}
+
+static int write_qoi(const char *filename, struct Image *img) {
+  void *buf;
+  size_t len;
+  int rc = img_write_qoi_mem(img, &buf, &len);
+  if (rc == IMG_SUCCESS) {
+    rc = write_file(filename, buf, len);
+    free(buf);
+  }
+  return rc;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Tiled (.timg) format
+////////////////////////////////////////////////////////////////////////
+
+int img_is_timg(const char *filename) {
+  size_t len = strlen(filename);
+  return len >= 5 && strcmp(filename + len - 5, ".timg") == 0;
+}
+
+// Decode a region of an opened tiled image (clipped to the image)
+static int timg_decode(const struct TiledImage *ti, int32_t x, int32_t y, int32_t w, int32_t h,
+                       struct Image *img) {
+  w = x >= ti->width ? 0 : (w < ti->width - x ? w : ti->width - x);
+  h = y >= ti->height ? 0 : (h < ti->height - y ? h : ti->height - y);
+
+  uint32_t *pixel_data = malloc((size_t) w * h * sizeof(uint32_t) + 1);
+  if (pixel_data == NULL) {
+    return IMG_ERR_MALLOC_FAILED;
+  }
+  if (w > 0 && h > 0) {
+    int rc = timg_read_region(ti, x, y, w, h, pixel_data, w);
+    if (rc != IMG_SUCCESS) {
       free(pixel_data);
-      return IMG_ERR_MALLOC_FAILED;
+      return rc;
     }
+  }
 
-    if (is_little_endian()) {
-      for (int i = 0; i < num_pixels; i++) {
-        pixel_data[i] = byteswap(pixel_data[i]);
-      }
+  img->width = w;
+  img->height = h;
+  img->data = pixel_data;
+  img->map = NULL;
+  img->map_len = 0;
+  return IMG_SUCCESS;
+}
+
+int img_write_timg_mem(struct Image *img, void **buf, size_t *len) {
+  return timg_encode(img, TIMG_DEFAULT_TILE, Z_DEFAULT_COMPRESSION, buf, len);
+}
+
+static int write_timg(const char *filename, struct Image *img) {
+  void *buf;
+  size_t len;
+  int rc = img_write_timg_mem(img, &buf, &len);
+  if (rc == IMG_SUCCESS) {
+    rc = write_file(filename, buf, len);
+    free(buf);
+  }
+  return rc;
+}
+
+int img_read_region(const char *filename, int32_t x, int32_t y, int32_t w, int32_t h, struct Image *img,
+                    int flags) {
+  // Tiled images only decode the tiles covering the region
+  if (img_is_timg(filename)) {
+    imgtrace_begin("decode", -1);
+    struct TiledImage ti;
+    int rc = timg_open(filename, &ti);
+    if (rc == IMG_SUCCESS) {
+      rc = timg_decode(&ti, x, y, w, h, img);
+      timg_close(&ti);
+    }
+    // tiles are skipped once the current job is stopped
+    if (rc == IMG_SUCCESS && imgjob_check()) {
+      img_cleanup(img);
+      rc = IMG_ERR_CANCELLED;
     }
+    imgtrace_end("decode");
+    return rc;
+  }
+
+  struct Image whole;
+  int rc = img_read_flags(filename, &whole, flags);
+  if (rc != IMG_SUCCESS) {
+    return rc;
+  }
+  w = x >= whole.width ? 0 : (w < whole.width - x ? w : whole.width - x);
+  h = y >= whole.height ? 0 : (h < whole.height - y ? h : whole.height - y);
+  uint32_t *pixel_data = malloc((size_t) w * h * sizeof(uint32_t) + 1);
+  if (pixel_data == NULL) {
+    img_cleanup(&whole);
+    return IMG_ERR_MALLOC_FAILED;
   }
+  for (int32_t i = 0; i < h; i++) {
+    memcpy(pixel_data + (size_t) i * w, whole.data + (size_t) (y + i) * whole.width + x, w * sizeof(uint32_t));
+  }
+  img_cleanup(&whole);
 
-  // communicate pixel data and image dimensions to caller
+  img->width = w;
+  img->height = h;
   img->data = pixel_data;
-  img->width = png.width;
-  img->height = png.height;
+  img->map = NULL;
+  img->map_len = 0;
+  return IMG_SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Public reading and writing functions
+////////////////////////////////////////////////////////////////////////
 
+// Fail a read or write during which the current job was stopped, as
+// parallel loops may have skipped part of the work, or count it as a
+// step of the job
+static int finish_job_step(int rc) {
+  if (rc == IMG_SUCCESS && imgjob_check()) {
+    return IMG_ERR_CANCELLED;
+  }
+  if (rc == IMG_SUCCESS) {
+    imgjob_step_done(imgjob_current());
+  }
+  return rc;
+}
+
+// The same for a read, freeing the image it decoded
+static int finish_read(int rc, struct Image *img) {
+  if (rc == IMG_SUCCESS && imgjob_check()) {
+    img_cleanup(img);
+    return IMG_ERR_CANCELLED;
+  }
+  return finish_job_step(rc);
+}
+
+int img_read(const char *filename, struct Image *img) {
+  return img_read_flags(filename, img, 0);
+}
+
+int img_read_flags(const char *filename, struct Image *img, int flags) {
+  return img_read_sampled(filename, 1, 1, img, flags);
+}
+
+static int read_sampled(const char *filename, int32_t xstep, int32_t ystep, struct Image *img, int flags) {
+  if (img_is_rimg(filename)) {
+    return read_rimg(filename, img, flags);
+  }
+  if (img_is_qoi(filename)) {
+    return read_qoi(filename, img);
+  }
+  if (img_is_timg(filename)) {
+    return img_read_region(filename, 0, 0, INT32_MAX, INT32_MAX, img, flags);
+  }
+
+  png_t png;
+
+  if (png_open_file_read(&png, filename) != PNG_NO_ERROR) {
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+
+  int rc = read_png(&png, img, flags, xstep > 0 ? xstep : 1, ystep > 0 ? ystep : 1);
   png_close_file(&png);
+  return rc;
+}
 
-  return IMG_SUCCESS;
+int img_read_sampled(const char *filename, int32_t xstep, int32_t ystep, struct Image *img, int flags) {
+  imgtrace_begin("decode", -1);
+  int rc = finish_read(read_sampled(filename, xstep, ystep, img, flags), img);
+  imgtrace_end("decode");
+  return rc;
 }
 
-int img_write(const char *filename, struct Image *img) {
-  if (!png_init_called) {
-    png_init(0, 0);
-    png_init_called = 1;
+int img_read_mem(const void *buf, size_t len, struct Image *img) {
+  return img_read_mem_flags(buf, len, img, 0);
+}
+
+static int read_mem(const void *buf, size_t len, struct Image *img, int flags) {
+  if (len >= 4 && memcmp(buf, "RIMG", 4) == 0) {
+    return rimg_decode(buf, len, img, 0, flags);
+  }
+  if (qoi_is_qoi(buf, len)) {
+    return qoi_decode(buf, len, img);
+  }
+  if (timg_is_timg(buf, len)) {
+    struct TiledImage ti;
+    int rc = timg_open_mem(buf, len, &ti);
+    if (rc == IMG_SUCCESS) {
+      rc = timg_decode(&ti, 0, 0, INT32_MAX, INT32_MAX, img);
+      timg_close(&ti);
+    }
+    return rc;
+  }
+
+  png_t png;
+  struct MemReader reader = { buf, len, 0 };
+
+  if (png_open_read(&png, mem_read, &reader) != PNG_NO_ERROR) {
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+
+  return read_png(&png, img, flags, 1, 1);
+}
+
+int img_read_mem_flags(const void *buf, size_t len, struct Image *img, int flags) {
+  imgtrace_begin("decode", -1);
+  int rc = finish_read(read_mem(buf, len, img, flags), img);
+  imgtrace_end("decode");
+  return rc;
+}
+
+int img_read_mapped(void *map, size_t len, struct Image *img, int flags) {
+  imgtrace_begin("decode", -1);
+  int rc;
+  if (len >= 4 && memcmp(map, "RIMG", 4) == 0) {
+    rc = rimg_decode_mapped(map, len, img, flags);
+  } else {
+    rc = read_mem(map, len, img, flags);
+    munmap(map, len);
+  }
+  rc = finish_read(rc, img);
+  imgtrace_end("decode");
+  return rc;
+}
+
+static int write_image(const char *filename, struct Image *img) {
+  if (img_is_rimg(filename)) {
+    return write_rimg(filename, img);
+  }
+  if (img_is_qoi(filename)) {
+    return write_qoi(filename, img);
+  }
+  if (img_is_timg(filename)) {
+    return write_timg(filename, img);
   }
 
   png_t png;
@@ -119,39 +970,656 @@ int img_write(const char *filename, struct Image *img) {
     return IMG_ERR_COULD_NOT_OPEN;
   }
 
-  // if this is a little endian system, we need to byteswap
-  // every uint32_t so that it can be written in big-endian order
-  // (which is what PNG requires)
+  int rc = write_png(&png, img);
+  png_close_file(&png);
+  return rc;
+}
+
+int img_write(const char *filename, struct Image *img) {
+  imgtrace_begin("encode", -1);
+  int rc = finish_job_step(write_image(filename, img));
+  if (rc == IMG_ERR_CANCELLED) {
+    // don't leave a partly written file behind
+    unlink(filename);
+  }
+  imgtrace_end("encode");
+  return rc;
+}
+
+int img_write_mem(struct Image *img, void **buf, size_t *len) {
+
+  png_t png;
+  struct MemWriter writer = { NULL, 0, 0 };
+
+  png_open_write(&png, mem_write, &writer);
+  int rc = write_png(&png, img);
+  if (rc != IMG_SUCCESS) {
+    free(writer.data);
+    return rc;
+  }
+
+  *buf = writer.data;
+  *len = writer.len;
+  return IMG_SUCCESS;
+}
+
+int img_write_mem_for(const char *filename, struct Image *img, void **buf, size_t *len) {
+  imgtrace_begin("encode", -1);
+  int rc;
+  if (img_is_rimg(filename)) {
+    rc = img_write_rimg_mem(img, buf, len);
+  } else if (img_is_qoi(filename)) {
+    rc = img_write_qoi_mem(img, buf, len);
+  } else if (img_is_timg(filename)) {
+    rc = img_write_timg_mem(img, buf, len);
+  } else {
+    rc = img_write_mem(img, buf, len);
+  }
+  if (rc == IMG_SUCCESS && imgjob_check()) {
+    free(*buf);
+    rc = IMG_ERR_CANCELLED;
+  } else {
+    rc = finish_job_step(rc);
+  }
+  imgtrace_end("encode");
+  return rc;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Reading and writing images a band of rows at a time
+////////////////////////////////////////////////////////////////////////
+
+// Bytes of a file read or written between trims of its page cache
+#define ROWS_TRIM_BYTES ((off_t) 8 << 20)
+
+enum RowFormat { ROWS_PNG, ROWS_RIMG, ROWS_QOI, ROWS_TIMG, ROWS_WHOLE };
+
+struct ImgRowReader {
+  enum RowFormat format;
+  int32_t width, height;
+  int32_t row;                  // rows read so far
+  int flags;
+  // PNG: the decoder, and the layout of its rows
+  png_t png;
+  uint32_t palette[256];
+  struct ExpandFormat expand;
+  unsigned char *raw;           // decoded rows that aren't 8-bit RGBA
+  size_t raw_size;
+  // .rimg and QOI: the file, mapped as it is read
+  int fd;
+  unsigned char *map;
+  size_t map_len;
+  off_t trimmed;                // bytes of the file dropped from the page cache
+  const unsigned char *rows;    // .rimg: first row, and bytes between rows
+  uint32_t stride;
+  uLong crc;
+  uint32_t expected_crc;
+  struct QoiDecoder qoi;
+  struct TiledImage ti;
+  struct Image whole;           // interlaced PNGs, which are read as a whole
+  char *filename;               // (when their first rows are read)
+};
+
+struct ImgRowWriter {
+  enum RowFormat format;
+  int32_t width, height;
+  int32_t row;                  // rows written so far
+  char *filename;
+  // PNG and .rimg: the file, and how much of it has been written
+  png_t png;
+  unsigned char *buf;           // pixels converted to the file's byte order
+  size_t buf_size;
+  int fd;
+  off_t written;
+  off_t flushed;                // bytes whose writeback has been started
+  off_t trimmed;                // bytes dropped from the page cache
+  uLong crc;
+  struct QoiEncoder qoi;
+  struct Image whole;           // .timg: the rows, in a scratch image
+};
+
+// Drop the part of a mapped file read since the last trim before pos
+// from memory and from the page cache, once it is large enough
+static void trim_read(int fd, unsigned char *map, off_t *trimmed, off_t pos) {
+  off_t page = sysconf(_SC_PAGESIZE);
+  pos -= pos % page;
+  if (pos - *trimmed < ROWS_TRIM_BYTES) {
+    return;
+  }
+  if (map != NULL) {
+    madvise(map + *trimmed, pos - *trimmed, MADV_DONTNEED);
+  }
+  posix_fadvise(fd, *trimmed, pos - *trimmed, POSIX_FADV_DONTNEED);
+  *trimmed = pos;
+}
+
+// Start writing back what has been written to a file since the last
+// call, once it is large enough, and drop what was written back by the
+// previous call from the page cache, so a file larger than memory is
+// written at disk speed without pushing everything else out of memory
+static void trim_written(struct ImgRowWriter *w) {
+  if (w->written - w->flushed < ROWS_TRIM_BYTES) {
+    return;
+  }
+  if (w->flushed > w->trimmed) {
+    sync_file_range(w->fd, w->trimmed, w->flushed - w->trimmed,
+                    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(w->fd, w->trimmed, w->flushed - w->trimmed, POSIX_FADV_DONTNEED);
+    w->trimmed = w->flushed;
+  }
+  sync_file_range(w->fd, w->flushed, w->written - w->flushed, SYNC_FILE_RANGE_WRITE);
+  w->flushed = w->written;
+}
+
+// Map the named file for reading it once from start to end: pages are
+// only read in as they are used (ahead of time, as the use is
+// sequential), and the file stays open so they can be dropped again
+static int map_stream(const char *filename, int *fd, unsigned char **map, size_t *len) {
+  *fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (*fd < 0) {
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+  struct stat st;
+  if (fstat(*fd, &st) != 0 || st.st_size == 0) {
+    close(*fd);
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+  *len = (size_t) st.st_size;
+  *map = mmap(NULL, *len, PROT_READ, MAP_SHARED, *fd, 0);
+  if (*map == MAP_FAILED) {
+    close(*fd);
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+  madvise(*map, *len, MADV_SEQUENTIAL);
+  return IMG_SUCCESS;
+}
+
+// pnglite read callback for a file read sequentially, which drops
+// what has been read from the page cache as it goes
+static unsigned stream_read(void *output, size_t size, size_t numel, void *user_pointer) {
+  struct ImgRowReader *r = user_pointer;
+  size_t n;
+  if (output == NULL) {
+    n = lseek(r->fd, size * numel, SEEK_CUR) < 0 ? 0 : numel;
+  } else {
+    size_t want = size * numel, got = 0;
+    while (got < want) {
+      ssize_t k = read(r->fd, (unsigned char *) output + got, want - got);
+      if (k <= 0) {
+        break;
+      }
+      got += k;
+    }
+    n = got / size;
+  }
+  trim_read(r->fd, NULL, &r->trimmed, lseek(r->fd, 0, SEEK_CUR));
+  return (unsigned) n;
+}
+
+// pnglite write callback for a file written sequentially
+static unsigned stream_write(void *input, size_t size, size_t numel, void *user_pointer) {
+  struct ImgRowWriter *w = user_pointer;
+  size_t want = size * numel, done = 0;
+  while (done < want) {
+    ssize_t k = write(w->fd, (const unsigned char *) input + done, want - done);
+    if (k < 0) {
+      break;
+    }
+    done += k;
+  }
+  w->written += done;
+  trim_written(w);
+  return (unsigned) (done / size);
+}
 
-  uint32_t *data_to_write = img->data;
-  int need_byteswap = is_little_endian();
+static int open_row_reader(const char *filename, struct ImgRowReader *r) {
+  if (img_is_rimg(filename)) {
+    r->format = ROWS_RIMG;
+    int rc = map_stream(filename, &r->fd, &r->map, &r->map_len);
+    if (rc != IMG_SUCCESS) {
+      return rc;
+    }
+    uint32_t width, height, offset;
+    if (rimg_parse(r->map, r->map_len, &width, &height, &r->stride, &offset) != IMG_SUCCESS) {
+      return IMG_ERR_CORRUPT;
+    }
+    r->width = (int32_t) width;
+    r->height = (int32_t) height;
+    r->rows = r->map + offset;
+    r->crc = crc32(0L, Z_NULL, 0);
+    r->expected_crc = get_le32(r->map + 24);
+    return IMG_SUCCESS;
+  }
 
-  if (need_byteswap) {
-    data_to_write = (uint32_t *) malloc(img->width * img->height * sizeof(uint32_t));
-    if (data_to_write == NULL) {
-      png_close_file(&png);
-      return IMG_ERR_MALLOC_FAILED;
+  if (img_is_qoi(filename)) {
+    r->format = ROWS_QOI;
+    int rc = map_stream(filename, &r->fd, &r->map, &r->map_len);
+    if (rc != IMG_SUCCESS) {
+      return rc;
+    }
+    if (qoi_decode_init(&r->qoi, r->map, r->map_len) != QOI_OK || r->qoi.width > INT32_MAX) {
+      return IMG_ERR_CORRUPT;
     }
+    r->width = (int32_t) r->qoi.width;
+    r->height = (int32_t) r->qoi.height;
+    return IMG_SUCCESS;
+  }
 
-    int32_t num_pixels = img->width * img->height;
-    for (int32_t i = 0; i < num_pixels; i++) {
-      data_to_write[i] = byteswap(img->data[i]);
+  if (img_is_timg(filename)) {
+    r->format = ROWS_TIMG;
+    int rc = timg_open(filename, &r->ti);
+    if (rc != IMG_SUCCESS) {
+      return rc;
     }
+    r->width = r->ti.width;
+    r->height = r->ti.height;
+    return IMG_SUCCESS;
   }
 
-  int rc = png_set_data(&png, img->width, img->height, 8, PNG_TRUECOLOR_ALPHA, (unsigned char *) data_to_write);
-  int success = (rc == PNG_NO_ERROR);
+  r->format = ROWS_PNG;
+  r->fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (r->fd < 0) {
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+  posix_fadvise(r->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  if (png_open_read(&r->png, stream_read, r) != PNG_NO_ERROR) {
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+  if (r->png.width == 0 || r->png.height == 0 || r->png.width > INT32_MAX / r->png.height) {
+    return IMG_ERR_CORRUPT;
+  }
+  r->width = (int32_t) r->png.width;
+  r->height = (int32_t) r->png.height;
+  png_set_crc_checks(&r->png, !(r->flags & IMG_READ_TRUSTED));
 
-  png_close_file(&png);
-  if (need_byteswap) {
-    free(data_to_write);
+  // Interlaced rows can't be decoded one after another
+  if (r->png.interlace_method) {
+    r->format = ROWS_WHOLE;
+    r->filename = strdup(filename);
+    return r->filename != NULL ? IMG_SUCCESS : IMG_ERR_MALLOC_FAILED;
+  }
+  return IMG_SUCCESS;
+}
+
+int img_rows_open(const char *filename, int flags, struct ImgRowReader **reader) {
+  struct ImgRowReader *r = calloc(1, sizeof(struct ImgRowReader));
+  if (r == NULL) {
+    return IMG_ERR_MALLOC_FAILED;
+  }
+  r->fd = -1;
+  r->flags = flags;
+  int rc = open_row_reader(filename, r);
+  if (rc != IMG_SUCCESS) {
+    img_rows_close(r);
+    return rc;
+  }
+  *reader = r;
+  return IMG_SUCCESS;
+}
+
+void img_rows_size(const struct ImgRowReader *reader, int32_t *width, int32_t *height) {
+  *width = reader->width;
+  *height = reader->height;
+}
+
+// Get a buffer of at least size bytes for rows that aren't decoded
+// straight into the caller's rows, or NULL if memory runs out
+static unsigned char *reader_buffer(struct ImgRowReader *r, size_t size) {
+  if (r->raw_size < size) {
+    free(r->raw);
+    r->raw = malloc(size);
+    r->raw_size = r->raw != NULL ? size : 0;
+  }
+  return r->raw;
+}
+
+static int read_png_rows(struct ImgRowReader *r, uint32_t *data, int32_t rows) {
+  png_t *png = &r->png;
+  size_t row_bytes = png_get_row_bytes(png);
+  int in_place = png->color_type == PNG_TRUECOLOR_ALPHA && png->depth == 8;
+
+  // Skipped rows still have to be decoded
+  unsigned char *raw = in_place && data != NULL ? (unsigned char *) data : reader_buffer(r, row_bytes * rows);
+  if (raw == NULL) {
+    return IMG_ERR_MALLOC_FAILED;
+  }
+
+  int rc = png_read_rows(png, raw, rows);
+  if (rc != PNG_NO_ERROR) {
+    return rc == PNG_MEMORY_ERROR ? IMG_ERR_MALLOC_FAILED : IMG_ERR_CORRUPT;
+  }
+  if (data == NULL) {
+    return IMG_SUCCESS;
+  }
+  // the palette has been read by now
+  if (r->expand.palette == NULL) {
+    png_expand_format(png, r->palette, &r->expand);
+  }
+  for (int32_t i = 0; i < rows; i++) {
+    img_expand_row(&r->expand, raw + i * row_bytes, data + (size_t) i * r->width, r->width);
+  }
+  return IMG_SUCCESS;
+}
+
+static int read_rows(struct ImgRowReader *reader, uint32_t *data, int32_t rows) {
+  struct ImgRowReader *r = reader;
+  if (rows < 0 || rows > r->height - r->row) {
+    return IMG_ERR_CORRUPT;
+  }
+  if (rows == 0) {
+    return IMG_SUCCESS;
+  }
+  size_t row_bytes = (size_t) r->width * sizeof(uint32_t);
+  int rc = IMG_SUCCESS;
+
+  switch (r->format) {
+  case ROWS_PNG:
+    rc = read_png_rows(r, data, rows);
+    break;
+  case ROWS_RIMG:
+    for (int32_t i = 0; i < rows; i++) {
+      const unsigned char *src = r->rows + (size_t) (r->row + i) * r->stride;
+      if (!(r->flags & IMG_READ_TRUSTED)) {
+        r->crc = crc32(r->crc, src, (uInt) row_bytes);
+      }
+      if (data != NULL) {
+        uint32_t *dst = data + (size_t) i * r->width;
+        memcpy(dst, src, row_bytes);
+        if (!is_little_endian()) {
+          for (int32_t j = 0; j < r->width; j++) {
+            dst[j] = byteswap(dst[j]);
+          }
+        }
+      }
+    }
+    trim_read(r->fd, r->map, &r->trimmed, r->rows - r->map + (off_t) (r->row + rows) * r->stride);
+    break;
+  case ROWS_QOI:
+    for (int32_t i = 0; i < rows && rc == IMG_SUCCESS; i++) {
+      // skipped rows are decoded over each other
+      uint32_t *dst = data != NULL ? data + (size_t) i * r->width : (uint32_t *) reader_buffer(r, row_bytes);
+      if (dst == NULL) {
+        return IMG_ERR_MALLOC_FAILED;
+      }
+      if (qoi_decode_row(&r->qoi, dst) != QOI_OK) {
+        rc = IMG_ERR_CORRUPT;
+      }
+    }
+    trim_read(r->fd, r->map, &r->trimmed, (off_t) r->qoi.pos);
+    break;
+  case ROWS_TIMG:
+    if (data != NULL && rows > 0) {
+      rc = timg_read_region(&r->ti, 0, r->row, r->width, rows, data, r->width);
+    }
+    break;
+  case ROWS_WHOLE:
+    if (r->whole.data == NULL) {
+      rc = img_read_flags(r->filename, &r->whole, r->flags);
+      if (rc != IMG_SUCCESS) {
+        r->whole.data = NULL;
+        return rc;
+      }
+    }
+    if (data != NULL) {
+      memcpy(data, r->whole.data + (size_t) r->row * r->width, rows * row_bytes);
+    }
+    break;
+  }
+
+  if (rc == IMG_SUCCESS) {
+    r->row += rows;
+  }
+  return rc;
+}
+
+int img_rows_read(struct ImgRowReader *reader, uint32_t *data, int32_t rows) {
+  imgtrace_begin("decode rows", reader->row);
+  int rc = read_rows(reader, data, rows);
+  imgtrace_end("decode rows");
+  return rc;
+}
+
+int img_rows_close(struct ImgRowReader *reader) {
+  struct ImgRowReader *r = reader;
+  int rc = IMG_SUCCESS;
+
+  // the checksum covers every row, including any that weren't needed
+  if (r->format == ROWS_RIMG && r->rows != NULL && !(r->flags & IMG_READ_TRUSTED)) {
+    if (r->row < r->height) {
+      img_rows_read(r, NULL, r->height - r->row);
+    }
+    if ((uint32_t) r->crc != r->expected_crc) {
+      rc = IMG_ERR_CORRUPT;
+    }
+  }
+
+  // (the PNG decoder is only set up once the file is open)
+  if (r->format == ROWS_PNG && r->png.free_fun != NULL) {
+    png_read_end(&r->png);
+  } else if (r->format == ROWS_TIMG) {
+    timg_close(&r->ti);
+  }
+  if (r->whole.data != NULL) {
+    img_cleanup(&r->whole);
+  }
+  if (r->map != NULL) {
+    munmap(r->map, r->map_len);
+  }
+  if (r->fd >= 0) {
+    close(r->fd);
+  }
+  free(r->raw);
+  free(r->filename);
+  free(r);
+  return rc;
+}
+
+static int open_row_writer(const char *filename, struct ImgRowWriter *w) {
+  if (img_is_timg(filename)) {
+    w->format = ROWS_TIMG;
+    return img_init_scratch(&w->whole, w->width, w->height);
+  }
+
+  w->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (w->fd < 0) {
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+
+  if (img_is_qoi(filename)) {
+    w->format = ROWS_QOI;
+    return qoi_encode_init(&w->qoi, w->width, w->height, 4) == QOI_OK ? IMG_SUCCESS : IMG_ERR_MALLOC_FAILED;
+  }
+  if (img_is_rimg(filename)) {
+    // the header, with the checksum, is written at the end
+    w->format = ROWS_RIMG;
+    w->crc = crc32(0L, Z_NULL, 0);
+    w->written = RIMG_HEADER_SIZE;
+    return lseek(w->fd, RIMG_HEADER_SIZE, SEEK_SET) == RIMG_HEADER_SIZE ? IMG_SUCCESS : IMG_ERR_COULD_NOT_WRITE;
   }
 
-  return success ? IMG_SUCCESS : IMG_ERR_COULD_NOT_WRITE;
+  // Whether the image is opaque isn't known in advance, so it is
+  // always written as RGBA
+  w->format = ROWS_PNG;
+  if (png_open_write(&w->png, stream_write, w) != PNG_NO_ERROR
+      || png_write_begin(&w->png, w->width, w->height, 8, PNG_TRUECOLOR_ALPHA) != PNG_NO_ERROR) {
+    return IMG_ERR_COULD_NOT_WRITE;
+  }
+  return IMG_SUCCESS;
+}
+
+int img_rows_create(const char *filename, int32_t width, int32_t height, struct ImgRowWriter **writer) {
+  struct ImgRowWriter *w = calloc(1, sizeof(struct ImgRowWriter));
+  if (w == NULL) {
+    return IMG_ERR_MALLOC_FAILED;
+  }
+  w->fd = -1;
+  w->width = width;
+  w->height = height;
+  w->filename = strdup(filename);
+  int rc = w->filename != NULL ? open_row_writer(filename, w) : IMG_ERR_MALLOC_FAILED;
+  if (rc != IMG_SUCCESS) {
+    img_rows_finish(w);
+    return rc;
+  }
+  *writer = w;
+  return IMG_SUCCESS;
+}
+
+static int write_rows(struct ImgRowWriter *writer, const uint32_t *data, int32_t rows) {
+  struct ImgRowWriter *w = writer;
+  if (rows < 0 || rows > w->height - w->row) {
+    return IMG_ERR_COULD_NOT_WRITE;
+  }
+  size_t bytes = (size_t) rows * w->width * sizeof(uint32_t);
+  int rc = IMG_SUCCESS;
+
+  // PNG wants big-endian pixels and .rimg little-endian ones
+  const unsigned char *bytes_out = (const unsigned char *) data;
+  int swap = w->format == ROWS_PNG ? is_little_endian() : w->format == ROWS_RIMG && !is_little_endian();
+  if (swap) {
+    if (w->buf_size < bytes) {
+      free(w->buf);
+      w->buf_size = bytes;
+      w->buf = malloc(bytes);
+      if (w->buf == NULL) {
+        w->buf_size = 0;
+        return IMG_ERR_MALLOC_FAILED;
+      }
+    }
+    uint32_t *out = (uint32_t *) w->buf;
+    for (size_t i = 0; i < bytes / sizeof(uint32_t); i++) {
+      out[i] = byteswap(data[i]);
+    }
+    bytes_out = w->buf;
+  }
+
+  switch (w->format) {
+  case ROWS_PNG:
+    if (png_write_rows(&w->png, (unsigned char *) bytes_out, rows) != PNG_NO_ERROR) {
+      rc = IMG_ERR_COULD_NOT_WRITE;
+    }
+    break;
+  case ROWS_RIMG:
+    w->crc = crc32(w->crc, bytes_out, (uInt) bytes);
+    if (stream_write((void *) bytes_out, 1, bytes, w) != bytes) {
+      rc = IMG_ERR_COULD_NOT_WRITE;
+    }
+    break;
+  case ROWS_QOI:
+    for (int32_t i = 0; i < rows && rc == IMG_SUCCESS; i++) {
+      if (qoi_encode_row(&w->qoi, data + (size_t) i * w->width) != QOI_OK) {
+        rc = IMG_ERR_MALLOC_FAILED;
+      }
+    }
+    // the pending run (if any) isn't in the buffer yet
+    if (rc == IMG_SUCCESS) {
+      size_t len = w->qoi.len;
+      rc = stream_write(w->qoi.buf, 1, len, w) == len ? IMG_SUCCESS : IMG_ERR_COULD_NOT_WRITE;
+      qoi_encode_consume(&w->qoi, len);
+    }
+    break;
+  default:
+    memcpy(w->whole.data + (size_t) w->row * w->width, data, bytes);
+    break;
+  }
+
+  if (rc == IMG_SUCCESS) {
+    w->row += rows;
+  }
+  return rc;
+}
+
+int img_rows_write(struct ImgRowWriter *writer, const uint32_t *data, int32_t rows) {
+  imgtrace_begin("encode rows", writer->row);
+  int rc = write_rows(writer, data, rows);
+  imgtrace_end("encode rows");
+  return rc;
+}
+
+int img_rows_finish(struct ImgRowWriter *writer) {
+  struct ImgRowWriter *w = writer;
+  int rc = w->row == w->height && w->filename != NULL ? IMG_SUCCESS : IMG_ERR_COULD_NOT_WRITE;
+
+  if (w->format == ROWS_PNG && w->fd >= 0) {
+    if (png_write_end(&w->png) != PNG_NO_ERROR) {
+      rc = IMG_ERR_COULD_NOT_WRITE;
+    }
+  } else if (w->format == ROWS_RIMG && w->fd >= 0 && rc == IMG_SUCCESS) {
+    unsigned char hdr[RIMG_HEADER_SIZE];
+    struct Image dims = { w->width, w->height, NULL, NULL, 0 };
+    rimg_header(&dims, w->crc, hdr);
+    if (pwrite(w->fd, hdr, RIMG_HEADER_SIZE, 0) != RIMG_HEADER_SIZE) {
+      rc = IMG_ERR_COULD_NOT_WRITE;
+    }
+  } else if (w->format == ROWS_QOI && w->fd >= 0) {
+    void *buf;
+    size_t len;
+    if (rc == IMG_SUCCESS && qoi_encode_finish(&w->qoi, &buf, &len) == QOI_OK) {
+      if (stream_write(buf, 1, len, w) != len) {
+        rc = IMG_ERR_COULD_NOT_WRITE;
+      }
+      free(buf);
+    } else {
+      qoi_encode_abort(&w->qoi);
+      rc = IMG_ERR_COULD_NOT_WRITE;
+    }
+  } else if (w->format == ROWS_TIMG && w->whole.data != NULL) {
+    if (rc == IMG_SUCCESS) {
+      rc = write_timg(w->filename, &w->whole);
+    }
+    img_cleanup(&w->whole);
+  }
+
+  if (w->fd >= 0 && close(w->fd) != 0) {
+    rc = IMG_ERR_COULD_NOT_WRITE;
+  }
+  free(w->buf);
+  free(w->filename);
+  free(w);
+  return rc;
+}
+
+int img_init_scratch(struct Image *img, int32_t width, int32_t height) {
+  const char *dir = getenv("IMGPROC_SCRATCH_DIR");
+  if (dir == NULL) {
+    dir = getenv("TMPDIR");
+  }
+  if (dir == NULL) {
+    dir = "/tmp";
+  }
+
+  // An unnamed file, which disappears once it is unmapped
+  int fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+  size_t len = (size_t) width * height * sizeof(uint32_t);
+  if (len == 0) {
+    len = 1;
+  }
+  void *map = MAP_FAILED;
+  if (ftruncate(fd, (off_t) len) == 0) {
+    map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (map == MAP_FAILED) {
+    return IMG_ERR_MALLOC_FAILED;
+  }
+
+  img->width = width;
+  img->height = height;
+  img->data = map;
+  img->map = map;
+  img->map_len = len;
+  return IMG_SUCCESS;
 }
 
 void img_cleanup( struct Image *img ) {
   // The data array is the only dynamically-allocated
-  // part of the representation of a struct Image
-  free( img->data );
+  // part of the representation of a struct Image, unless
+  // it points into a mapped .rimg file
+  if ( img->map != NULL )
+    munmap( img->map, img->map_len );
+  else
+    free( img->data );
 }
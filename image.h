@@ -7,14 +7,24 @@
 #define IMG_ERR_NOT_TRUECOLOR    -2
 #define IMG_ERR_MALLOC_FAILED    -3
 #define IMG_ERR_COULD_NOT_WRITE  -4
+#define IMG_ERR_CORRUPT          -5
+#define IMG_ERR_CANCELLED        -6   // the current job (see imgjob.h) was stopped
+
+// flags for img_read_flags and img_read_mem_flags
+#define IMG_READ_TRUSTED         1   // skip checksums (PNG chunk CRCs, .rimg CRC)
 
 #ifndef ASM_SOURCE
+#include <stddef.h>
 #include <stdint.h>
 
 struct Image {
   int32_t width;
   int32_t height;
   uint32_t *data;
+  // If non-NULL, data points into this mapping of a .rimg file
+  // (map_len bytes long) rather than to a malloc'ed buffer
+  void *map;
+  size_t map_len;
 };
 
 // Initialize an Image struct instance by creating a pixel
@@ -35,10 +45,16 @@ struct Image {
 int img_init(struct Image *img, int32_t width, int32_t height);
 
 // Read PNG image data from a file and initialize the specified
-// Image struct instance.
+// Image struct instance. Greyscale, palette and 16-bit PNGs are
+// expanded to 8-bit RGBA as they are decoded. If the file name ends
+// in ".rimg", the file is read as a raw .rimg image instead; where
+// possible it is mapped into memory and its pixel rows are used in
+// place (zero-copy). If it ends in ".qoi", the file is read as a QOI
+// image, and if it ends in ".timg", as a tiled image (whose tiles are
+// decoded in parallel).
 //
 // Parameters:
-//   filename - name of PNG file to read
+//   filename - name of PNG (or .rimg) file to read
 //   img - pointer to Image struct to initialize with the loaded
 //         image data
 //
@@ -47,11 +63,60 @@ int img_init(struct Image *img, int32_t width, int32_t height);
 //   IMG_ERR_* values
 int img_read(const char *filename, struct Image *img);
 
+// Decode PNG image data held in memory and initialize the specified
+// Image struct instance, like img_read. Data starting with the .rimg,
+// QOI or .timg magic number is decoded in that format.
+//
+// Parameters:
+//   buf - the contents of a PNG (or .rimg, QOI or .timg) file
+//   len - number of bytes in buf
+//   img - pointer to Image struct to initialize with the decoded
+//         image data
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values
+int img_read_mem(const void *buf, size_t len, struct Image *img);
+
+// Like img_read and img_read_mem, with flags that are a combination of
+// IMG_READ_* values. IMG_READ_TRUSTED skips the CRC checks of the PNG
+// chunks after the header and the checksum of .rimg data. Use it only
+// for files this program wrote itself, as damaged input may then decode
+// to wrong pixels. The QOI and .timg checks are unaffected.
+int img_read_flags(const char *filename, struct Image *img, int flags);
+int img_read_mem_flags(const void *buf, size_t len, struct Image *img, int flags);
+
+// Like img_read_mem_flags, for a buffer of len bytes mapped with mmap
+// (readable and writable, e.g. a private mapping of a file), which then
+// belongs to the image: the pixel rows of .rimg data are used where
+// they are (zero-copy) and img_cleanup unmaps the buffer, while data in
+// other formats is decoded and the buffer unmapped right away. The
+// buffer is unmapped if decoding fails too.
+int img_read_mapped(void *map, size_t len, struct Image *img, int flags);
+
+// Read an image like img_read_flags when only the pixels in every
+// ystep-th row and xstep-th column (starting with the first) are
+// needed, e.g. to squash it by those factors. For interlaced PNGs only
+// the Adam7 passes holding those pixels are decoded, and each of them
+// is copied to the pixels around it that belong to later passes (so
+// with steps of 8, only the first, 1/8-scale pass is decoded). Other
+// images are read completely.
+int img_read_sampled(const char *filename, int32_t xstep, int32_t ystep, struct Image *img, int flags);
+
 // Write pixel data from specified Image struct instance to the
-// named PNG output file.
+// named PNG output file (as RGB if every pixel is opaque). If the file
+// name ends in ".rimg", an uncompressed .rimg file is written instead,
+// with a single write; if it ends in ".qoi", a QOI file is written,
+// and if it ends in ".timg", a tiled image with independently
+// compressed tiles.
+//
+// If the IMGPROC_PNG_RESTART environment variable is set to a number
+// of rows, PNGs are compressed in bands of that many rows that can be
+// inflated independently, and the band offsets are stored in an
+// ancillary chunk, so img_read can decode the bands in parallel.
 //
 // Parameters:
-//   filename - name of PNG file to write
+//   filename - name of PNG (or .rimg, QOI or .timg) file to write
 //   img - pointer to Image struct with the pixel data to write
 //         to a PNG file
 //
@@ -60,6 +125,143 @@ int img_read(const char *filename, struct Image *img);
 //   IMG_ERR_* values
 int img_write(const char *filename, struct Image *img);
 
+// Encode pixel data from specified Image struct instance as PNG data
+// in a newly allocated memory buffer, like img_write.
+//
+// Parameters:
+//   img - pointer to Image struct with the pixel data to encode
+//   buf - set to the buffer with the PNG data, which the caller
+//         must free
+//   len - set to the number of bytes in the buffer
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values
+int img_write_mem(struct Image *img, void **buf, size_t *len);
+
+// Encode pixel data from specified Image struct instance as .rimg
+// data in a newly allocated memory buffer. Parameters and return
+// values are the same as for img_write_mem.
+int img_write_rimg_mem(struct Image *img, void **buf, size_t *len);
+
+// Encode pixel data from specified Image struct instance as QOI
+// data in a newly allocated memory buffer. Parameters and return
+// values are the same as for img_write_mem.
+int img_write_qoi_mem(struct Image *img, void **buf, size_t *len);
+
+// Encode pixel data from specified Image struct instance as .timg
+// data (with TIMG_DEFAULT_TILE sized tiles) in a newly allocated
+// memory buffer. Parameters and return values are the same as for
+// img_write_mem.
+int img_write_timg_mem(struct Image *img, void **buf, size_t *len);
+
+// Encode pixel data in a newly allocated memory buffer, in the format
+// img_write would use for the named file (PNG, .rimg, QOI or .timg).
+// Parameters and return values are otherwise the same as for
+// img_write_mem.
+int img_write_mem_for(const char *filename, struct Image *img, void **buf, size_t *len);
+
+// For computing an image straight into the buffer its .rimg data is
+// written to (e.g. a shared mapping): img_rimg_size is the size of the
+// .rimg data of an image of the given dimensions, img_init_rimg_at
+// initializes img with its pixels where the rows go in buf (which must
+// be 64-byte aligned and img_rimg_size bytes long), and once they are
+// final, img_finish_rimg_at writes the header in front of them. The
+// pixels start out as they are in buf, and img_cleanup must not be
+// called on img.
+size_t img_rimg_size(int32_t width, int32_t height);
+void img_init_rimg_at(struct Image *img, int32_t width, int32_t height, void *buf);
+void img_finish_rimg_at(struct Image *img, void *buf);
+
+// Returns 1 if the named file is a .rimg image (judging by its
+// extension), 0 otherwise.
+int img_is_rimg(const char *filename);
+
+// Returns 1 if the named file is a QOI image (judging by its
+// extension), 0 otherwise.
+int img_is_qoi(const char *filename);
+
+// Returns 1 if the named file is a tiled .timg image (judging by its
+// extension), 0 otherwise.
+int img_is_timg(const char *filename);
+
+// Read the region of w x h pixels whose top left pixel is (x, y) from
+// an image file, clipping it to the image (so the result may be
+// smaller, or even empty). For .timg files only the tiles covering the
+// region are decoded; other formats are read whole and then cropped.
+//
+// Parameters:
+//   filename - name of the image file to read
+//   x, y - position of the region's top left pixel
+//   w, h - size of the region
+//   img - pointer to Image struct to initialize with the region
+//   flags - IMG_READ_* values, as for img_read_flags
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values
+int img_read_region(const char *filename, int32_t x, int32_t y, int32_t w, int32_t h, struct Image *img,
+                    int flags);
+
+// Initialize an Image like img_init, but with its pixels in a shared
+// mapping of an unnamed scratch file (created in the directory named
+// by IMGPROC_SCRATCH_DIR, or else TMPDIR or /tmp), so the kernel can
+// write them back to disk instead of keeping them in memory or swap.
+// The pixels start out as 0 (transparent black). img_cleanup unmaps
+// the file, which deletes it.
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values
+int img_init_scratch(struct Image *img, int32_t width, int32_t height);
+
+// Reading an image a band of rows at a time, for images too large to
+// hold in memory. The file is read from start to end, and what has
+// been read is dropped from the page cache as it goes. PNG (unless
+// interlaced), .rimg and QOI files are decoded as they are read, and
+// .timg files a band of tiles at a time; interlaced PNGs are read as a
+// whole when the reader is opened.
+struct ImgRowReader;
+
+// Open the named image file (flags are IMG_READ_* values) and set
+// *reader to a new reader for it. Returns IMG_SUCCESS or one of the
+// IMG_ERR_* values.
+int img_rows_open(const char *filename, int flags, struct ImgRowReader **reader);
+
+// Get the dimensions of the image being read.
+void img_rows_size(const struct ImgRowReader *reader, int32_t *width, int32_t *height);
+
+// Read the next rows of the image into data (rows * width pixels), or
+// skip them if data is NULL. Returns IMG_SUCCESS or one of the
+// IMG_ERR_* values.
+int img_rows_read(struct ImgRowReader *reader, uint32_t *data, int32_t rows);
+
+// Close a reader. The checksum of a .rimg file can only be checked
+// once every row has been read (rows that weren't are read now), so a
+// damaged .rimg file is reported here, as IMG_ERR_CORRUPT.
+int img_rows_close(struct ImgRowReader *reader);
+
+// Writing an image a band of rows at a time. PNG, .rimg and QOI files
+// are written as the rows come in (PNGs always as RGBA), with their
+// pages dropped from the page cache once written back; .timg images
+// are collected in a scratch image (see img_init_scratch) and encoded
+// at the end.
+struct ImgRowWriter;
+
+// Create the named image file for an image of the given dimensions and
+// set *writer to a new writer for it. Returns IMG_SUCCESS or one of
+// the IMG_ERR_* values.
+int img_rows_create(const char *filename, int32_t width, int32_t height, struct ImgRowWriter **writer);
+
+// Write the next rows of the image from data (rows * width pixels).
+// Returns IMG_SUCCESS or one of the IMG_ERR_* values.
+int img_rows_write(struct ImgRowWriter *writer, const uint32_t *data, int32_t rows);
+
+// Finish writing the image and free the writer. Returns IMG_SUCCESS if
+// every row was written and the file is complete, otherwise one of the
+// IMG_ERR_* values.
+int img_rows_finish(struct ImgRowWriter *writer);
+
 // De-allocate the dynamically-allocated memory used in the internal
 // representation of the given Image struct. Note that this function
 // does NOT de-allocate the struct Image instance itself (since allocating
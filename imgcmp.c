@@ -0,0 +1,97 @@
+// Compares an image with the expected one, as the test harness does for
+// every transformation: reports the number of differing pixels, the
+// mean squared error, PSNR and largest component difference, and the
+// first differing pixel, and optionally writes an image showing where
+// they differ (only if they do). By default the images must match
+// exactly; the tolerance options accept images within all of the
+// given tolerances instead.
+//
+// Usage: imgcmp [--max-mse <x>] [--min-psnr <db>] [--max-diff <n>] [--diff <diff img>]
+//               <expected img> <actual img>
+//
+// Exits with 0 if the images match, 1 if they don't, and 2 if either
+// image can't be read or the diff image can't be written.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "image.h"
+#include "imgcompare.h"
+
+static void usage( const char *prog ) {
+  fprintf( stderr, "Usage: %s [--max-mse <x>] [--min-psnr <db>] [--max-diff <n>] [--diff <diff img>]\n"
+                   "       %*s <expected img> <actual img>\n", prog, (int) strlen( prog ), "" );
+}
+
+int main( int argc, char **argv ) {
+  // Without tolerances, any difference is a mismatch
+  double max_mse = INFINITY, min_psnr = 0;
+  int max_diff = 255;
+  int tolerant = 0;
+  const char *diff_filename = NULL;
+
+  int i = 1;
+  for ( ; i + 1 < argc && strncmp( argv[i], "--", 2 ) == 0; i += 2 ) {
+    if ( strcmp( argv[i], "--max-mse" ) == 0 )
+      max_mse = atof( argv[i + 1] );
+    else if ( strcmp( argv[i], "--min-psnr" ) == 0 )
+      min_psnr = atof( argv[i + 1] );
+    else if ( strcmp( argv[i], "--max-diff" ) == 0 )
+      max_diff = atoi( argv[i + 1] );
+    else if ( strcmp( argv[i], "--diff" ) == 0 )
+      diff_filename = argv[i + 1];
+    else
+      break;
+    tolerant |= strcmp( argv[i], "--diff" ) != 0;
+  }
+  if ( argc - i != 2 ) {
+    usage( argv[0] );
+    return 2;
+  }
+
+  struct Image expected, actual;
+  if ( img_read( argv[i], &expected ) != IMG_SUCCESS ) {
+    fprintf( stderr, "Error: couldn't read image '%s'\n", argv[i] );
+    return 2;
+  }
+  if ( img_read( argv[i + 1], &actual ) != IMG_SUCCESS ) {
+    fprintf( stderr, "Error: couldn't read image '%s'\n", argv[i + 1] );
+    img_cleanup( &expected );
+    return 2;
+  }
+
+  // The diff image is only computed if it will be written
+  struct Image diff = { 0, 0, NULL, NULL, 0 };
+  if ( diff_filename != NULL && expected.width == actual.width && expected.height == actual.height )
+    img_init( &diff, expected.width, expected.height );
+
+  struct ImgCompareResult r;
+  int rc = 0;
+  if ( !img_compare( &expected, &actual, diff.data != NULL ? &diff : NULL, &r ) ) {
+    printf( "dimensions differ: expected %dx%d, actual %dx%d\n", expected.width, expected.height,
+            actual.width, actual.height );
+    rc = 1;
+  } else {
+    printf( "differing pixels: %llu of %llu\n", (unsigned long long) r.differing,
+            (unsigned long long) expected.width * expected.height );
+    printf( "mse: %.6g, psnr: %.6g dB, max abs diff: %d\n", r.mse, r.psnr, r.max_abs_diff );
+    if ( r.differing > 0 ) {
+      size_t first = (size_t) r.first_y * expected.width + r.first_x;
+      printf( "first mismatch at (%d, %d): expected 0x%08X, actual 0x%08X\n", r.first_x, r.first_y,
+              expected.data[first], actual.data[first] );
+      if ( !tolerant || r.mse > max_mse || r.psnr < min_psnr || r.max_abs_diff > max_diff )
+        rc = 1;
+      if ( diff.data != NULL && img_write( diff_filename, &diff ) != IMG_SUCCESS ) {
+        fprintf( stderr, "Error: couldn't write diff image '%s'\n", diff_filename );
+        rc = 2;
+      }
+    }
+  }
+
+  if ( diff.data != NULL )
+    img_cleanup( &diff );
+  img_cleanup( &expected );
+  img_cleanup( &actual );
+  return rc;
+}
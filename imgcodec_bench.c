@@ -0,0 +1,122 @@
+// Benchmark of the image codecs: encodes and decodes each input image
+// as PNG, QOI, .rimg and .timg, in memory and through files, and
+// reports the average time of each along with the encoded size. The
+// "trusted" rows decode with IMG_READ_TRUSTED, so comparing their
+// decode and read times with the rows above shows what checksums cost.
+//
+// Usage: imgcodec_bench [-n <iterations>] <input png>...
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "image.h"
+
+struct Codec {
+  const char *name;
+  const char *extension;
+  int read_flags;
+};
+
+static const struct Codec s_codecs[] = {
+  { "png", ".png", 0 },
+  { "png trusted", ".png", IMG_READ_TRUSTED },
+  { "qoi", ".qoi", 0 },
+  { "rimg", ".rimg", 0 },
+  { "rimg trusted", ".rimg", IMG_READ_TRUSTED },
+  { "timg", ".timg", 0 },
+  { NULL, NULL, 0 },
+};
+
+static double now_ms( void ) {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int images_equal( const struct Image *a, const struct Image *b ) {
+  return a->width == b->width && a->height == b->height
+      && memcmp( a->data, b->data, (size_t) a->width * a->height * sizeof( uint32_t ) ) == 0;
+}
+
+// Benchmark one codec on img. Returns 0 if the codec failed or didn't
+// round-trip the image exactly.
+static int bench_codec( const struct Codec *codec, struct Image *img, int iterations ) {
+  char filename[64];
+  snprintf( filename, sizeof( filename ), "/tmp/imgcodec_bench_%d%s", (int) getpid(), codec->extension );
+
+  void *buf = NULL;
+  size_t len = 0;
+  struct Image decoded;
+  double encode_ms = 0, decode_ms = 0, write_ms = 0, read_ms = 0;
+  int ok = 1;
+
+  for ( int i = 0; i < iterations && ok; i++ ) {
+    double start = now_ms();
+    free( buf );
+    ok = img_write_mem_for( filename, img, &buf, &len ) == IMG_SUCCESS;
+    encode_ms += now_ms() - start;
+    if ( !ok )
+      break;
+
+    start = now_ms();
+    ok = img_read_mem_flags( buf, len, &decoded, codec->read_flags ) == IMG_SUCCESS;
+    decode_ms += now_ms() - start;
+    if ( !ok )
+      break;
+    ok = images_equal( img, &decoded );
+    img_cleanup( &decoded );
+
+    start = now_ms();
+    ok = ok && img_write( filename, img ) == IMG_SUCCESS;
+    write_ms += now_ms() - start;
+
+    start = now_ms();
+    ok = ok && img_read_flags( filename, &decoded, codec->read_flags ) == IMG_SUCCESS;
+    read_ms += now_ms() - start;
+    if ( ok )
+      img_cleanup( &decoded );
+  }
+  free( buf );
+  unlink( filename );
+
+  if ( !ok ) {
+    printf( "  %-12s FAILED\n", codec->name );
+    return 0;
+  }
+  printf( "  %-12s %10zu %10.2f %10.2f %10.2f %10.2f\n", codec->name, len,
+          encode_ms / iterations, decode_ms / iterations, write_ms / iterations, read_ms / iterations );
+  return 1;
+}
+
+int main( int argc, char **argv ) {
+  int iterations = 5;
+  int first = 1;
+  if ( argc >= 3 && strcmp( argv[1], "-n" ) == 0 ) {
+    iterations = atoi( argv[2] );
+    first = 3;
+  }
+  if ( first >= argc || iterations < 1 ) {
+    fprintf( stderr, "Usage: %s [-n <iterations>] <input png>...\n", argv[0] );
+    return 1;
+  }
+
+  int failed = 0;
+  for ( int i = first; i < argc; i++ ) {
+    struct Image img;
+    if ( img_read( argv[i], &img ) != IMG_SUCCESS ) {
+      fprintf( stderr, "Error: couldn't read input image '%s'\n", argv[i] );
+      failed = 1;
+      continue;
+    }
+
+    printf( "%s (%dx%d), average of %d runs:\n", argv[i], img.width, img.height, iterations );
+    printf( "  %-12s %10s %10s %10s %10s %10s\n", "codec", "bytes", "enc ms", "dec ms", "write ms", "read ms" );
+    for ( int c = 0; s_codecs[c].name != NULL; c++ )
+      failed |= !bench_codec( &s_codecs[c], &img, iterations );
+    img_cleanup( &img );
+  }
+
+  return failed;
+}
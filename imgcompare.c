@@ -0,0 +1,179 @@
+// Comparison of two images, in bands of rows compared in parallel. The
+// rows are compared VEC_LANES pixels at a time with the vector helpers
+// of imgproc_vec.h where the compiler supports them, and the totals of
+// the bands are added up at the end.
+
+#include <math.h>
+#include "imgcompare.h"
+#include "imgproc_kernels.h"
+#include "parallel.h"
+#ifdef IMGPROC_HAVE_VEC
+#include "imgproc_vec.h"
+#endif
+
+// Colour of the differing pixels in the diff image
+#define DIFF_PIXEL 0xFF0000FFU
+
+// Vectors whose squared differences are added up in 32-bit lanes before
+// being moved to the 64-bit total (each adds at most 4 * 255 * 255)
+#define SUM_FLUSH_VECTORS 8192
+
+// Bands of rows the images are split into
+#define COMPARE_BANDS 64
+
+// Totals for one band of rows, and its first differing pixel
+struct BandStats {
+  uint64_t sum_sq;
+  uint64_t differing;
+  uint32_t max_abs_diff;
+  int32_t first_x, first_y;
+};
+
+struct CompareCtx {
+  const struct Image *expected;
+  const struct Image *actual;
+  struct Image *diff;
+  int32_t bands;
+  struct BandStats stats[COMPARE_BANDS];
+};
+
+// A matching pixel of the diff image: halfway between the expected
+// pixel and white, and opaque
+static uint32_t lighten( uint32_t p ) {
+  return ((p >> 1) & 0x7F7F7F00) + 0x80808000 + 0xFF;
+}
+
+static uint32_t abs_diff( uint32_t a, uint32_t b ) {
+  return a > b ? a - b : b - a;
+}
+
+// Compare pixels [x, width) of a row one at a time
+static void compare_pixels( const uint32_t *e, const uint32_t *a, uint32_t *d, int32_t x, int32_t width,
+                            struct BandStats *stats ) {
+  for ( ; x < width; x++ ) {
+    uint32_t sum_sq = 0;
+    for ( int shift = 0; shift < 32; shift += 8 ) {
+      uint32_t c = abs_diff( (e[x] >> shift) & 0xFF, (a[x] >> shift) & 0xFF );
+      sum_sq += c * c;
+      if ( c > stats->max_abs_diff )
+        stats->max_abs_diff = c;
+    }
+    stats->sum_sq += sum_sq;
+    if ( e[x] != a[x] ) {
+      stats->differing++;
+      if ( stats->first_x < 0 )
+        stats->first_x = x;
+    }
+    if ( d != NULL )
+      d[x] = e[x] != a[x] ? DIFF_PIXEL : lighten( e[x] );
+  }
+}
+
+#ifdef IMGPROC_HAVE_VEC
+static inline vec_u32 vec_abs_diff( vec_u32 a, vec_u32 b ) {
+  return vec_select( vec_lt( b, a ), a - b, b - a );
+}
+
+// Compare the whole vectors of a row, returning the first pixel left.
+// stats->first_x is set if it was negative and the row has a difference.
+static int32_t compare_vectors( const uint32_t *e, const uint32_t *a, uint32_t *d, int32_t width,
+                                struct BandStats *stats ) {
+  vec_u32 sum_sq = { 0 }, max = { 0 }, differing = { 0 };
+  int32_t x = 0;
+  for ( int32_t n = 0; x + VEC_LANES <= width; x += VEC_LANES ) {
+    vec_u32 pe = vec_load( e + x ), pa = vec_load( a + x );
+    vec_u32 dr = vec_abs_diff( vec_get_r( pe ), vec_get_r( pa ) );
+    vec_u32 dg = vec_abs_diff( vec_get_g( pe ), vec_get_g( pa ) );
+    vec_u32 db = vec_abs_diff( vec_get_b( pe ), vec_get_b( pa ) );
+    vec_u32 da = vec_abs_diff( vec_get_a( pe ), vec_get_a( pa ) );
+    sum_sq += dr * dr + dg * dg + db * db + da * da;
+    max = vec_select( vec_lt( max, dr ), dr, max );
+    max = vec_select( vec_lt( max, dg ), dg, max );
+    max = vec_select( vec_lt( max, db ), db, max );
+    max = vec_select( vec_lt( max, da ), da, max );
+
+    // Lanes that differ are all ones, so subtracting counts them
+    vec_u32 ne = (vec_u32) (pe != pa);
+    differing -= ne;
+    if ( d != NULL )
+      vec_store( d + x, vec_select( ne, vec_splat( DIFF_PIXEL ), ((pe >> 1) & 0x7F7F7F00) + 0x808080FF ) );
+    if ( stats->first_x < 0 ) {
+      for ( int i = 0; i < VEC_LANES; i++ ) {
+        if ( ne[i] != 0 ) {
+          stats->first_x = x + i;
+          break;
+        }
+      }
+    }
+
+    if ( ++n == SUM_FLUSH_VECTORS || x + 2 * VEC_LANES > width ) {
+      for ( int i = 0; i < VEC_LANES; i++ ) {
+        stats->sum_sq += sum_sq[i];
+        if ( max[i] > stats->max_abs_diff )
+          stats->max_abs_diff = max[i];
+        stats->differing += differing[i];
+      }
+      sum_sq = (vec_u32) { 0 };
+      differing = (vec_u32) { 0 };
+      n = 0;
+    }
+  }
+  return x;
+}
+#endif
+
+// Compare the rows of bands [begin, end)
+static void compare_bands( void *arg, int32_t begin, int32_t end ) {
+  struct CompareCtx *ctx = arg;
+  int32_t width = ctx->expected->width;
+  int32_t height = ctx->expected->height;
+  for ( int32_t band = begin; band < end; band++ ) {
+    struct BandStats *stats = &ctx->stats[band];
+    *stats = (struct BandStats) { 0, 0, 0, -1, -1 };
+    int32_t row_end = (int32_t) ((int64_t) height * (band + 1) / ctx->bands);
+    for ( int32_t row = (int32_t) ((int64_t) height * band / ctx->bands); row < row_end; row++ ) {
+      const uint32_t *e = ctx->expected->data + (size_t) row * width;
+      const uint32_t *a = ctx->actual->data + (size_t) row * width;
+      uint32_t *d = ctx->diff != NULL ? ctx->diff->data + (size_t) row * width : NULL;
+      int32_t x = 0;
+#ifdef IMGPROC_HAVE_VEC
+      x = compare_vectors( e, a, d, width, stats );
+#endif
+      compare_pixels( e, a, d, x, width, stats );
+      if ( stats->first_x >= 0 && stats->first_y < 0 )
+        stats->first_y = row;
+    }
+  }
+}
+
+int img_compare( const struct Image *expected, const struct Image *actual, struct Image *diff,
+                 struct ImgCompareResult *result ) {
+  if ( expected->width != actual->width || expected->height != actual->height )
+    return 0;
+
+  struct CompareCtx ctx = { .expected = expected, .actual = actual, .diff = diff };
+  ctx.bands = expected->height < COMPARE_BANDS ? expected->height : COMPARE_BANDS;
+  par_for( ctx.bands, compare_bands, &ctx );
+
+  struct ImgCompareResult r = { 0, 0.0, INFINITY, 0, -1, -1 };
+  uint64_t sum_sq = 0;
+  for ( int32_t band = 0; band < ctx.bands; band++ ) {
+    const struct BandStats *stats = &ctx.stats[band];
+    sum_sq += stats->sum_sq;
+    r.differing += stats->differing;
+    if ( (int) stats->max_abs_diff > r.max_abs_diff )
+      r.max_abs_diff = (int) stats->max_abs_diff;
+    if ( r.first_y < 0 && stats->first_y >= 0 ) {
+      r.first_x = stats->first_x;
+      r.first_y = stats->first_y;
+    }
+  }
+
+  uint64_t samples = (uint64_t) expected->width * expected->height * 4;
+  if ( samples > 0 )
+    r.mse = (double) sum_sq / samples;
+  if ( r.mse > 0 )
+    r.psnr = 10.0 * log10( 255.0 * 255.0 / r.mse );
+  *result = r;
+  return 1;
+}
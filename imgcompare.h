@@ -0,0 +1,29 @@
+// Header for comparing two images pixel by pixel: exact match, mean
+// squared error, PSNR and largest component difference, with an
+// optional image showing where they differ. Used by the imgcmp tool.
+
+#ifndef IMGCOMPARE_H
+#define IMGCOMPARE_H
+
+#include <stdint.h>
+#include "image.h"
+
+//! Results of img_compare. Differences are per component (R, G, B and
+//! A), on the 0-255 scale of the pixels.
+struct ImgCompareResult {
+  uint64_t differing;       // pixels that differ in any component
+  double mse;               // mean squared difference over all components
+  double psnr;              // in dB, or INFINITY if the images are equal
+  int max_abs_diff;         // largest difference of any component
+  int32_t first_x, first_y; // first differing pixel in row order, or -1
+};
+
+//! Compare actual with expected and fill in *result. If diff isn't
+//! NULL, it must have the images' dimensions, and is set to a copy of
+//! expected, lightened, with the differing pixels in opaque red.
+//! Returns 1, or 0 (leaving *result and diff alone) if the images'
+//! dimensions differ.
+int img_compare( const struct Image *expected, const struct Image *actual, struct Image *diff,
+                 struct ImgCompareResult *result );
+
+#endif // IMGCOMPARE_H
@@ -0,0 +1,128 @@
+// Expansion of decoded PNG rows into packed pixels. The common 8-bit
+// formats have kernels written with the vector types of imgproc_vec.h,
+// which turn each group of VEC_LANES pixels into a single byte shuffle;
+// the other formats (and color keys) go through a scalar loop that
+// extracts one sample at a time.
+
+#include <string.h>
+#include "pnglite.h"
+#include "imgproc_kernels.h"
+#include "imgexpand.h"
+
+// The byte shuffles assume that a pixel 0xRRGGBBAA is stored as the
+// bytes AA BB GG RR
+#if defined(IMGPROC_HAVE_VEC) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define EXPAND_HAVE_VEC 1
+#include "imgproc_vec.h"
+#endif
+
+// Sample i of a row of samples of the given depth
+static inline uint32_t get_sample( const uint8_t *src, int depth, int32_t i ) {
+  if ( depth == 8 )
+    return src[i];
+  if ( depth == 16 ) {
+    uint16_t v;
+    memcpy( &v, src + (size_t) i * 2, sizeof( v ) );
+    return v;
+  }
+  // Smaller samples are packed into bytes, most significant bits first
+  size_t bit = (size_t) i * depth;
+  return (src[bit / 8] >> (8 - depth - bit % 8)) & ((1u << depth) - 1);
+}
+
+// Scale a sample of the given depth to 8 bits
+static inline uint32_t to_8bit( uint32_t v, int depth ) {
+  switch ( depth ) {
+  case 1: return v * 0xFF;
+  case 2: return v * 0x55;
+  case 4: return v * 0x11;
+  case 16: return v >> 8;
+  default: return v;
+  }
+}
+
+static void expand_row_scalar( const struct ExpandFormat *fmt, const uint8_t *src, uint32_t *dst, int32_t width ) {
+  int depth = fmt->depth;
+
+  for ( int32_t x = 0; x < width; x++ ) {
+    uint32_t r, g, b, a = 0xFF;
+    switch ( fmt->color_type ) {
+    case PNG_INDEXED:
+      dst[x] = fmt->palette[get_sample( src, depth, x )];
+      continue;
+    case PNG_GREYSCALE:
+      r = g = b = get_sample( src, depth, x );
+      if ( fmt->has_key && g == fmt->key[0] )
+        a = 0;
+      break;
+    case PNG_GREYSCALE_ALPHA:
+      r = g = b = get_sample( src, depth, x * 2 );
+      a = to_8bit( get_sample( src, depth, x * 2 + 1 ), depth );
+      break;
+    case PNG_TRUECOLOR:
+      r = get_sample( src, depth, x * 3 );
+      g = get_sample( src, depth, x * 3 + 1 );
+      b = get_sample( src, depth, x * 3 + 2 );
+      if ( fmt->has_key && r == fmt->key[0] && g == fmt->key[1] && b == fmt->key[2] )
+        a = 0;
+      break;
+    default: // PNG_TRUECOLOR_ALPHA
+      r = get_sample( src, depth, x * 4 );
+      g = get_sample( src, depth, x * 4 + 1 );
+      b = get_sample( src, depth, x * 4 + 2 );
+      a = to_8bit( get_sample( src, depth, x * 4 + 3 ), depth );
+      break;
+    }
+    dst[x] = (to_8bit( r, depth ) << 24) | (to_8bit( g, depth ) << 16) | (to_8bit( b, depth ) << 8) | a;
+  }
+}
+
+#ifdef EXPAND_HAVE_VEC
+
+// Load n (at most 16) bytes; the rest of the vector is zero
+static inline vec_u8 load_bytes( const uint8_t *p, size_t n ) {
+  vec_u8 v = { 0 };
+  memcpy( &v, p, n );
+  return v;
+}
+
+// Expand an 8-bit row whose pixels are bytes_per_pixel bytes each
+static void expand_row_vec( int bytes_per_pixel, const uint8_t *src, uint32_t *dst, int32_t width ) {
+  for ( int32_t x = 0; x < width; x += VEC_LANES ) {
+    int32_t n = width - x < VEC_LANES ? width - x : VEC_LANES;
+    vec_u8 v = load_bytes( src + (size_t) x * bytes_per_pixel, (size_t) n * bytes_per_pixel );
+    vec_u32 px;
+    // Byte 0 of each output pixel is its alpha; where it comes from a
+    // color byte, or-ing in 0xFF makes it opaque
+    switch ( bytes_per_pixel ) {
+    case 1: // G -> FF G G G
+      px = (vec_u32) VEC_SHUFFLE_U8( v, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3 ) | 0xFF;
+      break;
+    case 2: // G A -> A G G G
+      px = (vec_u32) VEC_SHUFFLE_U8( v, 1, 0, 0, 0, 3, 2, 2, 2, 5, 4, 4, 4, 7, 6, 6, 6 );
+      break;
+    case 3: // R G B -> FF B G R
+      px = (vec_u32) VEC_SHUFFLE_U8( v, 0, 2, 1, 0, 0, 5, 4, 3, 0, 8, 7, 6, 0, 11, 10, 9 ) | 0xFF;
+      break;
+    default: // R G B A -> A B G R
+      px = (vec_u32) VEC_SHUFFLE_U8( v, 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12 );
+      break;
+    }
+    vec_store_n( dst + x, px, n );
+  }
+}
+
+#endif // EXPAND_HAVE_VEC
+
+void img_expand_row( const struct ExpandFormat *fmt, const uint8_t *src, uint32_t *dst, int32_t width ) {
+#ifdef EXPAND_HAVE_VEC
+  if ( fmt->depth == 8 && fmt->color_type != PNG_INDEXED && !fmt->has_key
+       && imgproc_kernels_selected() != NULL ) {
+    int bytes_per_pixel = fmt->color_type == PNG_GREYSCALE ? 1 : fmt->color_type == PNG_GREYSCALE_ALPHA ? 2
+                        : fmt->color_type == PNG_TRUECOLOR ? 3 : 4;
+    expand_row_vec( bytes_per_pixel, src, dst, width );
+    return;
+  }
+#endif
+  expand_row_scalar( fmt, src, dst, width );
+}
@@ -0,0 +1,26 @@
+// Header for the expansion of decoded PNG rows (greyscale, palette,
+// RGB and RGBA, at any bit depth) into the packed 0xRRGGBBAA pixels of
+// struct Image, so every kind of PNG is read in one decode pass.
+
+#ifndef IMGEXPAND_H
+#define IMGEXPAND_H
+
+#include <stdint.h>
+
+//! Layout of the rows decoded by png_get_data
+struct ExpandFormat {
+  int color_type;             // PNG color type (a PNG_* value from pnglite.h)
+  int depth;                  // bits per sample: 1, 2, 4, 8 or 16
+  const uint32_t *palette;    // 256 packed pixels, for palette images
+  int has_key;                // nonzero if pixels of color key are transparent
+  uint16_t key[3];            // transparent gray, or RGB, at the image's depth
+};
+
+//! Expand a row of width pixels in the given format from src to
+//! packed pixels in dst. 16-bit samples are reduced to their high
+//! byte, and gray levels below 8 bits are scaled to the full range.
+//! For 8-bit RGBA rows without a color key, src and dst may be the
+//! same buffer.
+void img_expand_row( const struct ExpandFormat *fmt, const uint8_t *src, uint32_t *dst, int32_t width );
+
+#endif // IMGEXPAND_H
@@ -0,0 +1,376 @@
+// Asynchronous whole-file I/O. Requests are submitted to an io_uring
+// set up with the raw io_uring_setup/io_uring_enter system calls (no
+// liburing), so many reads and writes are in flight at once; short
+// transfers are resubmitted for the remaining bytes. If io_uring can't
+// be used, or the ring is full, requests are done with pread/pwrite.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "imgio.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define IMGIO_HAVE_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+// Largest transfer done by one submission (io_uring lengths are 32 bits)
+#define IMGIO_MAX_CHUNK (1u << 30)
+
+struct IoRequest {
+  struct IoRequest *next;   // link in the finished list
+  void *tag;
+  int is_write;
+  int fd;
+  unsigned char *buf;
+  size_t len;
+  size_t done;              // bytes transferred so far
+  int error;
+};
+
+struct ImgIoQueue {
+  pthread_mutex_t lock;     // protects the submission ring and the finished list
+  struct IoRequest *finished_head;
+  struct IoRequest *finished_tail;
+  unsigned pending;         // submitted, not yet returned by imgio_wait
+  unsigned in_flight;       // requests in the ring
+  unsigned depth;
+  int ring_fd;              // -1 if not using io_uring
+#ifdef IMGIO_HAVE_URING
+  void *sq_ptr;
+  size_t sq_size;
+  void *cq_ptr;
+  size_t cq_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+#endif
+};
+
+#ifdef IMGIO_HAVE_URING
+// Set up the ring and map its submission and completion queues.
+// Returns 0 if successful, -1 if io_uring isn't available.
+static int ring_setup( struct ImgIoQueue *q ) {
+  struct io_uring_params p;
+  memset( &p, 0, sizeof( p ) );
+  int fd = (int) syscall( __NR_io_uring_setup, q->depth, &p );
+  if ( fd < 0 )
+    return -1;
+
+  q->sq_size = p.sq_off.array + p.sq_entries * sizeof( unsigned );
+  q->cq_size = p.cq_off.cqes + p.cq_entries * sizeof( struct io_uring_cqe );
+  // With IORING_FEAT_SINGLE_MMAP, one mapping covers both rings
+  int single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if ( single ) {
+    if ( q->cq_size > q->sq_size )
+      q->sq_size = q->cq_size;
+    q->cq_size = q->sq_size;
+  }
+
+  q->sq_ptr = mmap( NULL, q->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING );
+  if ( q->sq_ptr == MAP_FAILED ) {
+    close( fd );
+    return -1;
+  }
+  q->cq_ptr = single ? q->sq_ptr
+                     : mmap( NULL, q->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING );
+  q->sqes_size = p.sq_entries * sizeof( struct io_uring_sqe );
+  q->sqes = mmap( NULL, q->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES );
+  if ( q->cq_ptr == MAP_FAILED || q->sqes == MAP_FAILED ) {
+    if ( q->sqes != MAP_FAILED )
+      munmap( q->sqes, q->sqes_size );
+    if ( !single && q->cq_ptr != MAP_FAILED )
+      munmap( q->cq_ptr, q->cq_size );
+    munmap( q->sq_ptr, q->sq_size );
+    close( fd );
+    return -1;
+  }
+
+  unsigned char *sq = q->sq_ptr, *cq = q->cq_ptr;
+  q->sq_head = (unsigned *) (sq + p.sq_off.head);
+  q->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+  q->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+  q->sq_array = (unsigned *) (sq + p.sq_off.array);
+  q->cq_head = (unsigned *) (cq + p.cq_off.head);
+  q->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+  q->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+  q->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+  // Never have more requests in flight than there are submission entries
+  if ( q->depth > p.sq_entries )
+    q->depth = p.sq_entries;
+  q->ring_fd = fd;
+  return 0;
+}
+
+static void ring_teardown( struct ImgIoQueue *q ) {
+  munmap( q->sqes, q->sqes_size );
+  if ( q->cq_ptr != q->sq_ptr )
+    munmap( q->cq_ptr, q->cq_size );
+  munmap( q->sq_ptr, q->sq_size );
+  close( q->ring_fd );
+}
+
+// Queue the next chunk of req on the ring and submit it. Must be called
+// with the lock held. Returns 0 if successful, -1 if the ring rejected it.
+static int ring_submit( struct ImgIoQueue *q, struct IoRequest *req ) {
+  unsigned tail = *q->sq_tail;
+  unsigned index = tail & *q->sq_mask;
+  struct io_uring_sqe *sqe = &q->sqes[index];
+  size_t chunk = req->len - req->done;
+  if ( chunk > IMGIO_MAX_CHUNK )
+    chunk = IMGIO_MAX_CHUNK;
+
+  memset( sqe, 0, sizeof( *sqe ) );
+  sqe->opcode = req->is_write ? IORING_OP_WRITE : IORING_OP_READ;
+  sqe->fd = req->fd;
+  sqe->addr = (uint64_t) (uintptr_t) (req->buf + req->done);
+  sqe->len = (uint32_t) chunk;
+  sqe->off = req->done;
+  sqe->user_data = (uint64_t) (uintptr_t) req;
+  q->sq_array[index] = index;
+  __atomic_store_n( q->sq_tail, tail + 1, __ATOMIC_RELEASE );
+
+  for ( ;; ) {
+    long rc = syscall( __NR_io_uring_enter, q->ring_fd, 1, 0, 0, NULL, 0 );
+    if ( rc >= 0 )
+      break;
+    if ( errno != EINTR && errno != EAGAIN && errno != EBUSY ) {
+      // The kernel didn't consume the entry, so take it back
+      __atomic_store_n( q->sq_tail, tail, __ATOMIC_RELEASE );
+      return -1;
+    }
+  }
+  q->in_flight++;
+  return 0;
+}
+
+// Take one completion off the ring, if there is one. Returns the
+// request it belongs to (with its progress updated), or NULL.
+static struct IoRequest *ring_reap( struct ImgIoQueue *q ) {
+  unsigned head = *q->cq_head;
+  if ( head == __atomic_load_n( q->cq_tail, __ATOMIC_ACQUIRE ) )
+    return NULL;
+
+  struct io_uring_cqe *cqe = &q->cqes[head & *q->cq_mask];
+  struct IoRequest *req = (struct IoRequest *) (uintptr_t) cqe->user_data;
+  int res = cqe->res;
+  __atomic_store_n( q->cq_head, head + 1, __ATOMIC_RELEASE );
+
+  if ( res < 0 )
+    req->error = -res;
+  else if ( res == 0 )
+    req->error = EIO;   // the file ended early
+  else
+    req->done += (size_t) res;
+  return req;
+}
+#endif // IMGIO_HAVE_URING
+
+// Transfer the rest of req with pread/pwrite
+static void sync_transfer( struct IoRequest *req ) {
+  while ( req->error == 0 && req->done < req->len ) {
+    ssize_t n = req->is_write ? pwrite( req->fd, req->buf + req->done, req->len - req->done, req->done )
+                              : pread( req->fd, req->buf + req->done, req->len - req->done, req->done );
+    if ( n < 0 && errno == EINTR )
+      continue;
+    if ( n <= 0 )
+      req->error = n < 0 ? errno : EIO;
+    else
+      req->done += (size_t) n;
+  }
+}
+
+// Close the file of a request that is done and put it on the finished list
+static void finish( struct ImgIoQueue *q, struct IoRequest *req ) {
+  if ( req->fd >= 0 )
+    close( req->fd );
+  req->fd = -1;
+  req->next = NULL;
+
+  pthread_mutex_lock( &q->lock );
+  if ( q->finished_tail != NULL )
+    q->finished_tail->next = req;
+  else
+    q->finished_head = req;
+  q->finished_tail = req;
+  pthread_mutex_unlock( &q->lock );
+}
+
+// Start transferring an opened request: on the ring if possible,
+// otherwise right away
+static void start( struct ImgIoQueue *q, struct IoRequest *req ) {
+  if ( req->error == 0 && req->done < req->len ) {
+#ifdef IMGIO_HAVE_URING
+    int queued = 0;
+    pthread_mutex_lock( &q->lock );
+    if ( q->ring_fd >= 0 && q->in_flight < q->depth )
+      queued = ring_submit( q, req ) == 0;
+    pthread_mutex_unlock( &q->lock );
+    if ( queued )
+      return;
+#endif
+    sync_transfer( req );
+  }
+  finish( q, req );
+}
+
+static struct IoRequest *new_request( struct ImgIoQueue *q, void *tag, int is_write ) {
+  struct IoRequest *req = calloc( 1, sizeof( struct IoRequest ) );
+  if ( req != NULL ) {
+    req->tag = tag;
+    req->is_write = is_write;
+    req->fd = -1;
+    __atomic_add_fetch( &q->pending, 1, __ATOMIC_SEQ_CST );
+  }
+  return req;
+}
+
+struct ImgIoQueue *imgio_create( unsigned depth ) {
+  struct ImgIoQueue *q = calloc( 1, sizeof( struct ImgIoQueue ) );
+  if ( q == NULL )
+    return NULL;
+  pthread_mutex_init( &q->lock, NULL );
+  q->depth = depth > 0 ? depth : 1;
+  q->ring_fd = -1;
+
+#ifdef IMGIO_HAVE_URING
+  const char *env = getenv( "IMGPROC_IO" );
+  if ( env == NULL || strcmp( env, "sync" ) != 0 )
+    ring_setup( q );
+#endif
+  return q;
+}
+
+void imgio_destroy( struct ImgIoQueue *q ) {
+  if ( q == NULL )
+    return;
+#ifdef IMGIO_HAVE_URING
+  if ( q->ring_fd >= 0 )
+    ring_teardown( q );
+#endif
+  pthread_mutex_destroy( &q->lock );
+  free( q );
+}
+
+int imgio_using_uring( struct ImgIoQueue *q ) {
+  return q->ring_fd >= 0;
+}
+
+int imgio_submit_read( struct ImgIoQueue *q, const char *filename, void *tag ) {
+  struct IoRequest *req = new_request( q, tag, 0 );
+  if ( req == NULL )
+    return 0;
+
+  struct stat st;
+  req->fd = open( filename, O_RDONLY | O_CLOEXEC );
+  if ( req->fd < 0 || fstat( req->fd, &st ) != 0 ) {
+    req->error = errno;
+  } else {
+    req->len = (size_t) st.st_size;
+    req->buf = malloc( req->len > 0 ? req->len : 1 );
+    if ( req->buf == NULL )
+      req->error = ENOMEM;
+  }
+  start( q, req );
+  return 1;
+}
+
+int imgio_submit_write( struct ImgIoQueue *q, const char *filename, void *buf, size_t len, void *tag ) {
+  struct IoRequest *req = new_request( q, tag, 1 );
+  if ( req == NULL ) {
+    free( buf );
+    return 0;
+  }
+
+  req->buf = buf;
+  req->len = len;
+  req->fd = open( filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666 );
+  if ( req->fd < 0 )
+    req->error = errno;
+  start( q, req );
+  return 1;
+}
+
+unsigned imgio_pending( struct ImgIoQueue *q ) {
+  return __atomic_load_n( &q->pending, __ATOMIC_SEQ_CST );
+}
+
+int imgio_wait( struct ImgIoQueue *q, struct ImgIoResult *result, int block ) {
+  for ( ;; ) {
+    // Requests finished without the ring (or after their last chunk)
+    pthread_mutex_lock( &q->lock );
+    struct IoRequest *req = q->finished_head;
+    if ( req != NULL ) {
+      q->finished_head = req->next;
+      if ( q->finished_head == NULL )
+        q->finished_tail = NULL;
+    }
+    pthread_mutex_unlock( &q->lock );
+
+    if ( req != NULL ) {
+      result->tag = req->tag;
+      result->is_write = req->is_write;
+      result->error = req->error;
+      result->buf = NULL;
+      result->len = 0;
+      if ( req->is_write || req->error != 0 ) {
+        free( req->buf );
+      } else {
+        result->buf = req->buf;
+        result->len = req->len;
+      }
+      free( req );
+      __atomic_sub_fetch( &q->pending, 1, __ATOMIC_SEQ_CST );
+      return 1;
+    }
+
+#ifdef IMGIO_HAVE_URING
+    if ( q->ring_fd >= 0 ) {
+      req = ring_reap( q );
+      if ( req != NULL ) {
+        pthread_mutex_lock( &q->lock );
+        q->in_flight--;
+        // Resubmit the rest of a short transfer
+        int requeued = req->error == 0 && req->done < req->len && ring_submit( q, req ) == 0;
+        pthread_mutex_unlock( &q->lock );
+        if ( !requeued ) {
+          sync_transfer( req );
+          finish( q, req );
+        }
+        continue;
+      }
+    }
+#endif
+
+    if ( !block || imgio_pending( q ) == 0 )
+      return 0;
+
+#ifdef IMGIO_HAVE_URING
+    // Sleep in the kernel until a request in the ring completes
+    pthread_mutex_lock( &q->lock );
+    unsigned in_flight = q->in_flight;
+    pthread_mutex_unlock( &q->lock );
+    if ( in_flight > 0 ) {
+      syscall( __NR_io_uring_enter, q->ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0 );
+      continue;
+    }
+#endif
+    // A request is still being set up (or done synchronously) by
+    // another thread
+    sched_yield();
+  }
+}
@@ -0,0 +1,53 @@
+// Header for the asynchronous whole-file I/O queue used by the batch
+// executor. On Linux it uses io_uring (through the raw system calls);
+// elsewhere, or if io_uring is unavailable, requests are done with
+// pread/pwrite when they are submitted.
+
+#ifndef IMGIO_H
+#define IMGIO_H
+
+#include <stddef.h>
+
+//! An I/O queue (opaque)
+struct ImgIoQueue;
+
+//! A finished request, as returned by imgio_wait
+struct ImgIoResult {
+  void *tag;       // the tag passed when the request was submitted
+  int is_write;
+  int error;       // 0 if successful, otherwise an errno value
+  void *buf;       // for reads, the file contents (owned by the caller)
+  size_t len;      // for reads, the file size
+};
+
+//! Create a queue that keeps up to depth requests in flight.
+//! Setting the IMGPROC_IO environment variable to "sync" disables
+//! io_uring. Returns NULL if memory couldn't be allocated.
+struct ImgIoQueue *imgio_create( unsigned depth );
+
+//! Destroy a queue. All requests must have been waited for.
+void imgio_destroy( struct ImgIoQueue *q );
+
+//! Return 1 if the queue uses io_uring, 0 if it uses pread/pwrite.
+int imgio_using_uring( struct ImgIoQueue *q );
+
+//! Submit a read of the whole named file. May be called from any thread.
+//! Returns 1 if the request was submitted (even if it will fail), 0 if
+//! memory couldn't be allocated for it.
+int imgio_submit_read( struct ImgIoQueue *q, const char *filename, void *tag );
+
+//! Submit a write of len bytes from buf to the named file, replacing
+//! its contents. The queue takes ownership of buf, which must have been
+//! allocated with malloc. May be called from any thread. Returns as
+//! imgio_submit_read does (buf is freed if 0 is returned).
+int imgio_submit_write( struct ImgIoQueue *q, const char *filename, void *buf, size_t len, void *tag );
+
+//! Return the number of submitted requests not yet returned by imgio_wait.
+unsigned imgio_pending( struct ImgIoQueue *q );
+
+//! Get a finished request. If block is nonzero, waits until a request
+//! finishes (as long as some are pending). Returns 1 if result was
+//! filled in, 0 otherwise. Only one thread may call this at a time.
+int imgio_wait( struct ImgIoQueue *q, struct ImgIoResult *result, int block );
+
+#endif // IMGIO_H
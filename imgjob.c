@@ -0,0 +1,97 @@
+// Job contexts. The cancellation flag is set with an atomic store, and
+// a passed deadline sets it too, so a stopped job stays stopped without
+// reading the clock again.
+
+#include <time.h>
+#include "imgjob.h"
+
+// Smallest increase of the fraction done that is reported
+#define PROGRESS_STEP 0.01
+
+static __thread struct ImgJob *t_job;
+
+void imgjob_init( struct ImgJob *job ) {
+  job->cancelled = 0;
+  job->deadline_ns = 0;
+  job->progress = NULL;
+  job->progress_arg = NULL;
+  job->num_steps = 0;
+  job->step = 0;
+  job->reported = 0.0;
+  pthread_mutex_init( &job->lock, NULL );
+}
+
+void imgjob_cleanup( struct ImgJob *job ) {
+  pthread_mutex_destroy( &job->lock );
+}
+
+void imgjob_cancel( struct ImgJob *job ) {
+  __atomic_store_n( &job->cancelled, 1, __ATOMIC_RELAXED );
+}
+
+void imgjob_set_deadline( struct ImgJob *job, uint64_t deadline_ns ) {
+  job->deadline_ns = deadline_ns;
+}
+
+void imgjob_set_progress( struct ImgJob *job, imgjob_progress_fn progress, void *arg, int num_steps ) {
+  job->progress = progress;
+  job->progress_arg = arg;
+  job->num_steps = num_steps;
+  job->step = 0;
+  job->reported = 0.0;
+}
+
+struct ImgJob *imgjob_enter( struct ImgJob *job ) {
+  struct ImgJob *prev = t_job;
+  t_job = job;
+  return prev;
+}
+
+struct ImgJob *imgjob_current( void ) {
+  return t_job;
+}
+
+int imgjob_stopped( struct ImgJob *job ) {
+  if ( job == NULL )
+    return 0;
+  if ( __atomic_load_n( &job->cancelled, __ATOMIC_RELAXED ) )
+    return 1;
+  if ( job->deadline_ns == 0 )
+    return 0;
+
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  if ( (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec < job->deadline_ns )
+    return 0;
+  imgjob_cancel( job );
+  return 1;
+}
+
+int imgjob_check( void ) {
+  return t_job != NULL && imgjob_stopped( t_job );
+}
+
+// Report that the job is done up to step + done (in steps)
+static void report( struct ImgJob *job, double done, int finish_step ) {
+  pthread_mutex_lock( &job->lock );
+  if ( finish_step )
+    job->step++;
+  double fraction = (job->step + done) / job->num_steps;
+  if ( fraction > 1.0 )
+    fraction = 1.0;
+  if ( fraction >= job->reported + PROGRESS_STEP || (fraction == 1.0 && job->reported < 1.0) ) {
+    job->reported = fraction;
+    job->progress( job->progress_arg, fraction );
+  }
+  pthread_mutex_unlock( &job->lock );
+}
+
+void imgjob_step_done( struct ImgJob *job ) {
+  if ( job != NULL && job->progress != NULL )
+    report( job, 0.0, 1 );
+}
+
+void imgjob_step_progress( struct ImgJob *job, double done ) {
+  if ( job != NULL && job->progress != NULL )
+    report( job, done < 1.0 ? done : 1.0, 0 );
+}
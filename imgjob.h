@@ -0,0 +1,77 @@
+// Header for job contexts, through which the work on an image (decoding,
+// transforming and encoding it) can be cancelled, be given a deadline,
+// and report its progress. A job is made current on the thread doing
+// the work; par_for passes it on to the threads running its bands, and
+// checks it before running each band, skipping the rest of the bands
+// once the job is stopped. The codecs check it every few rows, and the
+// image reading and writing functions (see image.h) and pipelines (see
+// imgproc_pipeline.h) then fail with IMG_ERR_CANCELLED, freeing what
+// they allocated.
+
+#ifndef IMGJOB_H
+#define IMGJOB_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+//! Called with the fraction (0 to 1) of a job that is done
+typedef void (*imgjob_progress_fn)( void *arg, double done );
+
+struct ImgJob {
+  int cancelled;              // set by imgjob_cancel
+  uint64_t deadline_ns;       // CLOCK_MONOTONIC time, or 0 for none
+  imgjob_progress_fn progress;
+  void *progress_arg;
+  int num_steps;              // steps the progress is divided into
+  int step;                   // steps finished
+  double reported;            // last fraction passed to progress
+  pthread_mutex_t lock;       // serializes the progress calls
+};
+
+//! Initialize a job that isn't cancelled and has no deadline or
+//! progress callback.
+void imgjob_init( struct ImgJob *job );
+
+void imgjob_cleanup( struct ImgJob *job );
+
+//! Stop the job at the next check. May be called from any thread, e.g.
+//! while another thread is working on the job.
+void imgjob_cancel( struct ImgJob *job );
+
+//! Stop the job at the first check after deadline_ns, a CLOCK_MONOTONIC
+//! time in nanoseconds (e.g. imgproc_stats_now() plus a timeout).
+void imgjob_set_deadline( struct ImgJob *job, uint64_t deadline_ns );
+
+//! Have progress called as the job advances, with increasing fractions
+//! and finally 1. The job's work is divided into num_steps equal steps,
+//! which end with imgjob_step_done: the image reading and writing
+//! functions each count as one step, and a pipeline as one step per
+//! stage. Within a step, the rows done by par_for are counted. The
+//! calls may come from any of the threads working on the job, but
+//! never at the same time, and are at least 1% apart.
+void imgjob_set_progress( struct ImgJob *job, imgjob_progress_fn progress, void *arg, int num_steps );
+
+//! Make job (which may be NULL) the calling thread's current job.
+//! Returns the previous one, which the caller should restore with
+//! imgjob_enter once it is done with the job.
+struct ImgJob *imgjob_enter( struct ImgJob *job );
+
+//! The calling thread's current job, or NULL.
+struct ImgJob *imgjob_current( void );
+
+//! Whether job (which may be NULL) has been cancelled or has passed
+//! its deadline. Once it returns 1, it always does.
+int imgjob_stopped( struct ImgJob *job );
+
+//! Whether the calling thread's current job is stopped. Costs a test
+//! when there is no current job.
+int imgjob_check( void );
+
+//! Finish a step of job (which may be NULL) and report its progress.
+void imgjob_step_done( struct ImgJob *job );
+
+//! Report that a fraction done (0 to 1) of the current step of job
+//! (which may be NULL) is done.
+void imgjob_step_progress( struct ImgJob *job, double done );
+
+#endif // IMGJOB_H
@@ -151,4 +151,50 @@ void imgproc_blur( struct Image *input_img, struct Image *output_img, int32_t bl
 //!                   transformed pixels should be stored)
 void imgproc_expand( struct Image *input_img, struct Image *output_img);
 
+//! Largest standard deviation of the `gaussian` transformation. Larger
+//! values are clamped to it (the blur then spans any image that fits in
+//! memory anyway).
+#define GAUSSIAN_MAX_SIGMA 1000000.0
+
+//! Compute the radii of the three box blurs used by imgproc_gaussian
+//! to approximate a Gaussian with standard deviation sigma.
+//! A non-positive (or NaN) sigma yields three radii of 0, and a sigma
+//! above GAUSSIAN_MAX_SIGMA is clamped to it.
+void gaussian_box_radii( double sigma, int32_t radii[3] );
+
+//! The `gaussian` transformation approximates a Gaussian blur with
+//! standard deviation sigma by applying three box blurs in succession.
+//!
+//! Each box blur is computed as a horizontal pass followed by a vertical
+//! pass using sliding-window sums, so the cost per pixel does not depend
+//! on sigma. As in imgproc_blur, pixel positions outside the image are
+//! ignored, averages are computed using integer arithmetic with no
+//! rounding, and the alpha value of each output pixel is identical to
+//! the corresponding input pixel. The passes are split into row and
+//! column bands processed in parallel.
+//!
+//! @param input_img pointer to the input Image
+//! @param output_img pointer to the output Image (in which the
+//!                   transformed pixels should be stored)
+//! @param sigma standard deviation of the approximated Gaussian;
+//!              0 leaves the image unchanged, and values above
+//!              GAUSSIAN_MAX_SIGMA are clamped to it
+//! @return 1 if successful, 0 if temporary buffers couldn't be allocated
+int imgproc_gaussian( struct Image *input_img, struct Image *output_img, double sigma );
+
+//! In-place variants of imgproc_color_rot, imgproc_squash and
+//! imgproc_blur, which transform img's own pixel buffer instead of
+//! writing to a separate output image (they call those functions on
+//! views of single rows or windows of rows, so both builds use their
+//! own code). imgproc_squash_in_place compacts the sampled pixels to
+//! the front of the buffer, one row at a time, and updates img's
+//! dimensions. imgproc_blur_in_place keeps the original rows it still
+//! needs in a buffer of about ten times blur_dist (at least 256) rows;
+//! if that would take as much memory as the image, it blurs into a new
+//! buffer instead, which replaces img's. Both return 1 if successful, 0
+//! if their buffer couldn't be allocated (leaving img unchanged).
+void imgproc_color_rot_in_place( struct Image *img );
+int imgproc_squash_in_place( struct Image *img, int32_t xfac, int32_t yfac );
+int imgproc_blur_in_place( struct Image *img, int32_t blur_dist );
+
 #endif // IMGPROC_H
@@ -0,0 +1,293 @@
+// AVX-512 (F + BW) kernel tier for the image transformations.
+// Each kernel processes 16 pixels per vector and uses masked loads
+// and stores for row tails, so there are no scalar cleanup loops.
+// The functions are compiled with a target attribute, so the rest
+// of the program doesn't need to be built for AVX-512; callers must
+// check that the CPU supports it (see imgproc_kernels_find).
+
+#include "imgproc_kernels.h"
+
+#ifdef IMGPROC_HAVE_AVX512
+
+#include <stdlib.h>
+#include <string.h>
+#include <immintrin.h>
+#include "imgproc.h"
+
+#define AVX512_TARGET __attribute__((target("avx512f,avx512bw")))
+
+// Number of 32-bit pixels per vector
+#define LANES 16
+
+// Mask selecting the first n (up to 16) lanes
+AVX512_TARGET static inline __mmask16 lane_mask( int32_t n ) {
+  return n >= LANES ? (__mmask16) 0xFFFF : (__mmask16) ((1u << n) - 1);
+}
+
+// Per-byte average of two vectors of pixels, truncating like avg_pixels.
+// avg_epu8 rounds up, so subtract the carried-out low bit.
+AVX512_TARGET static inline __m512i avg2_epu8( __m512i a, __m512i b ) {
+  __m512i round = _mm512_and_si512( _mm512_xor_si512( a, b ), _mm512_set1_epi8( 1 ) );
+  return _mm512_sub_epi8( _mm512_avg_epu8( a, b ), round );
+}
+
+// Per-byte truncating average of four vectors of pixels, computed
+// separately for even and odd bytes in 16-bit lanes
+AVX512_TARGET static inline __m512i avg4_epu8( __m512i a, __m512i b, __m512i c, __m512i d ) {
+  const __m512i even = _mm512_set1_epi16( 0x00FF );
+  __m512i lo = _mm512_add_epi16( _mm512_add_epi16( _mm512_and_si512( a, even ), _mm512_and_si512( b, even ) ),
+                                 _mm512_add_epi16( _mm512_and_si512( c, even ), _mm512_and_si512( d, even ) ) );
+  __m512i hi = _mm512_add_epi16( _mm512_add_epi16( _mm512_srli_epi16( a, 8 ), _mm512_srli_epi16( b, 8 ) ),
+                                 _mm512_add_epi16( _mm512_srli_epi16( c, 8 ), _mm512_srli_epi16( d, 8 ) ) );
+  return _mm512_or_si512( _mm512_srli_epi16( lo, 2 ), _mm512_slli_epi16( _mm512_srli_epi16( hi, 2 ), 8 ) );
+}
+
+// Unsigned 32-bit division n / d (truncating). The single precision
+// quotient is within 1 of the exact one for the sums used here, so one
+// correction step in each direction makes it exact.
+AVX512_TARGET static inline __m512i udiv_epu32( __m512i n, __m512i d ) {
+  const __m512i one = _mm512_set1_epi32( 1 );
+  __m512 qf = _mm512_div_ps( _mm512_cvtepu32_ps( n ), _mm512_cvtepu32_ps( d ) );
+  __m512i q = _mm512_cvttps_epu32( qf );
+
+  __mmask16 too_big = _mm512_cmpgt_epu32_mask( _mm512_mullo_epi32( q, d ), n );
+  q = _mm512_mask_sub_epi32( q, too_big, q, one );
+  __m512i rem = _mm512_sub_epi32( n, _mm512_mullo_epi32( q, d ) );
+  __mmask16 too_small = _mm512_cmpge_epu32_mask( rem, d );
+  return _mm512_mask_add_epi32( q, too_small, q, one );
+}
+
+AVX512_TARGET static void squash_avx512( struct Image *input_img, struct Image *output_img,
+                                         int32_t xfac, int32_t yfac, int32_t row_begin, int32_t row_end ) {
+  // Only output columns whose sampled input column is in bounds are written
+  int32_t ncols = (input_img->width + xfac - 1) / xfac;
+  if (ncols > output_img->width) { ncols = output_img->width; }
+
+  // Sample offsets of the 16 lanes relative to the first sampled pixel
+  const __m512i lane_offsets = _mm512_mullo_epi32( _mm512_set_epi32( 15, 14, 13, 12, 11, 10, 9, 8,
+                                                                     7, 6, 5, 4, 3, 2, 1, 0 ),
+                                                   _mm512_set1_epi32( xfac ) );
+
+  for (int32_t row = row_begin; row < row_end; row++) {
+    int64_t input_row = (int64_t) row * yfac;
+    if (input_row >= input_img->height) {
+      continue;
+    }
+    const uint32_t *src = input_img->data + input_row * input_img->width;
+    uint32_t *dst = output_img->data + (size_t) row * output_img->width;
+
+    if (xfac == 1) {
+      memcpy(dst, src, (size_t) ncols * sizeof(uint32_t));
+      continue;
+    }
+    for (int32_t col = 0; col < ncols; col += LANES) {
+      __mmask16 m = lane_mask(ncols - col);
+      __m512i v = _mm512_mask_i32gather_epi32( _mm512_setzero_si512(), m, lane_offsets,
+                                               src + (size_t) col * xfac, 4 );
+      _mm512_mask_storeu_epi32( dst + col, m, v );
+    }
+  }
+}
+
+AVX512_TARGET static void color_rot_avx512( struct Image *input_img, struct Image *output_img,
+                                            int32_t row_begin, int32_t row_end ) {
+  // In memory a pixel 0xRRGGBBAA is the bytes AA BB GG RR; the rotated
+  // pixel 0xBBRRGGAA is AA GG RR BB, i.e. source bytes 0, 2, 3, 1
+  const __m512i shuffle = _mm512_broadcast_i32x4( _mm_set_epi32( 0x0D0F0E0C, 0x090B0A08, 0x05070604, 0x01030200 ) );
+
+  size_t begin = (size_t) row_begin * input_img->width;
+  size_t end = (size_t) row_end * input_img->width;
+  const uint32_t *src = input_img->data;
+  uint32_t *dst = output_img->data;
+
+  for (size_t i = begin; i < end; i += LANES) {
+    __mmask16 m = lane_mask(end - i < LANES ? (int32_t) (end - i) : LANES);
+    __m512i v = _mm512_maskz_loadu_epi32( m, src + i );
+    _mm512_mask_storeu_epi32( dst + i, m, _mm512_shuffle_epi8( v, shuffle ) );
+  }
+}
+
+// Add (sign > 0) or subtract (sign < 0) the r, g, b components of one
+// row of pixels to/from the per-column sums
+AVX512_TARGET static void accum_row( const uint32_t *row, int32_t width, int sign,
+                                     uint32_t *col_r, uint32_t *col_g, uint32_t *col_b ) {
+  const __m512i byte = _mm512_set1_epi32( 0xFF );
+  for (int32_t c = 0; c < width; c += LANES) {
+    __mmask16 m = lane_mask(width - c);
+    __m512i p = _mm512_maskz_loadu_epi32( m, row + c );
+    __m512i r = _mm512_srli_epi32( p, 24 );
+    __m512i g = _mm512_and_si512( _mm512_srli_epi32( p, 16 ), byte );
+    __m512i b = _mm512_and_si512( _mm512_srli_epi32( p, 8 ), byte );
+    __m512i sr = _mm512_maskz_loadu_epi32( m, col_r + c );
+    __m512i sg = _mm512_maskz_loadu_epi32( m, col_g + c );
+    __m512i sb = _mm512_maskz_loadu_epi32( m, col_b + c );
+    if (sign > 0) {
+      sr = _mm512_add_epi32( sr, r );
+      sg = _mm512_add_epi32( sg, g );
+      sb = _mm512_add_epi32( sb, b );
+    } else {
+      sr = _mm512_sub_epi32( sr, r );
+      sg = _mm512_sub_epi32( sg, g );
+      sb = _mm512_sub_epi32( sb, b );
+    }
+    _mm512_mask_storeu_epi32( col_r + c, m, sr );
+    _mm512_mask_storeu_epi32( col_g + c, m, sg );
+    _mm512_mask_storeu_epi32( col_b + c, m, sb );
+  }
+}
+
+AVX512_TARGET static void blur_avx512( struct Image *input_img, struct Image *output_img, int32_t blur_dist,
+                                       int32_t row_begin, int32_t row_end ) {
+  int32_t width = input_img->width;
+  int32_t height = input_img->height;
+  if (width <= 0 || height <= 0 || row_begin >= row_end) {
+    return;
+  }
+
+  // Windows larger than the image cover all of it anyway
+  int32_t dist = blur_dist < 0 ? 0 : blur_dist;
+  int32_t max_dim = width > height ? width : height;
+  if (dist > max_dim) { dist = max_dim; }
+
+  // Per-column sums of the rows in the vertical window, plus their
+  // edge-extended prefix sums for the horizontal window
+  size_t ext_len = (size_t) width + 2 * (size_t) dist + 1;
+  uint32_t *buf = malloc(sizeof(uint32_t) * (3 * (size_t) width + 3 * ext_len));
+  if (buf == NULL) {
+    // Fall back to blurring one pixel at a time
+    for (int32_t row = row_begin; row < row_end; row++) {
+      for (int32_t col = 0; col < width; col++) {
+        output_img->data[compute_index(output_img, row, col)] = blur_pixel(input_img, row, col, dist);
+      }
+    }
+    return;
+  }
+  uint32_t *col_r = buf;
+  uint32_t *col_g = col_r + width;
+  uint32_t *col_b = col_g + width;
+  uint32_t *ext_r = col_b + width;
+  uint32_t *ext_g = ext_r + ext_len;
+  uint32_t *ext_b = ext_g + ext_len;
+  memset(col_r, 0, 3 * (size_t) width * sizeof(uint32_t));
+
+  // Prime the column sums with the vertical window of the first row
+  int32_t first = row_begin - dist < 0 ? 0 : row_begin - dist;
+  int32_t last = row_begin + dist > height - 1 ? height - 1 : row_begin + dist;
+  for (int32_t r = first; r <= last; r++) {
+    accum_row(input_img->data + (size_t) r * width, width, 1, col_r, col_g, col_b);
+  }
+
+  const __m512i lane_index = _mm512_set_epi32( 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0 );
+  const __m512i vdist = _mm512_set1_epi32( dist );
+  const __m512i last_col = _mm512_set1_epi32( width - 1 );
+  const __m512i one = _mm512_set1_epi32( 1 );
+  const __m512i byte = _mm512_set1_epi32( 0xFF );
+
+  for (int32_t row = row_begin; row < row_end; row++) {
+    int32_t lo = row - dist < 0 ? 0 : row - dist;
+    int32_t hi = row + dist > height - 1 ? height - 1 : row + dist;
+    const __m512i nrows = _mm512_set1_epi32( hi - lo + 1 );
+
+    imgproc_kernels_prefix_sums(col_r, width, dist, ext_r);
+    imgproc_kernels_prefix_sums(col_g, width, dist, ext_g);
+    imgproc_kernels_prefix_sums(col_b, width, dist, ext_b);
+
+    const uint32_t *src = input_img->data + (size_t) row * width;
+    uint32_t *dst = output_img->data + (size_t) row * width;
+    for (int32_t c = 0; c < width; c += LANES) {
+      __mmask16 m = lane_mask(width - c);
+
+      // Window sums: ext[c + 2 * dist + 1] - ext[c]
+      size_t right = (size_t) c + 2 * (size_t) dist + 1;
+      __m512i sr = _mm512_sub_epi32( _mm512_maskz_loadu_epi32( m, ext_r + right ), _mm512_maskz_loadu_epi32( m, ext_r + c ) );
+      __m512i sg = _mm512_sub_epi32( _mm512_maskz_loadu_epi32( m, ext_g + right ), _mm512_maskz_loadu_epi32( m, ext_g + c ) );
+      __m512i sb = _mm512_sub_epi32( _mm512_maskz_loadu_epi32( m, ext_b + right ), _mm512_maskz_loadu_epi32( m, ext_b + c ) );
+
+      // Pixel count: rows * (min(col + dist, width - 1) - max(col - dist, 0) + 1)
+      __m512i col = _mm512_add_epi32( _mm512_set1_epi32( c ), lane_index );
+      __m512i col_hi = _mm512_min_epi32( _mm512_add_epi32( col, vdist ), last_col );
+      __m512i col_lo = _mm512_max_epi32( _mm512_sub_epi32( col, vdist ), _mm512_setzero_si512() );
+      __m512i ncols = _mm512_add_epi32( _mm512_sub_epi32( col_hi, col_lo ), one );
+      // Lanes past the end of the row would get a zero count; give them 1
+      ncols = _mm512_mask_mov_epi32( one, m, ncols );
+      __m512i count = _mm512_mullo_epi32( ncols, nrows );
+
+      __m512i r = udiv_epu32( sr, count );
+      __m512i g = udiv_epu32( sg, count );
+      __m512i b = udiv_epu32( sb, count );
+      __m512i a = _mm512_and_si512( _mm512_maskz_loadu_epi32( m, src + c ), byte );
+      __m512i p = _mm512_or_si512( _mm512_or_si512( _mm512_slli_epi32( r, 24 ), _mm512_slli_epi32( g, 16 ) ),
+                                   _mm512_or_si512( _mm512_slli_epi32( b, 8 ), a ) );
+      _mm512_mask_storeu_epi32( dst + c, m, p );
+    }
+
+    // Slide the vertical window down one row
+    if (row + 1 < row_end) {
+      if (row + dist + 1 < height) {
+        accum_row(input_img->data + (size_t) (row + dist + 1) * width, width, 1, col_r, col_g, col_b);
+      }
+      if (row - dist >= 0) {
+        accum_row(input_img->data + (size_t) (row - dist) * width, width, -1, col_r, col_g, col_b);
+      }
+    }
+  }
+
+  free(buf);
+}
+
+AVX512_TARGET static void expand_avx512( struct Image *input_img, struct Image *output_img,
+                                         int32_t row_begin, int32_t row_end ) {
+  static const uint32_t interleave_lo[LANES] = { 0, 16, 1, 17, 2, 18, 3, 19, 4, 20, 5, 21, 6, 22, 7, 23 };
+  static const uint32_t interleave_hi[LANES] = { 8, 24, 9, 25, 10, 26, 11, 27, 12, 28, 13, 29, 14, 30, 15, 31 };
+  const __m512i idx_lo = _mm512_loadu_si512( interleave_lo );
+  const __m512i idx_hi = _mm512_loadu_si512( interleave_hi );
+
+  int32_t width = input_img->width;
+  int32_t height = input_img->height;
+
+  for (int32_t row = row_begin; row < row_end; row++) {
+    const uint32_t *top = input_img->data + (size_t) (row / 2) * width;
+    // For the last input row, the row below is the row itself, which
+    // makes every average include only in-bounds pixels
+    const uint32_t *bottom = row / 2 + 1 < height ? top + width : top;
+    uint32_t *dst = output_img->data + (size_t) row * output_img->width;
+    int odd_row = row % 2;
+
+    for (int32_t col = 0; col < width; col += LANES) {
+      int32_t n = width - col < LANES ? width - col : LANES;
+      __mmask16 m = lane_mask(n);
+      // Lanes whose right neighbour is in bounds; the others reuse the pixel itself
+      __mmask16 m_right = lane_mask(width - col - 1);
+
+      __m512i a = _mm512_maskz_loadu_epi32( m, top + col );
+      __m512i b = _mm512_mask_loadu_epi32( a, m_right, top + col + 1 );
+      __m512i even, odd;
+      if (odd_row) {
+        __m512i c = _mm512_maskz_loadu_epi32( m, bottom + col );
+        __m512i d = _mm512_mask_loadu_epi32( c, m_right, bottom + col + 1 );
+        even = avg2_epu8( a, c );
+        odd = avg4_epu8( a, b, c, d );
+      } else {
+        even = a;
+        odd = avg2_epu8( a, b );
+      }
+
+      // Interleave even/odd output columns and store 2n pixels
+      uint32_t *out = dst + 2 * (size_t) col;
+      _mm512_mask_storeu_epi32( out, lane_mask(2 * n), _mm512_permutex2var_epi32( even, idx_lo, odd ) );
+      if (n > LANES / 2) {
+        _mm512_mask_storeu_epi32( out + LANES, lane_mask(2 * n - LANES), _mm512_permutex2var_epi32( even, idx_hi, odd ) );
+      }
+    }
+  }
+}
+
+const struct ImgprocKernels imgproc_avx512_kernels = {
+  "avx512",
+  squash_avx512,
+  color_rot_avx512,
+  blur_avx512,
+  expand_avx512,
+};
+
+#endif // IMGPROC_HAVE_AVX512
@@ -0,0 +1,333 @@
+// Batch executor: runs the jobs of a job file as tasks on the
+// work-stealing scheduler. Input files are read ahead and output files
+// written behind through an asynchronous I/O queue, so the workers
+// only decode, transform and encode images in memory.
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "image.h"
+#include "imgproc_pipeline.h"
+#include "imgproc_batch.h"
+#include "imgproc_stats.h"
+#include "imgio.h"
+#include "imgjob.h"
+#include "imgtrace.h"
+#include "tasks.h"
+
+// Maximum number of words on a job line (files plus stage arguments)
+#define BATCH_MAX_WORDS (2 + IMGPROC_MAX_STAGE_WORDS * IMGPROC_MAX_STAGES)
+
+// Maximum number of jobs whose files are being read, transformed or
+// written at once (bounds the memory used for file contents)
+#define BATCH_IO_DEPTH 64
+
+struct BatchRun {
+  struct ImgIoQueue *io;
+  struct ImgprocStats *stats;
+  int read_flags;    // IMG_READ_* flags for decoding inputs
+  uint64_t timeout_ns;  // time allowed per job from submitting its read, 0 for no limit
+  int num_done;      // jobs finished, successfully or not
+};
+
+struct BatchJob {
+  struct BatchRun *run;
+  int line_num;
+  char *line;        // copy of the line; words point into it
+  char *words[BATCH_MAX_WORDS];
+  int num_words;
+  struct ImgprocStage stages[IMGPROC_MAX_STAGES];
+  int num_stages;
+  void *input;       // contents of the input file, once read
+  size_t input_len;
+  int failed;
+  // for the statistics
+  int kind;
+  uint64_t submit_ns;  // when the read was submitted
+  uint64_t ready_ns;   // when the read finished
+  uint64_t write_ns;   // when the write was submitted
+  uint64_t pixels_in, pixels_out;
+  size_t output_len;
+};
+
+// Split line into whitespace-separated words. Returns the number of
+// words, or -1 if there are too many.
+static int split_words( char *line, char **words, int max_words ) {
+  int n = 0;
+  char *save;
+  for ( char *word = strtok_r( line, " \t\r\n", &save ); word != NULL; word = strtok_r( NULL, " \t\r\n", &save ) ) {
+    if ( n == max_words )
+      return -1;
+    words[n++] = word;
+  }
+  return n;
+}
+
+static void job_done( struct BatchJob *job, int failed ) {
+  job->failed = failed;
+  struct ImgprocStats *stats = job->run->stats;
+  if ( !failed )
+    imgproc_stats_record( stats, job->kind, STATS_TOTAL, imgproc_stats_now() - job->submit_ns );
+  imgproc_stats_job( stats, job->kind, failed, job->pixels_in, job->pixels_out, job->input_len,
+                     failed ? 0 : job->output_len );
+  __atomic_add_fetch( &job->run->num_done, 1, __ATOMIC_SEQ_CST );
+}
+
+// Report a job stopped for running past its deadline
+static void report_timeout( const struct BatchJob *job ) {
+  fprintf( stderr, "Error: line %d: job took longer than %llu ms\n", job->line_num,
+           (unsigned long long) (job->run->timeout_ns / 1000000) );
+}
+
+// Decode a job's input, run its pipeline, encode the output and
+// submit the write
+static void process_job( struct BatchJob *job ) {
+  const char *input_filename = job->words[0];
+  const char *output_filename = job->words[1];
+  struct ImgprocStats *stats = job->run->stats;
+  struct Image input_img, output_img;
+
+  uint64_t start = imgproc_stats_now();
+  int rc = img_read_mem_flags( job->input, job->input_len, &input_img, job->run->read_flags );
+  free( job->input );
+  job->input = NULL;
+  if ( rc == IMG_ERR_CANCELLED ) {
+    report_timeout( job );
+    job_done( job, 1 );
+    return;
+  }
+  if ( rc != IMG_SUCCESS ) {
+    fprintf( stderr, "Error: line %d: couldn't read input image '%s'\n", job->line_num, input_filename );
+    job_done( job, 1 );
+    return;
+  }
+  uint64_t decoded = imgproc_stats_now();
+  imgproc_stats_record( stats, job->kind, STATS_DECODE, decoded - start );
+  job->pixels_in = (uint64_t) input_img.width * input_img.height;
+
+  int32_t out_w, out_h;
+  imgproc_pipeline_dimensions( job->stages, job->num_stages, input_img.width, input_img.height, &out_w, &out_h );
+  if ( img_init( &output_img, out_w, out_h ) != IMG_SUCCESS ) {
+    fprintf( stderr, "Error: line %d: couldn't create output image\n", job->line_num );
+    img_cleanup( &input_img );
+    job_done( job, 1 );
+    return;
+  }
+
+  // The job is finished when the write completes, so its statistics
+  // are filled in before submitting it
+  void *output;
+  size_t output_len;
+  int failed = 1;
+  job->pixels_out = (uint64_t) out_w * out_h;
+  rc = imgproc_pipeline_run( &input_img, &output_img, job->stages, job->num_stages );
+  if ( rc == IMG_ERR_CANCELLED ) {
+    report_timeout( job );
+  } else if ( rc != IMG_SUCCESS ) {
+    fprintf( stderr, "Error: line %d: transformation failed\n", job->line_num );
+  } else {
+    uint64_t transformed = imgproc_stats_now();
+    imgproc_stats_record( stats, job->kind, STATS_TRANSFORM, transformed - decoded );
+    rc = img_write_mem_for( output_filename, &output_img, &output, &output_len );
+    if ( rc == IMG_SUCCESS ) {
+      job->output_len = output_len;
+      job->write_ns = imgproc_stats_now();
+      imgproc_stats_record( stats, job->kind, STATS_ENCODE, job->write_ns - transformed );
+      failed = !imgio_submit_write( job->run->io, output_filename, output, output_len, job );
+    }
+    if ( rc == IMG_ERR_CANCELLED )
+      report_timeout( job );
+    else if ( failed )
+      fprintf( stderr, "Error: line %d: couldn't write output image '%s'\n", job->line_num, output_filename );
+  }
+
+  img_cleanup( &input_img );
+  img_cleanup( &output_img );
+  if ( failed )
+    job_done( job, 1 );
+}
+
+// Task that processes a job, traced as a "job" event with its line
+// number. The job is current while it runs, with its deadline if there
+// is a timeout (it has no deadline otherwise, but still replaces the
+// job of any band this worker was running when it picked up the task).
+static void run_job( void *arg ) {
+  struct BatchJob *job = arg;
+  imgproc_stats_record( job->run->stats, job->kind, STATS_QUEUE, imgproc_stats_now() - job->ready_ns );
+  struct ImgJob ctx;
+  imgjob_init( &ctx );
+  if ( job->run->timeout_ns > 0 )
+    imgjob_set_deadline( &ctx, job->submit_ns + job->run->timeout_ns );
+  struct ImgJob *prev = imgjob_enter( &ctx );
+  imgtrace_begin( "job", job->line_num );
+  process_job( job );
+  imgtrace_end( "job" );
+  imgjob_enter( prev );
+  imgjob_cleanup( &ctx );
+}
+
+// Handle a finished read or write of a job
+static void io_finished( const struct ImgIoResult *result, struct TaskGroup *group ) {
+  struct BatchJob *job = result->tag;
+  struct ImgprocStats *stats = job->run->stats;
+  uint64_t now = imgproc_stats_now();
+
+  if ( result->is_write ) {
+    if ( result->error == 0 )
+      imgproc_stats_record( stats, job->kind, STATS_WRITE, now - job->write_ns );
+    if ( result->error != 0 )
+      fprintf( stderr, "Error: line %d: couldn't write output image '%s': %s\n",
+               job->line_num, job->words[1], strerror( result->error ) );
+    job_done( job, result->error != 0 );
+  } else if ( result->error != 0 ) {
+    fprintf( stderr, "Error: line %d: couldn't read input image '%s': %s\n",
+             job->line_num, job->words[0], strerror( result->error ) );
+    job_done( job, 1 );
+  } else {
+    job->input = result->buf;
+    job->input_len = result->len;
+    job->ready_ns = now;
+    imgproc_stats_record( stats, job->kind, STATS_READ, now - job->submit_ns );
+    tasks_spawn( group, -1, run_job, job );
+  }
+}
+
+// Write the statistics of a finished batch to the file named by the
+// IMGPROC_STATS environment variable ("-" for stdout), if it is set
+static void write_stats( const struct ImgprocStats *stats ) {
+  const char *filename = getenv( "IMGPROC_STATS" );
+  if ( filename == NULL || filename[0] == '\0' )
+    return;
+  int to_stdout = strcmp( filename, "-" ) == 0;
+  FILE *out = to_stdout ? stdout : fopen( filename, "w" );
+  int ok = out != NULL && imgproc_stats_format( stats, out );
+  if ( out != NULL && !to_stdout && fclose( out ) != 0 )
+    ok = 0;
+  if ( !ok )
+    fprintf( stderr, "Error: couldn't write statistics to '%s'\n", filename );
+}
+
+// The time allowed per job, from the IMGPROC_JOB_TIMEOUT environment
+// variable (in milliseconds), or 0 for no limit
+static uint64_t job_timeout( void ) {
+  const char *env = getenv( "IMGPROC_JOB_TIMEOUT" );
+  long long ms = env != NULL ? strtoll( env, NULL, 10 ) : 0;
+  return ms > 0 ? (uint64_t) ms * 1000000 : 0;
+}
+
+static void free_jobs( struct BatchJob *jobs, int num_jobs ) {
+  for ( int i = 0; i < num_jobs; i++ ) {
+    free( jobs[i].line );
+    free( jobs[i].input );
+  }
+  free( jobs );
+}
+
+int imgproc_batch_run( const char *job_filename, int read_flags ) {
+  FILE *in = fopen( job_filename, "r" );
+  if ( in == NULL ) {
+    fprintf( stderr, "Error: couldn't open job file '%s'\n", job_filename );
+    return -1;
+  }
+
+  // Parse every job before running any, so a bad line runs nothing
+  struct BatchJob *jobs = NULL;
+  int num_jobs = 0, cap = 0, line_num = 0, ok = 1;
+  char *buf = NULL;
+  size_t buf_size = 0;
+  while ( ok && getline( &buf, &buf_size, in ) != -1 ) {
+    line_num++;
+    const char *p = buf + strspn( buf, " \t\r\n" );
+    if ( *p == '\0' || *p == '#' )
+      continue;
+
+    if ( num_jobs == cap ) {
+      cap = cap == 0 ? 16 : cap * 2;
+      struct BatchJob *grown = realloc( jobs, cap * sizeof( struct BatchJob ) );
+      if ( grown == NULL ) {
+        fprintf( stderr, "Error: out of memory reading job file\n" );
+        ok = 0;
+        break;
+      }
+      jobs = grown;
+    }
+
+    struct BatchJob *job = &jobs[num_jobs];
+    memset( job, 0, sizeof( *job ) );
+    job->line_num = line_num;
+    job->line = strdup( buf );
+    if ( job->line == NULL ) {
+      fprintf( stderr, "Error: out of memory reading job file\n" );
+      ok = 0;
+      break;
+    }
+    num_jobs++;
+
+    job->num_words = split_words( job->line, job->words, BATCH_MAX_WORDS );
+    if ( job->num_words >= 3 )
+      job->num_stages = imgproc_parse_stages( job->num_words - 2, job->words + 2,
+                                              job->stages, IMGPROC_MAX_STAGES );
+    if ( job->num_words < 3 || job->num_stages < 0 ) {
+      fprintf( stderr, "Error: line %d: invalid job\n", line_num );
+      ok = 0;
+    } else {
+      job->kind = imgproc_stats_kind( job->stages, job->num_stages );
+    }
+  }
+  free( buf );
+  fclose( in );
+
+  if ( !ok ) {
+    free_jobs( jobs, num_jobs );
+    return -1;
+  }
+
+  struct BatchRun run = { imgio_create( BATCH_IO_DEPTH ), imgproc_stats_create(), read_flags, job_timeout(), 0 };
+  if ( run.io == NULL || run.stats == NULL ) {
+    fprintf( stderr, run.io == NULL ? "Error: couldn't create I/O queue\n" : "Error: out of memory\n" );
+    if ( run.io != NULL )
+      imgio_destroy( run.io );
+    imgproc_stats_destroy( run.stats );
+    free_jobs( jobs, num_jobs );
+    return -1;
+  }
+
+  // Read inputs in file order, keeping up to BATCH_IO_DEPTH jobs going.
+  // Each job becomes a task once its input is read; its row bands are
+  // queued on the worker that runs it, where idle workers can steal
+  // them. Meanwhile this thread handles I/O completions and runs tasks.
+  struct TaskGroup group = TASK_GROUP_INIT;
+  int next = 0;
+  while ( __atomic_load_n( &run.num_done, __ATOMIC_SEQ_CST ) < num_jobs ) {
+    while ( next < num_jobs && next - __atomic_load_n( &run.num_done, __ATOMIC_SEQ_CST ) < BATCH_IO_DEPTH ) {
+      struct BatchJob *job = &jobs[next++];
+      job->run = &run;
+      job->submit_ns = imgproc_stats_now();
+      if ( !imgio_submit_read( run.io, job->words[0], job ) ) {
+        fprintf( stderr, "Error: line %d: couldn't read input image '%s'\n", job->line_num, job->words[0] );
+        job_done( job, 1 );
+      }
+    }
+
+    struct ImgIoResult result;
+    if ( imgio_wait( run.io, &result, 0 ) )
+      io_finished( &result, &group );
+    else if ( tasks_run_one() )
+      continue;
+    else if ( imgio_pending( run.io ) > 0 && imgio_wait( run.io, &result, 1 ) )
+      io_finished( &result, &group );
+    else
+      sched_yield();
+  }
+  tasks_wait( &group );
+  imgio_destroy( run.io );
+  write_stats( run.stats );
+  imgproc_stats_destroy( run.stats );
+
+  int num_failed = 0;
+  for ( int i = 0; i < num_jobs; i++ )
+    num_failed += jobs[i].failed;
+  free_jobs( jobs, num_jobs );
+  return num_failed;
+}
@@ -0,0 +1,30 @@
+// Header for the batch executor, which runs many independent image
+// transformation jobs at once on the work-stealing scheduler.
+
+#ifndef IMGPROC_BATCH_H
+#define IMGPROC_BATCH_H
+
+//! Run the jobs in the named job file. Each non-empty line that doesn't
+//! start with '#' is one job:
+//!
+//!     <input img> <output img> <transform> [args...] [<transform> [args...] ...]
+//!
+//! i.e. the input and output files and the stages of a pipeline (see
+//! imgproc_pipeline.h), e.g. "in.png out.png blur 3 expand". Every job
+//! is a task for the scheduler, and the transformations of each job are
+//! split into row-band tasks, so idle threads help with large images
+//! once the small ones are done. Input files are read ahead and output
+//! files written behind asynchronously (see imgio.h), so the workers
+//! don't wait for the disk. Inputs are decoded with the given
+//! IMG_READ_* flags (see image.h). Errors are reported on stderr.
+//! Latency histograms and throughput of the jobs (see imgproc_stats.h)
+//! are written at the end to the file named by the IMGPROC_STATS
+//! environment variable ("-" for stdout), if it is set. If the
+//! IMGPROC_JOB_TIMEOUT environment variable is set to a number of
+//! milliseconds, jobs still running that long after their input was
+//! submitted for reading are stopped (see imgjob.h) and fail.
+//! Returns the number of jobs that failed, or -1 if the job file
+//! couldn't be read or has an invalid line.
+int imgproc_batch_run( const char *job_filename, int read_flags );
+
+#endif // IMGPROC_BATCH_H
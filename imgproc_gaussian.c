@@ -0,0 +1,212 @@
+// Gaussian blur approximated by three successive box blurs.
+// Shared by the C and assembly builds (it only relies on the
+// pixel helper functions declared in imgproc.h).
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "imgproc.h"
+#include "parallel.h"
+
+// Number of box passes used to approximate the Gaussian
+#define GAUSSIAN_NUM_BOXES 3
+
+// Context shared by the bands of one box pass
+struct BoxPass {
+  const uint32_t *src;    // pixels read by this pass
+  uint32_t *dst;          // pixels written by this pass
+  const uint32_t *alpha;  // original pixels, source of the alpha values
+  uint32_t *totals;       // 3 * width running sums for the vertical pass
+  int32_t width;
+  int32_t height;
+  int32_t radius;
+};
+
+// Number of in-bounds positions within radius of pos, for a line of length len
+static uint32_t window_count( int32_t pos, int32_t radius, int32_t len ) {
+  int32_t lo = pos - radius;
+  int32_t hi = pos + radius;
+  if (lo < 0) { lo = 0; }
+  if (hi >= len) { hi = len - 1; }
+  return (uint32_t) (hi - lo + 1);
+}
+
+// Horizontal box pass over rows [begin, end) using a running sum per channel
+static void box_pass_rows( void *ctx, int32_t begin, int32_t end ) {
+  const struct BoxPass *pass = ctx;
+  int32_t width = pass->width;
+  int32_t radius = pass->radius;
+
+  for (int32_t row = begin; row < end; row++) {
+    const uint32_t *in = pass->src + (size_t) row * width;
+    uint32_t *out = pass->dst + (size_t) row * width;
+    const uint32_t *alpha = pass->alpha + (size_t) row * width;
+
+    // Prime the window with the pixels covering column 0
+    uint32_t r_total = 0, g_total = 0, b_total = 0;
+    int32_t first_end = radius < width - 1 ? radius : width - 1;
+    for (int32_t c = 0; c <= first_end; c++) {
+      r_total += get_r(in[c]);
+      g_total += get_g(in[c]);
+      b_total += get_b(in[c]);
+    }
+
+    for (int32_t col = 0; col < width; col++) {
+      uint32_t count = window_count(col, radius, width);
+      out[col] = make_pixel(r_total / count, g_total / count, b_total / count, get_a(alpha[col]));
+
+      // Slide the window one column to the right
+      int32_t enter = col + radius + 1;
+      int32_t leave = col - radius;
+      if (enter < width) {
+        r_total += get_r(in[enter]);
+        g_total += get_g(in[enter]);
+        b_total += get_b(in[enter]);
+      }
+      if (leave >= 0) {
+        r_total -= get_r(in[leave]);
+        g_total -= get_g(in[leave]);
+        b_total -= get_b(in[leave]);
+      }
+    }
+  }
+}
+
+// Vertical box pass over columns [begin, end). The running sums for the
+// whole column band are updated one row at a time, so memory is still
+// accessed row by row.
+static void box_pass_cols( void *ctx, int32_t begin, int32_t end ) {
+  const struct BoxPass *pass = ctx;
+  int32_t width = pass->width;
+  int32_t height = pass->height;
+  int32_t radius = pass->radius;
+  int32_t ncols = end - begin;
+
+  // Each band owns columns [begin, end) of the shared running sums
+  uint32_t *r_total = pass->totals + begin;
+  uint32_t *g_total = pass->totals + width + begin;
+  uint32_t *b_total = pass->totals + 2 * width + begin;
+  for (int32_t i = 0; i < ncols; i++) {
+    r_total[i] = g_total[i] = b_total[i] = 0;
+  }
+
+  // Prime the window with the rows covering row 0
+  int32_t first_end = radius < height - 1 ? radius : height - 1;
+  for (int32_t r = 0; r <= first_end; r++) {
+    const uint32_t *in = pass->src + (size_t) r * width + begin;
+    for (int32_t i = 0; i < ncols; i++) {
+      r_total[i] += get_r(in[i]);
+      g_total[i] += get_g(in[i]);
+      b_total[i] += get_b(in[i]);
+    }
+  }
+
+  for (int32_t row = 0; row < height; row++) {
+    uint32_t count = window_count(row, radius, height);
+    uint32_t *out = pass->dst + (size_t) row * width + begin;
+    const uint32_t *alpha = pass->alpha + (size_t) row * width + begin;
+    for (int32_t i = 0; i < ncols; i++) {
+      out[i] = make_pixel(r_total[i] / count, g_total[i] / count, b_total[i] / count, get_a(alpha[i]));
+    }
+
+    // Slide the window one row down
+    int32_t enter = row + radius + 1;
+    int32_t leave = row - radius;
+    if (enter < height) {
+      const uint32_t *in = pass->src + (size_t) enter * width + begin;
+      for (int32_t i = 0; i < ncols; i++) {
+        r_total[i] += get_r(in[i]);
+        g_total[i] += get_g(in[i]);
+        b_total[i] += get_b(in[i]);
+      }
+    }
+    if (leave >= 0) {
+      const uint32_t *in = pass->src + (size_t) leave * width + begin;
+      for (int32_t i = 0; i < ncols; i++) {
+        r_total[i] -= get_r(in[i]);
+        g_total[i] -= get_g(in[i]);
+        b_total[i] -= get_b(in[i]);
+      }
+    }
+  }
+}
+
+// Compute the radii of the three box blurs whose composition best
+// approximates a Gaussian with standard deviation sigma. The box
+// widths are the odd integers wl and wl + 2 closest to the ideal width
+// sqrt(12*sigma^2/n + 1), mixed so the total variance matches sigma^2.
+void gaussian_box_radii( double sigma, int32_t radii[3] ) {
+  const int n = GAUSSIAN_NUM_BOXES;
+
+  if (!(sigma > 0.0)) {
+    for (int i = 0; i < n; i++) {
+      radii[i] = 0;
+    }
+    return;
+  }
+  if (sigma > GAUSSIAN_MAX_SIGMA) {
+    sigma = GAUSSIAN_MAX_SIGMA;
+  }
+
+  double w_ideal = sqrt(12.0 * sigma * sigma / n + 1.0);
+  int32_t wl = (int32_t) floor(w_ideal);
+  if (wl % 2 == 0) {
+    wl--;
+  }
+  int32_t wu = wl + 2;
+
+  // Number of passes that use the smaller width
+  double m_ideal = (12.0 * sigma * sigma - (double) n * wl * wl - 4.0 * n * wl - 3.0 * n) / (-4.0 * wl - 4.0);
+  int32_t m = (int32_t) lround(m_ideal);
+
+  for (int i = 0; i < n; i++) {
+    int32_t w = i < m ? wl : wu;
+    radii[i] = (w - 1) / 2;
+  }
+}
+
+//! Approximate a Gaussian blur with standard deviation sigma by three
+//! box blurs. Each box blur is split into a horizontal and a vertical
+//! pass computed with sliding-window sums, so the cost per pixel does
+//! not depend on sigma. Out-of-bounds pixels are ignored and averages
+//! truncate, as in imgproc_blur, and the alpha values are unchanged.
+//! Returns 1 if successful, 0 if temporary buffers couldn't be allocated.
+int imgproc_gaussian( struct Image *input_img, struct Image *output_img, double sigma ) {
+  int32_t width = input_img->width;
+  int32_t height = input_img->height;
+  size_t num_pixels = (size_t) width * height;
+
+  if (num_pixels == 0) {
+    return 1;
+  }
+
+  uint32_t *tmp = malloc(num_pixels * sizeof(uint32_t));
+  uint32_t *totals = malloc((size_t) width * 3 * sizeof(uint32_t));
+  if (tmp == NULL || totals == NULL) {
+    free(tmp);
+    free(totals);
+    return 0;
+  }
+
+  int32_t radii[GAUSSIAN_NUM_BOXES];
+  gaussian_box_radii(sigma, radii);
+
+  // The first pass reads the input; every later pass reads the previous
+  // vertical pass result from the output image.
+  memcpy(output_img->data, input_img->data, num_pixels * sizeof(uint32_t));
+  for (int i = 0; i < GAUSSIAN_NUM_BOXES; i++) {
+    if (radii[i] == 0) {
+      continue;
+    }
+    struct BoxPass pass = { output_img->data, tmp, input_img->data, totals, width, height, radii[i] };
+    par_for(height, box_pass_rows, &pass);
+
+    pass.src = tmp;
+    pass.dst = output_img->data;
+    par_for(width, box_pass_cols, &pass);
+  }
+
+  free(tmp);
+  free(totals);
+  return 1;
+}
@@ -0,0 +1,134 @@
+// In-place variants of the transformations whose output fits in the
+// input's pixel buffer. Shared by the C and assembly builds: the pixels
+// are transformed by the build's own imgproc_color_rot, imgproc_squash
+// and imgproc_blur, called on views of single rows or windows of rows.
+
+#include <stdlib.h>
+#include <string.h>
+#include "imgproc.h"
+
+// Minimum number of rows blurred per chunk by imgproc_blur_in_place
+#define BLUR_CHUNK_MIN_ROWS 256
+
+// Chunks are at least this many times blur_dist rows, so blurring the
+// rows around a chunk (only needed as its context) adds at most a
+// quarter to the work
+#define BLUR_CHUNK_DISTS 8
+
+void imgproc_color_rot_in_place( struct Image *img ) {
+  // Each output pixel only depends on the input pixel it replaces
+  imgproc_color_rot( img, img );
+}
+
+int imgproc_squash_in_place( struct Image *img, int32_t xfac, int32_t yfac ) {
+  int32_t width = img->width;
+  int32_t out_w = img->width / xfac;
+  int32_t out_h = img->height / yfac;
+
+  // Output row r never starts before input row r * yfac, so squashing
+  // one row at a time, front to back, only overwrites rows already
+  // sampled. A row overlapping its own output (the first one, and all
+  // of them if yfac is 1) is copied out first, so imgproc_squash never
+  // reads pixels it has written.
+  uint32_t *row_copy = malloc( (size_t) width * sizeof( uint32_t ) );
+  if ( row_copy == NULL && out_h > 0 )
+    return 0;
+  uint32_t *dst = img->data;
+  for ( int32_t row = 0; row < out_h; row++ ) {
+    struct Image in_row = { .width = width, .height = 1, .data = img->data + (size_t) row * yfac * width };
+    struct Image out_row = { .width = out_w, .height = 1, .data = dst };
+    if ( in_row.data < dst + out_w ) {
+      memcpy( row_copy, in_row.data, (size_t) width * sizeof( uint32_t ) );
+      in_row.data = row_copy;
+    }
+    imgproc_squash( &in_row, &out_row, xfac, 1 );
+    dst += out_w;
+  }
+  free( row_copy );
+  img->width = out_w;
+  img->height = out_h;
+
+  // Give back the unused end of a malloc'ed buffer (a mapped .rimg file
+  // is left as it is)
+  size_t size = (size_t) out_w * out_h * sizeof( uint32_t );
+  if ( img->map == NULL && size > 0 ) {
+    uint32_t *data = realloc( img->data, size );
+    if ( data != NULL )
+      img->data = data;
+  }
+  return 1;
+}
+
+int imgproc_blur_in_place( struct Image *img, int32_t blur_dist ) {
+  int32_t width = img->width;
+  int32_t height = img->height;
+  if ( blur_dist <= 0 || width == 0 || height == 0 )
+    return 1;
+
+  // Rows are blurred a chunk at a time. The window holds the original
+  // rows the chunk's output depends on: the blur_dist rows above it
+  // (kept from the previous chunk, as they have been overwritten in
+  // img by now) and the chunk and blur_dist rows below it (still
+  // unchanged in img). The whole window is blurred, and the chunk's
+  // rows, which have all the rows they need around them, are copied
+  // back.
+  int64_t chunk_rows = BLUR_CHUNK_DISTS * (int64_t) blur_dist;
+  if ( chunk_rows < BLUR_CHUNK_MIN_ROWS ) { chunk_rows = BLUR_CHUNK_MIN_ROWS; }
+  int64_t window_rows = chunk_rows + 2 * (int64_t) blur_dist;
+  if ( chunk_rows > height ) { chunk_rows = height; }
+  if ( window_rows > height ) { window_rows = height; }
+  size_t row_size = (size_t) width * sizeof( uint32_t );
+
+  // For a blur_dist so large that the window and its blurred rows take
+  // as much memory as the image, blurring into a new buffer (which then
+  // replaces img's) needs less
+  if ( 2 * window_rows >= height ) {
+    struct Image out = { .width = width, .height = height, .data = malloc( height * row_size ) };
+    if ( out.data == NULL )
+      return 0;
+    imgproc_blur( img, &out, blur_dist );
+    img_cleanup( img );
+    *img = out;
+    return 1;
+  }
+
+  uint32_t *window_data = malloc( window_rows * row_size );
+  uint32_t *out_data = malloc( window_rows * row_size );
+  if ( window_data == NULL || out_data == NULL ) {
+    free( window_data );
+    free( out_data );
+    return 0;
+  }
+
+  struct Image window = { .width = width, .data = window_data };
+  struct Image out = { .width = width, .data = out_data };
+
+  // Window rows [0, kept) are the original rows from start on
+  int32_t start = 0;
+  int32_t kept = 0;
+  for ( int32_t r0 = 0; r0 < height; r0 = (int32_t) (r0 + chunk_rows) ) {
+    int32_t r1 = r0 + chunk_rows < height ? (int32_t) (r0 + chunk_rows) : height;
+    int32_t new_start = r0 - (int64_t) blur_dist > 0 ? r0 - blur_dist : 0;
+    int32_t end = r1 + (int64_t) blur_dist < height ? r1 + blur_dist : height;
+
+    // Keep the original rows from new_start that are already in the
+    // window, then add the rest from img
+    int32_t skip = new_start - start;
+    kept -= skip;
+    memmove( window_data, window_data + (size_t) skip * width, kept * row_size );
+    memcpy( window_data + (size_t) kept * width, img->data + (size_t) (new_start + kept) * width,
+            (end - new_start - kept) * row_size );
+    start = new_start;
+    kept = end - start;
+
+    window.height = kept;
+    out.height = kept;
+    imgproc_blur( &window, &out, blur_dist );
+    memcpy( img->data + (size_t) r0 * width, out_data + (size_t) (r0 - start) * width,
+            (r1 - r0) * row_size );
+  }
+
+  free( window_data );
+  free( out_data );
+  return 1;
+}
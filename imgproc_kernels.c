@@ -0,0 +1,130 @@
+// Runtime selection of SIMD kernel tiers and parallel dispatch of
+// the selected kernels over row bands
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "imgproc_kernels.h"
+#include "parallel.h"
+
+// Which kind of transformation a band context describes
+enum KernelOp { OP_SQUASH, OP_COLOR_ROT, OP_BLUR, OP_EXPAND };
+
+// Context shared by the bands of one kernel invocation
+struct KernelCall {
+  const struct ImgprocKernels *k;
+  enum KernelOp op;
+  struct Image *input_img;
+  struct Image *output_img;
+  int32_t arg0;
+  int32_t arg1;
+};
+
+static pthread_once_t s_select_once = PTHREAD_ONCE_INIT;
+static const struct ImgprocKernels *s_selected;
+
+static int cpu_has_avx512( void ) {
+#ifdef IMGPROC_HAVE_AVX512
+  __builtin_cpu_init();
+  return __builtin_cpu_supports( "avx512f" ) && __builtin_cpu_supports( "avx512bw" );
+#else
+  return 0;
+#endif
+}
+
+const struct ImgprocKernels *imgproc_kernels_find( const char *name ) {
+#ifdef IMGPROC_HAVE_AVX512
+  if ( strcmp( name, imgproc_avx512_kernels.name ) == 0 && cpu_has_avx512() )
+    return &imgproc_avx512_kernels;
+#endif
+#ifdef IMGPROC_HAVE_VEC
+  if ( strcmp( name, imgproc_vec_kernels.name ) == 0 )
+    return &imgproc_vec_kernels;
+#endif
+  return NULL;
+}
+
+static void select_kernels( void ) {
+  const char *env = getenv( "IMGPROC_KERNELS" );
+
+  if ( env != NULL ) {
+    // "scalar" means the plain C code, which is also used (with a
+    // warning, so a forced tier can't go unnoticed) if the named tier
+    // isn't available
+    s_selected = imgproc_kernels_find( env );
+    if ( s_selected == NULL && strcmp( env, "scalar" ) != 0 )
+      fprintf( stderr, "Warning: IMGPROC_KERNELS=%s isn't available here, using the scalar code\n", env );
+    return;
+  }
+
+  // Otherwise, pick the best tier this CPU supports: the hand-written
+  // intrinsics if possible, then the portable vector code
+  s_selected = imgproc_kernels_find( "avx512" );
+  if ( s_selected == NULL )
+    s_selected = imgproc_kernels_find( "vec" );
+}
+
+const struct ImgprocKernels *imgproc_kernels_selected( void ) {
+  pthread_once( &s_select_once, select_kernels );
+  return s_selected;
+}
+
+void imgproc_kernels_prefix_sums( const uint32_t *col, int32_t width, int32_t dist, uint32_t *ext ) {
+  uint32_t total = 0;
+  for ( int32_t i = 0; i <= dist; i++ )
+    ext[i] = 0;
+  for ( int32_t c = 0; c < width; c++ ) {
+    total += col[c];
+    ext[dist + c + 1] = total;
+  }
+  for ( int32_t i = dist + width + 1; i <= width + 2 * dist; i++ )
+    ext[i] = total;
+}
+
+static void kernel_band( void *ctx, int32_t begin, int32_t end ) {
+  const struct KernelCall *call = ctx;
+
+  switch ( call->op ) {
+  case OP_SQUASH:
+    call->k->squash( call->input_img, call->output_img, call->arg0, call->arg1, begin, end );
+    break;
+  case OP_COLOR_ROT:
+    call->k->color_rot( call->input_img, call->output_img, begin, end );
+    break;
+  case OP_BLUR:
+    call->k->blur( call->input_img, call->output_img, call->arg0, begin, end );
+    break;
+  case OP_EXPAND:
+    call->k->expand( call->input_img, call->output_img, begin, end );
+    break;
+  }
+}
+
+// Run op with the selected tier over all output rows
+static int run_kernel( enum KernelOp op, struct Image *input_img, struct Image *output_img,
+                       int32_t arg0, int32_t arg1 ) {
+  const struct ImgprocKernels *k = imgproc_kernels_selected();
+  if ( k == NULL )
+    return 0;
+
+  struct KernelCall call = { k, op, input_img, output_img, arg0, arg1 };
+  par_for( output_img->height, kernel_band, &call );
+  return 1;
+}
+
+int imgproc_kernels_squash( struct Image *input_img, struct Image *output_img, int32_t xfac, int32_t yfac ) {
+  return run_kernel( OP_SQUASH, input_img, output_img, xfac, yfac );
+}
+
+int imgproc_kernels_color_rot( struct Image *input_img, struct Image *output_img ) {
+  return run_kernel( OP_COLOR_ROT, input_img, output_img, 0, 0 );
+}
+
+int imgproc_kernels_blur( struct Image *input_img, struct Image *output_img, int32_t blur_dist ) {
+  return run_kernel( OP_BLUR, input_img, output_img, blur_dist, 0 );
+}
+
+int imgproc_kernels_expand( struct Image *input_img, struct Image *output_img ) {
+  return run_kernel( OP_EXPAND, input_img, output_img, 0, 0 );
+}
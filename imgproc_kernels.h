@@ -0,0 +1,65 @@
+// Header for the SIMD kernel tiers used by the C implementations
+// of the image transformations, and for runtime tier selection.
+
+#ifndef IMGPROC_KERNELS_H
+#define IMGPROC_KERNELS_H
+
+#include "image.h" // for struct Image
+
+//! A set of transformation kernels for one instruction set tier.
+//! Each kernel computes output rows [row_begin, row_end) and has the
+//! same semantics as the corresponding imgproc_* function, so the rows
+//! of an image can be split into bands processed by different threads.
+struct ImgprocKernels {
+  const char *name;
+  void (*squash)( struct Image *input_img, struct Image *output_img, int32_t xfac, int32_t yfac,
+                  int32_t row_begin, int32_t row_end );
+  void (*color_rot)( struct Image *input_img, struct Image *output_img,
+                     int32_t row_begin, int32_t row_end );
+  void (*blur)( struct Image *input_img, struct Image *output_img, int32_t blur_dist,
+                int32_t row_begin, int32_t row_end );
+  void (*expand)( struct Image *input_img, struct Image *output_img,
+                  int32_t row_begin, int32_t row_end );
+};
+
+//! Look up a kernel tier by name ("avx512" or "vec").
+//! Returns NULL if the tier is not compiled in or is not supported by
+//! the CPU this program is running on.
+const struct ImgprocKernels *imgproc_kernels_find( const char *name );
+
+//! Return the kernel tier used by the imgproc_* functions, or NULL if
+//! they should use their scalar C code. The best tier supported by the
+//! CPU is chosen the first time this is called; the IMGPROC_KERNELS
+//! environment variable ("scalar" or a tier name) overrides the choice.
+//! If it names a tier that isn't available, a warning is printed on
+//! stderr and the scalar code is used.
+const struct ImgprocKernels *imgproc_kernels_selected( void );
+
+//! Run a transformation with the selected kernel tier, splitting the
+//! output rows into bands processed in parallel. Each function returns
+//! 1 if the transformation was done, or 0 if no SIMD tier is selected
+//! (in which case the caller should fall back to scalar code).
+int imgproc_kernels_squash( struct Image *input_img, struct Image *output_img, int32_t xfac, int32_t yfac );
+int imgproc_kernels_color_rot( struct Image *input_img, struct Image *output_img );
+int imgproc_kernels_blur( struct Image *input_img, struct Image *output_img, int32_t blur_dist );
+int imgproc_kernels_expand( struct Image *input_img, struct Image *output_img );
+
+//! Helper shared by the tiers' blur kernels: fill ext (length
+//! width + 2 * dist + 1) so that ext[i + dist] is the sum of
+//! col[0 .. clamp(i, 0, width) - 1] for i in [-dist, width + dist].
+//! A horizontal window sum is then ext[c + 2 * dist + 1] - ext[c].
+void imgproc_kernels_prefix_sums( const uint32_t *col, int32_t width, int32_t dist, uint32_t *ext );
+
+#if defined(__GNUC__) && !defined(IMGPROC_NO_VEC)
+#define IMGPROC_HAVE_VEC 1
+//! Portable tier written with the compiler's vector extensions
+extern const struct ImgprocKernels imgproc_vec_kernels;
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(IMGPROC_NO_AVX512)
+#define IMGPROC_HAVE_AVX512 1
+//! AVX-512 (F + BW) tier; only valid if the CPU supports it
+extern const struct ImgprocKernels imgproc_avx512_kernels;
+#endif
+
+#endif // IMGPROC_KERNELS_H
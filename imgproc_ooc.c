@@ -0,0 +1,131 @@
+// Out-of-core processing: the stages of a pipeline are run on one band
+// of output rows at a time, from a sliding window of the input rows the
+// band depends on, with the input read and the output written as the
+// bands move down the image.
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "image.h"
+#include "imgproc_ooc.h"
+
+// Smallest budget honoured, in MiB
+#define OOC_MIN_BUDGET_MIB 16
+
+size_t imgproc_ooc_budget( void ) {
+  const char *env = getenv( "IMGPROC_RAM_BUDGET" );
+  long mib = env != NULL ? strtol( env, NULL, 10 ) : 0;
+  if ( mib > 0 )
+    return (size_t) (mib < OOC_MIN_BUDGET_MIB ? OOC_MIN_BUDGET_MIB : mib) << 20;
+
+  long pages = sysconf( _SC_PHYS_PAGES );
+  long page_size = sysconf( _SC_PAGESIZE );
+  if ( pages <= 0 || page_size <= 0 )
+    return (size_t) 1 << 30;
+  return (size_t) pages * page_size / 2;
+}
+
+int imgproc_ooc_wanted( const char *input_filename, const struct ImgprocStage *stages, int num_stages ) {
+  struct ImgRowReader *reader;
+  if ( img_rows_open( input_filename, IMG_READ_TRUSTED, &reader ) != IMG_SUCCESS )
+    return 0;
+  int32_t w, h, out_w, out_h;
+  img_rows_size( reader, &w, &h );
+  img_rows_close( reader );
+
+  imgproc_pipeline_dimensions( stages, num_stages, w, h, &out_w, &out_h );
+  size_t bytes = ((size_t) w * h + (size_t) out_w * out_h) * sizeof( uint32_t );
+  return bytes > imgproc_ooc_budget();
+}
+
+// Memory needed to compute output rows [begin, end): the input window,
+// the intermediate images and the output band
+static size_t band_bytes( const struct ImgprocStage *stages, int num_stages, int32_t w, int32_t h,
+                          int32_t out_w, int32_t begin, int32_t end ) {
+  int32_t in_begin, in_end;
+  size_t bytes;
+  imgproc_pipeline_input_rows( stages, num_stages, w, h, begin, end, &in_begin, &in_end, &bytes );
+  return bytes + ((size_t) w * (in_end - in_begin) + (size_t) out_w * (end - begin)) * sizeof( uint32_t );
+}
+
+int imgproc_ooc_run( const char *input_filename, const char *output_filename,
+                     const struct ImgprocStage *stages, int num_stages, int read_flags ) {
+  struct ImgRowReader *reader;
+  int rc = img_rows_open( input_filename, read_flags, &reader );
+  if ( rc != IMG_SUCCESS )
+    return rc;
+  int32_t w, h, out_w, out_h;
+  img_rows_size( reader, &w, &h );
+  imgproc_pipeline_dimensions( stages, num_stages, w, h, &out_w, &out_h );
+
+  struct ImgRowWriter *writer;
+  rc = img_rows_create( output_filename, out_w, out_h, &writer );
+  if ( rc != IMG_SUCCESS ) {
+    img_rows_close( reader );
+    return rc;
+  }
+
+  // Halve the bands until one from the middle of the image (which has
+  // the most rows around it) fits in the budget
+  size_t budget = imgproc_ooc_budget();
+  int32_t band = out_h > 0 ? out_h : 1;
+  while ( band > 1 && band_bytes( stages, num_stages, w, h, out_w, out_h / 2,
+                                  out_h / 2 + band < out_h ? out_h / 2 + band : out_h ) > budget )
+    band /= 2;
+
+  // The window holds input rows [win_begin, win_end)
+  uint32_t *window = NULL;
+  size_t window_rows = 0;
+  int32_t win_begin = 0, win_end = 0;
+  struct Image out = { out_w, 0, NULL, NULL, 0 };
+  out.data = malloc( (size_t) out_w * band * sizeof( uint32_t ) + 1 );
+  if ( out.data == NULL )
+    rc = IMG_ERR_MALLOC_FAILED;
+
+  for ( int32_t begin = 0; begin < out_h && rc == IMG_SUCCESS; begin += band ) {
+    int32_t end = begin + band < out_h ? begin + band : out_h;
+    int32_t in_begin, in_end;
+    size_t bytes;
+    imgproc_pipeline_input_rows( stages, num_stages, w, h, begin, end, &in_begin, &in_end, &bytes );
+
+    // Slide the window down: keep the rows still needed, skip any rows
+    // that no band needs and read the new ones
+    if ( in_begin >= win_end ) {
+      rc = img_rows_read( reader, NULL, in_begin - win_end );
+      win_end = in_begin;
+    } else {
+      memmove( window, window + (size_t) (in_begin - win_begin) * w,
+               (size_t) (win_end - in_begin) * w * sizeof( uint32_t ) );
+    }
+    win_begin = in_begin;
+    if ( rc == IMG_SUCCESS && (size_t) (in_end - win_begin) > window_rows ) {
+      uint32_t *grown = realloc( window, (size_t) (in_end - win_begin) * w * sizeof( uint32_t ) + 1 );
+      if ( grown == NULL ) {
+        rc = IMG_ERR_MALLOC_FAILED;
+      } else {
+        window = grown;
+        window_rows = in_end - win_begin;
+      }
+    }
+    if ( rc == IMG_SUCCESS && in_end > win_end ) {
+      rc = img_rows_read( reader, window + (size_t) (win_end - win_begin) * w, in_end - win_end );
+      win_end = in_end;
+    }
+    if ( rc != IMG_SUCCESS )
+      break;
+
+    struct Image in_rows = { w, in_end - in_begin, window, NULL, 0 };
+    out.height = end - begin;
+    rc = imgproc_pipeline_run_rows( &in_rows, h, stages, num_stages, begin, end, &out );
+    if ( rc == IMG_SUCCESS )
+      rc = img_rows_write( writer, out.data, end - begin );
+  }
+
+  free( window );
+  free( out.data );
+  int read_rc = img_rows_close( reader );
+  int write_rc = img_rows_finish( writer );
+  if ( rc == IMG_SUCCESS )
+    rc = read_rc != IMG_SUCCESS ? read_rc : write_rc;
+  return rc;
+}
@@ -0,0 +1,34 @@
+// Header for out-of-core processing: running the stages of a pipeline
+// on images too large to hold in memory, a band of rows at a time.
+
+#ifndef IMGPROC_OOC_H
+#define IMGPROC_OOC_H
+
+#include <stddef.h>
+#include "imgproc_pipeline.h"
+
+//! The memory that transforming an image may use, in bytes: the
+//! IMGPROC_RAM_BUDGET environment variable (in MiB), or by default half
+//! of the physical memory.
+size_t imgproc_ooc_budget( void );
+
+//! Return 1 if running the stages on the named image would need more
+//! memory than the budget (judging by the sizes of the input and
+//! output images), so it should be done out of core, 0 otherwise
+//! (including if the image can't be opened).
+int imgproc_ooc_wanted( const char *input_filename, const struct ImgprocStage *stages, int num_stages );
+
+//! Run the stages on the named input image, writing the result to the
+//! named output image, a band of output rows at a time. The bands are
+//! as tall as the budget allows; each is computed from the input rows
+//! it depends on (see imgproc_pipeline_input_rows), which are read as
+//! the bands move down the image, and is written as soon as it is
+//! done (see image.h for how the files are read and written). So
+//! the pixels in memory at once are about a band of input and output
+//! rows, whatever the size of the image. The input is decoded with the
+//! given IMG_READ_* flags. Returns IMG_SUCCESS or one of the IMG_ERR_*
+//! values.
+int imgproc_ooc_run( const char *input_filename, const char *output_filename,
+                     const struct ImgprocStage *stages, int num_stages, int read_flags );
+
+#endif // IMGPROC_OOC_H
@@ -0,0 +1,507 @@
+// Pipelines of image transformations. Runs of consecutive stages that
+// only do per-component arithmetic are executed on the planar layout,
+// so the packed <-> planar conversions are amortized over the run.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "imgproc.h"
+#include "imgproc_planar.h"
+#include "imgproc_pipeline.h"
+#include "imgtrace.h"
+#include "imgjob.h"
+
+static const char *const s_op_names[IMGPROC_NUM_OPS] = {
+  "squash", "color_rot", "blur", "expand", "gaussian", "crop",
+};
+
+const char *imgproc_op_name( enum ImgprocOp op ) {
+  return s_op_names[op];
+}
+
+// Output rows transformed per call when a stage of a job is split so
+// the job can be checked during the stage
+#define JOB_CHUNK_ROWS 1024
+
+// Blur chunks are at least this many times blur_dist rows, so the rows
+// blurred again around each chunk add little to the work
+#define JOB_CHUNK_BLUR_DISTS 32
+
+// Whether op has a planar version
+static int has_planar( enum ImgprocOp op ) {
+  return op != IMGPROC_OP_GAUSSIAN && op != IMGPROC_OP_CROP;
+}
+
+static void stage_dimensions( const struct ImgprocStage *stage, int32_t width, int32_t height,
+                              int32_t *out_w, int32_t *out_h ) {
+  switch (stage->op) {
+  case IMGPROC_OP_SQUASH:
+    *out_w = width / stage->xfac;
+    *out_h = height / stage->yfac;
+    break;
+  case IMGPROC_OP_EXPAND:
+    *out_w = width * 2;
+    *out_h = height * 2;
+    break;
+  case IMGPROC_OP_CROP:
+    *out_w = stage->x >= width ? 0 : (stage->w < width - stage->x ? stage->w : width - stage->x);
+    *out_h = stage->y >= height ? 0 : (stage->h < height - stage->y ? stage->h : height - stage->y);
+    break;
+  default:
+    *out_w = width;
+    *out_h = height;
+    break;
+  }
+}
+
+int imgproc_parse_stages( int argc, char **argv, struct ImgprocStage *stages, int max_stages ) {
+  int num_stages = 0;
+  int i = 0;
+
+  while (i < argc) {
+    if (num_stages == max_stages) {
+      return -1;
+    }
+    struct ImgprocStage *stage = &stages[num_stages++];
+    memset(stage, 0, sizeof(*stage));
+    const char *name = argv[i++];
+
+    if (strcmp(name, "squash") == 0) {
+      stage->op = IMGPROC_OP_SQUASH;
+      if (i + 2 > argc
+          || sscanf(argv[i], "%d", &stage->xfac) != 1
+          || sscanf(argv[i + 1], "%d", &stage->yfac) != 1
+          || stage->xfac < 1 || stage->yfac < 1) {
+        return -1;
+      }
+      i += 2;
+    } else if (strcmp(name, "color_rot") == 0) {
+      stage->op = IMGPROC_OP_COLOR_ROT;
+    } else if (strcmp(name, "blur") == 0) {
+      stage->op = IMGPROC_OP_BLUR;
+      if (i + 1 > argc || sscanf(argv[i], "%d", &stage->blur_dist) != 1) {
+        return -1;
+      }
+      i++;
+    } else if (strcmp(name, "expand") == 0) {
+      stage->op = IMGPROC_OP_EXPAND;
+    } else if (strcmp(name, "crop") == 0) {
+      stage->op = IMGPROC_OP_CROP;
+      if (i + 4 > argc
+          || sscanf(argv[i], "%d", &stage->x) != 1
+          || sscanf(argv[i + 1], "%d", &stage->y) != 1
+          || sscanf(argv[i + 2], "%d", &stage->w) != 1
+          || sscanf(argv[i + 3], "%d", &stage->h) != 1
+          || stage->x < 0 || stage->y < 0 || stage->w < 1 || stage->h < 1) {
+        return -1;
+      }
+      i += 4;
+    } else if (strcmp(name, "gaussian") == 0) {
+      stage->op = IMGPROC_OP_GAUSSIAN;
+      if (i + 1 > argc || sscanf(argv[i], "%lf", &stage->sigma) != 1
+          || !isfinite(stage->sigma) || stage->sigma < 0.0) {
+        return -1;
+      }
+      i++;
+    } else {
+      return -1;
+    }
+  }
+
+  return num_stages;
+}
+
+void imgproc_pipeline_dimensions( const struct ImgprocStage *stages, int num_stages,
+                                  int32_t width, int32_t height, int32_t *out_w, int32_t *out_h ) {
+  for (int i = 0; i < num_stages; i++) {
+    stage_dimensions(&stages[i], width, height, &width, &height);
+  }
+  *out_w = width;
+  *out_h = height;
+}
+
+// Apply one stage to a packed image
+static int apply_packed_stage( const struct ImgprocStage *stage, struct Image *in, struct Image *out ) {
+  switch (stage->op) {
+  case IMGPROC_OP_SQUASH:
+    imgproc_squash(in, out, stage->xfac, stage->yfac);
+    return 1;
+  case IMGPROC_OP_COLOR_ROT:
+    imgproc_color_rot(in, out);
+    return 1;
+  case IMGPROC_OP_BLUR:
+    imgproc_blur(in, out, stage->blur_dist);
+    return 1;
+  case IMGPROC_OP_EXPAND:
+    imgproc_expand(in, out);
+    return 1;
+  case IMGPROC_OP_GAUSSIAN:
+    return imgproc_gaussian(in, out, stage->sigma);
+  case IMGPROC_OP_CROP:
+    for (int32_t i = 0; i < out->height; i++) {
+      memcpy(out->data + (size_t) i * out->width,
+             in->data + (size_t) (stage->y + i) * in->width + stage->x,
+             sizeof(uint32_t) * out->width);
+    }
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+// A view of rows [row, row + rows) of img
+static struct Image row_view( struct Image *img, int32_t row, int32_t rows ) {
+  struct Image view = { .width = img->width, .height = rows, .data = img->data + (size_t) row * img->width };
+  return view;
+}
+
+// Apply a squash, color_rot, blur or expand stage a chunk of output rows
+// at a time, on views of the rows of in and out each chunk needs, and
+// stop early once the current job is stopped. The imgproc_* functions of
+// the assembly build are single loops, so this is what lets a job be
+// stopped during such a stage. Returns 1 if successful (or stopped), 0
+// if memory couldn't be allocated.
+static int apply_stage_in_chunks( const struct ImgprocStage *stage, struct Image *in, struct Image *out ) {
+  int32_t height = out->height;
+  int64_t chunk_rows = JOB_CHUNK_ROWS;
+  if (stage->op == IMGPROC_OP_BLUR && JOB_CHUNK_BLUR_DISTS * (int64_t) stage->blur_dist > chunk_rows) {
+    chunk_rows = JOB_CHUNK_BLUR_DISTS * (int64_t) stage->blur_dist;
+  }
+  if (chunk_rows >= height) {
+    return apply_packed_stage(stage, in, out);
+  }
+
+  // A chunk's blur also writes the blur_dist rows above it (as if they
+  // were at the top of the image), so the previous chunk's rows there
+  // are kept and put back
+  int32_t dist = stage->op == IMGPROC_OP_BLUR && stage->blur_dist > 0 ? stage->blur_dist : 0;
+  size_t row_size = (size_t) out->width * sizeof(uint32_t);
+  uint32_t *kept = NULL;
+  if (dist > 0 && (kept = malloc((size_t) dist * row_size)) == NULL) {
+    return 0;
+  }
+
+  for (int32_t r0 = 0; r0 < height && !imgjob_check(); r0 = (int32_t) (r0 + chunk_rows)) {
+    int32_t r1 = r0 + chunk_rows < height ? (int32_t) (r0 + chunk_rows) : height;
+    struct Image in_rows, out_rows;
+
+    switch (stage->op) {
+    case IMGPROC_OP_SQUASH: {
+      int64_t first = (int64_t) r0 * stage->yfac;
+      int64_t last = (int64_t) r1 * stage->yfac < in->height ? (int64_t) r1 * stage->yfac : in->height;
+      in_rows = row_view(in, (int32_t) first, (int32_t) (last - first));
+      out_rows = row_view(out, r0, r1 - r0);
+      imgproc_squash(&in_rows, &out_rows, stage->xfac, stage->yfac);
+      break;
+    }
+    case IMGPROC_OP_COLOR_ROT:
+      in_rows = row_view(in, r0, r1 - r0);
+      out_rows = row_view(out, r0, r1 - r0);
+      imgproc_color_rot(&in_rows, &out_rows);
+      break;
+    case IMGPROC_OP_BLUR: {
+      int32_t lo = r0 - dist > 0 ? r0 - dist : 0;
+      int32_t hi = r1 + (int64_t) dist < height ? r1 + dist : height;
+      memcpy(kept, out->data + (size_t) lo * out->width, (size_t) (r0 - lo) * row_size);
+      in_rows = row_view(in, lo, hi - lo);
+      out_rows = row_view(out, lo, hi - lo);
+      imgproc_blur(&in_rows, &out_rows, stage->blur_dist);
+      memcpy(out->data + (size_t) lo * out->width, kept, (size_t) (r0 - lo) * row_size);
+      break;
+    }
+    case IMGPROC_OP_EXPAND: {
+      // (chunks start on even rows; the last two rows of a chunk are
+      // expanded as if they were at the bottom of the image, and
+      // written again by the next chunk)
+      int32_t first = r0 / 2;
+      int32_t last = r1 / 2 + 1 < in->height ? r1 / 2 + 1 : in->height;
+      in_rows = row_view(in, first, last - first);
+      out_rows = row_view(out, r0, 2 * (last - first));
+      imgproc_expand(&in_rows, &out_rows);
+      break;
+    }
+    default:
+      free(kept);
+      return apply_packed_stage(stage, in, out);
+    }
+  }
+
+  free(kept);
+  return 1;
+}
+
+static int run_packed_stage( const struct ImgprocStage *stage, struct Image *in, struct Image *out ) {
+  imgtrace_begin(s_op_names[stage->op], -1);
+  // Stages of a job are split into chunks, so the job can be stopped
+  // during them
+  int ok = imgjob_current() != NULL ? apply_stage_in_chunks(stage, in, out) : apply_packed_stage(stage, in, out);
+  imgtrace_end(s_op_names[stage->op]);
+  imgjob_step_done(imgjob_current());
+  return ok;
+}
+
+// Apply a run of stages that all have planar versions to the packed
+// image in, converting the result back into the packed image out
+static int run_planar_stages( const struct ImgprocStage *stages, int num_stages,
+                              struct Image *in, struct Image *out ) {
+  struct PlanarImage cur, next;
+  if (planar_init(&cur, in->width, in->height) != IMG_SUCCESS) {
+    return 0;
+  }
+  imgtrace_begin("to planar", -1);
+  planar_from_packed(in, &cur);
+  imgtrace_end("to planar");
+
+  for (int i = 0; i < num_stages; i++) {
+    const struct ImgprocStage *stage = &stages[i];
+
+    // Stop between stages once the current job is stopped
+    if (imgjob_check()) {
+      planar_cleanup(&cur);
+      return 0;
+    }
+
+    // Color rotation just permutes the planes
+    if (stage->op == IMGPROC_OP_COLOR_ROT) {
+      imgtrace_begin("color_rot", -1);
+      planar_color_rot(&cur, &cur);
+      imgtrace_end("color_rot");
+      imgjob_step_done(imgjob_current());
+      continue;
+    }
+
+    int32_t w, h;
+    stage_dimensions(stage, cur.width, cur.height, &w, &h);
+    if (planar_init(&next, w, h) != IMG_SUCCESS) {
+      planar_cleanup(&cur);
+      return 0;
+    }
+
+    int ok = 1;
+    imgtrace_begin(s_op_names[stage->op], -1);
+    switch (stage->op) {
+    case IMGPROC_OP_SQUASH:
+      planar_squash(&cur, &next, stage->xfac, stage->yfac);
+      break;
+    case IMGPROC_OP_BLUR:
+      ok = planar_blur(&cur, &next, stage->blur_dist);
+      break;
+    case IMGPROC_OP_EXPAND:
+      planar_expand(&cur, &next);
+      break;
+    default:
+      ok = 0;
+      break;
+    }
+    imgtrace_end(s_op_names[stage->op]);
+    imgjob_step_done(imgjob_current());
+
+    planar_cleanup(&cur);
+    cur = next;
+    if (!ok) {
+      planar_cleanup(&cur);
+      return 0;
+    }
+  }
+
+  imgtrace_begin("to packed", -1);
+  planar_to_packed(&cur, out);
+  imgtrace_end("to packed");
+  planar_cleanup(&cur);
+  return 1;
+}
+
+int imgproc_pipeline_run( struct Image *input_img, struct Image *output_img,
+                          const struct ImgprocStage *stages, int num_stages ) {
+  if (num_stages == 0) {
+    memcpy(output_img->data, input_img->data, sizeof(uint32_t) * input_img->width * input_img->height);
+    return IMG_SUCCESS;
+  }
+
+  // cur is the input of the next stage; it is only freed here if it
+  // is an intermediate image
+  struct Image cur = *input_img;
+  int cur_owned = 0;
+  int i = 0;
+
+  while (i < num_stages) {
+    // Find the run of stages starting at i that can be done planar
+    int end = i;
+    while (end < num_stages && has_planar(stages[end].op)) {
+      end++;
+    }
+    // A single stage isn't worth converting for
+    if (end - i < 2) {
+      end = i + 1;
+    }
+
+    struct Image next;
+    if (end == num_stages) {
+      next = *output_img;
+    } else {
+      int32_t w, h;
+      imgproc_pipeline_dimensions(stages + i, end - i, cur.width, cur.height, &w, &h);
+      if (img_init(&next, w, h) != IMG_SUCCESS) {
+        if (cur_owned) { img_cleanup(&cur); }
+        return IMG_ERR_MALLOC_FAILED;
+      }
+    }
+
+    int ok = end - i >= 2 ? run_planar_stages(stages + i, end - i, &cur, &next)
+                          : run_packed_stage(&stages[i], &cur, &next);
+
+    if (cur_owned) {
+      img_cleanup(&cur);
+    }
+    // A stopped job's stages may have skipped bands, or not have run
+    if (!ok || imgjob_check()) {
+      if (end != num_stages) { img_cleanup(&next); }
+      return imgjob_check() ? IMG_ERR_CANCELLED : IMG_ERR_MALLOC_FAILED;
+    }
+    cur = next;
+    cur_owned = end != num_stages;
+    i = end;
+  }
+
+  return IMG_SUCCESS;
+}
+
+// Rows [begin, end) of one of the images between the stages of a pipeline
+struct RowRange {
+  int32_t begin, end;
+};
+
+// Work out which rows of each stage's input the output rows
+// [out_begin, out_end) depend on: ranges[i] for the input of stage i,
+// and ranges[num_stages] for the output rows themselves. Also return
+// the input dimensions of each stage in widths and heights.
+static void band_ranges( const struct ImgprocStage *stages, int num_stages, int32_t width, int32_t height,
+                         int32_t out_begin, int32_t out_end, struct RowRange *ranges,
+                         int32_t *widths, int32_t *heights ) {
+  widths[0] = width;
+  heights[0] = height;
+  for (int i = 0; i < num_stages; i++) {
+    stage_dimensions(&stages[i], widths[i], heights[i], &widths[i + 1], &heights[i + 1]);
+  }
+
+  ranges[num_stages].begin = out_begin;
+  ranges[num_stages].end = out_end;
+  for (int i = num_stages - 1; i >= 0; i--) {
+    const struct ImgprocStage *stage = &stages[i];
+    int64_t begin = ranges[i + 1].begin;
+    int64_t end = ranges[i + 1].end;
+    int32_t radii[3];
+
+    switch (stage->op) {
+    case IMGPROC_OP_SQUASH:
+      begin *= stage->yfac;
+      end *= stage->yfac;
+      break;
+    case IMGPROC_OP_BLUR:
+      begin -= stage->blur_dist;
+      end += stage->blur_dist;
+      break;
+    case IMGPROC_OP_GAUSSIAN:
+      // each of the box passes reaches a radius further
+      gaussian_box_radii(stage->sigma, radii);
+      begin -= (int64_t) radii[0] + radii[1] + radii[2];
+      end += (int64_t) radii[0] + radii[1] + radii[2];
+      break;
+    case IMGPROC_OP_EXPAND:
+      // odd output rows also need the input row below
+      end = end > begin ? (end - 1) / 2 + 2 : begin / 2;
+      begin /= 2;
+      break;
+    case IMGPROC_OP_CROP:
+      begin += stage->y;
+      end += stage->y;
+      break;
+    default:
+      break;
+    }
+
+    ranges[i].begin = (int32_t) (begin < 0 ? 0 : begin > heights[i] ? heights[i] : begin);
+    ranges[i].end = (int32_t) (end < ranges[i].begin ? ranges[i].begin : end > heights[i] ? heights[i] : end);
+  }
+}
+
+void imgproc_pipeline_input_rows( const struct ImgprocStage *stages, int num_stages, int32_t width, int32_t height,
+                                  int32_t out_begin, int32_t out_end, int32_t *in_begin, int32_t *in_end,
+                                  size_t *bytes ) {
+  struct RowRange ranges[IMGPROC_MAX_STAGES + 1];
+  int32_t widths[IMGPROC_MAX_STAGES + 1], heights[IMGPROC_MAX_STAGES + 1];
+  band_ranges(stages, num_stages, width, height, out_begin, out_end, ranges, widths, heights);
+  *in_begin = ranges[0].begin;
+  *in_end = ranges[0].end;
+
+  // Each stage's input and output images exist at the same time
+  size_t peak = 0;
+  for (int i = 0; i < num_stages; i++) {
+    int32_t w, h;
+    stage_dimensions(&stages[i], widths[i], ranges[i].end - ranges[i].begin, &w, &h);
+    size_t stage_bytes = ((size_t) widths[i] * (ranges[i].end - ranges[i].begin) + (size_t) w * h) * sizeof(uint32_t);
+    if (stage_bytes > peak) {
+      peak = stage_bytes;
+    }
+  }
+  *bytes = peak;
+}
+
+int imgproc_pipeline_run_rows( struct Image *in_rows, int32_t height, const struct ImgprocStage *stages,
+                               int num_stages, int32_t out_begin, int32_t out_end, struct Image *output_img ) {
+  struct RowRange ranges[IMGPROC_MAX_STAGES + 1];
+  int32_t widths[IMGPROC_MAX_STAGES + 1], heights[IMGPROC_MAX_STAGES + 1];
+  band_ranges(stages, num_stages, in_rows->width, height, out_begin, out_end, ranges, widths, heights);
+
+  // cur holds exactly the rows ranges[i] of the input of stage i; it
+  // points into owned (unless it is in_rows)
+  struct Image cur = *in_rows;
+  struct Image owned;
+  int have_owned = 0;
+
+  for (int i = 0; i < num_stages; i++) {
+    // Row ranges[i].begin of the stage's input becomes row first of its
+    // output, and the rows the next stage needs are then picked out. A
+    // crop only has to keep those rows.
+    struct ImgprocStage stage = stages[i];
+    int32_t first = ranges[i].begin;
+    if (stage.op == IMGPROC_OP_SQUASH) {
+      first /= stage.yfac;
+    } else if (stage.op == IMGPROC_OP_EXPAND) {
+      first *= 2;
+    } else if (stage.op == IMGPROC_OP_CROP) {
+      stage.y = 0;
+      stage.h = ranges[i + 1].end - ranges[i + 1].begin;
+      first = ranges[i + 1].begin;
+    }
+
+    int32_t w, h;
+    struct Image next;
+    stage_dimensions(&stage, cur.width, cur.height, &w, &h);
+    if (img_init(&next, w, h) != IMG_SUCCESS) {
+      if (have_owned) { img_cleanup(&owned); }
+      return IMG_ERR_MALLOC_FAILED;
+    }
+    int ok = run_packed_stage(&stage, &cur, &next);
+    if (have_owned) {
+      img_cleanup(&owned);
+    }
+    owned = next;
+    have_owned = 1;
+    if (!ok || imgjob_check()) {
+      img_cleanup(&owned);
+      return imgjob_check() ? IMG_ERR_CANCELLED : IMG_ERR_MALLOC_FAILED;
+    }
+
+    cur = next;
+    cur.data += (size_t) (ranges[i + 1].begin - first) * w;
+    cur.height = ranges[i + 1].end - ranges[i + 1].begin;
+  }
+
+  memcpy(output_img->data, cur.data, sizeof(uint32_t) * cur.width * cur.height);
+  if (have_owned) {
+    img_cleanup(&owned);
+  }
+  return IMG_SUCCESS;
+}
@@ -0,0 +1,90 @@
+// Header for running a sequence of image transformations (a pipeline)
+// on one image, choosing the pixel layout used by each stage.
+
+#ifndef IMGPROC_PIPELINE_H
+#define IMGPROC_PIPELINE_H
+
+#include "image.h" // for struct Image and the IMG_* return values
+
+//! Maximum number of stages in one pipeline
+#define IMGPROC_MAX_STAGES 64
+
+//! Most words a stage takes in the stage arguments, its name included
+//! (crop x y w h)
+#define IMGPROC_MAX_STAGE_WORDS 5
+
+//! The transformations a pipeline stage can apply
+enum ImgprocOp {
+  IMGPROC_OP_SQUASH,
+  IMGPROC_OP_COLOR_ROT,
+  IMGPROC_OP_BLUR,
+  IMGPROC_OP_EXPAND,
+  IMGPROC_OP_GAUSSIAN,
+  IMGPROC_OP_CROP,
+  IMGPROC_NUM_OPS
+};
+
+//! One stage of a pipeline and its arguments
+struct ImgprocStage {
+  enum ImgprocOp op;
+  int32_t xfac, yfac;   // squash
+  int32_t blur_dist;    // blur
+  double sigma;         // gaussian
+  int32_t x, y, w, h;   // crop: the region kept (clipped to the image)
+};
+
+//! The name of an op, as in the stage arguments (e.g. "color_rot")
+const char *imgproc_op_name( enum ImgprocOp op );
+
+//! Parse stages from command line style arguments, e.g.
+//! "blur 3 expand squash 2 1 crop 10 20 100 50" (crop takes the x and
+//! y of the region's top left pixel and its width and height). Returns
+//! the number of stages parsed, or -1 if the arguments are invalid or
+//! there are more than max_stages stages.
+int imgproc_parse_stages( int argc, char **argv, struct ImgprocStage *stages, int max_stages );
+
+//! Compute the dimensions of the image produced by running the stages
+//! on an image with the given dimensions.
+void imgproc_pipeline_dimensions( const struct ImgprocStage *stages, int num_stages,
+                                  int32_t width, int32_t height, int32_t *out_w, int32_t *out_h );
+
+//! Run the stages on input_img, storing the result in output_img, which
+//! must already be initialized with the dimensions computed by
+//! imgproc_pipeline_dimensions. Each run of two or more consecutive
+//! stages that have planar versions (squash, color_rot, blur and expand)
+//! is done on a planar copy of the image, so the image is converted
+//! from and to the packed layout once per run rather than once per
+//! stage; other stages work on the packed layout.
+//! Each stage is a step of the current job (see imgjob.h), which is
+//! checked between stages, and during the squash, color_rot, blur and
+//! expand stages done on the packed layout, which are then run a chunk
+//! of rows at a time (the imgproc_* functions of the assembly build
+//! can't be stopped otherwise).
+//! Returns IMG_SUCCESS, IMG_ERR_MALLOC_FAILED if memory for the
+//! intermediate images couldn't be allocated, or IMG_ERR_CANCELLED if
+//! the current job was stopped (output_img then holds partial results).
+int imgproc_pipeline_run( struct Image *input_img, struct Image *output_img,
+                          const struct ImgprocStage *stages, int num_stages );
+
+//! For running the stages on an image a band of rows at a time:
+//! compute the rows [*in_begin, *in_end) of an input image of the
+//! given dimensions that rows [out_begin, out_end) of the output
+//! depend on (e.g. for a blur, the rows blur_dist above and below as
+//! well), and in *bytes an estimate of the memory that
+//! imgproc_pipeline_run_rows needs for the intermediate images.
+void imgproc_pipeline_input_rows( const struct ImgprocStage *stages, int num_stages, int32_t width, int32_t height,
+                                  int32_t out_begin, int32_t out_end, int32_t *in_begin, int32_t *in_end,
+                                  size_t *bytes );
+
+//! Compute rows [out_begin, out_end) of the output of the stages for an
+//! input image with the given height, from just the input rows
+//! computed by imgproc_pipeline_input_rows, which are in in_rows. The
+//! rows are the same as those computed by imgproc_pipeline_run for the
+//! whole image. output_img must be initialized with the output width
+//! and out_end - out_begin rows. Returns IMG_SUCCESS,
+//! IMG_ERR_MALLOC_FAILED if memory for the intermediate images couldn't
+//! be allocated, or IMG_ERR_CANCELLED if the current job was stopped.
+int imgproc_pipeline_run_rows( struct Image *in_rows, int32_t height, const struct ImgprocStage *stages,
+                               int num_stages, int32_t out_begin, int32_t out_end, struct Image *output_img );
+
+#endif // IMGPROC_PIPELINE_H
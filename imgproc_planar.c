@@ -0,0 +1,283 @@
+// Planar (structure of arrays) image layout and the image
+// transformations on it. Keeping each color component in its own
+// 8-bit plane means the per-component arithmetic of blur and expand
+// needs no shifts or masks, blur can skip the alpha plane entirely,
+// and the loops vectorize over plain byte arrays.
+
+#include <stdlib.h>
+#include <string.h>
+#include "imgproc_planar.h"
+#include "imgproc_kernels.h"
+#include "parallel.h"
+#ifdef IMGPROC_HAVE_VEC
+#include "imgproc_vec.h"
+#endif
+
+// Context shared by the bands of one planar operation
+struct PlanarCall {
+  struct Image *packed;
+  struct PlanarImage *in;
+  struct PlanarImage *out;
+  int32_t arg;
+  int failed;      // set if a band couldn't allocate its buffers
+};
+
+int planar_init( struct PlanarImage *img, int32_t width, int32_t height ) {
+  int32_t stride = (width + PLANAR_ALIGN - 1) / PLANAR_ALIGN * PLANAR_ALIGN;
+  size_t plane_size = (size_t) stride * height;
+  void *buf = NULL;
+
+  // Always allocate something, so that empty images are valid too
+  if (posix_memalign(&buf, PLANAR_ALIGN, 4 * plane_size + PLANAR_ALIGN) != 0) {
+    return IMG_ERR_MALLOC_FAILED;
+  }
+
+  img->width = width;
+  img->height = height;
+  img->stride = stride;
+  img->buf = buf;
+  for (int p = 0; p < 4; p++) {
+    img->plane[p] = (uint8_t *) buf + p * plane_size;
+  }
+  return IMG_SUCCESS;
+}
+
+void planar_cleanup( struct PlanarImage *img ) {
+  free(img->buf);
+  img->buf = NULL;
+}
+
+static void from_packed_band( void *ctx, int32_t begin, int32_t end ) {
+  const struct PlanarCall *call = ctx;
+  struct PlanarImage *dst = call->out;
+  int32_t width = dst->width;
+
+  for (int32_t row = begin; row < end; row++) {
+    const uint32_t *src = call->packed->data + (size_t) row * width;
+    size_t off = (size_t) row * dst->stride;
+    uint8_t *r = dst->plane[PLANE_R] + off;
+    uint8_t *g = dst->plane[PLANE_G] + off;
+    uint8_t *b = dst->plane[PLANE_B] + off;
+    uint8_t *a = dst->plane[PLANE_A] + off;
+    int32_t col = 0;
+#ifdef IMGPROC_HAVE_VEC
+    for (; col + VEC_LANES <= width; col += VEC_LANES) {
+      vec_u32 p = vec_load(src + col);
+      vec_store_u8(r + col, vec_get_r(p));
+      vec_store_u8(g + col, vec_get_g(p));
+      vec_store_u8(b + col, vec_get_b(p));
+      vec_store_u8(a + col, vec_get_a(p));
+    }
+#endif
+    for (; col < width; col++) {
+      r[col] = src[col] >> 24;
+      g[col] = src[col] >> 16;
+      b[col] = src[col] >> 8;
+      a[col] = src[col];
+    }
+  }
+}
+
+static void to_packed_band( void *ctx, int32_t begin, int32_t end ) {
+  const struct PlanarCall *call = ctx;
+  struct PlanarImage *src = call->in;
+  int32_t width = src->width;
+
+  for (int32_t row = begin; row < end; row++) {
+    uint32_t *dst = call->packed->data + (size_t) row * width;
+    size_t off = (size_t) row * src->stride;
+    const uint8_t *r = src->plane[PLANE_R] + off;
+    const uint8_t *g = src->plane[PLANE_G] + off;
+    const uint8_t *b = src->plane[PLANE_B] + off;
+    const uint8_t *a = src->plane[PLANE_A] + off;
+    int32_t col = 0;
+#ifdef IMGPROC_HAVE_VEC
+    for (; col + VEC_LANES <= width; col += VEC_LANES) {
+      vec_store(dst + col, vec_make_pixel(vec_load_u8(r + col), vec_load_u8(g + col),
+                                          vec_load_u8(b + col), vec_load_u8(a + col)));
+    }
+#endif
+    for (; col < width; col++) {
+      dst[col] = ((uint32_t) r[col] << 24) | ((uint32_t) g[col] << 16) | ((uint32_t) b[col] << 8) | a[col];
+    }
+  }
+}
+
+void planar_from_packed( struct Image *src, struct PlanarImage *dst ) {
+  struct PlanarCall call = { src, NULL, dst, 0, 0 };
+  par_for(dst->height, from_packed_band, &call);
+}
+
+void planar_to_packed( struct PlanarImage *src, struct Image *dst ) {
+  struct PlanarCall call = { dst, src, NULL, 0, 0 };
+  par_for(src->height, to_packed_band, &call);
+}
+
+void planar_squash( struct PlanarImage *input_img, struct PlanarImage *output_img, int32_t xfac, int32_t yfac ) {
+  // Only output pixels whose sampled input pixel is in bounds are written
+  int32_t ncols = (input_img->width + xfac - 1) / xfac;
+  if (ncols > output_img->width) { ncols = output_img->width; }
+
+  for (int p = 0; p < 4; p++) {
+    for (int32_t row = 0; row < output_img->height; row++) {
+      int64_t input_row = (int64_t) row * yfac;
+      if (input_row >= input_img->height) {
+        break;
+      }
+      const uint8_t *src = input_img->plane[p] + input_row * input_img->stride;
+      uint8_t *dst = output_img->plane[p] + (size_t) row * output_img->stride;
+      for (int32_t col = 0; col < ncols; col++) {
+        dst[col] = src[(size_t) col * xfac];
+      }
+    }
+  }
+}
+
+void planar_color_rot( struct PlanarImage *input_img, struct PlanarImage *output_img ) {
+  // The new red values are the old blue values, the new green values
+  // the old red values, and the new blue values the old green values
+  if (input_img == output_img) {
+    uint8_t *red = input_img->plane[PLANE_R];
+    input_img->plane[PLANE_R] = input_img->plane[PLANE_B];
+    input_img->plane[PLANE_B] = input_img->plane[PLANE_G];
+    input_img->plane[PLANE_G] = red;
+    return;
+  }
+
+  size_t plane_size = (size_t) input_img->stride * input_img->height;
+  memcpy(output_img->plane[PLANE_R], input_img->plane[PLANE_B], plane_size);
+  memcpy(output_img->plane[PLANE_G], input_img->plane[PLANE_R], plane_size);
+  memcpy(output_img->plane[PLANE_B], input_img->plane[PLANE_G], plane_size);
+  memcpy(output_img->plane[PLANE_A], input_img->plane[PLANE_A], plane_size);
+}
+
+// Blur rows [begin, end) of the r, g and b planes. Like the SIMD
+// kernels, this keeps running per-column sums of the rows in the
+// vertical window and uses their prefix sums for the horizontal window.
+static void blur_band( void *ctx, int32_t begin, int32_t end ) {
+  const struct PlanarCall *call = ctx;
+  const struct PlanarImage *in = call->in;
+  struct PlanarImage *out = call->out;
+  int32_t width = in->width;
+  int32_t height = in->height;
+  int32_t dist = call->arg;
+
+  size_t ext_len = (size_t) width + 2 * (size_t) dist + 1;
+  uint32_t *col_sum = malloc(sizeof(uint32_t) * (width + ext_len));
+  if (col_sum == NULL) {
+    __atomic_store_n(&((struct PlanarCall *) ctx)->failed, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  uint32_t *ext = col_sum + width;
+
+  for (int p = PLANE_R; p <= PLANE_B; p++) {
+    const uint8_t *src = in->plane[p];
+    uint8_t *dst = out->plane[p];
+
+    memset(col_sum, 0, sizeof(uint32_t) * width);
+    int32_t first = begin - dist < 0 ? 0 : begin - dist;
+    int32_t last = begin + dist > height - 1 ? height - 1 : begin + dist;
+    for (int32_t r = first; r <= last; r++) {
+      const uint8_t *line = src + (size_t) r * in->stride;
+      for (int32_t c = 0; c < width; c++) {
+        col_sum[c] += line[c];
+      }
+    }
+
+    for (int32_t row = begin; row < end; row++) {
+      int32_t lo = row - dist < 0 ? 0 : row - dist;
+      int32_t hi = row + dist > height - 1 ? height - 1 : row + dist;
+      uint32_t nrows = hi - lo + 1;
+
+      imgproc_kernels_prefix_sums(col_sum, width, dist, ext);
+      uint8_t *line = dst + (size_t) row * out->stride;
+      for (int32_t c = 0; c < width; c++) {
+        int32_t c_lo = c - dist < 0 ? 0 : c - dist;
+        int32_t c_hi = c + dist > width - 1 ? width - 1 : c + dist;
+        uint32_t count = nrows * (uint32_t) (c_hi - c_lo + 1);
+        line[c] = (ext[c + 2 * (size_t) dist + 1] - ext[c]) / count;
+      }
+
+      // Slide the vertical window down one row
+      if (row + 1 < end) {
+        if (row + dist + 1 < height) {
+          const uint8_t *enter = src + (size_t) (row + dist + 1) * in->stride;
+          for (int32_t c = 0; c < width; c++) {
+            col_sum[c] += enter[c];
+          }
+        }
+        if (row - dist >= 0) {
+          const uint8_t *leave = src + (size_t) (row - dist) * in->stride;
+          for (int32_t c = 0; c < width; c++) {
+            col_sum[c] -= leave[c];
+          }
+        }
+      }
+    }
+  }
+
+  free(col_sum);
+}
+
+int planar_blur( struct PlanarImage *input_img, struct PlanarImage *output_img, int32_t blur_dist ) {
+  int32_t width = input_img->width;
+  int32_t height = input_img->height;
+  if (width <= 0 || height <= 0) {
+    return 1;
+  }
+
+  // Windows larger than the image cover all of it anyway
+  int32_t dist = blur_dist < 0 ? 0 : blur_dist;
+  int32_t max_dim = width > height ? width : height;
+  if (dist > max_dim) { dist = max_dim; }
+
+  // The alpha values are unchanged
+  memcpy(output_img->plane[PLANE_A], input_img->plane[PLANE_A], (size_t) input_img->stride * height);
+
+  struct PlanarCall call = { NULL, input_img, output_img, dist, 0 };
+  par_for(height, blur_band, &call);
+  return !call.failed;
+}
+
+// Expand output rows [begin, end) of all four planes
+static void expand_band( void *ctx, int32_t begin, int32_t end ) {
+  const struct PlanarCall *call = ctx;
+  const struct PlanarImage *in = call->in;
+  struct PlanarImage *out = call->out;
+  int32_t width = in->width;
+
+  for (int p = 0; p < 4; p++) {
+    for (int32_t row = begin; row < end; row++) {
+      const uint8_t *top = in->plane[p] + (size_t) (row / 2) * in->stride;
+      // For the last input row, the row below is the row itself, which
+      // makes every average include only in-bounds pixels
+      const uint8_t *bottom = row / 2 + 1 < in->height ? top + in->stride : top;
+      uint8_t *dst = out->plane[p] + (size_t) row * out->stride;
+
+      if (row % 2 == 0) {
+        for (int32_t c = 0; c + 1 < width; c++) {
+          dst[2 * c] = top[c];
+          dst[2 * c + 1] = (top[c] + top[c + 1]) >> 1;
+        }
+      } else {
+        for (int32_t c = 0; c + 1 < width; c++) {
+          dst[2 * c] = (top[c] + bottom[c]) >> 1;
+          dst[2 * c + 1] = (top[c] + top[c + 1] + bottom[c] + bottom[c + 1]) >> 2;
+        }
+      }
+
+      // The last column has no right neighbour
+      if (width > 0) {
+        int32_t c = width - 1;
+        uint8_t v = row % 2 == 0 ? top[c] : (top[c] + bottom[c]) >> 1;
+        dst[2 * c] = v;
+        dst[2 * c + 1] = v;
+      }
+    }
+  }
+}
+
+void planar_expand( struct PlanarImage *input_img, struct PlanarImage *output_img ) {
+  struct PlanarCall call = { NULL, input_img, output_img, 0, 0 };
+  par_for(output_img->height, expand_band, &call);
+}
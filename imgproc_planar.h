@@ -0,0 +1,54 @@
+// Header for the planar (structure of arrays) image layout, the
+// converters between it and the packed struct Image layout, and the
+// versions of the image transformations that work on planar images.
+
+#ifndef IMGPROC_PLANAR_H
+#define IMGPROC_PLANAR_H
+
+#include "image.h" // for struct Image and the IMG_* return values
+
+//! Indices of the color component planes of a PlanarImage
+#define PLANE_R 0
+#define PLANE_G 1
+#define PLANE_B 2
+#define PLANE_A 3
+
+//! Alignment (in bytes) of every plane row
+#define PLANAR_ALIGN 64
+
+//! An image stored as four separate 8-bit planes, one per color
+//! component. Row r of plane p starts at plane[p] + r * stride, and
+//! stride is a multiple of PLANAR_ALIGN, so every row is aligned.
+//! The planes share one allocation that belongs to the image.
+struct PlanarImage {
+  int32_t width;
+  int32_t height;
+  int32_t stride;
+  uint8_t *plane[4];
+  void *buf;
+};
+
+//! Initialize a planar image of the given dimensions (contents are
+//! uninitialized). Returns IMG_SUCCESS or IMG_ERR_MALLOC_FAILED.
+int planar_init( struct PlanarImage *img, int32_t width, int32_t height );
+
+//! Free the planes of a planar image (not the struct itself).
+void planar_cleanup( struct PlanarImage *img );
+
+//! Convert between the packed and planar layouts. The destination must
+//! already be initialized with the same dimensions as the source.
+void planar_from_packed( struct Image *src, struct PlanarImage *dst );
+void planar_to_packed( struct PlanarImage *src, struct Image *dst );
+
+//! Planar versions of imgproc_squash, imgproc_color_rot, imgproc_blur
+//! and imgproc_expand, with exactly the same results. The output image
+//! must already be initialized with the output dimensions. color_rot
+//! may be done in place (input_img == output_img), in which case it
+//! just permutes the plane pointers. planar_blur returns 1 if
+//! successful, 0 if temporary buffers couldn't be allocated.
+void planar_squash( struct PlanarImage *input_img, struct PlanarImage *output_img, int32_t xfac, int32_t yfac );
+void planar_color_rot( struct PlanarImage *input_img, struct PlanarImage *output_img );
+int planar_blur( struct PlanarImage *input_img, struct PlanarImage *output_img, int32_t blur_dist );
+void planar_expand( struct PlanarImage *input_img, struct PlanarImage *output_img );
+
+#endif // IMGPROC_PLANAR_H
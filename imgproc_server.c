@@ -0,0 +1,593 @@
+// Image daemon serving requests on a local socket, with the images
+// passed in memfds, and its client side. Each client is served on a
+// thread of its own; the transforms of concurrent requests share the
+// work-stealing scheduler's workers through par_for.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "image.h"
+#include "imgjob.h"
+#include "imgproc_pipeline.h"
+#include "imgproc_server.h"
+#include "imgproc_stats.h"
+#include "imgtrace.h"
+
+// Maximum number of words in the stage arguments of a request
+#define SERVER_MAX_WORDS (IMGPROC_MAX_STAGE_WORDS * IMGPROC_MAX_STAGES)
+
+// Clients waiting to be accepted
+#define SERVER_BACKLOG 64
+
+struct ImgprocServer {
+  int listen_fd;
+  char *path;
+  int read_flags;
+  int stopped;                // set by imgproc_server_stop
+  struct ImgprocStats *stats;
+  pthread_mutex_t lock;       // protects num_clients
+  pthread_cond_t idle;        // signalled when num_clients drops to 0
+  int num_clients;
+};
+
+struct ServerClient {
+  struct ImgprocServer *server;
+  int fd;
+};
+
+////////////////////////////////////////////////////////////////////////
+// Messages and memfds
+////////////////////////////////////////////////////////////////////////
+
+// Send a message, with the descriptor pass_fd unless it is -1. Returns
+// 1 if successful, 0 if not.
+static int send_msg( int sock, const void *msg, size_t len, int pass_fd ) {
+  struct iovec iov = { (void *) msg, len };
+  union {
+    char buf[CMSG_SPACE( sizeof( int ) )];
+    struct cmsghdr align;
+  } control;
+  struct msghdr hdr;
+  memset( &hdr, 0, sizeof( hdr ) );
+  hdr.msg_iov = &iov;
+  hdr.msg_iovlen = 1;
+  if ( pass_fd >= 0 ) {
+    memset( &control, 0, sizeof( control ) );
+    hdr.msg_control = control.buf;
+    hdr.msg_controllen = sizeof( control.buf );
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR( &hdr );
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN( sizeof( int ) );
+    memcpy( CMSG_DATA( cmsg ), &pass_fd, sizeof( int ) );
+  }
+  ssize_t n;
+  do
+    n = sendmsg( sock, &hdr, MSG_NOSIGNAL );
+  while ( n < 0 && errno == EINTR );
+  return n == (ssize_t) len;
+}
+
+// Receive a message of exactly len bytes, and in *fd the descriptor
+// sent with it, or -1 if there is none. Any further descriptors are
+// closed. Returns 1 if a message was received, 0 at the end of the
+// connection, or -1 if the message is invalid or receiving failed.
+static int recv_msg( int sock, void *msg, size_t len, int *fd ) {
+  struct iovec iov = { msg, len };
+  union {
+    char buf[CMSG_SPACE( 4 * sizeof( int ) )];
+    struct cmsghdr align;
+  } control;
+  struct msghdr hdr;
+  memset( &hdr, 0, sizeof( hdr ) );
+  hdr.msg_iov = &iov;
+  hdr.msg_iovlen = 1;
+  hdr.msg_control = control.buf;
+  hdr.msg_controllen = sizeof( control.buf );
+
+  ssize_t n;
+  do
+    n = recvmsg( sock, &hdr, MSG_CMSG_CLOEXEC );
+  while ( n < 0 && errno == EINTR );
+
+  *fd = -1;
+  for ( struct cmsghdr *cmsg = CMSG_FIRSTHDR( &hdr ); n > 0 && cmsg != NULL; cmsg = CMSG_NXTHDR( &hdr, cmsg ) ) {
+    if ( cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS )
+      continue;
+    int num_fds = (int) ((cmsg->cmsg_len - CMSG_LEN( 0 )) / sizeof( int ));
+    for ( int i = 0; i < num_fds; i++ ) {
+      int received;
+      memcpy( &received, CMSG_DATA( cmsg ) + i * sizeof( int ), sizeof( int ) );
+      if ( *fd < 0 )
+        *fd = received;
+      else
+        close( received );
+    }
+  }
+
+  if ( n == 0 )
+    return 0;
+  if ( n != (ssize_t) len || (hdr.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) ) {
+    if ( *fd >= 0 )
+      close( *fd );
+    *fd = -1;
+    return -1;
+  }
+  return 1;
+}
+
+int imgproc_memfd_create( const char *name, size_t len ) {
+  int fd = memfd_create( name, MFD_CLOEXEC | MFD_ALLOW_SEALING );
+  if ( fd >= 0 && ftruncate( fd, (off_t) len ) != 0 ) {
+    close( fd );
+    fd = -1;
+  }
+  return fd;
+}
+
+int imgproc_memfd_seal( int fd, int write ) {
+  int seals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL | (write ? F_SEAL_WRITE : 0);
+  return fcntl( fd, F_ADD_SEALS, seals ) == 0;
+}
+
+// Write len bytes from buf to fd
+static int write_all( int fd, const void *buf, size_t len ) {
+  const unsigned char *p = buf;
+  while ( len > 0 ) {
+    ssize_t n = write( fd, p, len );
+    if ( n < 0 && errno == EINTR )
+      continue;
+    if ( n <= 0 )
+      return 0;
+    p += n;
+    len -= n;
+  }
+  return 1;
+}
+
+// Copy len bytes from the start of in_fd to out_fd in the kernel
+static int copy_fd( int out_fd, int in_fd, size_t len ) {
+  off_t offset = 0;
+  while ( (size_t) offset < len ) {
+    ssize_t n = sendfile( out_fd, in_fd, &offset, len - offset );
+    if ( n < 0 && errno == EINTR )
+      continue;
+    if ( n <= 0 )
+      return 0;
+  }
+  return 1;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Daemon
+////////////////////////////////////////////////////////////////////////
+
+// Whether format is an output format, and if so the name of a file in
+// that format (for img_write_mem_for) in filename
+static int format_filename( const char *format, char *filename, size_t size ) {
+  static const char *const formats[] = { "png", "rimg", "qoi", "timg" };
+  for ( size_t i = 0; i < sizeof( formats ) / sizeof( formats[0] ); i++ ) {
+    if ( strcmp( format, formats[i] ) == 0 ) {
+      snprintf( filename, size, "output.%s", format );
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Create a sealed memfd holding len bytes from buf
+static int memfd_with( const char *name, const void *buf, size_t len ) {
+  int fd = imgproc_memfd_create( name, 0 );
+  if ( fd >= 0 && (!write_all( fd, buf, len ) || !imgproc_memfd_seal( fd, 1 )) ) {
+    close( fd );
+    fd = -1;
+  }
+  return fd;
+}
+
+// Run the stages on input_img into a new memfd in the format of
+// filename. A .rimg image is computed straight into the memfd's shared
+// mapping; other formats are encoded and then written into the memfd.
+static int transform_to_memfd( const char *filename, struct Image *input_img, const struct ImgprocStage *stages,
+                               int num_stages, int *output_fd, size_t *output_len, uint64_t *encode_ns ) {
+  int32_t out_w, out_h;
+  imgproc_pipeline_dimensions( stages, num_stages, input_img->width, input_img->height, &out_w, &out_h );
+  struct Image output_img;
+  int rc;
+
+  if ( img_is_rimg( filename ) ) {
+    size_t len = img_rimg_size( out_w, out_h );
+    int fd = imgproc_memfd_create( "imgproc output", len );
+    if ( fd < 0 )
+      return IMG_ERR_MALLOC_FAILED;
+    void *map = mmap( NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    if ( map == MAP_FAILED ) {
+      close( fd );
+      return IMG_ERR_MALLOC_FAILED;
+    }
+    img_init_rimg_at( &output_img, out_w, out_h, map );
+    rc = imgproc_pipeline_run( input_img, &output_img, stages, num_stages );
+    uint64_t start = imgproc_stats_now();
+    if ( rc == IMG_SUCCESS )
+      img_finish_rimg_at( &output_img, map );
+    munmap( map, len );
+    if ( rc == IMG_SUCCESS && !imgproc_memfd_seal( fd, 1 ) )
+      rc = IMG_ERR_COULD_NOT_WRITE;
+    *encode_ns = imgproc_stats_now() - start;
+    if ( rc != IMG_SUCCESS ) {
+      close( fd );
+      return rc;
+    }
+    *output_fd = fd;
+    *output_len = len;
+    return IMG_SUCCESS;
+  }
+
+  rc = img_init( &output_img, out_w, out_h );
+  if ( rc != IMG_SUCCESS )
+    return rc;
+  rc = imgproc_pipeline_run( input_img, &output_img, stages, num_stages );
+  uint64_t start = imgproc_stats_now();
+  void *buf;
+  size_t len;
+  if ( rc == IMG_SUCCESS )
+    rc = img_write_mem_for( filename, &output_img, &buf, &len );
+  img_cleanup( &output_img );
+  if ( rc == IMG_SUCCESS ) {
+    *output_fd = memfd_with( "imgproc output", buf, len );
+    *output_len = len;
+    free( buf );
+    if ( *output_fd < 0 )
+      rc = IMG_ERR_COULD_NOT_WRITE;
+  }
+  *encode_ns = imgproc_stats_now() - start;
+  return rc;
+}
+
+// Serve a transform request, whose input is in the memfd input_fd
+static int serve_transform( struct ImgprocServer *server, struct ImgprocRequest *req, int input_fd,
+                            int *output_fd, size_t *output_len ) {
+  uint64_t start = imgproc_stats_now();
+  char filename[32];
+  char *words[SERVER_MAX_WORDS];
+  int num_words = 0;
+  char *save;
+  struct ImgprocStage stages[IMGPROC_MAX_STAGES];
+  req->format[sizeof( req->format ) - 1] = '\0';
+  req->args[sizeof( req->args ) - 1] = '\0';
+  char *word = strtok_r( req->args, " \t\n", &save );
+  for ( ; word != NULL && num_words < SERVER_MAX_WORDS; word = strtok_r( NULL, " \t\n", &save ) )
+    words[num_words++] = word;
+  // (a word left over is more than the most stages can take)
+  int num_stages = word == NULL ? imgproc_parse_stages( num_words, words, stages, IMGPROC_MAX_STAGES ) : -1;
+  if ( input_fd < 0 || num_stages < 0 || !format_filename( req->format, filename, sizeof( filename ) ) )
+    return IMGPROC_SERVER_BAD_REQUEST;
+
+  // The input must not shrink while it is mapped, or reading the
+  // mapping would fault
+  struct stat st;
+  int seals = fcntl( input_fd, F_GET_SEALS );
+  if ( seals < 0 || !(seals & F_SEAL_SHRINK) || fstat( input_fd, &st ) != 0 || st.st_size <= 0 )
+    return IMGPROC_SERVER_BAD_REQUEST;
+  size_t input_len = (size_t) st.st_size;
+  // (mapped privately, so the daemon never writes to the client's memory)
+  void *map = mmap( NULL, input_len, PROT_READ | PROT_WRITE, MAP_PRIVATE, input_fd, 0 );
+  if ( map == MAP_FAILED )
+    return IMG_ERR_COULD_NOT_OPEN;
+
+  int kind = imgproc_stats_kind( stages, num_stages );
+  struct ImgJob job;
+  imgjob_init( &job );
+  if ( req->timeout_ms > 0 )
+    imgjob_set_deadline( &job, start + (uint64_t) req->timeout_ms * 1000000 );
+  struct ImgJob *prev = imgjob_enter( &job );
+
+  struct Image input_img;
+  uint64_t pixels_in = 0, pixels_out = 0;
+  int rc = img_read_mapped( map, input_len, &input_img, server->read_flags );
+  uint64_t decoded = imgproc_stats_now();
+  if ( rc == IMG_SUCCESS ) {
+    imgproc_stats_record( server->stats, kind, STATS_DECODE, decoded - start );
+    int32_t out_w, out_h;
+    imgproc_pipeline_dimensions( stages, num_stages, input_img.width, input_img.height, &out_w, &out_h );
+    pixels_in = (uint64_t) input_img.width * input_img.height;
+    pixels_out = (uint64_t) out_w * out_h;
+    uint64_t encode_ns = 0;
+    rc = transform_to_memfd( filename, &input_img, stages, num_stages, output_fd, output_len, &encode_ns );
+    img_cleanup( &input_img );
+    if ( rc == IMG_SUCCESS ) {
+      uint64_t now = imgproc_stats_now();
+      imgproc_stats_record( server->stats, kind, STATS_TRANSFORM, now - decoded - encode_ns );
+      imgproc_stats_record( server->stats, kind, STATS_ENCODE, encode_ns );
+      imgproc_stats_record( server->stats, kind, STATS_TOTAL, now - start );
+    }
+  }
+
+  imgjob_enter( prev );
+  imgjob_cleanup( &job );
+  imgproc_stats_job( server->stats, kind, rc != IMG_SUCCESS, pixels_in, pixels_out, input_len,
+                     rc == IMG_SUCCESS ? *output_len : 0 );
+  return rc;
+}
+
+// Serve a statistics request
+static int serve_stats( struct ImgprocServer *server, int *output_fd, size_t *output_len ) {
+  char *text;
+  size_t len;
+  FILE *out = open_memstream( &text, &len );
+  if ( out == NULL )
+    return IMG_ERR_MALLOC_FAILED;
+  int ok = imgproc_stats_format( server->stats, out );
+  if ( fclose( out ) != 0 || !ok ) {
+    free( text );
+    return IMG_ERR_MALLOC_FAILED;
+  }
+  *output_fd = memfd_with( "imgproc stats", text, len );
+  *output_len = len;
+  free( text );
+  return *output_fd >= 0 ? IMG_SUCCESS : IMG_ERR_COULD_NOT_WRITE;
+}
+
+// Thread serving a client's requests until it disconnects
+static void *serve_client( void *arg ) {
+  struct ServerClient *client = arg;
+  struct ImgprocServer *server = client->server;
+  struct ImgprocRequest req;
+  int input_fd, got;
+
+  while ( (got = recv_msg( client->fd, &req, sizeof( req ), &input_fd )) != 0 ) {
+    struct ImgprocResponse resp = { IMGPROC_SERVER_MAGIC, IMGPROC_SERVER_BAD_REQUEST, 0 };
+    int output_fd = -1;
+    size_t output_len = 0;
+    if ( got > 0 && req.magic == IMGPROC_SERVER_MAGIC && req.version == IMGPROC_SERVER_VERSION ) {
+      imgtrace_begin( "request", req.type );
+      if ( req.type == IMGPROC_REQ_TRANSFORM )
+        resp.status = serve_transform( server, &req, input_fd, &output_fd, &output_len );
+      else if ( req.type == IMGPROC_REQ_STATS )
+        resp.status = serve_stats( server, &output_fd, &output_len );
+      imgtrace_end( "request" );
+    }
+    if ( input_fd >= 0 )
+      close( input_fd );
+    resp.length = resp.status == IMG_SUCCESS ? output_len : 0;
+    int sent = send_msg( client->fd, &resp, sizeof( resp ), resp.status == IMG_SUCCESS ? output_fd : -1 );
+    if ( output_fd >= 0 )
+      close( output_fd );
+    if ( !sent || got < 0 )
+      break;
+  }
+
+  close( client->fd );
+  free( client );
+  pthread_mutex_lock( &server->lock );
+  if ( --server->num_clients == 0 )
+    pthread_cond_broadcast( &server->idle );
+  pthread_mutex_unlock( &server->lock );
+  return NULL;
+}
+
+struct ImgprocServer *imgproc_server_create( const char *socket_path, int read_flags ) {
+  struct sockaddr_un addr;
+  if ( strlen( socket_path ) >= sizeof( addr.sun_path ) ) {
+    errno = ENAMETOOLONG;
+    return NULL;
+  }
+  memset( &addr, 0, sizeof( addr ) );
+  addr.sun_family = AF_UNIX;
+  strcpy( addr.sun_path, socket_path );
+
+  struct ImgprocServer *server = calloc( 1, sizeof( struct ImgprocServer ) );
+  if ( server == NULL )
+    return NULL;
+  server->read_flags = read_flags;
+  server->path = strdup( socket_path );
+  server->stats = imgproc_stats_create();
+  server->listen_fd = socket( AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0 );
+  unlink( socket_path );
+  if ( server->path == NULL || server->stats == NULL || server->listen_fd < 0
+       || bind( server->listen_fd, (struct sockaddr *) &addr, sizeof( addr ) ) != 0
+       || listen( server->listen_fd, SERVER_BACKLOG ) != 0 ) {
+    int err = errno;
+    if ( server->listen_fd >= 0 )
+      close( server->listen_fd );
+    imgproc_stats_destroy( server->stats );
+    free( server->path );
+    free( server );
+    errno = err;
+    return NULL;
+  }
+  pthread_mutex_init( &server->lock, NULL );
+  pthread_cond_init( &server->idle, NULL );
+  return server;
+}
+
+int imgproc_server_run( struct ImgprocServer *server ) {
+  while ( !__atomic_load_n( &server->stopped, __ATOMIC_ACQUIRE ) ) {
+    int fd = accept4( server->listen_fd, NULL, NULL, SOCK_CLOEXEC );
+    if ( fd < 0 ) {
+      if ( __atomic_load_n( &server->stopped, __ATOMIC_ACQUIRE ) )
+        break;
+      if ( errno == EINTR || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE )
+        continue;
+      return -1;
+    }
+
+    struct ServerClient *client = malloc( sizeof( struct ServerClient ) );
+    pthread_attr_t attr;
+    pthread_t thread;
+    if ( client == NULL ) {
+      close( fd );
+      continue;
+    }
+    client->server = server;
+    client->fd = fd;
+    pthread_mutex_lock( &server->lock );
+    server->num_clients++;
+    pthread_mutex_unlock( &server->lock );
+    pthread_attr_init( &attr );
+    pthread_attr_setdetachstate( &attr, PTHREAD_CREATE_DETACHED );
+    if ( pthread_create( &thread, &attr, serve_client, client ) != 0 )
+      serve_client( client );
+    pthread_attr_destroy( &attr );
+  }
+  return 0;
+}
+
+void imgproc_server_stop( struct ImgprocServer *server ) {
+  __atomic_store_n( &server->stopped, 1, __ATOMIC_RELEASE );
+  // makes a blocked accept return
+  shutdown( server->listen_fd, SHUT_RDWR );
+}
+
+void imgproc_server_destroy( struct ImgprocServer *server ) {
+  pthread_mutex_lock( &server->lock );
+  while ( server->num_clients > 0 )
+    pthread_cond_wait( &server->idle, &server->lock );
+  pthread_mutex_unlock( &server->lock );
+  close( server->listen_fd );
+  unlink( server->path );
+  pthread_mutex_destroy( &server->lock );
+  pthread_cond_destroy( &server->idle );
+  imgproc_stats_destroy( server->stats );
+  free( server->path );
+  free( server );
+}
+
+////////////////////////////////////////////////////////////////////////
+// Client
+////////////////////////////////////////////////////////////////////////
+
+int imgproc_client_connect( const char *socket_path ) {
+  struct sockaddr_un addr;
+  if ( strlen( socket_path ) >= sizeof( addr.sun_path ) )
+    return -1;
+  memset( &addr, 0, sizeof( addr ) );
+  addr.sun_family = AF_UNIX;
+  strcpy( addr.sun_path, socket_path );
+  int sock = socket( AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0 );
+  if ( sock >= 0 && connect( sock, (struct sockaddr *) &addr, sizeof( addr ) ) != 0 ) {
+    close( sock );
+    sock = -1;
+  }
+  return sock;
+}
+
+// Send a request and receive the response, with the memfd holding its
+// output in *output_fd
+static int client_request( int sock, const struct ImgprocRequest *req, int input_fd, int *output_fd,
+                           size_t *output_len ) {
+  struct ImgprocResponse resp;
+  int fd;
+  if ( !send_msg( sock, req, sizeof( *req ), input_fd )
+       || recv_msg( sock, &resp, sizeof( resp ), &fd ) <= 0 )
+    return IMG_ERR_COULD_NOT_OPEN;
+  if ( resp.magic != IMGPROC_SERVER_MAGIC || (resp.status == IMG_SUCCESS && fd < 0) ) {
+    if ( fd >= 0 )
+      close( fd );
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+  if ( resp.status != IMG_SUCCESS ) {
+    if ( fd >= 0 )
+      close( fd );
+    return resp.status;
+  }
+  *output_fd = fd;
+  *output_len = (size_t) resp.length;
+  return IMG_SUCCESS;
+}
+
+// Fill in the fields common to all requests
+static void init_request( struct ImgprocRequest *req, uint32_t type ) {
+  memset( req, 0, sizeof( *req ) );
+  req->magic = IMGPROC_SERVER_MAGIC;
+  req->version = IMGPROC_SERVER_VERSION;
+  req->type = type;
+}
+
+int imgproc_client_transform( int sock, int input_fd, const char *format, const char *args, uint32_t timeout_ms,
+                              int *output_fd, size_t *output_len ) {
+  struct ImgprocRequest req;
+  init_request( &req, IMGPROC_REQ_TRANSFORM );
+  if ( strlen( format ) >= sizeof( req.format ) || strlen( args ) >= sizeof( req.args ) )
+    return IMGPROC_SERVER_BAD_REQUEST;
+  req.timeout_ms = timeout_ms;
+  strcpy( req.format, format );
+  strcpy( req.args, args );
+  return client_request( sock, &req, input_fd, output_fd, output_len );
+}
+
+int imgproc_client_stats( int sock, FILE *out ) {
+  struct ImgprocRequest req;
+  int fd;
+  size_t len;
+  init_request( &req, IMGPROC_REQ_STATS );
+  if ( client_request( sock, &req, -1, &fd, &len ) != IMG_SUCCESS )
+    return 0;
+
+  int ok = 1;
+  if ( len > 0 ) {
+    void *map = mmap( NULL, len, PROT_READ, MAP_SHARED, fd, 0 );
+    ok = map != MAP_FAILED && fwrite( map, 1, len, out ) == len;
+    if ( map != MAP_FAILED )
+      munmap( map, len );
+  }
+  close( fd );
+  return ok && fflush( out ) == 0;
+}
+
+int imgproc_client_run( const char *socket_path, const char *input_filename, const char *output_filename,
+                        const char *args, uint32_t timeout_ms ) {
+  const char *format = img_is_rimg( output_filename ) ? "rimg"
+                     : img_is_qoi( output_filename ) ? "qoi"
+                     : img_is_timg( output_filename ) ? "timg" : "png";
+
+  // Copy the input file into a sealed memfd
+  int in = open( input_filename, O_RDONLY | O_CLOEXEC );
+  struct stat st;
+  if ( in < 0 || fstat( in, &st ) != 0 ) {
+    if ( in >= 0 )
+      close( in );
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+  int input_fd = imgproc_memfd_create( "imgproc input", 0 );
+  int ok = input_fd >= 0 && copy_fd( input_fd, in, (size_t) st.st_size ) && imgproc_memfd_seal( input_fd, 1 );
+  close( in );
+  if ( !ok ) {
+    if ( input_fd >= 0 )
+      close( input_fd );
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+
+  int sock = imgproc_client_connect( socket_path );
+  int output_fd;
+  size_t output_len;
+  int rc = sock < 0 ? IMG_ERR_COULD_NOT_OPEN
+         : imgproc_client_transform( sock, input_fd, format, args, timeout_ms, &output_fd, &output_len );
+  close( input_fd );
+  if ( sock >= 0 )
+    close( sock );
+  if ( rc != IMG_SUCCESS )
+    return rc;
+
+  // Copy the output memfd into the output file
+  int out = open( output_filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666 );
+  if ( out < 0 ) {
+    rc = IMG_ERR_COULD_NOT_OPEN;
+  } else {
+    if ( !copy_fd( out, output_fd, output_len ) )
+      rc = IMG_ERR_COULD_NOT_WRITE;
+    if ( close( out ) != 0 )
+      rc = IMG_ERR_COULD_NOT_WRITE;
+  }
+  close( output_fd );
+  return rc;
+}
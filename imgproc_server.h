@@ -0,0 +1,112 @@
+// Header for the image daemon and its clients. The daemon listens on a
+// local (Unix domain) socket, and transforms images without their
+// bytes going through the socket: the client puts the input image in
+// a memfd and passes the descriptor with the request (as SCM_RIGHTS
+// ancillary data), and the daemon replies with a memfd holding the
+// output image. The daemon maps the input and decodes it where it is
+// (.rimg pixels aren't even copied), and computes .rimg outputs
+// straight into the shared mapping of the output.
+
+#ifndef IMGPROC_SERVER_H
+#define IMGPROC_SERVER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+//! Identifies the messages of the protocol ("IMGD", and its version)
+#define IMGPROC_SERVER_MAGIC 0x44474d49u
+#define IMGPROC_SERVER_VERSION 1
+
+//! Maximum length of the stage arguments of a request, with the NUL
+#define IMGPROC_SERVER_MAX_ARGS 1024
+
+//! Status of a response to a request that isn't valid (other
+//! statuses are IMG_SUCCESS and the IMG_ERR_* values of image.h)
+#define IMGPROC_SERVER_BAD_REQUEST -64
+
+//! Request types
+enum ImgprocRequestType {
+  IMGPROC_REQ_TRANSFORM = 1,  // transform the image in the memfd sent with the request
+  IMGPROC_REQ_STATS = 2,      // get the statistics of the daemon's jobs
+};
+
+//! A request, sent as one message on the SOCK_SEQPACKET socket. A
+//! transform request comes with the descriptor of a memfd holding the
+//! input image, in any format img_read_mem reads (PNG, .rimg, QOI or
+//! .timg), which must be sealed against shrinking (F_SEAL_SHRINK) so
+//! the daemon can map it safely.
+struct ImgprocRequest {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t type;          // enum ImgprocRequestType
+  uint32_t timeout_ms;    // time the daemon may spend on the request, 0 for no limit
+  char format[8];         // format of the output: "png", "rimg", "qoi" or "timg"
+  char args[IMGPROC_SERVER_MAX_ARGS];  // the stages, e.g. "blur 3 expand"
+};
+
+//! The response to a request, sent as one message. If status is
+//! IMG_SUCCESS, it comes with the descriptor of a sealed memfd holding
+//! the output image (or the statistics, in the Prometheus text format
+//! of imgproc_stats_format), length bytes long.
+struct ImgprocResponse {
+  uint32_t magic;
+  int32_t status;
+  uint64_t length;
+};
+
+struct ImgprocServer;
+
+//! Create a daemon listening on a socket at socket_path (replacing any
+//! socket already there), which decodes inputs with the given
+//! IMG_READ_* flags. Returns NULL (with errno set) on failure.
+struct ImgprocServer *imgproc_server_create( const char *socket_path, int read_flags );
+
+//! Accept clients until imgproc_server_stop is called, serving each
+//! client's requests, one at a time, on a thread of its own. Returns 0
+//! once stopped, or -1 if accepting failed.
+int imgproc_server_run( struct ImgprocServer *server );
+
+//! Make imgproc_server_run return. May be called from any thread.
+void imgproc_server_stop( struct ImgprocServer *server );
+
+//! Wait for the clients to disconnect, remove the socket and free the
+//! daemon.
+void imgproc_server_destroy( struct ImgprocServer *server );
+
+//! Connect to the daemon at socket_path. Returns the socket, or -1.
+int imgproc_client_connect( const char *socket_path );
+
+//! Create a memfd of len bytes for the input of a request, or the
+//! output of a response. Returns the descriptor, or -1.
+int imgproc_memfd_create( const char *name, size_t len );
+
+//! Seal a memfd against changes of its size (and, if write is nonzero,
+//! its contents; the memfd mustn't be mapped for writing then), as
+//! requests and responses require. Returns 1 if successful, 0 if not.
+int imgproc_memfd_seal( int fd, int write );
+
+//! Have the daemon transform the image in the memfd input_fd (sealed
+//! with imgproc_memfd_seal) with the stages in args, e.g. "blur 3", in
+//! at most timeout_ms milliseconds (0 for no limit). The output, in the
+//! named format ("png", "rimg", "qoi" or "timg"), is in the memfd
+//! *output_fd, of *output_len bytes, which the caller must close.
+//! Returns IMG_SUCCESS, the IMG_ERR_* value the daemon failed with
+//! (IMG_ERR_CANCELLED if it ran out of time), IMGPROC_SERVER_BAD_REQUEST,
+//! or IMG_ERR_COULD_NOT_OPEN if the daemon couldn't be reached.
+int imgproc_client_transform( int sock, int input_fd, const char *format, const char *args, uint32_t timeout_ms,
+                              int *output_fd, size_t *output_len );
+
+//! Write the daemon's statistics to out. Returns 1 if successful, 0 if
+//! not.
+int imgproc_client_stats( int sock, FILE *out );
+
+//! Transform the named input file into the named output file (whose
+//! extension gives the format, as for img_write) through the daemon at
+//! socket_path. The files are copied to and from the memfds by the
+//! kernel (with sendfile). Returns the same values as
+//! imgproc_client_transform.
+int imgproc_client_run( const char *socket_path, const char *input_filename, const char *output_filename,
+                        const char *args, uint32_t timeout_ms );
+
+#endif // IMGPROC_SERVER_H
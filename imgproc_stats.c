@@ -0,0 +1,190 @@
+// Latency histograms and counters of image jobs, and their text
+// exposition. Everything is updated with relaxed atomic operations:
+// the statistics only have to be consistent once the jobs recorded
+// are finished.
+
+#include <math.h>
+#include <stdlib.h>
+#include <time.h>
+#include "imgproc_stats.h"
+
+// Quantiles reported for each histogram
+static const double s_quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+static const char *const s_stage_names[STATS_NUM_STAGES] = {
+  "queue", "read", "decode", "transform", "encode", "write", "total",
+};
+
+uint64_t imgproc_stats_now( void ) {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+// Bucket of a latency: the latency itself while it is small, then the
+// power of two it is in, followed by its next STATS_SUB_BITS bits
+static int bucket_index( uint64_t ns ) {
+  if ( ns >= (uint64_t) 1 << STATS_MAX_BITS )
+    ns = ((uint64_t) 1 << STATS_MAX_BITS) - 1;
+  if ( ns < (uint64_t) 2 << STATS_SUB_BITS )
+    return (int) ns;
+  int shift = 63 - __builtin_clzll( ns ) - STATS_SUB_BITS;
+  return (shift << STATS_SUB_BITS) + (int) (ns >> shift);
+}
+
+// Largest latency in a bucket
+static uint64_t bucket_high( int index ) {
+  if ( index < 2 << STATS_SUB_BITS )
+    return (uint64_t) index;
+  int shift = (index >> STATS_SUB_BITS) - 1;
+  uint64_t low = (uint64_t) (index - (shift << STATS_SUB_BITS)) << shift;
+  return low + ((uint64_t) 1 << shift) - 1;
+}
+
+void imgproc_hist_record( struct ImgprocHistogram *hist, uint64_t ns ) {
+  __atomic_add_fetch( &hist->buckets[bucket_index( ns )], 1, __ATOMIC_RELAXED );
+  __atomic_add_fetch( &hist->count, 1, __ATOMIC_RELAXED );
+  __atomic_add_fetch( &hist->sum_ns, ns, __ATOMIC_RELAXED );
+  uint64_t max = __atomic_load_n( &hist->max_ns, __ATOMIC_RELAXED );
+  while ( ns > max && !__atomic_compare_exchange_n( &hist->max_ns, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+    ;
+}
+
+uint64_t imgproc_hist_quantile( const struct ImgprocHistogram *hist, double q ) {
+  uint64_t count = __atomic_load_n( &hist->count, __ATOMIC_RELAXED );
+  if ( count == 0 )
+    return 0;
+  uint64_t rank = (uint64_t) ceil( q * count );
+  if ( rank < 1 )
+    rank = 1;
+
+  uint64_t max = __atomic_load_n( &hist->max_ns, __ATOMIC_RELAXED );
+  uint64_t seen = 0;
+  for ( int i = 0; i < STATS_BUCKETS; i++ ) {
+    seen += __atomic_load_n( &hist->buckets[i], __ATOMIC_RELAXED );
+    if ( seen >= rank )
+      return bucket_high( i ) < max ? bucket_high( i ) : max;
+  }
+  return max;
+}
+
+struct ImgprocStats *imgproc_stats_create( void ) {
+  struct ImgprocStats *stats = calloc( 1, sizeof( struct ImgprocStats ) );
+  if ( stats != NULL )
+    stats->start_ns = imgproc_stats_now();
+  return stats;
+}
+
+void imgproc_stats_destroy( struct ImgprocStats *stats ) {
+  free( stats );
+}
+
+int imgproc_stats_kind( const struct ImgprocStage *stages, int num_stages ) {
+  return num_stages == 1 ? (int) stages[0].op : STATS_KIND_PIPELINE;
+}
+
+void imgproc_stats_record( struct ImgprocStats *stats, int kind, enum ImgprocStatsStage stage, uint64_t ns ) {
+  imgproc_hist_record( &stats->latency[kind][stage], ns );
+}
+
+void imgproc_stats_job( struct ImgprocStats *stats, int kind, int failed, uint64_t pixels_in, uint64_t pixels_out,
+                        uint64_t bytes_read, uint64_t bytes_written ) {
+  __atomic_add_fetch( &stats->jobs[kind], 1, __ATOMIC_RELAXED );
+  __atomic_add_fetch( &stats->failed[kind], failed != 0, __ATOMIC_RELAXED );
+  __atomic_add_fetch( &stats->pixels_in[kind], pixels_in, __ATOMIC_RELAXED );
+  __atomic_add_fetch( &stats->pixels_out[kind], pixels_out, __ATOMIC_RELAXED );
+  __atomic_add_fetch( &stats->bytes_read, bytes_read, __ATOMIC_RELAXED );
+  __atomic_add_fetch( &stats->bytes_written, bytes_written, __ATOMIC_RELAXED );
+}
+
+static const char *kind_name( int kind ) {
+  return kind == STATS_KIND_PIPELINE ? "pipeline" : imgproc_op_name( (enum ImgprocOp) kind );
+}
+
+static uint64_t load( const uint64_t *counter ) {
+  return __atomic_load_n( counter, __ATOMIC_RELAXED );
+}
+
+static void metric_header( FILE *out, const char *name, const char *type, const char *help ) {
+  fprintf( out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type );
+}
+
+int imgproc_stats_format( const struct ImgprocStats *stats, FILE *out ) {
+  double uptime = (imgproc_stats_now() - stats->start_ns) / 1e9;
+
+  metric_header( out, "imgproc_latency_seconds", "summary", "Latency of each stage of the jobs, by transform." );
+  for ( int kind = 0; kind < STATS_NUM_KINDS; kind++ ) {
+    for ( int stage = 0; stage < STATS_NUM_STAGES; stage++ ) {
+      const struct ImgprocHistogram *hist = &stats->latency[kind][stage];
+      uint64_t count = load( &hist->count );
+      if ( count == 0 )
+        continue;
+      for ( size_t i = 0; i < sizeof( s_quantiles ) / sizeof( s_quantiles[0] ); i++ )
+        fprintf( out, "imgproc_latency_seconds{transform=\"%s\",stage=\"%s\",quantile=\"%g\"} %.9f\n",
+                 kind_name( kind ), s_stage_names[stage], s_quantiles[i],
+                 imgproc_hist_quantile( hist, s_quantiles[i] ) / 1e9 );
+      fprintf( out, "imgproc_latency_seconds_sum{transform=\"%s\",stage=\"%s\"} %.9f\n",
+               kind_name( kind ), s_stage_names[stage], load( &hist->sum_ns ) / 1e9 );
+      fprintf( out, "imgproc_latency_seconds_count{transform=\"%s\",stage=\"%s\"} %llu\n",
+               kind_name( kind ), s_stage_names[stage], (unsigned long long) count );
+    }
+  }
+
+  metric_header( out, "imgproc_latency_max_seconds", "gauge", "Largest latency of each stage of the jobs, by transform." );
+  for ( int kind = 0; kind < STATS_NUM_KINDS; kind++ ) {
+    for ( int stage = 0; stage < STATS_NUM_STAGES; stage++ ) {
+      const struct ImgprocHistogram *hist = &stats->latency[kind][stage];
+      if ( load( &hist->count ) > 0 )
+        fprintf( out, "imgproc_latency_max_seconds{transform=\"%s\",stage=\"%s\"} %.9f\n",
+                 kind_name( kind ), s_stage_names[stage], load( &hist->max_ns ) / 1e9 );
+    }
+  }
+
+  metric_header( out, "imgproc_jobs_total", "counter", "Jobs finished, by transform." );
+  for ( int kind = 0; kind < STATS_NUM_KINDS; kind++ )
+    if ( load( &stats->jobs[kind] ) > 0 )
+      fprintf( out, "imgproc_jobs_total{transform=\"%s\"} %llu\n", kind_name( kind ),
+               (unsigned long long) load( &stats->jobs[kind] ) );
+  metric_header( out, "imgproc_jobs_failed_total", "counter", "Jobs that failed, by transform." );
+  for ( int kind = 0; kind < STATS_NUM_KINDS; kind++ )
+    if ( load( &stats->jobs[kind] ) > 0 )
+      fprintf( out, "imgproc_jobs_failed_total{transform=\"%s\"} %llu\n", kind_name( kind ),
+               (unsigned long long) load( &stats->failed[kind] ) );
+
+  metric_header( out, "imgproc_pixels_total", "counter", "Pixels of the input and output images, by transform." );
+  uint64_t all_pixels = 0;
+  for ( int kind = 0; kind < STATS_NUM_KINDS; kind++ ) {
+    if ( load( &stats->jobs[kind] ) == 0 )
+      continue;
+    all_pixels += load( &stats->pixels_in[kind] );
+    fprintf( out, "imgproc_pixels_total{transform=\"%s\",direction=\"in\"} %llu\n", kind_name( kind ),
+             (unsigned long long) load( &stats->pixels_in[kind] ) );
+    fprintf( out, "imgproc_pixels_total{transform=\"%s\",direction=\"out\"} %llu\n", kind_name( kind ),
+             (unsigned long long) load( &stats->pixels_out[kind] ) );
+  }
+
+  metric_header( out, "imgproc_bytes_total", "counter", "Bytes of the files read and written." );
+  fprintf( out, "imgproc_bytes_total{direction=\"read\"} %llu\n", (unsigned long long) load( &stats->bytes_read ) );
+  fprintf( out, "imgproc_bytes_total{direction=\"write\"} %llu\n", (unsigned long long) load( &stats->bytes_written ) );
+
+  // Input pixels per second spent transforming them
+  metric_header( out, "imgproc_transform_mpix_per_second", "gauge", "Input megapixels per second of transforming, by transform." );
+  for ( int kind = 0; kind < STATS_NUM_KINDS; kind++ ) {
+    uint64_t ns = load( &stats->latency[kind][STATS_TRANSFORM].sum_ns );
+    if ( ns > 0 )
+      fprintf( out, "imgproc_transform_mpix_per_second{transform=\"%s\"} %.3f\n", kind_name( kind ),
+               load( &stats->pixels_in[kind] ) * 1e3 / ns );
+  }
+
+  metric_header( out, "imgproc_uptime_seconds", "gauge", "Time since the statistics started." );
+  fprintf( out, "imgproc_uptime_seconds %.3f\n", uptime );
+  metric_header( out, "imgproc_throughput_mpix_per_second", "gauge", "Input megapixels per second since the statistics started." );
+  fprintf( out, "imgproc_throughput_mpix_per_second %.3f\n", uptime > 0 ? all_pixels / 1e6 / uptime : 0.0 );
+  metric_header( out, "imgproc_throughput_bytes_per_second", "gauge", "Bytes read and written per second since the statistics started." );
+  fprintf( out, "imgproc_throughput_bytes_per_second{direction=\"read\"} %.0f\n",
+           uptime > 0 ? load( &stats->bytes_read ) / uptime : 0.0 );
+  fprintf( out, "imgproc_throughput_bytes_per_second{direction=\"write\"} %.0f\n",
+           uptime > 0 ? load( &stats->bytes_written ) / uptime : 0.0 );
+
+  return !ferror( out );
+}
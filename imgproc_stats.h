@@ -0,0 +1,107 @@
+// Header for the statistics kept about image jobs: latency histograms
+// per transform and per stage of a job, and counters of the pixels
+// and bytes processed, reported in the Prometheus text exposition
+// format. Used by the batch executor, which dumps them when it
+// finishes.
+
+#ifndef IMGPROC_STATS_H
+#define IMGPROC_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "imgproc_pipeline.h"
+
+//! Each power of two of latencies is split into 2^STATS_SUB_BITS
+//! buckets, so a recorded latency is off by at most 1/16 (6.25%)
+#define STATS_SUB_BITS 4
+
+//! Latencies of 2^STATS_MAX_BITS ns (73 minutes) and more are recorded
+//! as the largest latency below that
+#define STATS_MAX_BITS 42
+
+//! Number of buckets of a histogram
+#define STATS_BUCKETS ((STATS_MAX_BITS - STATS_SUB_BITS + 1) << STATS_SUB_BITS)
+
+//! A histogram of latencies in nanoseconds, with buckets whose width
+//! grows with the latency (as in HdrHistogram): latencies below
+//! 2^(STATS_SUB_BITS + 1) ns have a bucket each, and then each power of
+//! two is split into 2^STATS_SUB_BITS buckets. Latencies can be
+//! recorded from several threads at once.
+struct ImgprocHistogram {
+  uint64_t count;
+  uint64_t sum_ns;
+  uint64_t max_ns;
+  uint64_t buckets[STATS_BUCKETS];
+};
+
+//! The stages of a job whose latencies are recorded
+enum ImgprocStatsStage {
+  STATS_QUEUE,      // waiting for a thread once the input is read
+  STATS_READ,       // reading the input file
+  STATS_DECODE,
+  STATS_TRANSFORM,
+  STATS_ENCODE,
+  STATS_WRITE,      // writing the output file
+  STATS_TOTAL,      // the whole job, from submitting the read
+  STATS_NUM_STAGES
+};
+
+//! Jobs are counted by the op of their single stage, or as pipelines
+//! (with any other number of stages)
+#define STATS_KIND_PIPELINE IMGPROC_NUM_OPS
+#define STATS_NUM_KINDS (IMGPROC_NUM_OPS + 1)
+
+//! The statistics of the jobs run since imgproc_stats_create. Updated
+//! with atomic operations, so jobs can be recorded from any thread.
+struct ImgprocStats {
+  uint64_t start_ns;
+  struct ImgprocHistogram latency[STATS_NUM_KINDS][STATS_NUM_STAGES];
+  uint64_t jobs[STATS_NUM_KINDS];
+  uint64_t failed[STATS_NUM_KINDS];
+  uint64_t pixels_in[STATS_NUM_KINDS];
+  uint64_t pixels_out[STATS_NUM_KINDS];
+  uint64_t bytes_read;
+  uint64_t bytes_written;
+};
+
+//! The current time in nanoseconds, from the monotonic clock
+uint64_t imgproc_stats_now( void );
+
+//! Record a latency in a histogram.
+void imgproc_hist_record( struct ImgprocHistogram *hist, uint64_t ns );
+
+//! The latency below which a fraction q (0 to 1) of the recorded
+//! latencies are, to within the width of its bucket, or 0 if none have
+//! been recorded.
+uint64_t imgproc_hist_quantile( const struct ImgprocHistogram *hist, double q );
+
+//! Create empty statistics, starting now. Returns NULL if memory
+//! couldn't be allocated.
+struct ImgprocStats *imgproc_stats_create( void );
+
+void imgproc_stats_destroy( struct ImgprocStats *stats );
+
+//! The kind of a job with the given stages: the op of a single stage,
+//! or STATS_KIND_PIPELINE.
+int imgproc_stats_kind( const struct ImgprocStage *stages, int num_stages );
+
+//! Record the latency of a stage of a job of the given kind.
+void imgproc_stats_record( struct ImgprocStats *stats, int kind, enum ImgprocStatsStage stage, uint64_t ns );
+
+//! Count a finished job of the given kind, its input and output pixels
+//! and its input and output file sizes.
+void imgproc_stats_job( struct ImgprocStats *stats, int kind, int failed, uint64_t pixels_in, uint64_t pixels_out,
+                        uint64_t bytes_read, uint64_t bytes_written );
+
+//! Write the statistics to out in the Prometheus text exposition format:
+//! - the 0.5, 0.9, 0.99 and 0.999 quantiles, sum and count of each
+//!   stage's latencies by transform, as imgproc_latency_seconds
+//!   summaries, and the largest as imgproc_latency_max_seconds;
+//! - jobs, failed jobs, pixels and bytes as counters;
+//! - the throughput in MPix/s of each transform while transforming,
+//!   and the overall MPix/s and bytes/s since the statistics started.
+//! Transforms and stages without jobs are left out. Returns 1 if
+//! successful, 0 if writing failed.
+int imgproc_stats_format( const struct ImgprocStats *stats, FILE *out );
+
+#endif // IMGPROC_STATS_H
@@ -0,0 +1,66 @@
+// SWAR ("SIMD within a register") arithmetic on packed 0xRRGGBBAA
+// pixels, used by the scalar C code. Each function works on all four
+// components of a pixel at once with ordinary integer operations, and
+// gives exactly the same result as unpacking the components with
+// get_r/get_g/get_b/get_a, computing per component, and repacking
+// with make_pixel (averages truncate, as in avg_pixels).
+
+#ifndef IMGPROC_SWAR_H
+#define IMGPROC_SWAR_H
+
+#include "image.h" // for uint32_t
+
+//! Spread the four 8-bit components of a pixel into the four 16-bit
+//! lanes of a 64-bit value (a in lane 0, g in lane 1, b in lane 2,
+//! r in lane 3), leaving room for sums of up to 257 pixels.
+static inline uint64_t swar_spread( uint32_t pixel ) {
+  return (pixel & 0x00FF00FFULL) | ((uint64_t) (pixel & 0xFF00FF00U) << 24);
+}
+
+//! Inverse of swar_spread; each lane must be at most 0xFF.
+static inline uint32_t swar_fold( uint64_t lanes ) {
+  return (uint32_t) (lanes | (lanes >> 24));
+}
+
+//! Average of two pixels per component, with the same trick as
+//! vec_avg2_pixels (see imgproc_vec.h) applied to a single pixel.
+static inline uint32_t swar_avg2( uint32_t a, uint32_t b ) {
+  return (a & b) + (((a ^ b) & 0xFEFEFEFEU) >> 1);
+}
+
+//! Average of four pixels per component, summed in 16-bit lanes.
+static inline uint32_t swar_avg4( uint32_t a, uint32_t b, uint32_t c, uint32_t d ) {
+  uint64_t sum = swar_spread(a) + swar_spread(b) + swar_spread(c) + swar_spread(d);
+  return swar_fold((sum >> 2) & 0x00FF00FF00FF00FFULL);
+}
+
+//! Average of num_pixels (1 to 257) pixels per component. Averages of 1,
+//! 2 and 4 pixels don't need any division.
+static inline uint32_t swar_avg( const uint32_t *pixels, int num_pixels ) {
+  switch (num_pixels) {
+  case 1:
+    return pixels[0];
+  case 2:
+    return swar_avg2(pixels[0], pixels[1]);
+  case 4:
+    return swar_avg4(pixels[0], pixels[1], pixels[2], pixels[3]);
+  }
+
+  uint64_t sum = 0;
+  for (int i = 0; i < num_pixels; i++) {
+    sum += swar_spread(pixels[i]);
+  }
+  uint64_t avg = 0;
+  for (int lane = 0; lane < 4; lane++) {
+    avg |= (((sum >> (16 * lane)) & 0xFFFF) / (uint32_t) num_pixels) << (16 * lane);
+  }
+  return swar_fold(avg);
+}
+
+//! Rotate the color components of a pixel (0xRRGGBBAA -> 0xBBRRGGAA)
+//! with the alpha value unchanged.
+static inline uint32_t swar_rot( uint32_t pixel ) {
+  return ((pixel & 0x0000FF00U) << 16) | ((pixel >> 8) & 0x00FFFF00U) | (pixel & 0xFFU);
+}
+
+#endif // IMGPROC_SWAR_H
@@ -1,8 +1,33 @@
+#define _GNU_SOURCE
 #include <assert.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <zlib.h>
 #include "tctest.h"
 #include "imgproc.h"
+#include "imgproc_kernels.h"
+#include "imgproc_vec.h"
+#include "imgproc_swar.h"
+#include "imgproc_planar.h"
+#include "imgproc_pipeline.h"
+#include "parallel.h"
+#include "tasks.h"
+#include "imgio.h"
+#include "qoi.h"
+#include "timg.h"
+#include "pnglite.h"
+#include "imgcompare.h"
+#include "imgtrace.h"
+#include "imgproc_stats.h"
+#include "imgjob.h"
+#include "imgproc_server.h"
+#include <sys/mman.h>
 
 // Maximum number of pixels in a test image
 #define MAX_NUM_PIXELS 1500
@@ -63,6 +88,7 @@ void test_compute_index( TestObjs *objs );
 void test_blur_pixel( TestObjs *objs );
 void test_color_rot_pixel( TestObjs *objs );
 void test_avg_pixel( TestObjs *objs );
+void test_swar_pixel_math( TestObjs *objs );
 
 // Edge case tests
 void test_squash_edge( TestObjs *objs );
@@ -70,6 +96,45 @@ void test_color_rot_edge( TestObjs *objs );
 void test_blur_edge( TestObjs *objs );
 void test_expand_edge( TestObjs *objs );
 
+// Gaussian tests
+void test_gaussian_radii( TestObjs *objs );
+void test_gaussian_edge( TestObjs *objs );
+void test_gaussian_matches_direct_boxes( TestObjs *objs );
+
+// Kernel tier tests
+void test_kernel_tiers_basic( TestObjs *objs );
+void test_kernel_tiers_tails( TestObjs *objs );
+void test_vec_pixel_helpers( TestObjs *objs );
+
+// Planar layout and pipeline tests
+void test_planar_round_trip( TestObjs *objs );
+void test_planar_transforms( TestObjs *objs );
+void test_pipeline_matches_stages( TestObjs *objs );
+void test_in_place_matches( TestObjs *objs );
+void test_pipeline_rows_match( TestObjs *objs );
+
+// Scheduler tests
+void test_par_for_covers_rows( TestObjs *objs );
+void test_tasks_nested( TestObjs *objs );
+
+// Asynchronous I/O tests
+void test_image_mem_io( TestObjs *objs );
+void test_png_restart_points( TestObjs *objs );
+void test_trusted_reads( TestObjs *objs );
+void test_png_opaque_rgb( TestObjs *objs );
+void test_png_color_types( TestObjs *objs );
+void test_png_interlaced( TestObjs *objs );
+void test_rimg_round_trip( TestObjs *objs );
+void test_qoi_round_trip( TestObjs *objs );
+void test_timg_regions( TestObjs *objs );
+void test_rows_round_trip( TestObjs *objs );
+void test_concurrent_codecs( TestObjs *objs );
+void test_image_compare( TestObjs *objs );
+void test_trace_events( TestObjs *objs );
+void test_latency_stats( TestObjs *objs );
+void test_job_cancel( TestObjs *objs );
+void test_server_memfd( TestObjs *objs );
+
 int main( int argc, char **argv ) {
   // allow the specific test to execute to be specified as the
   // first command line argument
@@ -93,6 +158,7 @@ int main( int argc, char **argv ) {
   TEST( test_blur_pixel );
   TEST( test_color_rot_pixel );
   TEST( test_avg_pixel );
+  TEST( test_swar_pixel_math );
 
   // Edge case tests
   TEST( test_squash_edge );
@@ -100,6 +166,45 @@ int main( int argc, char **argv ) {
   TEST( test_blur_edge );
   TEST( test_expand_edge );
 
+  // Gaussian tests
+  TEST( test_gaussian_radii );
+  TEST( test_gaussian_edge );
+  TEST( test_gaussian_matches_direct_boxes );
+
+  // Kernel tier tests
+  TEST( test_kernel_tiers_basic );
+  TEST( test_kernel_tiers_tails );
+  TEST( test_vec_pixel_helpers );
+
+  // Planar layout and pipeline tests
+  TEST( test_planar_round_trip );
+  TEST( test_planar_transforms );
+  TEST( test_pipeline_matches_stages );
+  TEST( test_in_place_matches );
+  TEST( test_pipeline_rows_match );
+
+  // Scheduler tests
+  TEST( test_par_for_covers_rows );
+  TEST( test_tasks_nested );
+
+  // Asynchronous I/O tests
+  TEST( test_image_mem_io );
+  TEST( test_png_restart_points );
+  TEST( test_trusted_reads );
+  TEST( test_png_opaque_rgb );
+  TEST( test_png_color_types );
+  TEST( test_png_interlaced );
+  TEST( test_rimg_round_trip );
+  TEST( test_qoi_round_trip );
+  TEST( test_timg_regions );
+  TEST( test_rows_round_trip );
+  TEST( test_concurrent_codecs );
+  TEST( test_image_compare );
+  TEST( test_trace_events );
+  TEST( test_latency_stats );
+  TEST( test_job_cancel );
+  TEST( test_server_memfd );
+
   TEST_FINI();
 }
 
@@ -299,6 +404,45 @@ void test_avg_pixel( TestObjs *objs ) {
   AVG_PIXEL_TEST(pixels, 4, make_pixel(0x6F, 0x6F, 0x6F, 0xBF)); // 00 + FF + 80 + 40 / 4 = 6F, avg of a is FF + FF + FF + 00 / 4 = BF
 }
 
+// Per-component average, as computed before the SWAR helpers
+static uint32_t avg_components( const uint32_t *pixels, int n ) {
+  uint32_t totals[4] = { 0, 0, 0, 0 };
+  for ( int i = 0; i < n; i++ )
+    for ( int shift = 0; shift < 4; shift++ )
+      totals[shift] += (pixels[i] >> (8 * shift)) & 0xFF;
+  uint32_t result = 0;
+  for ( int shift = 0; shift < 4; shift++ )
+    result |= (totals[shift] / n) << (8 * shift);
+  return result;
+}
+
+void test_swar_pixel_math( TestObjs *objs ) {
+  (void) objs;
+  uint32_t pixels[300];
+  uint32_t x = 12345;
+  for ( int i = 0; i < 300; i++ ) {
+    x = x * 1103515245U + 12345U;
+    pixels[i] = x;
+  }
+  // Extreme components, where carries between components would show up
+  pixels[0] = 0xFFFFFFFF;
+  pixels[1] = 0xFEFEFEFE;
+  pixels[2] = 0x01010101;
+  pixels[3] = 0x00000000;
+
+  for ( int i = 0; i + 4 <= 300; i++ ) {
+    ASSERT( swar_avg2( pixels[i], pixels[i+1] ) == avg_components( pixels + i, 2 ) );
+    ASSERT( swar_avg4( pixels[i], pixels[i+1], pixels[i+2], pixels[i+3] ) == avg_components( pixels + i, 4 ) );
+    ASSERT( swar_fold( swar_spread( pixels[i] ) ) == pixels[i] );
+    ASSERT( swar_rot( pixels[i] ) == make_pixel( get_b( pixels[i] ), get_r( pixels[i] ),
+                                                 get_g( pixels[i] ), get_a( pixels[i] ) ) );
+  }
+
+  int counts[] = { 1, 2, 3, 4, 5, 256, 257, 258, 300 };
+  for ( int i = 0; i < 9; i++ )
+    ASSERT( avg_pixels( pixels, counts[i] ) == avg_components( pixels, counts[i] ) );
+}
+
 void test_squash_edge( TestObjs *objs ) {
   // 3x3 
   static struct TestImageData sq_in = {
@@ -475,3 +619,1536 @@ void test_expand_edge( TestObjs *objs ) {
     img_cleanup( &out );
   }
 }
+
+void test_gaussian_radii( TestObjs *objs ) {
+  int32_t radii[3];
+
+  // sigma 0 means no blurring at all
+  gaussian_box_radii( 0.0, radii );
+  ASSERT( radii[0] == 0 && radii[1] == 0 && radii[2] == 0 );
+
+  // sigma 2: ideal width sqrt(17) -> widths 3, 3, 5
+  gaussian_box_radii( 2.0, radii );
+  ASSERT( radii[0] == 1 && radii[1] == 1 && radii[2] == 2 );
+
+  // radii grow with sigma
+  gaussian_box_radii( 10.0, radii );
+  ASSERT( radii[0] >= 8 && radii[2] <= 10 );
+
+  // NaN blurs nothing, and huge values are clamped
+  gaussian_box_radii( NAN, radii );
+  ASSERT( radii[0] == 0 && radii[1] == 0 && radii[2] == 0 );
+  int32_t max_radii[3];
+  gaussian_box_radii( GAUSSIAN_MAX_SIGMA, max_radii );
+  gaussian_box_radii( 1e300, radii );
+  ASSERT( memcmp( radii, max_radii, sizeof( radii ) ) == 0 );
+  ASSERT( radii[0] > 0 && radii[2] <= (int32_t) GAUSSIAN_MAX_SIGMA );
+}
+
+void test_gaussian_edge( TestObjs *objs ) {
+  // Case 1: sigma 0 leaves the image unchanged
+  {
+    struct Image *out = create_output_image( &objs->smol );
+    ASSERT( imgproc_gaussian( &objs->smol, out, 0.0 ) );
+    ASSERT( images_equal( out, &objs->smol ) );
+    destroy_img( out );
+  }
+
+  // Case 2: uniform color stays uniform, alpha is preserved per pixel
+  {
+    static struct TestImageData unif = {
+      3, 2, { 0x7F7F7F10, 0x7F7F7F20, 0x7F7F7F30, 0x7F7F7F40, 0x7F7F7F50, 0x7F7F7F60 }
+    };
+    struct Image src, out;
+    init_image_from_testdata( &src, &unif );
+    img_init( &out, 3, 2 );
+    ASSERT( imgproc_gaussian( &src, &out, 5.0 ) );
+    ASSERT( images_equal( &out, &src ) );
+    img_cleanup( &out );
+  }
+
+  // Case 3: a huge sigma on a 1x1 image is still the identity
+  {
+    static struct TestImageData one = { 1, 1, { 0xDEADBEEF } };
+    struct Image src, out;
+    init_image_from_testdata( &src, &one );
+    img_init( &out, 1, 1 );
+    ASSERT( imgproc_gaussian( &src, &out, 1000.0 ) );
+    ASSERT( out.data[0] == 0xDEADBEEF );
+    img_cleanup( &out );
+  }
+}
+
+// Reference box pass computing every window sum directly
+static void direct_box_pass( const uint32_t *src, uint32_t *dst, const uint32_t *alpha,
+                             int32_t w, int32_t h, int32_t radius, bool horizontal ) {
+  for ( int32_t row = 0; row < h; row++ )
+    for ( int32_t col = 0; col < w; col++ ) {
+      uint32_t r = 0, g = 0, b = 0, count = 0;
+      for ( int32_t d = -radius; d <= radius; d++ ) {
+        int32_t rr = horizontal ? row : row + d;
+        int32_t cc = horizontal ? col + d : col;
+        if ( rr < 0 || rr >= h || cc < 0 || cc >= w )
+          continue;
+        uint32_t p = src[rr*w + cc];
+        r += get_r( p ); g += get_g( p ); b += get_b( p );
+        count++;
+      }
+      dst[row*w + col] = make_pixel( r/count, g/count, b/count, get_a( alpha[row*w + col] ) );
+    }
+}
+
+void test_gaussian_matches_direct_boxes( TestObjs *objs ) {
+  int32_t w = objs->smol.width, h = objs->smol.height;
+  double sigmas[] = { 0.8, 2.0, 3.5, 40.0 };
+
+  for ( int s = 0; s < 4; s++ ) {
+    struct Image *expected = create_output_image( &objs->smol );
+    struct Image *tmp = create_output_image( &objs->smol );
+    struct Image *out = create_output_image( &objs->smol );
+    int32_t radii[3];
+    gaussian_box_radii( sigmas[s], radii );
+
+    for ( int i = 0; i < w*h; i++ )
+      expected->data[i] = objs->smol.data[i];
+    for ( int i = 0; i < 3; i++ ) {
+      direct_box_pass( expected->data, tmp->data, objs->smol.data, w, h, radii[i], true );
+      direct_box_pass( tmp->data, expected->data, objs->smol.data, w, h, radii[i], false );
+    }
+
+    ASSERT( imgproc_gaussian( &objs->smol, out, sigmas[s] ) );
+    ASSERT( images_equal( out, expected ) );
+    destroy_img( expected );
+    destroy_img( tmp );
+    destroy_img( out );
+  }
+}
+
+// Names of the SIMD kernel tiers to test (skipped if unsupported)
+static const char *s_kernel_tiers[] = { "avx512", "vec", NULL };
+
+// Look up a tier to test. A tier forced with IMGPROC_KERNELS (as by
+// make test_avx512) must be available and selected, so its tests can't
+// pass without running it.
+static const struct ImgprocKernels *find_tier( const char *name ) {
+  const struct ImgprocKernels *k = imgproc_kernels_find( name );
+  const char *forced = getenv( "IMGPROC_KERNELS" );
+  if ( forced != NULL && strcmp( forced, name ) == 0 ) {
+    ASSERT( k != NULL );
+    ASSERT( imgproc_kernels_selected() == k );
+  }
+  return k;
+}
+
+void test_kernel_tiers_basic( TestObjs *objs ) {
+  for ( int t = 0; s_kernel_tiers[t] != NULL; t++ ) {
+    const struct ImgprocKernels *k = find_tier( s_kernel_tiers[t] );
+    if ( k == NULL )
+      continue;
+
+    struct Image *out = create_output_image( &objs->smol_squash_3_1 );
+    k->squash( &objs->smol, out, 3, 1, 0, out->height );
+    ASSERT( images_equal( out, &objs->smol_squash_3_1 ) );
+    destroy_img( out );
+
+    out = create_output_image( &objs->smol_color_rot );
+    k->color_rot( &objs->smol, out, 0, out->height );
+    ASSERT( images_equal( out, &objs->smol_color_rot ) );
+    destroy_img( out );
+
+    // Split into two bands to check that bands are independent
+    out = create_output_image( &objs->smol_blur_3 );
+    k->blur( &objs->smol, out, 3, 0, 4 );
+    k->blur( &objs->smol, out, 3, 4, out->height );
+    ASSERT( images_equal( out, &objs->smol_blur_3 ) );
+    destroy_img( out );
+
+    out = create_output_image( &objs->smol_expand );
+    k->expand( &objs->smol, out, 0, 7 );
+    k->expand( &objs->smol, out, 7, out->height );
+    ASSERT( images_equal( out, &objs->smol_expand ) );
+    destroy_img( out );
+  }
+}
+
+void test_kernel_tiers_tails( TestObjs *objs ) {
+  // Widths that aren't a multiple of any vector size, including 1
+  int32_t widths[] = { 1, 7, 17, 37 };
+
+  for ( int t = 0; s_kernel_tiers[t] != NULL; t++ ) {
+    const struct ImgprocKernels *k = find_tier( s_kernel_tiers[t] );
+    if ( k == NULL )
+      continue;
+
+    for ( int w = 0; w < 4; w++ ) {
+      struct Image src, out, big;
+      img_init( &src, widths[w], 5 );
+      for ( int i = 0; i < widths[w] * 5; i++ )
+        src.data[i] = (uint32_t) i * 2654435761U;
+
+      // blur: compare with blur_pixel
+      img_init( &out, src.width, src.height );
+      k->blur( &src, &out, 2, 0, src.height );
+      for ( int r = 0; r < src.height; r++ )
+        for ( int c = 0; c < src.width; c++ )
+          ASSERT( out.data[r*src.width + c] == blur_pixel( &src, r, c, 2 ) );
+
+      // color_rot: compare with rot_pixel
+      k->color_rot( &src, &out, 0, src.height );
+      for ( int i = 0; i < src.width * src.height; i++ )
+        ASSERT( out.data[i] == rot_pixel( &src, i ) );
+      img_cleanup( &out );
+
+      // expand: compare with averages of the in-bounds neighbours
+      img_init( &big, src.width * 2, src.height * 2 );
+      k->expand( &src, &big, 0, big.height );
+      for ( int r = 0; r < big.height; r++ )
+        for ( int c = 0; c < big.width; c++ ) {
+          uint32_t pixels[4];
+          int n = 0;
+          for ( int dr = 0; dr <= r % 2; dr++ )
+            for ( int dc = 0; dc <= c % 2; dc++ )
+              if ( r/2 + dr < src.height && c/2 + dc < src.width )
+                pixels[n++] = src.data[(r/2 + dr)*src.width + c/2 + dc];
+          ASSERT( big.data[r*big.width + c] == avg_pixels( pixels, n ) );
+        }
+      img_cleanup( &big );
+
+      // squash by 2 horizontally: every other column
+      img_init( &out, (src.width + 1) / 2, src.height );
+      k->squash( &src, &out, 2, 1, 0, out.height );
+      for ( int r = 0; r < out.height; r++ )
+        for ( int c = 0; c < out.width; c++ )
+          ASSERT( out.data[r*out.width + c] == src.data[r*src.width + 2*c] );
+      img_cleanup( &out );
+
+      img_cleanup( &src );
+    }
+  }
+}
+
+void test_vec_pixel_helpers( TestObjs *objs ) {
+  // Each lane must match the scalar helpers, for 1 to 4 pixels
+  vec_u32 pixels[4];
+  for ( int i = 0; i < 4; i++ )
+    for ( int lane = 0; lane < VEC_LANES; lane++ )
+      pixels[i][lane] = objs->smol.data[i * VEC_LANES + lane] ^ (0xFFFFFFFFU * (lane & 1));
+
+  for ( int n = 1; n <= 4; n++ ) {
+    vec_u32 avg = vec_avg_pixels( pixels, n );
+    for ( int lane = 0; lane < VEC_LANES; lane++ ) {
+      uint32_t lane_pixels[4];
+      for ( int i = 0; i < n; i++ )
+        lane_pixels[i] = pixels[i][lane];
+      ASSERT( avg[lane] == avg_pixels( lane_pixels, n ) );
+    }
+  }
+
+  vec_u32 p = pixels[0];
+  vec_u32 rebuilt = vec_make_pixel( vec_get_r( p ), vec_get_g( p ), vec_get_b( p ), vec_get_a( p ) );
+  for ( int lane = 0; lane < VEC_LANES; lane++ ) {
+    ASSERT( vec_get_r( p )[lane] == get_r( p[lane] ) );
+    ASSERT( vec_get_g( p )[lane] == get_g( p[lane] ) );
+    ASSERT( vec_get_b( p )[lane] == get_b( p[lane] ) );
+    ASSERT( vec_get_a( p )[lane] == get_a( p[lane] ) );
+    ASSERT( rebuilt[lane] == p[lane] );
+  }
+}
+
+void test_planar_round_trip( TestObjs *objs ) {
+  struct PlanarImage planar;
+  ASSERT( planar_init( &planar, objs->smol.width, objs->smol.height ) == IMG_SUCCESS );
+  ASSERT( planar.stride % PLANAR_ALIGN == 0 );
+  ASSERT( (uintptr_t) planar.plane[PLANE_R] % PLANAR_ALIGN == 0 );
+
+  planar_from_packed( &objs->smol, &planar );
+  ASSERT( planar.plane[PLANE_R][0] == get_r( objs->smol.data[0] ) );
+  ASSERT( planar.plane[PLANE_A][planar.stride + 1] == get_a( objs->smol.data[objs->smol.width + 1] ) );
+
+  struct Image *out = create_output_image( &objs->smol );
+  planar_to_packed( &planar, out );
+  ASSERT( images_equal( out, &objs->smol ) );
+
+  destroy_img( out );
+  planar_cleanup( &planar );
+}
+
+// Convert img to planar, apply op with the given argument, and check
+// that the result converted back matches expected
+static int planar_result_equals( struct Image *img, int op, int32_t arg, struct Image *expected ) {
+  struct PlanarImage in, out;
+  planar_init( &in, img->width, img->height );
+  planar_init( &out, expected->width, expected->height );
+  planar_from_packed( img, &in );
+
+  switch ( op ) {
+  case IMGPROC_OP_SQUASH: planar_squash( &in, &out, arg, 1 ); break;
+  case IMGPROC_OP_COLOR_ROT: planar_color_rot( &in, &out ); break;
+  case IMGPROC_OP_BLUR: planar_blur( &in, &out, arg ); break;
+  case IMGPROC_OP_EXPAND: planar_expand( &in, &out ); break;
+  }
+
+  struct Image *result = create_output_image( expected );
+  planar_to_packed( &out, result );
+  int equal = images_equal( result, expected );
+
+  destroy_img( result );
+  planar_cleanup( &in );
+  planar_cleanup( &out );
+  return equal;
+}
+
+void test_planar_transforms( TestObjs *objs ) {
+  ASSERT( planar_result_equals( &objs->smol, IMGPROC_OP_SQUASH, 3, &objs->smol_squash_3_1 ) );
+  ASSERT( planar_result_equals( &objs->smol, IMGPROC_OP_COLOR_ROT, 0, &objs->smol_color_rot ) );
+  ASSERT( planar_result_equals( &objs->smol, IMGPROC_OP_BLUR, 0, &objs->smol_blur_0 ) );
+  ASSERT( planar_result_equals( &objs->smol, IMGPROC_OP_BLUR, 3, &objs->smol_blur_3 ) );
+  ASSERT( planar_result_equals( &objs->smol, IMGPROC_OP_EXPAND, 0, &objs->smol_expand ) );
+
+  // In place color rotation just permutes the planes
+  struct PlanarImage planar;
+  planar_init( &planar, objs->smol.width, objs->smol.height );
+  planar_from_packed( &objs->smol, &planar );
+  planar_color_rot( &planar, &planar );
+  struct Image *out = create_output_image( &objs->smol_color_rot );
+  planar_to_packed( &planar, out );
+  ASSERT( images_equal( out, &objs->smol_color_rot ) );
+  destroy_img( out );
+  planar_cleanup( &planar );
+}
+
+void test_pipeline_matches_stages( TestObjs *objs ) {
+  // Planar run of four stages, then a packed gaussian stage
+  char *args[] = { "blur", "2", "expand", "color_rot", "squash", "3", "2", "gaussian", "1.5" };
+  struct ImgprocStage stages[IMGPROC_MAX_STAGES];
+  int num_stages = imgproc_parse_stages( 9, args, stages, IMGPROC_MAX_STAGES );
+  ASSERT( num_stages == 5 );
+
+  int32_t w, h;
+  imgproc_pipeline_dimensions( stages, num_stages, objs->smol.width, objs->smol.height, &w, &h );
+  ASSERT( w == objs->smol.width * 2 / 3 );
+  ASSERT( h == objs->smol.height );
+
+  struct Image result;
+  img_init( &result, w, h );
+  ASSERT( imgproc_pipeline_run( &objs->smol, &result, stages, num_stages ) == IMG_SUCCESS );
+
+  // The same stages, one at a time on the packed layout
+  struct Image a, b, c, d, e;
+  img_init( &a, objs->smol.width, objs->smol.height );
+  imgproc_blur( &objs->smol, &a, 2 );
+  img_init( &b, a.width * 2, a.height * 2 );
+  imgproc_expand( &a, &b );
+  img_init( &c, b.width, b.height );
+  imgproc_color_rot( &b, &c );
+  img_init( &d, c.width / 3, c.height / 2 );
+  imgproc_squash( &c, &d, 3, 2 );
+  img_init( &e, d.width, d.height );
+  ASSERT( imgproc_gaussian( &d, &e, 1.5 ) );
+  ASSERT( images_equal( &result, &e ) );
+
+  img_cleanup( &a );
+  img_cleanup( &b );
+  img_cleanup( &c );
+  img_cleanup( &d );
+  img_cleanup( &e );
+  img_cleanup( &result );
+
+  // Invalid stage lists
+  char *bad1[] = { "blur" };
+  char *bad2[] = { "squash", "0", "1" };
+  char *bad3[] = { "sharpen" };
+  char *bad4[] = { "gaussian", "nan" };
+  char *bad5[] = { "gaussian", "inf" };
+  ASSERT( imgproc_parse_stages( 1, bad1, stages, IMGPROC_MAX_STAGES ) == -1 );
+  ASSERT( imgproc_parse_stages( 3, bad2, stages, IMGPROC_MAX_STAGES ) == -1 );
+  ASSERT( imgproc_parse_stages( 1, bad3, stages, IMGPROC_MAX_STAGES ) == -1 );
+  ASSERT( imgproc_parse_stages( 2, bad4, stages, IMGPROC_MAX_STAGES ) == -1 );
+  ASSERT( imgproc_parse_stages( 2, bad5, stages, IMGPROC_MAX_STAGES ) == -1 );
+}
+
+void test_in_place_matches( TestObjs *objs ) {
+  // Tall enough for blur_in_place to work in several chunks of rows,
+  // and blur distances both smaller and larger than the chunks
+  struct Image src, copy, out;
+  img_init( &src, 37, 601 );
+  for ( int i = 0; i < src.width * src.height; i++ )
+    src.data[i] = (uint32_t) i * 2654435761U;
+
+  int32_t dists[] = { 0, 1, 5, 40, 300 };
+  for ( int i = 0; i < 5; i++ ) {
+    img_init( &copy, src.width, src.height );
+    memcpy( copy.data, src.data, src.width * src.height * sizeof( uint32_t ) );
+    img_init( &out, src.width, src.height );
+    imgproc_blur( &src, &out, dists[i] );
+    ASSERT( imgproc_blur_in_place( &copy, dists[i] ) );
+    ASSERT( images_equal( &copy, &out ) );
+    img_cleanup( &copy );
+    img_cleanup( &out );
+  }
+
+  img_init( &copy, src.width, src.height );
+  memcpy( copy.data, src.data, src.width * src.height * sizeof( uint32_t ) );
+  img_init( &out, src.width, src.height );
+  imgproc_color_rot( &src, &out );
+  imgproc_color_rot_in_place( &copy );
+  ASSERT( images_equal( &copy, &out ) );
+  img_cleanup( &copy );
+  img_cleanup( &out );
+
+  int32_t facs[][2] = { { 1, 1 }, { 3, 2 }, { 1, 7 }, { 5, 1 }, { 40, 1 } };
+  for ( int i = 0; i < 5; i++ ) {
+    img_init( &copy, src.width, src.height );
+    memcpy( copy.data, src.data, src.width * src.height * sizeof( uint32_t ) );
+    img_init( &out, src.width / facs[i][0], src.height / facs[i][1] );
+    imgproc_squash( &src, &out, facs[i][0], facs[i][1] );
+    ASSERT( imgproc_squash_in_place( &copy, facs[i][0], facs[i][1] ) );
+    ASSERT( images_equal( &copy, &out ) );
+    img_cleanup( &copy );
+    img_cleanup( &out );
+  }
+  img_cleanup( &src );
+
+  // The small test image's expected results
+  struct Image *img = create_output_image( &objs->smol );
+  memcpy( img->data, objs->smol.data, objs->smol.width * objs->smol.height * sizeof( uint32_t ) );
+  ASSERT( imgproc_blur_in_place( img, 3 ) );
+  ASSERT( images_equal( img, &objs->smol_blur_3 ) );
+  destroy_img( img );
+}
+
+// Count how many times each row is visited
+static void count_rows( void *ctx, int32_t begin, int32_t end ) {
+  int *counts = ctx;
+  for ( int32_t i = begin; i < end; i++ )
+    __atomic_add_fetch( &counts[i], 1, __ATOMIC_RELAXED );
+}
+
+void test_pipeline_rows_match( TestObjs *objs ) {
+  struct Image src;
+  img_init( &src, 29, 61 );
+  for ( int i = 0; i < src.width * src.height; i++ )
+    src.data[i] = (uint32_t) i * 2654435761U;
+
+  // Every kind of stage, with halos and row factors in both directions
+  char *args[] = { "crop", "2", "3", "25", "55", "blur", "2", "expand", "squash", "2", "3",
+                   "gaussian", "1.5", "color_rot" };
+  struct ImgprocStage stages[IMGPROC_MAX_STAGES];
+  int num_stages = imgproc_parse_stages( 14, args, stages, IMGPROC_MAX_STAGES );
+  ASSERT( num_stages == 6 );
+
+  int32_t w, h;
+  imgproc_pipeline_dimensions( stages, num_stages, src.width, src.height, &w, &h );
+  struct Image whole;
+  img_init( &whole, w, h );
+  ASSERT( imgproc_pipeline_run( &src, &whole, stages, num_stages ) == IMG_SUCCESS );
+
+  // Bands of 1, 4 and all the rows, each from just the input rows it needs
+  int32_t bands[] = { 1, 4, h };
+  for ( int i = 0; i < 3; i++ ) {
+    for ( int32_t begin = 0; begin < h; begin += bands[i] ) {
+      int32_t end = begin + bands[i] < h ? begin + bands[i] : h;
+      int32_t in_begin, in_end;
+      size_t bytes;
+      imgproc_pipeline_input_rows( stages, num_stages, src.width, src.height, begin, end,
+                                   &in_begin, &in_end, &bytes );
+      ASSERT( in_begin >= 0 && in_begin < in_end && in_end <= src.height );
+
+      struct Image in_rows = { src.width, in_end - in_begin, src.data + (size_t) in_begin * src.width, NULL, 0 };
+      struct Image band;
+      img_init( &band, w, end - begin );
+      ASSERT( imgproc_pipeline_run_rows( &in_rows, src.height, stages, num_stages, begin, end, &band ) == IMG_SUCCESS );
+      ASSERT( memcmp( band.data, whole.data + (size_t) begin * w, (size_t) w * (end - begin) * sizeof( uint32_t ) ) == 0 );
+      img_cleanup( &band );
+    }
+  }
+
+  img_cleanup( &whole );
+  img_cleanup( &src );
+}
+
+void test_par_for_covers_rows( TestObjs *objs ) {
+  (void) objs;
+  int32_t sizes[] = { 1, 2, 7, 100, 1000 };
+  for ( int s = 0; s < 5; s++ ) {
+    int counts[1000] = { 0 };
+    par_for( sizes[s], count_rows, counts );
+    for ( int32_t i = 0; i < sizes[s]; i++ )
+      ASSERT( counts[i] == 1 );
+    ASSERT( sizes[s] == 1000 || counts[sizes[s]] == 0 );
+  }
+}
+
+// A "job" that runs its own par_for, as the batch executor's jobs do
+struct NestedJob {
+  int counts[300];
+  int32_t rows;
+};
+
+static void nested_job( void *arg ) {
+  struct NestedJob *job = arg;
+  par_for( job->rows, count_rows, job->counts );
+}
+
+void test_tasks_nested( TestObjs *objs ) {
+  (void) objs;
+  struct NestedJob jobs[20];
+  struct TaskGroup group = TASK_GROUP_INIT;
+
+  // Mix of small and large jobs
+  for ( int j = 0; j < 20; j++ ) {
+    memset( jobs[j].counts, 0, sizeof( jobs[j].counts ) );
+    jobs[j].rows = j % 3 == 0 ? 300 : j + 1;
+    tasks_spawn( &group, -1, nested_job, &jobs[j] );
+  }
+  tasks_wait( &group );
+
+  ASSERT( group.pending == 0 );
+  for ( int j = 0; j < 20; j++ )
+    for ( int32_t i = 0; i < jobs[j].rows; i++ )
+      ASSERT( jobs[j].counts[i] == 1 );
+}
+
+// Write an image to a file through an I/O queue and read it back
+static void mem_io_round_trip( struct Image *img ) {
+  char filename[] = "/tmp/imgproc_test_XXXXXX";
+  int fd = mkstemp( filename );
+  ASSERT( fd >= 0 );
+  close( fd );
+
+  struct ImgIoQueue *io = imgio_create( 4 );
+  ASSERT( io != NULL );
+  void *buf;
+  size_t len;
+  ASSERT( img_write_mem( img, &buf, &len ) == IMG_SUCCESS );
+  ASSERT( imgio_submit_write( io, filename, buf, len, img ) );
+
+  struct ImgIoResult result;
+  ASSERT( imgio_wait( io, &result, 1 ) );
+  ASSERT( result.is_write && result.error == 0 && result.tag == img );
+
+  ASSERT( imgio_submit_read( io, filename, img ) );
+  ASSERT( imgio_wait( io, &result, 1 ) );
+  ASSERT( !result.is_write && result.error == 0 && result.len == len );
+  ASSERT( imgio_pending( io ) == 0 );
+  ASSERT( !imgio_wait( io, &result, 1 ) );
+
+  struct Image copy;
+  ASSERT( img_read_mem( result.buf, result.len, &copy ) == IMG_SUCCESS );
+  ASSERT( images_equal( img, &copy ) );
+  img_cleanup( &copy );
+  free( result.buf );
+
+  // Missing files are reported through the result
+  ASSERT( imgio_submit_read( io, "/nonexistent/imgproc_test.png", NULL ) );
+  ASSERT( imgio_wait( io, &result, 1 ) );
+  ASSERT( result.error != 0 && result.buf == NULL );
+
+  imgio_destroy( io );
+  unlink( filename );
+}
+
+void test_image_mem_io( TestObjs *objs ) {
+  mem_io_round_trip( &objs->smol );
+  mem_io_round_trip( &objs->small );
+
+  // Again with pread/pwrite
+  setenv( "IMGPROC_IO", "sync", 1 );
+  mem_io_round_trip( &objs->smol );
+  unsetenv( "IMGPROC_IO" );
+
+  // Truncated data is rejected
+  void *buf;
+  size_t len;
+  struct Image img;
+  ASSERT( img_write_mem( &objs->smol, &buf, &len ) == IMG_SUCCESS );
+  ASSERT( img_read_mem( buf, len / 2, &img ) != IMG_SUCCESS );
+  free( buf );
+}
+
+void test_png_restart_points( TestObjs *objs ) {
+  (void) objs;
+  struct Image img, decoded;
+  ASSERT( img_init( &img, 37, 101 ) == IMG_SUCCESS );
+  for ( int32_t i = 0; i < 37 * 101; i++ )
+    img.data[i] = (uint32_t) i * 2654435761u;
+
+  // Written in bands (the last one shorter) listed in an rsPT chunk
+  void *buf;
+  size_t len;
+  setenv( "IMGPROC_PNG_RESTART", "16", 1 );
+  ASSERT( img_write_mem( &img, &buf, &len ) == IMG_SUCCESS );
+  unsetenv( "IMGPROC_PNG_RESTART" );
+  ASSERT( memmem( buf, len, "rsPT", 4 ) != NULL );
+
+  // The bands decode to the same pixels on any number of threads
+  setenv( "IMGPROC_THREADS", "1", 1 );
+  ASSERT( img_read_mem( buf, len, &decoded ) == IMG_SUCCESS );
+  ASSERT( images_equal( &img, &decoded ) );
+  img_cleanup( &decoded );
+  setenv( "IMGPROC_THREADS", "4", 1 );
+  ASSERT( img_read_mem( buf, len, &decoded ) == IMG_SUCCESS );
+  ASSERT( images_equal( &img, &decoded ) );
+  img_cleanup( &decoded );
+  unsetenv( "IMGPROC_THREADS" );
+
+  // Restart points past the end of the image data (with a valid CRC)
+  // are ignored too
+  unsigned char *rspt = memmem( buf, len, "rsPT", 4 );
+  uint32_t rspt_len = ((uint32_t) rspt[-4] << 24) | (rspt[-3] << 16) | (rspt[-2] << 8) | rspt[-1];
+  unsigned char saved[8];
+  memcpy( saved, rspt + rspt_len, 8 );
+  memcpy( rspt + rspt_len, "\x7f\xff\x00\x00", 4 );
+  uint32_t crc = (uint32_t) crc32( crc32( 0, NULL, 0 ), rspt, 4 + rspt_len );
+  for ( int i = 0; i < 4; i++ )
+    rspt[4 + rspt_len + i] = (unsigned char) (crc >> (24 - 8 * i));
+  setenv( "IMGPROC_THREADS", "4", 1 );
+  ASSERT( img_read_mem( buf, len, &decoded ) == IMG_SUCCESS );
+  unsetenv( "IMGPROC_THREADS" );
+  ASSERT( images_equal( &img, &decoded ) );
+  img_cleanup( &decoded );
+  memcpy( rspt + rspt_len, saved, 8 );
+
+  // A damaged rsPT chunk is ignored
+  rspt[12] ^= 0xFF;
+  ASSERT( img_read_mem( buf, len, &decoded ) == IMG_SUCCESS );
+  ASSERT( images_equal( &img, &decoded ) );
+  img_cleanup( &decoded );
+  free( buf );
+
+  // Without the setting, no chunk is written
+  ASSERT( img_write_mem( &img, &buf, &len ) == IMG_SUCCESS );
+  ASSERT( memmem( buf, len, "rsPT", 4 ) == NULL );
+  free( buf );
+  img_cleanup( &img );
+}
+
+void test_trusted_reads( TestObjs *objs ) {
+  void *buf;
+  size_t len;
+  struct Image img;
+
+  // A damaged PNG chunk CRC is only ignored for trusted data
+  ASSERT( img_write_mem( &objs->small, &buf, &len ) == IMG_SUCCESS );
+  unsigned char *idat = memmem( buf, len, "IDAT", 4 );
+  uint32_t idat_len = ((uint32_t) idat[-4] << 24) | (idat[-3] << 16) | (idat[-2] << 8) | idat[-1];
+  idat[4 + idat_len] ^= 0xFF;
+  ASSERT( img_read_mem( buf, len, &img ) != IMG_SUCCESS );
+  ASSERT( img_read_mem_flags( buf, len, &img, IMG_READ_TRUSTED ) == IMG_SUCCESS );
+  ASSERT( images_equal( &objs->small, &img ) );
+  img_cleanup( &img );
+  free( buf );
+
+  // Likewise for the .rimg checksum
+  ASSERT( img_write_rimg_mem( &objs->small, &buf, &len ) == IMG_SUCCESS );
+  ((unsigned char *) buf)[24] ^= 0xFF;
+  ASSERT( img_read_mem( buf, len, &img ) == IMG_ERR_CORRUPT );
+  ASSERT( img_read_mem_flags( buf, len, &img, IMG_READ_TRUSTED ) == IMG_SUCCESS );
+  ASSERT( images_equal( &objs->small, &img ) );
+  img_cleanup( &img );
+
+  // and for a region of such a file
+  char filename[] = "/tmp/imgproc_test_XXXXXX.rimg";
+  int fd = mkstemps( filename, 5 );
+  ASSERT( fd >= 0 );
+  ASSERT( write( fd, buf, len ) == (ssize_t) len );
+  close( fd );
+  ASSERT( img_read_region( filename, 1, 1, 2, 2, &img, 0 ) == IMG_ERR_CORRUPT );
+  ASSERT( img_read_region( filename, 1, 1, 2, 2, &img, IMG_READ_TRUSTED ) == IMG_SUCCESS );
+  ASSERT( img.width == 2 && img.height == 2 && img.data[0] == objs->small.data[objs->small.width + 1] );
+  img_cleanup( &img );
+  unlink( filename );
+  free( buf );
+}
+
+void test_png_opaque_rgb( TestObjs *objs ) {
+  (void) objs;
+  void *buf;
+  size_t len;
+  struct Image img, decoded;
+  ASSERT( img_init( &img, 19, 7 ) == IMG_SUCCESS );
+  for ( int32_t i = 0; i < 19 * 7; i++ )
+    img.data[i] = ((uint32_t) i * 2654435761u) | 0xFF;
+
+  // Opaque images are written as RGB (color type 2 in IHDR)
+  ASSERT( img_write_mem( &img, &buf, &len ) == IMG_SUCCESS );
+  ASSERT( ((unsigned char *) buf)[25] == 2 );
+  ASSERT( img_read_mem( buf, len, &decoded ) == IMG_SUCCESS );
+  ASSERT( images_equal( &img, &decoded ) );
+  img_cleanup( &decoded );
+  free( buf );
+
+  // One translucent pixel in the last row keeps the alpha channel
+  img.data[19 * 7 - 1] &= 0xFFFFFF00;
+  ASSERT( img_write_mem( &img, &buf, &len ) == IMG_SUCCESS );
+  ASSERT( ((unsigned char *) buf)[25] == 6 );
+  ASSERT( img_read_mem( buf, len, &decoded ) == IMG_SUCCESS );
+  ASSERT( images_equal( &img, &decoded ) );
+  img_cleanup( &decoded );
+  free( buf );
+  img_cleanup( &img );
+}
+
+// Check that a PNG held in memory decodes to the 3x2 pixels expected
+static void check_png_pixels( const unsigned char *png, size_t len, const uint32_t *expected ) {
+  struct Image img;
+  ASSERT( img_read_mem( png, len, &img ) == IMG_SUCCESS );
+  ASSERT( img.width == 3 && img.height == 2 );
+  ASSERT( memcmp( img.data, expected, 6 * sizeof( uint32_t ) ) == 0 );
+  img_cleanup( &img );
+}
+
+void test_png_color_types( TestObjs *objs ) {
+  (void) objs;
+
+  // 2-bit palette with some entries made translucent by tRNS
+  static const unsigned char palette_png[] = {
+    0x89, 0x50, 0x4e, 0x47, 0x0d, 0x0a, 0x1a, 0x0a, 0x00, 0x00, 0x00, 0x0d, 0x49, 0x48, 0x44, 0x52,
+    0x00, 0x00, 0x00, 0x03, 0x00, 0x00, 0x00, 0x02, 0x02, 0x03, 0x00, 0x00, 0x00, 0xe0, 0x1a, 0x8e,
+    0x89, 0x00, 0x00, 0x00, 0x0c, 0x50, 0x4c, 0x54, 0x45, 0xbb, 0x1d, 0x6d, 0x13, 0x2c, 0xde, 0xd6,
+    0x23, 0x7b, 0x2e, 0xd9, 0x1e, 0xd7, 0x98, 0x18, 0x61, 0x00, 0x00, 0x00, 0x02, 0x74, 0x52, 0x4e,
+    0x53, 0x3f, 0x72, 0x90, 0x46, 0xf7, 0x14, 0x00, 0x00, 0x00, 0x0c, 0x49, 0x44, 0x41, 0x54, 0x78,
+    0x9c, 0x63, 0x99, 0xc3, 0xc0, 0x00, 0x00, 0x01, 0xe8, 0x00, 0xa1, 0x61, 0xb9, 0x93, 0xdc, 0x00,
+    0x00, 0x00, 0x00, 0x49, 0x45, 0x4e, 0x44, 0xae, 0x42, 0x60, 0x82,
+  };
+  static const uint32_t palette_pixels[] = {
+    0xd6237bff, 0x132cde72, 0x2ed91eff, 0xbb1d6d3f, 0xbb1d6d3f, 0xbb1d6d3f,
+  };
+  check_png_pixels( palette_png, sizeof( palette_png ), palette_pixels );
+
+  // 16-bit grayscale with alpha, reduced to 8 bits
+  static const unsigned char gray_alpha_png[] = {
+    0x89, 0x50, 0x4e, 0x47, 0x0d, 0x0a, 0x1a, 0x0a, 0x00, 0x00, 0x00, 0x0d, 0x49, 0x48, 0x44, 0x52,
+    0x00, 0x00, 0x00, 0x03, 0x00, 0x00, 0x00, 0x02, 0x10, 0x04, 0x00, 0x00, 0x00, 0x67, 0xed, 0x72,
+    0xd2, 0x00, 0x00, 0x00, 0x23, 0x49, 0x44, 0x41, 0x54, 0x78, 0x9c, 0x63, 0x39, 0x2d, 0x29, 0x99,
+    0xbc, 0x4c, 0xe2, 0x5f, 0xd9, 0xe5, 0x7f, 0xb5, 0x79, 0x2c, 0xdc, 0x0d, 0x06, 0x15, 0xa7, 0xb7,
+    0x85, 0x88, 0x29, 0x58, 0x4e, 0xaf, 0x01, 0x00, 0x94, 0x29, 0x0a, 0xe1, 0x14, 0x6f, 0xce, 0x48,
+    0x00, 0x00, 0x00, 0x00, 0x49, 0x45, 0x4e, 0x44, 0xae, 0x42, 0x60, 0x82,
+  };
+  static const uint32_t gray_alpha_pixels[] = {
+    0xcbcbcb19, 0x71717117, 0x44444494, 0xd6d6d649, 0x3c3c3c9d, 0x5c5c5c34,
+  };
+  check_png_pixels( gray_alpha_png, sizeof( gray_alpha_png ), gray_alpha_pixels );
+
+  // 4-bit grayscale, scaled to the full range
+  static const unsigned char gray_png[] = {
+    0x89, 0x50, 0x4e, 0x47, 0x0d, 0x0a, 0x1a, 0x0a, 0x00, 0x00, 0x00, 0x0d, 0x49, 0x48, 0x44, 0x52,
+    0x00, 0x00, 0x00, 0x03, 0x00, 0x00, 0x00, 0x02, 0x04, 0x00, 0x00, 0x00, 0x00, 0x7d, 0xef, 0xd4,
+    0xc7, 0x00, 0x00, 0x00, 0x0e, 0x49, 0x44, 0x41, 0x54, 0x78, 0x9c, 0x63, 0xce, 0xfe, 0xcd, 0xb2,
+    0xcd, 0x1e, 0x00, 0x07, 0xd2, 0x02, 0x63, 0xc6, 0x45, 0xb2, 0xc2, 0x00, 0x00, 0x00, 0x00, 0x49,
+    0x45, 0x4e, 0x44, 0xae, 0x42, 0x60, 0x82,
+  };
+  static const uint32_t gray_pixels[] = {
+    0x666666ff, 0xbbbbbbff, 0x333333ff, 0x222222ff, 0x111111ff, 0x666666ff,
+  };
+  check_png_pixels( gray_png, sizeof( gray_png ), gray_pixels );
+}
+
+void test_png_interlaced( TestObjs *objs ) {
+  (void) objs;
+
+  // 5x5 RGB, Adam7 interlaced
+  static const unsigned char interlaced_png[] = {
+    0x89, 0x50, 0x4e, 0x47, 0x0d, 0x0a, 0x1a, 0x0a, 0x00, 0x00, 0x00, 0x0d, 0x49, 0x48, 0x44, 0x52,
+    0x00, 0x00, 0x00, 0x05, 0x00, 0x00, 0x00, 0x05, 0x08, 0x02, 0x00, 0x00, 0x01, 0x75, 0x0a, 0x81,
+    0x24, 0x00, 0x00, 0x00, 0x61, 0x49, 0x44, 0x41, 0x54, 0x78, 0x9c, 0x01, 0x56, 0x00, 0xa9, 0xff,
+    0x01, 0x39, 0x0c, 0x8c, 0x04, 0x6f, 0x77, 0x0d, 0x02, 0x57, 0x7d, 0x53, 0xcd, 0x89, 0x21, 0x01,
+    0x34, 0x2c, 0xd8, 0x03, 0x56, 0x90, 0xb0, 0x03, 0xc2, 0x31, 0xb7, 0x8a, 0x27, 0x66, 0xed, 0x04,
+    0xb7, 0x03, 0x7d, 0x72, 0x47, 0xd2, 0xd6, 0x0c, 0x01, 0xb0, 0x87, 0x16, 0x78, 0x0f, 0xa3, 0x02,
+    0x3c, 0x3b, 0x74, 0x4d, 0x7a, 0xe8, 0x01, 0x65, 0xd6, 0x70, 0x80, 0xb8, 0x93, 0x6c, 0x4a, 0xab,
+    0x3d, 0x77, 0xc0, 0x1e, 0xe5, 0xc1, 0x01, 0x74, 0x94, 0x28, 0x03, 0x9f, 0x9a, 0x17, 0xb5, 0xf8,
+    0xc5, 0xd5, 0xfb, 0x18, 0xcb, 0x6f, 0x62, 0xdf, 0x23, 0xd1, 0x79, 0xc4, 0xfc, 0x8d, 0x00, 0x00,
+    0x00, 0x00, 0x49, 0x45, 0x4e, 0x44, 0xae, 0x42, 0x60, 0x82,
+  };
+  static const uint32_t pixels[] = {
+    0x390c8cff, 0x7d7247ff, 0x342cd8ff, 0x100f2fff, 0x6f770dff, 0x65d670ff, 0xe58e03ff, 0x51d8aeff,
+    0x8e4f6eff, 0xac342fff, 0xc231b7ff, 0xb08716ff, 0xeb3fc1ff, 0x2896b9ff, 0x622317ff, 0x749428ff,
+    0x7733c2ff, 0x8ee8baff, 0x53bdb5ff, 0x6b8824ff, 0x577d53ff, 0xecc28aff, 0x70a61cff, 0x7510a1ff,
+    0xcd8921ff,
+  };
+
+  struct Image img;
+  ASSERT( img_read_mem( interlaced_png, sizeof( interlaced_png ), &img ) == IMG_SUCCESS );
+  ASSERT( img.width == 5 && img.height == 5 );
+  ASSERT( memcmp( img.data, pixels, sizeof( pixels ) ) == 0 );
+  img_cleanup( &img );
+
+  char filename[] = "/tmp/imgproc_test_XXXXXX.png";
+  int fd = mkstemps( filename, 4 );
+  ASSERT( fd >= 0 );
+  ASSERT( write( fd, interlaced_png, sizeof( interlaced_png ) ) == (ssize_t) sizeof( interlaced_png ) );
+  close( fd );
+
+  // Every 8th pixel is only in the first pass, which fills 8x8 blocks
+  ASSERT( img_read_sampled( filename, 8, 8, &img, 0 ) == IMG_SUCCESS );
+  for ( int32_t i = 0; i < 25; i++ )
+    ASSERT( img.data[i] == pixels[0] );
+  img_cleanup( &img );
+
+  // Every 4th pixel takes three passes, which fill 4x4 blocks
+  ASSERT( img_read_sampled( filename, 4, 4, &img, 0 ) == IMG_SUCCESS );
+  for ( int32_t y = 0; y < 5; y++ )
+    for ( int32_t x = 0; x < 5; x++ )
+      ASSERT( img.data[y * 5 + x] == pixels[(y - y % 4) * 5 + x - x % 4] );
+  img_cleanup( &img );
+
+  ASSERT( img_read_sampled( filename, 1, 1, &img, 0 ) == IMG_SUCCESS );
+  ASSERT( memcmp( img.data, pixels, sizeof( pixels ) ) == 0 );
+  img_cleanup( &img );
+  unlink( filename );
+}
+
+void test_rimg_round_trip( TestObjs *objs ) {
+  char filename[] = "/tmp/imgproc_test_XXXXXX.rimg";
+  int fd = mkstemps( filename, 5 );
+  ASSERT( fd >= 0 );
+  close( fd );
+  ASSERT( img_is_rimg( filename ) );
+  ASSERT( !img_is_rimg( "input/kittens.png" ) );
+
+  // Files are mapped and used in place; changes stay private
+  struct Image img;
+  ASSERT( img_write( filename, &objs->small ) == IMG_SUCCESS );
+  ASSERT( img_read( filename, &img ) == IMG_SUCCESS );
+  ASSERT( img.map != NULL );
+  ASSERT( ((uintptr_t) img.data & 63) == 0 );
+  ASSERT( images_equal( &objs->small, &img ) );
+  img.data[0] ^= 0xFF;
+  img_cleanup( &img );
+  ASSERT( img_read( filename, &img ) == IMG_SUCCESS );
+  ASSERT( images_equal( &objs->small, &img ) );
+  img_cleanup( &img );
+  unlink( filename );
+
+  // Data in memory is copied
+  void *buf;
+  size_t len;
+  ASSERT( img_write_rimg_mem( &objs->smol, &buf, &len ) == IMG_SUCCESS );
+  ASSERT( img_read_mem( buf, len, &img ) == IMG_SUCCESS );
+  ASSERT( img.map == NULL );
+  ASSERT( images_equal( &objs->smol, &img ) );
+  img_cleanup( &img );
+
+  // Rows may be padded (the checksum only covers the pixels)
+  unsigned char *data = buf;
+  int32_t w = objs->smol.width, h = objs->smol.height;
+  size_t stride = w * 4 + 12;
+  unsigned char *padded = calloc( 1, 64 + stride * h );
+  memcpy( padded, data, 64 );
+  padded[16] = stride & 0xFF;
+  padded[17] = stride >> 8;
+  for ( int32_t i = 0; i < h; i++ )
+    memcpy( padded + 64 + i * stride, data + 64 + i * w * 4, w * 4 );
+  ASSERT( img_read_mem( padded, 64 + stride * h, &img ) == IMG_SUCCESS );
+  ASSERT( images_equal( &objs->smol, &img ) );
+  img_cleanup( &img );
+  free( padded );
+
+  // Damaged data is rejected
+  data[64 + 5] ^= 1;
+  ASSERT( img_read_mem( buf, len, &img ) == IMG_ERR_CORRUPT );
+  data[64 + 5] ^= 1;
+  ASSERT( img_read_mem( buf, len - 1, &img ) == IMG_ERR_CORRUPT );
+  free( buf );
+}
+
+void test_qoi_round_trip( TestObjs *objs ) {
+  struct Image img;
+  void *buf;
+  size_t len;
+
+  ASSERT( img_is_qoi( "out.qoi" ) && !img_is_qoi( "out.png" ) );
+  ASSERT( img_write_qoi_mem( &objs->small, &buf, &len ) == IMG_SUCCESS );
+  ASSERT( qoi_is_qoi( buf, len ) );
+  ASSERT( img_read_mem( buf, len, &img ) == IMG_SUCCESS );
+  ASSERT( images_equal( &objs->small, &img ) );
+  img_cleanup( &img );
+
+  // Truncated data is rejected
+  ASSERT( img_read_mem( buf, len - 9, &img ) == IMG_ERR_CORRUPT );
+  free( buf );
+
+  // Exercise every op: runs across rows and longer than one op can
+  // code, small and larger differences, alpha changes and repeats
+  uint32_t pixels[7 * 20];
+  for ( int i = 0; i < 7 * 20; i++ ) {
+    if ( i < 70 )
+      pixels[i] = 0x102030FF;
+    else if ( i < 100 )
+      pixels[i] = make_pixel( 0x10 + i % 3, 0x20 + (i * 7) % 40, 0x30 + (i * 13) % 50, 0xFF );
+    else
+      pixels[i] = make_pixel( i * 37, i * 91, i * 53, i % 4 == 0 ? 0x80 : 0xFF );
+  }
+  struct Image src = { 7, 20, pixels, NULL, 0 };
+  ASSERT( img_write_qoi_mem( &src, &buf, &len ) == IMG_SUCCESS );
+  ASSERT( img_read_mem( buf, len, &img ) == IMG_SUCCESS );
+  ASSERT( images_equal( &src, &img ) );
+  img_cleanup( &img );
+  free( buf );
+
+  // Row by row; RGB drops alpha
+  struct QoiEncoder enc;
+  struct QoiDecoder dec;
+  uint32_t row[7];
+  ASSERT( qoi_encode_init( &enc, 7, 20, 3 ) == QOI_OK );
+  for ( int i = 0; i < 20; i++ )
+    ASSERT( qoi_encode_row( &enc, pixels + i * 7 ) == QOI_OK );
+  ASSERT( qoi_encode_row( &enc, pixels ) == QOI_ERR_STATE );
+  ASSERT( qoi_encode_finish( &enc, &buf, &len ) == QOI_OK );
+  ASSERT( qoi_decode_init( &dec, buf, len ) == QOI_OK );
+  ASSERT( dec.width == 7 && dec.height == 20 && dec.channels == 3 );
+  for ( int i = 0; i < 20; i++ ) {
+    ASSERT( qoi_decode_row( &dec, row ) == QOI_OK );
+    for ( int j = 0; j < 7; j++ )
+      ASSERT( row[j] == (pixels[i * 7 + j] | 0xFF) );
+  }
+  ASSERT( qoi_decode_row( &dec, row ) == QOI_ERR_STATE );
+  free( buf );
+}
+
+// Check that region (x, y, w, h) of tiled image ti matches img
+static bool timg_region_matches( struct TiledImage *ti, struct Image *img, int32_t x, int32_t y, int32_t w, int32_t h ) {
+  uint32_t *out = malloc( w * h * sizeof( uint32_t ) );
+  bool ok = timg_read_region( ti, x, y, w, h, out, w ) == IMG_SUCCESS;
+  for ( int32_t i = 0; ok && i < h; i++ )
+    ok = memcmp( out + i * w, img->data + (y + i) * img->width + x, w * sizeof( uint32_t ) ) == 0;
+  free( out );
+  return ok;
+}
+
+void test_timg_regions( TestObjs *objs ) {
+  struct Image *img = &objs->small;
+  struct Image decoded;
+  struct TiledImage ti;
+  void *buf;
+  size_t len;
+
+  // Stored and compressed tiles, with partial tiles on the edges
+  for ( int level = 0; level <= 6; level += 6 ) {
+    ASSERT( timg_encode( img, 3, level, &buf, &len ) == IMG_SUCCESS );
+    ASSERT( img_read_mem( buf, len, &decoded ) == IMG_SUCCESS );
+    ASSERT( images_equal( img, &decoded ) );
+    img_cleanup( &decoded );
+
+    ASSERT( timg_open_mem( buf, len, &ti ) == IMG_SUCCESS );
+    ASSERT( ti.tile_w == 3 && ti.tiles_x == (img->width + 2) / 3 );
+    ASSERT( timg_region_matches( &ti, img, 0, 0, img->width, img->height ) );
+    ASSERT( timg_region_matches( &ti, img, 1, 2, 1, 1 ) );
+    ASSERT( timg_region_matches( &ti, img, 2, 1, img->width - 2, img->height - 1 ) );
+    ASSERT( timg_read_region( &ti, 1, 0, img->width, 1, NULL, 0 ) != IMG_SUCCESS );
+    timg_close( &ti );
+    free( buf );
+  }
+
+  // Reading a region of a file matches cropping in a pipeline
+  char filename[] = "/tmp/imgproc_test_XXXXXX.timg";
+  int fd = mkstemps( filename, 5 );
+  ASSERT( fd >= 0 );
+  close( fd );
+  ASSERT( img_is_timg( filename ) );
+  ASSERT( img_write( filename, img ) == IMG_SUCCESS );
+
+  char *args[] = { "crop", "3", "1", "100", "2" };
+  struct ImgprocStage crop;
+  ASSERT( imgproc_parse_stages( 5, args, &crop, 1 ) == 1 );
+  int32_t w, h;
+  imgproc_pipeline_dimensions( &crop, 1, img->width, img->height, &w, &h );
+  ASSERT( w == img->width - 3 && h == 2 );
+  struct Image cropped;
+  img_init( &cropped, w, h );
+  ASSERT( imgproc_pipeline_run( img, &cropped, &crop, 1 ) == IMG_SUCCESS );
+  ASSERT( img_read_region( filename, 3, 1, 100, 2, &decoded, 0 ) == IMG_SUCCESS );
+  ASSERT( images_equal( &cropped, &decoded ) );
+  img_cleanup( &decoded );
+  img_cleanup( &cropped );
+
+  // Damaged tiles are detected
+  ASSERT( timg_encode( img, 4, 0, &buf, &len ) == IMG_SUCCESS );
+  ((unsigned char *) buf)[len - 1] ^= 1;
+  ASSERT( img_read_mem( buf, len, &decoded ) == IMG_ERR_CORRUPT );
+  free( buf );
+  unlink( filename );
+}
+
+void test_rows_round_trip( TestObjs *objs ) {
+  struct Image src;
+  struct Image *img = &src;
+  img_init( img, 37, 23 );
+  for ( int i = 0; i < img->width * img->height; i++ )
+    img->data[i] = (uint32_t) i * 2654435761U;
+  const char *exts[] = { ".png", ".rimg", ".qoi", ".timg" };
+  for ( int i = 0; i < 4; i++ ) {
+    char filename[64];
+    snprintf( filename, sizeof( filename ), "/tmp/imgproc_test_XXXXXX%s", exts[i] );
+    int suffix_len = (int) strlen( exts[i] );
+    int fd = mkstemps( filename, suffix_len );
+    ASSERT( fd >= 0 );
+    close( fd );
+
+    // Written a few rows at a time, then read back whole
+    struct ImgRowWriter *writer;
+    ASSERT( img_rows_create( filename, img->width, img->height, &writer ) == IMG_SUCCESS );
+    for ( int32_t row = 0; row < img->height; row += 3 ) {
+      int32_t rows = img->height - row < 3 ? img->height - row : 3;
+      ASSERT( img_rows_write( writer, img->data + (size_t) row * img->width, rows ) == IMG_SUCCESS );
+    }
+    ASSERT( img_rows_finish( writer ) == IMG_SUCCESS );
+    struct Image decoded;
+    ASSERT( img_read( filename, &decoded ) == IMG_SUCCESS );
+    ASSERT( images_equal( img, &decoded ) );
+    img_cleanup( &decoded );
+
+    // Read back a few rows at a time, skipping some
+    struct ImgRowReader *reader;
+    int32_t w, h;
+    ASSERT( img_rows_open( filename, 0, &reader ) == IMG_SUCCESS );
+    img_rows_size( reader, &w, &h );
+    ASSERT( w == img->width && h == img->height );
+    uint32_t *rows = malloc( (size_t) w * 2 * sizeof( uint32_t ) );
+    ASSERT( img_rows_read( reader, NULL, 0 ) == IMG_SUCCESS );
+    for ( int32_t row = 0; row + 2 <= h; row += 5 ) {
+      ASSERT( img_rows_read( reader, rows, 2 ) == IMG_SUCCESS );
+      ASSERT( memcmp( rows, img->data + (size_t) row * w, (size_t) w * 2 * sizeof( uint32_t ) ) == 0 );
+      int32_t skip = h - row - 2 < 3 ? h - row - 2 : 3;
+      ASSERT( img_rows_read( reader, NULL, skip ) == IMG_SUCCESS );
+    }
+    ASSERT( img_rows_read( reader, rows, 1 ) == IMG_ERR_CORRUPT );
+    ASSERT( img_rows_close( reader ) == IMG_SUCCESS );
+    free( rows );
+    unlink( filename );
+
+    // A file that isn't there can't be opened
+    ASSERT( img_rows_open( filename, 0, &reader ) == IMG_ERR_COULD_NOT_OPEN );
+  }
+
+  // A scratch image is zeroed and writable
+  struct Image scratch;
+  ASSERT( img_init_scratch( &scratch, 100, 50 ) == IMG_SUCCESS );
+  ASSERT( scratch.data[100 * 50 - 1] == 0 );
+  memcpy( scratch.data, img->data, img->width * sizeof( uint32_t ) );
+  img_cleanup( &scratch );
+  img_cleanup( img );
+}
+
+// Allocations made (and not yet freed) through a thread's pnglite
+// allocator
+static __thread long t_png_allocs;
+static __thread long t_png_live;
+
+static void *counting_alloc( size_t size ) {
+  t_png_allocs++;
+  t_png_live++;
+  return malloc( size );
+}
+
+static void counting_free( void *p ) {
+  if ( p != NULL )
+    t_png_live--;
+  free( p );
+}
+
+static unsigned png_to_mem( void *input, size_t size, size_t numel, void *user_pointer ) {
+  struct { unsigned char *data; size_t len; } *out = user_pointer;
+  unsigned char *data = realloc( out->data, out->len + size * numel );
+  if ( data == NULL )
+    return 0;
+  memcpy( data + out->len, input, size * numel );
+  out->data = data;
+  out->len += size * numel;
+  return (unsigned) numel;
+}
+
+#define STRESS_THREADS 8
+#define STRESS_ROUNDS 10
+
+struct CodecStress {
+  int id;
+  int failures;
+};
+
+// Encode and decode an image of its own in every format, in memory and
+// through files, and with pnglite directly using its own allocator
+static void *codec_stress( void *arg ) {
+  struct CodecStress *stress = arg;
+  struct Image img;
+  img_init( &img, 61 + stress->id, 47 );
+  for ( int i = 0; i < img.width * img.height; i++ )
+    img.data[i] = ((uint32_t) i + stress->id * 7919U) * 2654435761U;
+
+  char filename[64];
+  const char *exts[] = { ".png", ".rimg", ".qoi", ".timg" };
+  for ( int round = 0; round < STRESS_ROUNDS; round++ ) {
+    for ( int f = 0; f < 4; f++ ) {
+      void *buf;
+      size_t len;
+      struct Image copy;
+      snprintf( filename, sizeof( filename ), "/tmp/imgproc_stress_%d_%d%s", (int) getpid(), stress->id, exts[f] );
+      if ( img_write_mem_for( filename, &img, &buf, &len ) != IMG_SUCCESS ) {
+        stress->failures++;
+        continue;
+      }
+      if ( img_read_mem( buf, len, &copy ) != IMG_SUCCESS || !images_equal( &img, &copy ) )
+        stress->failures++;
+      else
+        img_cleanup( &copy );
+      free( buf );
+
+      if ( img_write( filename, &img ) != IMG_SUCCESS || img_read( filename, &copy ) != IMG_SUCCESS ) {
+        stress->failures++;
+        continue;
+      }
+      if ( !images_equal( &img, &copy ) )
+        stress->failures++;
+      img_cleanup( &copy );
+      unlink( filename );
+    }
+
+    png_t png;
+    struct { unsigned char *data; size_t len; } out = { NULL, 0 };
+    if ( png_open_write( &png, png_to_mem, &out ) != PNG_NO_ERROR ) {
+      stress->failures++;
+      continue;
+    }
+    png_set_allocator( &png, counting_alloc, counting_free );
+    if ( png_set_data( &png, img.width, img.height, 8, PNG_TRUECOLOR_ALPHA, (unsigned char *) img.data ) != PNG_NO_ERROR )
+      stress->failures++;
+    free( out.data );
+  }
+  if ( t_png_allocs == 0 || t_png_live != 0 )
+    stress->failures++;
+  img_cleanup( &img );
+  return NULL;
+}
+
+void test_concurrent_codecs( TestObjs *objs ) {
+  (void) objs;
+  pthread_t threads[STRESS_THREADS];
+  struct CodecStress stress[STRESS_THREADS];
+  for ( int i = 0; i < STRESS_THREADS; i++ ) {
+    stress[i].id = i;
+    stress[i].failures = 0;
+    ASSERT( pthread_create( &threads[i], NULL, codec_stress, &stress[i] ) == 0 );
+  }
+  for ( int i = 0; i < STRESS_THREADS; i++ ) {
+    pthread_join( threads[i], NULL );
+    ASSERT( stress[i].failures == 0 );
+  }
+}
+
+void test_image_compare( TestObjs *objs ) {
+  (void) objs;
+  // A width that leaves a tail after the whole vectors, and enough rows
+  // for several bands
+  struct Image a, b, diff;
+  img_init( &a, 13, 150 );
+  img_init( &b, 13, 150 );
+  img_init( &diff, 13, 150 );
+  for ( int i = 0; i < a.width * a.height; i++ )
+    a.data[i] = b.data[i] = (uint32_t) i * 2654435761U;
+
+  struct ImgCompareResult r;
+  ASSERT( img_compare( &a, &b, &diff, &r ) );
+  ASSERT( r.differing == 0 && r.mse == 0 && r.max_abs_diff == 0 );
+  ASSERT( r.first_x == -1 && r.first_y == -1 );
+  ASSERT( isinf( r.psnr ) );
+
+  // A pixel in the tail of row 77 and two in row 140 differ
+  b.data[77 * 13 + 12] ^= 0x03000000;
+  b.data[140 * 13 + 1] ^= 0x000000C8;
+  b.data[140 * 13 + 2] ^= 0x000A0000;
+  ASSERT( img_compare( &a, &b, &diff, &r ) );
+  ASSERT( r.differing == 3 );
+  ASSERT( r.first_x == 12 && r.first_y == 77 );
+  ASSERT( diff.data[77 * 13 + 12] == 0xFF0000FF );
+  ASSERT( diff.data[77 * 13 + 11] == (((a.data[77 * 13 + 11] >> 1) & 0x7F7F7F00) + 0x808080FF) );
+  img_cleanup( &diff );
+
+  // The same from a straightforward computation
+  uint64_t sum_sq = 0;
+  int max = 0;
+  for ( int i = 0; i < a.width * a.height; i++ ) {
+    for ( int shift = 0; shift < 32; shift += 8 ) {
+      int d = abs( (int) ((a.data[i] >> shift) & 0xFF) - (int) ((b.data[i] >> shift) & 0xFF) );
+      sum_sq += d * d;
+      max = d > max ? d : max;
+    }
+  }
+  ASSERT( r.max_abs_diff == max );
+  ASSERT( r.mse == (double) sum_sq / (13 * 150 * 4) );
+  ASSERT( fabs( r.psnr - 10 * log10( 255.0 * 255.0 / r.mse ) ) < 1e-9 );
+
+  // Different dimensions
+  struct Image c;
+  img_init( &c, 13, 149 );
+  ASSERT( !img_compare( &a, &c, NULL, &r ) );
+  img_cleanup( &c );
+  img_cleanup( &a );
+  img_cleanup( &b );
+}
+
+// Number of times needle occurs in haystack
+static int count_occurrences( const char *haystack, const char *needle ) {
+  int n = 0;
+  for ( const char *p = strstr( haystack, needle ); p != NULL; p = strstr( p + 1, needle ) )
+    n++;
+  return n;
+}
+
+void test_trace_events( TestObjs *objs ) {
+  // Tracing stays on for the rest of the run, and the final trace is
+  // discarded at exit
+  setenv( "IMGPROC_TRACE", "/dev/null", 1 );
+  imgtrace_init();
+  unsetenv( "IMGPROC_TRACE" );
+  ASSERT( imgtrace_on );
+
+  // Decode, transform on several threads and encode
+  char *args[] = { "blur", "2", "color_rot", "gaussian", "1.5" };
+  struct ImgprocStage stages[IMGPROC_MAX_STAGES];
+  ASSERT( imgproc_parse_stages( 5, args, stages, IMGPROC_MAX_STAGES ) == 3 );
+  struct Image result, decoded;
+  void *buf;
+  size_t len;
+  img_init( &result, objs->smol.width, objs->smol.height );
+  setenv( "IMGPROC_THREADS", "4", 1 );
+  ASSERT( imgproc_pipeline_run( &objs->smol, &result, stages, 3 ) == IMG_SUCCESS );
+  ASSERT( img_write_mem_for( "x.png", &result, &buf, &len ) == IMG_SUCCESS );
+  ASSERT( img_read_mem( buf, len, &decoded ) == IMG_SUCCESS );
+  unsetenv( "IMGPROC_THREADS" );
+  ASSERT( images_equal( &result, &decoded ) );
+  img_cleanup( &decoded );
+  img_cleanup( &result );
+  free( buf );
+
+  char filename[] = "/tmp/imgproc_test_XXXXXX.json";
+  int fd = mkstemps( filename, 5 );
+  ASSERT( fd >= 0 );
+  close( fd );
+  ASSERT( imgtrace_write( filename ) );
+  ASSERT( !imgtrace_write( "/nonexistent/trace.json" ) );
+
+  FILE *in = fopen( filename, "r" );
+  ASSERT( in != NULL );
+  fseek( in, 0, SEEK_END );
+  long size = ftell( in );
+  rewind( in );
+  char *json = malloc( size + 1 );
+  ASSERT( json != NULL && fread( json, 1, size, in ) == (size_t) size );
+  json[size] = '\0';
+  fclose( in );
+  unlink( filename );
+
+  // Every phase was recorded, and each one began and ended
+  ASSERT( strncmp( json, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", 38 ) == 0 );
+  const char *names[] = { "band", "to planar", "blur", "color_rot", "to packed", "gaussian",
+                          "encode", "convert", "filter", "deflate", "write", "decode", "inflate", "unfilter" };
+  for ( size_t i = 0; i < sizeof( names ) / sizeof( names[0] ); i++ ) {
+    char begin[64], end[64];
+    snprintf( begin, sizeof( begin ), "{\"name\":\"%s\",\"ph\":\"B\"", names[i] );
+    snprintf( end, sizeof( end ), "{\"name\":\"%s\",\"ph\":\"E\"", names[i] );
+    ASSERT( count_occurrences( json, begin ) > 0 );
+    ASSERT( count_occurrences( json, begin ) == count_occurrences( json, end ) );
+  }
+  ASSERT( strstr( json, "\"args\":{\"arg\":0}" ) != NULL );
+  ASSERT( strcmp( json + size - 4, "\n]}\n" ) == 0 );
+  free( json );
+}
+
+void test_latency_stats( TestObjs *objs ) {
+  (void) objs;
+  struct ImgprocStats *stats = imgproc_stats_create();
+  ASSERT( stats != NULL );
+  struct ImgprocHistogram *hist = &stats->latency[IMGPROC_OP_BLUR][STATS_TRANSFORM];
+  ASSERT( imgproc_hist_quantile( hist, 0.5 ) == 0 );
+
+  // Small latencies are exact
+  for ( uint64_t ns = 0; ns < 32; ns++ )
+    imgproc_hist_record( hist, ns );
+  ASSERT( imgproc_hist_quantile( hist, 0.5 ) == 15 );
+  ASSERT( imgproc_hist_quantile( hist, 1.0 ) == 31 );
+
+  // Larger ones are within 1/16, and the largest is kept exactly
+  memset( hist, 0, sizeof( *hist ) );
+  uint64_t sum = 0;
+  for ( uint64_t i = 1; i <= 1000; i++ ) {
+    imgproc_hist_record( hist, i * 1000003 );
+    sum += i * 1000003;
+  }
+  ASSERT( hist->count == 1000 && hist->sum_ns == sum && hist->max_ns == 1000 * 1000003 );
+  const double quantiles[] = { 0.001, 0.5, 0.9, 0.99, 0.999 };
+  for ( int i = 0; i < 5; i++ ) {
+    double exact = ceil( quantiles[i] * 1000 ) * 1000003;
+    uint64_t q = imgproc_hist_quantile( hist, quantiles[i] );
+    ASSERT( q >= exact && q <= exact * 17 / 16 );
+  }
+  ASSERT( imgproc_hist_quantile( hist, 1.0 ) == 1000 * 1000003 );
+
+  // Latencies beyond the range are counted in the last bucket
+  imgproc_hist_record( hist, UINT64_MAX / 2 );
+  ASSERT( hist->max_ns == UINT64_MAX / 2 && hist->buckets[STATS_BUCKETS - 1] == 1 );
+
+  struct ImgprocStage stages[2] = { { .op = IMGPROC_OP_BLUR }, { .op = IMGPROC_OP_EXPAND } };
+  ASSERT( imgproc_stats_kind( stages, 1 ) == IMGPROC_OP_BLUR );
+  ASSERT( imgproc_stats_kind( stages, 2 ) == STATS_KIND_PIPELINE );
+  ASSERT( imgproc_stats_kind( stages, 0 ) == STATS_KIND_PIPELINE );
+  imgproc_stats_job( stats, IMGPROC_OP_BLUR, 0, 100, 100, 5000, 6000 );
+  imgproc_stats_job( stats, IMGPROC_OP_BLUR, 1, 0, 0, 0, 0 );
+  imgproc_stats_record( stats, STATS_KIND_PIPELINE, STATS_QUEUE, 2500000000u );
+
+  char *text;
+  size_t len;
+  FILE *out = open_memstream( &text, &len );
+  ASSERT( out != NULL );
+  ASSERT( imgproc_stats_format( stats, out ) );
+  fclose( out );
+  ASSERT( strstr( text, "# TYPE imgproc_latency_seconds summary\n" ) != NULL );
+  ASSERT( strstr( text, "imgproc_latency_seconds_count{transform=\"blur\",stage=\"transform\"} 1001\n" ) != NULL );
+  ASSERT( strstr( text, "imgproc_latency_seconds{transform=\"pipeline\",stage=\"queue\",quantile=\"0.99\"} 2.5" ) != NULL );
+  ASSERT( strstr( text, "imgproc_latency_max_seconds{transform=\"pipeline\",stage=\"queue\"} 2.500000000\n" ) != NULL );
+  ASSERT( strstr( text, "imgproc_jobs_total{transform=\"blur\"} 2\n" ) != NULL );
+  ASSERT( strstr( text, "imgproc_jobs_failed_total{transform=\"blur\"} 1\n" ) != NULL );
+  ASSERT( strstr( text, "imgproc_pixels_total{transform=\"blur\",direction=\"in\"} 100\n" ) != NULL );
+  ASSERT( strstr( text, "imgproc_bytes_total{direction=\"write\"} 6000\n" ) != NULL );
+  ASSERT( strstr( text, "imgproc_throughput_mpix_per_second " ) != NULL );
+  // Transforms and stages without jobs are left out
+  ASSERT( strstr( text, "squash" ) == NULL );
+  ASSERT( strstr( text, "stage=\"decode\"" ) == NULL );
+  free( text );
+  imgproc_stats_destroy( stats );
+}
+
+// Progress reports of a job, which cancel it once cancel_at is reached
+struct JobProgress {
+  struct ImgJob *job;
+  double cancel_at;
+  double done[256];
+  int n;
+};
+
+static void record_progress( void *arg, double done ) {
+  struct JobProgress *p = arg;
+  if ( p->n < 256 )
+    p->done[p->n++] = done;
+  if ( done >= p->cancel_at )
+    imgjob_cancel( p->job );
+}
+
+void test_job_cancel( TestObjs *objs ) {
+  (void) objs;
+  struct Image img, result, expected, decoded;
+  ASSERT( img_init( &img, 300, 200 ) == IMG_SUCCESS );
+  for ( int32_t i = 0; i < 300 * 200; i++ )
+    img.data[i] = (uint32_t) i * 2654435761u;
+  char *args[] = { "blur", "2", "color_rot", "gaussian", "1.5", "squash", "1", "1" };
+  struct ImgprocStage stages[IMGPROC_MAX_STAGES];
+  ASSERT( imgproc_parse_stages( 8, args, stages, IMGPROC_MAX_STAGES ) == 4 );
+  img_init( &expected, 300, 200 );
+  img_init( &result, 300, 200 );
+  ASSERT( imgproc_pipeline_run( &img, &expected, stages, 4 ) == IMG_SUCCESS );
+  setenv( "IMGPROC_THREADS", "4", 1 );
+
+  // A job that isn't stopped gives the same result, and reports its
+  // progress up to 1 (the pipeline's stages, the encode and the decode)
+  struct ImgJob job;
+  struct JobProgress progress = { &job, 2.0, { 0 }, 0 };
+  void *buf;
+  size_t len;
+  imgjob_init( &job );
+  imgjob_set_progress( &job, record_progress, &progress, 6 );
+  ASSERT( imgjob_enter( &job ) == NULL );
+  ASSERT( imgjob_current() == &job );
+  ASSERT( imgproc_pipeline_run( &img, &result, stages, 4 ) == IMG_SUCCESS );
+  ASSERT( img_write_mem_for( "x.png", &result, &buf, &len ) == IMG_SUCCESS );
+  ASSERT( img_read_mem( buf, len, &decoded ) == IMG_SUCCESS );
+  ASSERT( imgjob_enter( NULL ) == &job );
+  ASSERT( images_equal( &expected, &decoded ) );
+  img_cleanup( &decoded );
+  ASSERT( progress.n > 6 && progress.done[progress.n - 1] == 1.0 );
+  for ( int i = 1; i < progress.n; i++ )
+    ASSERT( progress.done[i] >= progress.done[i - 1] + 0.01 || progress.done[i] == 1.0 );
+  imgjob_cleanup( &job );
+
+  // Cancelling part way through (here from the progress callback, on
+  // whichever thread reports it) stops the pipeline
+  imgjob_init( &job );
+  progress = (struct JobProgress) { &job, 0.3, { 0 }, 0 };
+  imgjob_set_progress( &job, record_progress, &progress, 4 );
+  imgjob_enter( &job );
+  ASSERT( imgproc_pipeline_run( &img, &result, stages, 4 ) == IMG_ERR_CANCELLED );
+  ASSERT( imgjob_check() );
+  imgjob_enter( NULL );
+  ASSERT( !imgjob_check() );
+  ASSERT( progress.n > 0 && progress.done[progress.n - 1] < 1.0 );
+  imgjob_cleanup( &job );
+
+  // Once the deadline has passed, decoding and encoding fail in every
+  // format, without returning buffers
+  imgjob_init( &job );
+  imgjob_set_deadline( &job, 1 );
+  ASSERT( imgjob_stopped( &job ) );
+  imgjob_enter( &job );
+  const char *names[] = { "x.png", "x.qoi", "x.rimg", "x.timg" };
+  for ( int i = 0; i < 4; i++ ) {
+    void *out;
+    size_t out_len;
+    ASSERT( img_write_mem_for( names[i], &result, &out, &out_len ) == IMG_ERR_CANCELLED );
+  }
+  ASSERT( img_read_mem( buf, len, &decoded ) == IMG_ERR_CANCELLED );
+  imgjob_enter( NULL );
+  imgjob_cleanup( &job );
+
+  free( buf );
+
+  // The stages of a job are split into chunks of rows, which give the
+  // same result (an image taller than a few chunks, with an odd height)
+  struct Image tall;
+  ASSERT( img_init( &tall, 5, 2301 ) == IMG_SUCCESS );
+  for ( int32_t i = 0; i < 5 * 2301; i++ )
+    tall.data[i] = (uint32_t) i * 2654435761u;
+  char *single[][3] = { { "squash", "2", "3" }, { "color_rot" }, { "blur", "2" }, { "blur", "40" }, { "expand" } };
+  int single_args[] = { 3, 1, 2, 2, 1 };
+  for ( int i = 0; i < 5; i++ ) {
+    ASSERT( imgproc_parse_stages( single_args[i], single[i], stages, IMGPROC_MAX_STAGES ) == 1 );
+    int32_t w, h;
+    imgproc_pipeline_dimensions( stages, 1, tall.width, tall.height, &w, &h );
+    struct Image whole, chunked;
+    img_init( &whole, w, h );
+    img_init( &chunked, w, h );
+    ASSERT( imgproc_pipeline_run( &tall, &whole, stages, 1 ) == IMG_SUCCESS );
+    imgjob_init( &job );
+    imgjob_enter( &job );
+    ASSERT( imgproc_pipeline_run( &tall, &chunked, stages, 1 ) == IMG_SUCCESS );
+    imgjob_enter( NULL );
+    imgjob_cleanup( &job );
+    ASSERT( images_equal( &whole, &chunked ) );
+    img_cleanup( &whole );
+    img_cleanup( &chunked );
+  }
+  img_cleanup( &tall );
+
+  unsetenv( "IMGPROC_THREADS" );
+  img_cleanup( &result );
+  img_cleanup( &expected );
+  img_cleanup( &img );
+}
+
+static void *run_server( void *arg ) {
+  imgproc_server_run( arg );
+  return NULL;
+}
+
+// Put len bytes from buf in a sealed memfd
+static int memfd_holding( const void *buf, size_t len ) {
+  int fd = imgproc_memfd_create( "test input", len );
+  ASSERT( fd >= 0 );
+  void *map = mmap( NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+  ASSERT( map != MAP_FAILED );
+  memcpy( map, buf, len );
+  munmap( map, len );
+  ASSERT( imgproc_memfd_seal( fd, 1 ) );
+  return fd;
+}
+
+// Decode the image in a memfd of len bytes
+static void read_memfd( int fd, size_t len, struct Image *img ) {
+  void *map = mmap( NULL, len, PROT_READ, MAP_SHARED, fd, 0 );
+  ASSERT( map != MAP_FAILED );
+  ASSERT( img_read_mem( map, len, img ) == IMG_SUCCESS );
+  munmap( map, len );
+  close( fd );
+}
+
+void test_server_memfd( TestObjs *objs ) {
+  char path[] = "/tmp/imgproc_test_XXXXXX";
+  ASSERT( mkdtemp( path ) != NULL );
+  char socket_path[64];
+  snprintf( socket_path, sizeof( socket_path ), "%s/sock", path );
+  struct ImgprocServer *server = imgproc_server_create( socket_path, 0 );
+  ASSERT( server != NULL );
+  pthread_t thread;
+  ASSERT( pthread_create( &thread, NULL, run_server, server ) == 0 );
+  int sock = imgproc_client_connect( socket_path );
+  ASSERT( sock >= 0 );
+
+  // A PNG input transformed into .rimg pixels, and .rimg pixels into a
+  // PNG, give what transforming locally does
+  char *args[] = { "blur", "2", "expand" };
+  struct ImgprocStage stages[IMGPROC_MAX_STAGES];
+  ASSERT( imgproc_parse_stages( 3, args, stages, IMGPROC_MAX_STAGES ) == 2 );
+  struct Image expected, result;
+  img_init( &expected, objs->smol.width * 2, objs->smol.height * 2 );
+  ASSERT( imgproc_pipeline_run( &objs->smol, &expected, stages, 2 ) == IMG_SUCCESS );
+
+  const char *input_names[] = { "in.png", "in.rimg" };
+  const char *formats[] = { "rimg", "png" };
+  for ( int i = 0; i < 2; i++ ) {
+    void *buf;
+    size_t len, output_len;
+    int output_fd;
+    ASSERT( img_write_mem_for( input_names[i], &objs->smol, &buf, &len ) == IMG_SUCCESS );
+    int input_fd = memfd_holding( buf, len );
+    free( buf );
+    ASSERT( imgproc_client_transform( sock, input_fd, formats[i], "blur 2 expand", 0, &output_fd, &output_len )
+            == IMG_SUCCESS );
+    // the output is sealed
+    ASSERT( (fcntl( output_fd, F_GET_SEALS ) & (F_SEAL_SHRINK | F_SEAL_WRITE)) == (F_SEAL_SHRINK | F_SEAL_WRITE) );
+    read_memfd( output_fd, output_len, &result );
+    ASSERT( images_equal( &expected, &result ) );
+    img_cleanup( &result );
+
+    // Bad requests fail without closing the connection
+    int output_fd2;
+    ASSERT( imgproc_client_transform( sock, input_fd, "gif", "blur 2", 0, &output_fd2, &output_len )
+            == IMGPROC_SERVER_BAD_REQUEST );
+    ASSERT( imgproc_client_transform( sock, input_fd, "png", "blur", 0, &output_fd2, &output_len )
+            == IMGPROC_SERVER_BAD_REQUEST );
+
+    // Long lists of wide stages are fine, unless they have more words
+    // than the most stages can take
+    char many[IMGPROC_SERVER_MAX_ARGS] = "";
+    for ( int j = 0; j < IMGPROC_MAX_STAGES - 4; j++ )
+      strcat( many, "crop 0 0 99 99 " );
+    strcat( many, "blur 2" );
+    ASSERT( imgproc_client_transform( sock, input_fd, "png", many, 0, &output_fd2, &output_len ) == IMG_SUCCESS );
+    close( output_fd2 );
+    many[0] = '\0';
+    for ( int j = 0; j < IMGPROC_MAX_STAGES; j++ )
+      strcat( many, "crop 0 0 99 99 " );
+    strcat( many, "blur 2" );
+    ASSERT( imgproc_client_transform( sock, input_fd, "png", many, 0, &output_fd2, &output_len )
+            == IMGPROC_SERVER_BAD_REQUEST );
+    close( input_fd );
+  }
+
+  // Inputs that could shrink while mapped are refused, and corrupt
+  // ones reported
+  int unsealed = imgproc_memfd_create( "test input", 64 );
+  int output_fd;
+  size_t output_len;
+  ASSERT( imgproc_client_transform( sock, unsealed, "png", "color_rot", 0, &output_fd, &output_len )
+          == IMGPROC_SERVER_BAD_REQUEST );
+  ASSERT( imgproc_memfd_seal( unsealed, 0 ) );
+  ASSERT( imgproc_client_transform( sock, unsealed, "png", "color_rot", 0, &output_fd, &output_len )
+          == IMG_ERR_COULD_NOT_OPEN );
+  close( unsealed );
+
+  // The statistics count the jobs so far
+  char *text;
+  size_t len;
+  FILE *out = open_memstream( &text, &len );
+  ASSERT( out != NULL );
+  ASSERT( imgproc_client_stats( sock, out ) );
+  fclose( out );
+  ASSERT( strstr( text, "imgproc_jobs_total{transform=\"pipeline\"} 4\n" ) != NULL );
+  ASSERT( strstr( text, "imgproc_jobs_total{transform=\"color_rot\"} 1\n" ) != NULL );
+  ASSERT( strstr( text, "imgproc_jobs_failed_total{transform=\"color_rot\"} 1\n" ) != NULL );
+  free( text );
+
+  close( sock );
+  imgproc_server_stop( server );
+  pthread_join( thread, NULL );
+  imgproc_server_destroy( server );
+  ASSERT( access( socket_path, F_OK ) != 0 );
+  ASSERT( rmdir( path ) == 0 );
+  img_cleanup( &expected );
+}
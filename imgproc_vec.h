@@ -0,0 +1,164 @@
+// Portable SIMD layer built on the GCC/Clang vector extensions, and
+// vector versions of the pixel helper functions. Used by the "vec"
+// kernel tier, which doesn't depend on any particular instruction set:
+// the compiler maps the vector operations to whatever the target has
+// (SSE2 on baseline x86-64, NEON on AArch64, or plain scalar code).
+
+#ifndef IMGPROC_VEC_H
+#define IMGPROC_VEC_H
+
+#include <string.h>
+#include "image.h" // for uint32_t
+
+//! Number of 32-bit pixels per vector. 16-byte vectors match the
+//! registers of the baseline targets (SSE2, NEON), so the vectors are
+//! passed in registers rather than split up.
+#define VEC_LANES 4
+
+//! A vector of VEC_LANES pixels (or other 32-bit values)
+typedef uint32_t vec_u32 __attribute__((vector_size(VEC_LANES * 4)));
+//! The same vector viewed as bytes
+typedef uint8_t vec_u8 __attribute__((vector_size(VEC_LANES * 4)));
+typedef int32_t vec_i32 __attribute__((vector_size(VEC_LANES * 4)));
+typedef float vec_f32 __attribute__((vector_size(VEC_LANES * 4)));
+//! VEC_LANES 8-bit values, one per lane of a vec_u32
+typedef uint8_t vec_u8_narrow __attribute__((vector_size(VEC_LANES)));
+
+//! Permute the bytes of one vector (VEC_SHUFFLE_U8) or the 32-bit lanes of
+//! two vectors (VEC_SHUFFLE2). The indices must be constants; for
+//! VEC_SHUFFLE2, indices of VEC_LANES and up select lanes of the second vector.
+#ifdef __clang__
+#define VEC_SHUFFLE_U8( v, ... ) __builtin_shufflevector( (v), (v), __VA_ARGS__ )
+#define VEC_SHUFFLE2( a, b, ... ) __builtin_shufflevector( (a), (b), __VA_ARGS__ )
+#else
+#define VEC_SHUFFLE_U8( v, ... ) __builtin_shuffle( (v), (vec_u8) { __VA_ARGS__ } )
+#define VEC_SHUFFLE2( a, b, ... ) __builtin_shuffle( (a), (b), (vec_u32) { __VA_ARGS__ } )
+#endif
+
+//! Load/store VEC_LANES pixels from/to a possibly unaligned address
+static inline vec_u32 vec_load( const uint32_t *p ) {
+  vec_u32 v;
+  memcpy( &v, p, sizeof(v) );
+  return v;
+}
+static inline void vec_store( uint32_t *p, vec_u32 v ) {
+  memcpy( p, &v, sizeof(v) );
+}
+
+//! Load/store only the first n (at most VEC_LANES) lanes, for row tails.
+//! Lanes that aren't loaded are zero.
+static inline vec_u32 vec_load_n( const uint32_t *p, int32_t n ) {
+  vec_u32 v = { 0 };
+  memcpy( &v, p, (size_t) n * sizeof(uint32_t) );
+  return v;
+}
+static inline void vec_store_n( uint32_t *p, vec_u32 v, int32_t n ) {
+  memcpy( p, &v, (size_t) n * sizeof(uint32_t) );
+}
+
+//! Load VEC_LANES bytes, widening each one to a 32-bit lane, and store
+//! the low 8 bits of each lane as VEC_LANES bytes
+static inline vec_u32 vec_load_u8( const uint8_t *p ) {
+  vec_u8_narrow v;
+  memcpy( &v, p, sizeof(v) );
+  return __builtin_convertvector( v, vec_u32 );
+}
+static inline void vec_store_u8( uint8_t *p, vec_u32 v ) {
+  vec_u8_narrow n = __builtin_convertvector( v, vec_u8_narrow );
+  memcpy( p, &n, sizeof(n) );
+}
+
+//! Vector with x in every lane, and with lane i equal to x + i
+static inline vec_u32 vec_splat( uint32_t x ) {
+  return (vec_u32) { 0 } + x;
+}
+static inline vec_u32 vec_iota( uint32_t x ) {
+  return (vec_u32) { 0, 1, 2, 3 } + x;
+}
+
+//! Lanewise a < b as a mask (all ones or all zeros per lane), and
+//! lanewise selection of a where mask is set and b elsewhere
+static inline vec_u32 vec_lt( vec_u32 a, vec_u32 b ) {
+  return (vec_u32) (a < b);
+}
+static inline vec_u32 vec_select( vec_u32 mask, vec_u32 a, vec_u32 b ) {
+  return (a & mask) | (b & ~mask);
+}
+
+//! Lanewise min/max of signed values
+static inline vec_u32 vec_min_i32( vec_u32 a, vec_u32 b ) {
+  return vec_select( (vec_u32) ((vec_i32) a < (vec_i32) b), a, b );
+}
+static inline vec_u32 vec_max_i32( vec_u32 a, vec_u32 b ) {
+  return vec_select( (vec_u32) ((vec_i32) a > (vec_i32) b), a, b );
+}
+
+//! Lanewise truncating division n / d. The single precision quotient is
+//! within 1 of the exact one for pixel component sums, so one
+//! correction step in each direction makes it exact.
+static inline vec_u32 vec_udiv( vec_u32 n, vec_u32 d ) {
+  vec_f32 qf = __builtin_convertvector( n, vec_f32 ) / __builtin_convertvector( d, vec_f32 );
+  vec_u32 q = __builtin_convertvector( qf, vec_u32 );
+  // Comparisons are -1 in the lanes where they are true
+  q += (vec_u32) (q * d > n);
+  q -= (vec_u32) (n - q * d >= d);
+  return q;
+}
+
+//! Vector versions of get_r, get_g, get_b, get_a and make_pixel
+static inline vec_u32 vec_get_r( vec_u32 p ) {
+  return p >> 24;
+}
+static inline vec_u32 vec_get_g( vec_u32 p ) {
+  return (p >> 16) & 0xFF;
+}
+static inline vec_u32 vec_get_b( vec_u32 p ) {
+  return (p >> 8) & 0xFF;
+}
+static inline vec_u32 vec_get_a( vec_u32 p ) {
+  return p & 0xFF;
+}
+static inline vec_u32 vec_make_pixel( vec_u32 r, vec_u32 g, vec_u32 b, vec_u32 a ) {
+  return (r << 24) | (g << 16) | (b << 8) | a;
+}
+
+//! Average two vectors of pixels per component, truncating like avg_pixels.
+//! a + b = 2 * (a & b) + (a ^ b), so (a & b) + (a ^ b) / 2 is the average;
+//! the mask stops each component's low bit from shifting into its neighbour.
+static inline vec_u32 vec_avg2_pixels( vec_u32 a, vec_u32 b ) {
+  return (a & b) + (((a ^ b) & 0xFEFEFEFE) >> 1);
+}
+
+//! Average four vectors of pixels per component, truncating like avg_pixels.
+//! The even and odd components are summed separately in 16-bit fields, which
+//! can hold the sum of four 8-bit values.
+static inline vec_u32 vec_avg4_pixels( vec_u32 a, vec_u32 b, vec_u32 c, vec_u32 d ) {
+  vec_u32 even = (a & 0x00FF00FF) + (b & 0x00FF00FF) + (c & 0x00FF00FF) + (d & 0x00FF00FF);
+  vec_u32 odd = ((a >> 8) & 0x00FF00FF) + ((b >> 8) & 0x00FF00FF)
+              + ((c >> 8) & 0x00FF00FF) + ((d >> 8) & 0x00FF00FF);
+  return ((even >> 2) & 0x00FF00FF) | (((odd >> 2) & 0x00FF00FF) << 8);
+}
+
+//! Vector version of avg_pixels: lane i of the result is the average of
+//! lane i of the num_pixels vectors in pixels.
+static inline vec_u32 vec_avg_pixels( const vec_u32 *pixels, int num_pixels ) {
+  if (num_pixels == 2) {
+    return vec_avg2_pixels( pixels[0], pixels[1] );
+  }
+  if (num_pixels == 4) {
+    return vec_avg4_pixels( pixels[0], pixels[1], pixels[2], pixels[3] );
+  }
+
+  vec_u32 r_total = { 0 }, g_total = { 0 }, b_total = { 0 }, a_total = { 0 };
+  for (int i = 0; i < num_pixels; i++) {
+    r_total += vec_get_r( pixels[i] );
+    g_total += vec_get_g( pixels[i] );
+    b_total += vec_get_b( pixels[i] );
+    a_total += vec_get_a( pixels[i] );
+  }
+  vec_u32 count = vec_splat( (uint32_t) num_pixels );
+  return vec_make_pixel( vec_udiv( r_total, count ), vec_udiv( g_total, count ),
+                         vec_udiv( b_total, count ), vec_udiv( a_total, count ) );
+}
+
+#endif // IMGPROC_VEC_H
@@ -0,0 +1,134 @@
+// Execution tracer. Each thread appends its events to chunks of a
+// buffer of its own; the buffers are kept on a list (pushed onto with
+// a compare-and-swap) that is walked when the trace is written at
+// exit. Each chunk's event count is published with a release store,
+// so the events are read consistently even if a thread were still
+// recording.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "imgtrace.h"
+
+// Events per chunk of a thread's buffer
+#define TRACE_CHUNK_EVENTS 4096
+
+struct TraceEvent {
+  const char *name;
+  int64_t arg;
+  uint64_t ns;  // since imgtrace_init
+  char phase;
+};
+
+struct TraceChunk {
+  struct TraceChunk *next;
+  int count;  // events recorded, read and written atomically
+  struct TraceEvent events[TRACE_CHUNK_EVENTS];
+};
+
+struct TraceBuffer {
+  struct TraceBuffer *next;  // next thread's buffer
+  int tid;
+  struct TraceChunk *first, *last;
+};
+
+int imgtrace_on;
+
+static char *s_filename;
+static struct timespec s_start;
+static struct TraceBuffer *s_buffers;
+static __thread struct TraceBuffer *t_buffer;
+
+static uint64_t elapsed_ns( void ) {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return (uint64_t) (ts.tv_sec - s_start.tv_sec) * 1000000000u + ts.tv_nsec - s_start.tv_nsec;
+}
+
+// Create the calling thread's buffer and add it to the list
+static struct TraceBuffer *thread_buffer( void ) {
+  struct TraceBuffer *buf = calloc( 1, sizeof( struct TraceBuffer ) );
+  struct TraceChunk *chunk = calloc( 1, sizeof( struct TraceChunk ) );
+  if ( buf == NULL || chunk == NULL ) {
+    free( buf );
+    free( chunk );
+    return NULL;
+  }
+  buf->tid = (int) syscall( SYS_gettid );
+  buf->first = buf->last = chunk;
+  buf->next = __atomic_load_n( &s_buffers, __ATOMIC_ACQUIRE );
+  while ( !__atomic_compare_exchange_n( &s_buffers, &buf->next, buf, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE ) )
+    ;
+  return buf;
+}
+
+void imgtrace_record( const char *name, char phase, int64_t arg ) {
+  struct TraceBuffer *buf = t_buffer;
+  if ( buf == NULL ) {
+    buf = t_buffer = thread_buffer();
+    if ( buf == NULL )
+      return;
+  }
+
+  struct TraceChunk *chunk = buf->last;
+  int n = chunk->count;
+  if ( n == TRACE_CHUNK_EVENTS ) {
+    struct TraceChunk *next = calloc( 1, sizeof( struct TraceChunk ) );
+    if ( next == NULL )
+      return;
+    __atomic_store_n( &chunk->next, next, __ATOMIC_RELEASE );
+    buf->last = chunk = next;
+    n = 0;
+  }
+  chunk->events[n] = (struct TraceEvent) { name, arg, elapsed_ns(), phase };
+  __atomic_store_n( &chunk->count, n + 1, __ATOMIC_RELEASE );
+}
+
+int imgtrace_write( const char *filename ) {
+  FILE *out = fopen( filename, "w" );
+  if ( out == NULL )
+    return 0;
+
+  int pid = (int) getpid();
+  const char *sep = "";
+  fprintf( out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n" );
+  for ( struct TraceBuffer *buf = __atomic_load_n( &s_buffers, __ATOMIC_ACQUIRE ); buf != NULL; buf = buf->next ) {
+    for ( struct TraceChunk *chunk = buf->first; chunk != NULL; chunk = __atomic_load_n( &chunk->next, __ATOMIC_ACQUIRE ) ) {
+      int count = __atomic_load_n( &chunk->count, __ATOMIC_ACQUIRE );
+      for ( int i = 0; i < count; i++ ) {
+        const struct TraceEvent *ev = &chunk->events[i];
+        // timestamps are in microseconds
+        fprintf( out, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu.%03u,\"pid\":%d,\"tid\":%d",
+                 sep, ev->name, ev->phase, (unsigned long long) (ev->ns / 1000), (unsigned) (ev->ns % 1000),
+                 pid, buf->tid );
+        if ( ev->arg >= 0 )
+          fprintf( out, ",\"args\":{\"arg\":%lld}", (long long) ev->arg );
+        fputc( '}', out );
+        sep = ",\n";
+      }
+    }
+  }
+  fprintf( out, "\n]}\n" );
+  return fclose( out ) == 0;
+}
+
+// Write the trace at exit
+static void write_trace( void ) {
+  if ( !imgtrace_write( s_filename ) )
+    fprintf( stderr, "Error: couldn't write trace file '%s'\n", s_filename );
+}
+
+void imgtrace_init( void ) {
+  const char *env = getenv( "IMGPROC_TRACE" );
+  if ( env == NULL || env[0] == '\0' || imgtrace_on )
+    return;
+  s_filename = strdup( env );
+  if ( s_filename == NULL || atexit( write_trace ) != 0 )
+    return;
+  clock_gettime( CLOCK_MONOTONIC, &s_start );
+  imgtrace_on = 1;
+}
@@ -0,0 +1,47 @@
+// Header for the execution tracer, which records when each thread
+// begins and ends the phases of decoding, transforming and encoding
+// images, and writes them as a Chrome trace-event JSON file (which
+// chrome://tracing and ui.perfetto.dev display as a timeline per
+// thread) when the program exits.
+
+#ifndef IMGTRACE_H
+#define IMGTRACE_H
+
+#include <stdint.h>
+
+//! Nonzero if events are recorded. Only set by imgtrace_init.
+extern int imgtrace_on;
+
+//! Turn tracing on if the IMGPROC_TRACE environment variable names an
+//! output file, which is then written at exit. Must be called before
+//! the work to be traced starts (e.g. first thing in main); without it,
+//! tracing stays off and each event costs a single test.
+void imgtrace_init( void );
+
+//! Write the events recorded so far to the named file as JSON (an
+//! object whose traceEvents are the events of all threads, timestamped
+//! in microseconds since imgtrace_init). Returns 1 if the file was
+//! written, 0 if not.
+int imgtrace_write( const char *filename );
+
+//! Record an event of the calling thread: phase 'B' (begin) or 'E'
+//! (end). name must stay valid until the program exits (a string
+//! literal), and arg is shown with begin events unless it is negative.
+//! Events go to a buffer owned by the thread, so recording takes no
+//! locks. Use imgtrace_begin and imgtrace_end rather than calling this
+//! directly.
+void imgtrace_record( const char *name, char phase, int64_t arg );
+
+//! Begin and end a phase named name on the calling thread. Phases on
+//! the same thread must nest, and each end must name the phase begun
+//! last. arg is e.g. the first row of a band, or -1 for none.
+static inline void imgtrace_begin( const char *name, int64_t arg ) {
+  if ( imgtrace_on )
+    imgtrace_record( name, 'B', arg );
+}
+static inline void imgtrace_end( const char *name ) {
+  if ( imgtrace_on )
+    imgtrace_record( name, 'E', -1 );
+}
+
+#endif // IMGTRACE_H
@@ -0,0 +1,271 @@
+// Threaded execution layer: row bands split into tasks for the
+// work-stealing scheduler, with bands placed on CPUs according to the
+// NUMA topology
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include "parallel.h"
+#include "tasks.h"
+#include "imgtrace.h"
+#include "imgjob.h"
+
+// Upper bound on the number of bands/threads used by a single par_for
+#define PAR_MAX_THREADS 256
+
+// Number of tasks each thread's band is split into
+#define PAR_TASKS_PER_BAND 8
+
+// Number of bands the range is split into on a single thread when a
+// job is current, so that the job is checked while the range runs
+#define PAR_JOB_BANDS 64
+
+// Upper bound on the number of CPUs considered for pinning
+#define PAR_MAX_CPUS 1024
+
+// Where the kernel describes the NUMA nodes and their CPUs
+#ifndef PAR_NODE_DIR
+#define PAR_NODE_DIR "/sys/devices/system/node"
+#endif
+
+// A call of par_for, shared by its tasks
+struct ParLoop {
+  par_range_fn fn;
+  void *ctx;
+  struct ImgJob *job;  // the calling thread's current job, or NULL
+  int32_t n;
+  int32_t done;        // indices processed, if the job's progress is reported
+  int report;          // whether to report the job's progress
+};
+
+// Work description for one task (part of a band)
+struct ParBand {
+  struct ParLoop *loop;
+  int32_t begin;
+  int32_t end;
+};
+
+// The CPUs this process may run on, ordered node by node, so that
+// consecutive bands (and so neighbouring rows) stay on the same node
+static struct {
+  int num_cpus;
+  int num_nodes;
+  int cpus[PAR_MAX_CPUS];
+  int pin;
+} s_topo;
+static pthread_once_t s_topo_once = PTHREAD_ONCE_INIT;
+
+// Append the CPUs in a cpulist string such as "0-3,8-11" that are in
+// allowed to the topology
+static void add_cpulist( const char *list, const cpu_set_t *allowed ) {
+  const char *p = list;
+  while ( *p != '\0' && *p != '\n' ) {
+    char *next;
+    long first = strtol( p, &next, 10 );
+    if ( next == p )
+      return;
+    long last = first;
+    if ( *next == '-' ) {
+      p = next + 1;
+      last = strtol( p, &next, 10 );
+      if ( next == p )
+        return;
+    }
+    for ( long cpu = first; cpu <= last && s_topo.num_cpus < PAR_MAX_CPUS; cpu++ ) {
+      if ( cpu < CPU_SETSIZE && CPU_ISSET( cpu, allowed ) ) {
+        s_topo.cpus[s_topo.num_cpus++] = (int) cpu;
+      }
+    }
+    p = *next == ',' ? next + 1 : next;
+  }
+}
+
+static int compare_ints( const void *a, const void *b ) {
+  return *(const int *) a - *(const int *) b;
+}
+
+static void read_topology( void ) {
+  cpu_set_t allowed;
+  if ( sched_getaffinity( 0, sizeof( allowed ), &allowed ) != 0 )
+    return;
+
+  // Collect the node numbers, in order
+  int node_ids[PAR_MAX_CPUS];
+  int num_nodes = 0;
+  DIR *dir = opendir( PAR_NODE_DIR );
+  if ( dir != NULL ) {
+    struct dirent *ent;
+    int id;
+    while ( (ent = readdir( dir )) != NULL && num_nodes < PAR_MAX_CPUS ) {
+      if ( sscanf( ent->d_name, "node%d", &id ) == 1 )
+        node_ids[num_nodes++] = id;
+    }
+    closedir( dir );
+  }
+  qsort( node_ids, num_nodes, sizeof( int ), compare_ints );
+
+  for ( int i = 0; i < num_nodes; i++ ) {
+    char path[256], list[4096];
+    snprintf( path, sizeof( path ), "%s/node%d/cpulist", PAR_NODE_DIR, node_ids[i] );
+    FILE *f = fopen( path, "r" );
+    if ( f == NULL )
+      continue;
+    int before = s_topo.num_cpus;
+    if ( fgets( list, sizeof( list ), f ) != NULL )
+      add_cpulist( list, &allowed );
+    fclose( f );
+    if ( s_topo.num_cpus > before )
+      s_topo.num_nodes++;
+  }
+
+  // Without NUMA information, treat all allowed CPUs as one node
+  if ( s_topo.num_cpus == 0 ) {
+    s_topo.num_nodes = 1;
+    for ( int cpu = 0; cpu < CPU_SETSIZE && s_topo.num_cpus < PAR_MAX_CPUS; cpu++ ) {
+      if ( CPU_ISSET( cpu, &allowed ) ) {
+        s_topo.cpus[s_topo.num_cpus++] = cpu;
+      }
+    }
+  }
+}
+
+static void init_topology( void ) {
+  read_topology();
+
+  // Pin by default only when there is more than one node; IMGPROC_PIN
+  // forces pinning on (1) or off (0)
+  const char *env = getenv( "IMGPROC_PIN" );
+  if ( env != NULL )
+    s_topo.pin = atoi( env ) != 0;
+  else
+    s_topo.pin = s_topo.num_nodes > 1;
+  if ( s_topo.num_cpus == 0 )
+    s_topo.pin = 0;
+}
+
+int par_num_nodes( void ) {
+  pthread_once( &s_topo_once, init_topology );
+  return s_topo.num_nodes > 0 ? s_topo.num_nodes : 1;
+}
+
+int par_band_cpu( int band ) {
+  pthread_once( &s_topo_once, init_topology );
+  if ( !s_topo.pin )
+    return -1;
+  return s_topo.cpus[band % s_topo.num_cpus];
+}
+
+// Nesting depth of the bands the calling thread is running
+static __thread int t_band_depth;
+
+// Run one band, traced as a "band" event with its first index, with
+// the loop's job current, unless the job is stopped. Only loops that
+// aren't nested in another loop's bands report the job's progress.
+static void run_band( struct ParLoop *loop, int32_t begin, int32_t end ) {
+  if ( imgjob_stopped( loop->job ) )
+    return;
+  struct ImgJob *prev = imgjob_enter( loop->job );
+  t_band_depth++;
+  imgtrace_begin( "band", begin );
+  loop->fn( loop->ctx, begin, end );
+  imgtrace_end( "band" );
+  t_band_depth--;
+  imgjob_enter( prev );
+
+  if ( loop->report ) {
+    int32_t done = __atomic_add_fetch( &loop->done, end - begin, __ATOMIC_RELAXED );
+    imgjob_step_progress( loop->job, (double) done / loop->n );
+  }
+}
+
+// Run the whole range on the calling thread, in PAR_JOB_BANDS bands if
+// a job is current
+static void run_serial( struct ParLoop *loop ) {
+  if ( loop->job == NULL ) {
+    run_band( loop, 0, loop->n );
+    return;
+  }
+  int32_t len = loop->n / PAR_JOB_BANDS > 0 ? loop->n / PAR_JOB_BANDS : 1;
+  for ( int32_t begin = 0; begin < loop->n; begin += len )
+    run_band( loop, begin, loop->n - begin > len ? begin + len : loop->n );
+}
+
+static void par_band_task( void *arg ) {
+  struct ParBand *band = arg;
+  run_band( band->loop, band->begin, band->end );
+}
+
+int par_num_threads( void ) {
+  const char *env = getenv( "IMGPROC_THREADS" );
+  long n = 0;
+
+  if ( env != NULL )
+    n = strtol( env, NULL, 10 );
+  if ( n <= 0 )
+    n = sysconf( _SC_NPROCESSORS_ONLN );
+
+  // Clamp to a sane range
+  if ( n < 1 ) { n = 1; }
+  if ( n > PAR_MAX_THREADS ) { n = PAR_MAX_THREADS; }
+  return (int) n;
+}
+
+void par_for( int32_t n, par_range_fn fn, void *ctx ) {
+  if ( n <= 0 )
+    return;
+
+  struct ImgJob *job = imgjob_current();
+  struct ParLoop loop = { fn, ctx, job, n, 0, job != NULL && job->progress != NULL && t_band_depth == 0 };
+
+  // Never use more bands than there are rows
+  int32_t nthreads = par_num_threads();
+  if ( nthreads > n ) { nthreads = n; }
+
+  if ( nthreads == 1 ) {
+    run_serial( &loop );
+    return;
+  }
+  int32_t nworkers = tasks_num_workers();
+  if ( nthreads > nworkers ) { nthreads = nworkers; }
+
+  // Split each thread's band into several tasks, so that threads that
+  // finish early can steal part of a slower thread's band
+  int32_t ntasks = nthreads * PAR_TASKS_PER_BAND;
+  if ( ntasks > n ) { ntasks = n; }
+  struct ParBand *tasks = malloc( ntasks * sizeof( struct ParBand ) );
+  if ( nthreads <= 1 || tasks == NULL ) {
+    free( tasks );
+    run_serial( &loop );
+    return;
+  }
+
+  // Distribute the remainder over the first tasks so sizes differ by at most 1
+  int32_t base = n / ntasks;
+  int32_t extra = n % ntasks;
+  int32_t begin = 0;
+  for ( int32_t i = 0; i < ntasks; i++ ) {
+    int32_t len = base + (i < extra ? 1 : 0);
+    tasks[i].loop = &loop;
+    tasks[i].begin = begin;
+    tasks[i].end = begin + len;
+    begin += len;
+  }
+
+  // Each thread's tasks go on that worker's deque, so unless they are
+  // stolen, band i runs on par_band_cpu( i ). When par_for is called
+  // from a task, the tasks go on the calling worker's own deque. They
+  // are queued last to first, so the owner runs them in row order.
+  struct TaskGroup group = TASK_GROUP_INIT;
+  int nested = tasks_current_worker() >= 0;
+  for ( int32_t i = ntasks - 1; i >= 0; i-- ) {
+    int worker = nested ? -1 : (int) ((int64_t) i * nthreads / ntasks);
+    tasks_spawn( &group, worker, par_band_task, &tasks[i] );
+  }
+  tasks_wait( &group );
+  free( tasks );
+}
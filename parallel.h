@@ -0,0 +1,56 @@
+// Header for the threaded execution layer used by the image
+// transformations to split work into row (or column) bands.
+
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <stdint.h>
+
+//! Callback type for par_for: process the half-open range [begin, end)
+//! of rows (or columns) using the caller-supplied context pointer.
+typedef void (*par_range_fn)( void *ctx, int32_t begin, int32_t end );
+
+//! Return the number of worker threads par_for will use (at least 1).
+//! Defaults to the number of online processors and can be overridden
+//! with the IMGPROC_THREADS environment variable.
+int par_num_threads( void );
+
+//! Return the number of NUMA nodes the process can run on (at least 1),
+//! as described by /sys/devices/system/node.
+int par_num_nodes( void );
+
+//! Return the CPU that worker thread number band (which processes band
+//! number band of a par_for) is pinned to, or -1 if threads aren't
+//! pinned. CPUs are assigned node by node, so consecutive bands run on
+//! the same node.
+//! Threads are pinned by default on machines with more than one node;
+//! the IMGPROC_PIN environment variable (0 or 1) overrides this.
+int par_band_cpu( int band );
+
+//! Split the range [0, n) into contiguous bands, one per worker thread,
+//! and each band into several tasks for the work-stealing scheduler
+//! (see tasks.h), and call fn on the range of each task. Returns once
+//! every task has been processed; while waiting, the calling thread
+//! runs queued tasks too. par_for may be called from within fn (or from
+//! any other task), e.g. to process the rows of images in a batch.
+//!
+//! Since the split only depends on n and the number of threads, calls
+//! with the same n queue band i's rows on the same worker and CPU.
+//! Buffers first touched with par_for (as img_init does) therefore have
+//! each band's pages on the node of the thread that later processes
+//! it, except for the parts stolen by other threads.
+//!
+//! If the calling thread has a current job (see imgjob.h), the job is
+//! current in fn too, and once the job is stopped, the bands that
+//! haven't started are skipped: callers that use what fn computed
+//! must then check imgjob_check() before relying on it. With a single
+//! thread, the range is still split into bands so that the job is
+//! checked while it runs. The rows done by a par_for that isn't called
+//! from fn count towards the progress of the job's current step.
+//!
+//! @param n number of rows (or columns) to process
+//! @param fn callback invoked once per band
+//! @param ctx context pointer passed through to fn
+void par_for( int32_t n, par_range_fn fn, void *ctx );
+
+#endif // PARALLEL_H
@@ -4,6 +4,15 @@
 #define DO_CRC_CHECKS 1
 #define USE_ZLIB 1
 
+/* Size of the buffers for the image data of streaming reads and writes (and so of the IDAT chunks
+   they write) */
+#define PNG_STREAM_BUFSIZE 65536
+
+/* Bytes of compressed (or uncompressed) data inflated (or deflated), and rows unfiltered, between
+   calls of the cancel callback */
+#define PNG_CANCEL_BYTES 262144
+#define PNG_CANCEL_ROWS 64
+
 #if USE_ZLIB
 #include <zlib.h>
 #else
@@ -15,9 +24,6 @@
 #include <string.h>
 #include "pnglite.h"
 
-static png_alloc_t png_alloc;
-static png_free_t png_free;
-
 static size_t file_read(png_t* png, void* out, size_t size, size_t numel)
 {
 	size_t result;
@@ -56,6 +62,19 @@ static size_t file_write(png_t* png, void* p, size_t size, size_t numel)
 	return result;
 }
 
+/* Marks the beginning or end of a phase for the trace callback, if there is one */
+static void png_trace(png_t* png, const char* name, int begin)
+{
+	if(png->trace)
+		png->trace(name, begin);
+}
+
+/* Whether the cancel callback, if there is one, asks to stop */
+static int png_cancelled(png_t* png)
+{
+	return png->cancelled && png->cancelled();
+}
+
 static int file_read_ul(png_t* png, unsigned *out)
 {
 	unsigned char buf[4];
@@ -105,19 +124,10 @@ static unsigned set_ul(unsigned char* buf, unsigned in)
 	return PNG_NO_ERROR;
 }
 
-int png_init(png_alloc_t pngalloc, png_free_t pngfree)
+void png_set_allocator(png_t* png, png_alloc_t pngalloc, png_free_t pngfree)
 {
-	if(pngalloc)
-		png_alloc = pngalloc;
-	else
-		png_alloc = &malloc;
-
-	if(pngfree)
-		png_free = pngfree;
-	else
-		png_free = &free;
-
-	return PNG_NO_ERROR;
+	png->alloc_fun = pngalloc ? pngalloc : &malloc;
+	png->free_fun = pngfree ? pngfree : &free;
 }
 
 static int png_get_bpp(png_t* png)
@@ -140,9 +150,64 @@ static int png_get_bpp(png_t* png)
 		return PNG_FILE_ERROR;
 	}
 
-	bpp *= png->depth/8;
+	bpp *= png->depth;
+
+	/* filters work on whole bytes, so smaller pixels count as one byte */
+	return bpp < 8 ? 1 : bpp/8;
+}
+
+/* Bits in a pixel */
+static unsigned png_pixel_bits(png_t* png)
+{
+	unsigned channels = png->color_type == PNG_TRUECOLOR ? 3 :
+			    png->color_type == PNG_GREYSCALE_ALPHA ? 2 :
+			    png->color_type == PNG_TRUECOLOR_ALPHA ? 4 : 1;
+
+	return channels * png->depth;
+}
+
+/* Bytes in an (unfiltered) row of width pixels */
+static unsigned png_row_len_for(png_t* png, unsigned width)
+{
+	return (unsigned)(((unsigned long long)width * png_pixel_bits(png) + 7) / 8);
+}
+
+/* Bytes in an (unfiltered) row of the image */
+static unsigned png_row_len(png_t* png)
+{
+	return png_row_len_for(png, png->width);
+}
+
+/* The Adam7 passes: first column and row, and the distance between columns and rows */
+static const unsigned char png_adam7[7][4] =
+{
+	{ 0, 0, 8, 8 }, { 4, 0, 8, 8 }, { 0, 4, 4, 8 }, { 2, 0, 4, 4 },
+	{ 0, 2, 2, 4 }, { 1, 0, 2, 2 }, { 0, 1, 1, 2 }
+};
+
+/* Size in pixels of the reduced image of a pass (0 to 6); either may be 0 */
+static void png_pass_size(png_t* png, int pass, unsigned* width, unsigned* height)
+{
+	const unsigned char *p = png_adam7[pass];
+
+	*width = png->width > p[0] ? (png->width - p[0] + p[2] - 1) / p[2] : 0;
+	*height = png->height > p[1] ? (png->height - p[1] + p[3] - 1) / p[3] : 0;
+}
+
+/* Bytes of filtered data of a pass */
+static unsigned long long png_pass_len(png_t* png, int pass)
+{
+	unsigned width, height;
+
+	png_pass_size(png, pass, &width, &height);
+	if(!width || !height)
+		return 0;
+	return (unsigned long long)(png_row_len_for(png, width) + 1) * height;
+}
 
-	return bpp;
+unsigned png_get_row_bytes(png_t* png)
+{
+	return png_row_len(png);
 }
 
 static int png_read_ihdr(png_t* png)
@@ -157,10 +222,7 @@ static int png_read_ihdr(png_t* png)
 	file_read_ul(png, &length);
 
 	if(length != 13)
-	{
-		printf("%d\n", length);
 		return PNG_CRC_ERROR;
-	}
 
 	if(file_read(png, ihdr, 1, 13+4) != 13+4)
 		return PNG_EOF_ERROR;
@@ -184,13 +246,28 @@ static int png_read_ihdr(png_t* png)
 	png->filter_method = ihdr[15];
 	png->interlace_method = ihdr[16];
 
-	if(png->color_type == PNG_INDEXED)
-		return PNG_NOT_SUPPORTED;
-
-	if(png->depth != 8 && png->depth != 16)
+	/* the allowed bit depths for each color type */
+	switch(png->color_type)
+	{
+	case PNG_GREYSCALE:
+		if(png->depth != 1 && png->depth != 2 && png->depth != 4 && png->depth != 8 && png->depth != 16)
+			return PNG_NOT_SUPPORTED;
+		break;
+	case PNG_INDEXED:
+		if(png->depth != 1 && png->depth != 2 && png->depth != 4 && png->depth != 8)
+			return PNG_NOT_SUPPORTED;
+		break;
+	case PNG_TRUECOLOR:
+	case PNG_GREYSCALE_ALPHA:
+	case PNG_TRUECOLOR_ALPHA:
+		if(png->depth != 8 && png->depth != 16)
+			return PNG_NOT_SUPPORTED;
+		break;
+	default:
 		return PNG_NOT_SUPPORTED;
+	}
 
-	if(png->interlace_method)
+	if(png->interlace_method > 1)
 		return PNG_NOT_SUPPORTED;
 
 	return PNG_NO_ERROR;
@@ -251,11 +328,63 @@ void png_print_info(png_t* png)
 	printf("\tinterlace:\t%s\n",	png->interlace_method?"interlace":"no interlace");
 }
 
+static void png_init_options(png_t* png)
+{
+	png->restart_rows = 0;
+	png->restarts = 0;
+	png->num_restarts = 0;
+	png->parallel_for = 0;
+	png->trace = 0;
+	png->cancelled = 0;
+	png->idat = 0;
+	png->idatlen = 0;
+	png->idatcap = 0;
+	png->crc_checks = 1;
+	png->palette_size = 0;
+	png->has_transparent = 0;
+	png->passes = 7;
+	png->zs = 0;
+	png->png_data = 0;
+	png->readbuf = 0;
+	png->readbuflen = 0;
+	png->prev_row = 0;
+	png->row = 0;
+	png->idat_left = 0;
+	png->zlib_msg = 0;
+	png_set_allocator(png, 0, 0);
+}
+
+void png_set_restart_interval(png_t* png, unsigned rows)
+{
+	png->restart_rows = rows;
+}
+
+void png_set_parallel(png_t* png, png_parallel_for_t parallel_for)
+{
+	png->parallel_for = parallel_for;
+}
+
+void png_set_trace(png_t* png, png_trace_t trace)
+{
+	png->trace = trace;
+}
+
+void png_set_cancel(png_t* png, png_cancel_t cancelled)
+{
+	png->cancelled = cancelled;
+}
+
+void png_set_crc_checks(png_t* png, int enabled)
+{
+	png->crc_checks = enabled != 0;
+}
+
 int png_open_read(png_t* png, png_read_callback_t read_fun, void* user_pointer)
 {
 	char header[8];
 	int result;
 
+	png_init_options(png);
 	png->read_fun = read_fun;
 	png->write_fun = 0;
 	png->user_pointer = user_pointer;
@@ -278,6 +407,7 @@ int png_open_read(png_t* png, png_read_callback_t read_fun, void* user_pointer)
 
 int png_open_write(png_t* png, png_write_callback_t write_fun, void* user_pointer)
 {
+	png_init_options(png);
 	png->write_fun = write_fun;
 	png->read_fun = 0;
 	png->user_pointer = user_pointer;
@@ -325,17 +455,38 @@ int png_close_file(png_t* png)
 	return PNG_NO_ERROR;
 }
 
+/* zlib allocates through the png's allocator too */
+static voidpf png_zalloc(voidpf opaque, uInt items, uInt size)
+{
+	png_t* png = opaque;
+	return png->alloc_fun((size_t)items * size);
+}
+
+static void png_zfree(voidpf opaque, voidpf p)
+{
+	png_t* png = opaque;
+	png->free_fun(p);
+}
+
+static void png_zstream_init(png_t* png, z_stream* stream)
+{
+	memset(stream, 0, sizeof(z_stream));
+	stream->zalloc = png_zalloc;
+	stream->zfree = png_zfree;
+	stream->opaque = png;
+}
+
 static int png_init_deflate(png_t* png, unsigned char* data, int datalen)
 {
 	z_stream *stream;
-	png->zs = png_alloc(sizeof(z_stream));
+	png->zs = png->alloc_fun(sizeof(z_stream));
 
 	stream = png->zs;
 
 	if(!stream)
 		return PNG_MEMORY_ERROR;
 
-	memset(stream, 0, sizeof(z_stream));
+	png_zstream_init(png, stream);
 
 	if(deflateInit(stream, Z_DEFAULT_COMPRESSION) != Z_OK)
 		return PNG_ZLIB_ERROR;
@@ -350,10 +501,10 @@ static int png_init_inflate(png_t* png)
 {
 #if USE_ZLIB
 	z_stream *stream;
-	png->zs = png_alloc(sizeof(z_stream));
+	png->zs = png->alloc_fun(sizeof(z_stream));
 #else
 	zl_stream *stream;
-	png->zs = png_alloc(sizeof(zl_stream));
+	png->zs = png->alloc_fun(sizeof(zl_stream));
 #endif
 
 	stream = png->zs;
@@ -362,7 +513,7 @@ static int png_init_inflate(png_t* png)
 		return PNG_MEMORY_ERROR;
 
 #if USE_ZLIB
-	memset(stream, 0, sizeof(z_stream));
+	png_zstream_init(png, stream);
 	if(inflateInit(stream) != Z_OK)
 		return PNG_ZLIB_ERROR;
 #else
@@ -386,7 +537,7 @@ static int png_end_deflate(png_t* png)
 
 	deflateEnd(stream);
 
-	png_free(png->zs);
+	png->free_fun(png->zs);
 
 	return PNG_NO_ERROR;
 }
@@ -408,11 +559,11 @@ static int png_end_inflate(png_t* png)
 	if(z_inflateEnd(stream) != Z_OK)
 #endif
 	{
-		printf("ZLIB says: %s\n", stream->msg);
+		png->zlib_msg = stream->msg;
 		return PNG_ZLIB_ERROR;
 	}
 
-	png_free(png->zs);
+	png->free_fun(png->zs);
 
 	return PNG_NO_ERROR;
 }
@@ -429,23 +580,39 @@ static int png_inflate(png_t* png, unsigned char* data, int len)
 	if(!stream)
 		return PNG_MEMORY_ERROR;
 
-	stream->next_in = data;
-	stream->avail_in = len;
+	/* the data is inflated in slices, checking in between whether to stop */
+	while(len > 0)
+	{
+		int slice = len < PNG_CANCEL_BYTES ? len : PNG_CANCEL_BYTES;
+
+		if(png_cancelled(png))
+			return PNG_CANCELLED;
+
+		stream->next_in = data;
+		stream->avail_in = slice;
 
 #if USE_ZLIB
-	result = inflate(stream, Z_SYNC_FLUSH);
+		result = inflate(stream, Z_SYNC_FLUSH);
 #else
-	result = z_inflate(stream);
+		result = z_inflate(stream);
 #endif
 
-	if(result != Z_STREAM_END && result != Z_OK)
-	{
-		printf("%s\n", stream->msg);
-		return PNG_ZLIB_ERROR;
-	}
+		/* the rest of the data belongs to passes that aren't wanted */
+		if(stream->avail_out == 0 && png->interlace_method && png->passes < 7)
+			return PNG_DONE;
 
-	if(stream->avail_in != 0)
-		return PNG_ZLIB_ERROR;
+		if(result != Z_STREAM_END && result != Z_OK)
+		{
+			png->zlib_msg = stream->msg;
+			return PNG_ZLIB_ERROR;
+		}
+
+		if(stream->avail_in != 0)
+			return PNG_ZLIB_ERROR;
+
+		data += slice;
+		len -= slice;
+	}
 
 	return PNG_NO_ERROR;
 }
@@ -468,13 +635,88 @@ static int png_deflate(png_t* png, char* outdata, int outlen, int *outwritten)
 
 	if(result != Z_STREAM_END && result != Z_OK)
 	{
-		printf("%s\n", stream->msg);
+		png->zlib_msg = stream->msg;
 		return PNG_ZLIB_ERROR;
 	}
 
 	return result;
 }
 
+/* Compress the image data in bands of rows rows, ending each band but the last with a Z_FULL_FLUSH
+   so that the next one can be inflated on its own. If there is more than one band, the row and the
+   offset in the zlib stream of each band's start are stored in restarts (as big-endian pairs). The
+   size of the compressed data is stored in written. Returns PNG_ZLIB_ERROR if it didn't fit in
+   outlen bytes. */
+static int png_deflate_bands(png_t* png, unsigned char* data, unsigned char* out, unsigned outlen,
+			     unsigned bands, unsigned rows, unsigned char* restarts, unsigned long* written)
+{
+	z_stream stream;
+	unsigned rowlen = png->width * png->bpp + 1;
+	unsigned b;
+	int result = PNG_ZLIB_ERROR;
+
+	png_zstream_init(png, &stream);
+	if(deflateInit(&stream, Z_DEFAULT_COMPRESSION) != Z_OK)
+		return PNG_ZLIB_ERROR;
+
+	stream.next_out = out;
+	stream.avail_out = outlen;
+
+	for(b = 0; b < bands; b++)
+	{
+		unsigned first = b * rows;
+		unsigned last = first + rows < png->height ? first + rows : png->height;
+		unsigned left = (last - first) * rowlen;
+		int last_band = b + 1 == bands;
+		int flush, status;
+
+		/* the first band starts after the 2-byte zlib header */
+		if(bands > 1)
+		{
+			set_ul(restarts + b*8, first);
+			set_ul(restarts + b*8 + 4, b == 0 ? 2 : (unsigned)stream.total_out);
+		}
+
+		/* the band is deflated in slices, checking in between whether to stop */
+		stream.next_in = data + first * rowlen;
+		do
+		{
+			unsigned slice = left < PNG_CANCEL_BYTES ? left : PNG_CANCEL_BYTES;
+
+			if(png_cancelled(png))
+			{
+				result = PNG_CANCELLED;
+				break;
+			}
+			left -= slice;
+			flush = left ? Z_NO_FLUSH : last_band ? Z_FINISH : Z_FULL_FLUSH;
+			stream.avail_in = slice;
+			status = deflate(&stream, flush);
+		}
+		while(left && status == Z_OK && stream.avail_in == 0);
+
+		if(result == PNG_CANCELLED)
+			break;
+		if(last_band ? status != Z_STREAM_END : (status != Z_OK || stream.avail_in != 0 || stream.avail_out == 0))
+			break;
+		if(last_band)
+		{
+			*written = stream.total_out;
+			result = PNG_NO_ERROR;
+		}
+	}
+
+	deflateEnd(&stream);
+	return result;
+}
+
+static int png_write_iend(png_t* png)
+{
+	file_write_ul(png, 0);
+	file_write(png, "IEND", 1, 4);
+	return file_write_ul(png, crc32(0L, (const unsigned char *)"IEND", 4));
+}
+
 static int png_write_idats(png_t* png, unsigned char* data)
 {
 	unsigned char *chunk;
@@ -482,36 +724,84 @@ static int png_write_idats(png_t* png, unsigned char* data)
 	unsigned long crc;
 	unsigned size = png->width * png->height * png->bpp + png->height;
 	unsigned chunk_size = compressBound(size);
+	unsigned bands = 1;
+	int result;
 
 	(void)png_init_deflate;
 	(void)png_end_deflate;
 	(void)png_deflate;
 
-	chunk = png_alloc(chunk_size + 4);
+	if(png->restart_rows && png->restart_rows < png->height)
+		bands = (png->height + png->restart_rows - 1) / png->restart_rows;
+
+	/* each flush adds an empty stored block and may end a partial block */
+	chunk_size += bands * 16;
+	chunk = png->alloc_fun(chunk_size + 8);
+	if(!chunk)
+		return PNG_MEMORY_ERROR;
 	memcpy(chunk, "IDAT", 4);
 
-	written = chunk_size;
-	compress(chunk+4, &written, data, size);
+	if(bands > 1)
+	{
+		unsigned char *rspt = png->alloc_fun(4 + bands*8);
+
+		if(!rspt)
+		{
+			png->free_fun(chunk);
+			return PNG_MEMORY_ERROR;
+		}
+
+		memcpy(rspt, "rsPT", 4);
+		png_trace(png, "deflate", 1);
+		result = png_deflate_bands(png, data, chunk+4, chunk_size, bands, png->restart_rows, rspt+4, &written);
+		png_trace(png, "deflate", 0);
+		if(result != PNG_NO_ERROR)
+		{
+			png->free_fun(rspt);
+			png->free_fun(chunk);
+			return result;
+		}
+
+		/* the restart points go before the image data */
+		crc = crc32(0L, Z_NULL, 0);
+		crc = crc32(crc, rspt, 4 + bands*8);
+		png_trace(png, "write", 1);
+		file_write_ul(png, bands*8);
+		file_write(png, rspt, 1, 4 + bands*8);
+		file_write_ul(png, crc);
+		png_trace(png, "write", 0);
+		png->free_fun(rspt);
+	}
+	else
+	{
+		png_trace(png, "deflate", 1);
+		result = png_deflate_bands(png, data, chunk+4, chunk_size, 1, png->height, 0, &written);
+		png_trace(png, "deflate", 0);
+		if(result != PNG_NO_ERROR)
+		{
+			png->free_fun(chunk);
+			return result;
+		}
+	}
 
 	crc = crc32(0L, Z_NULL, 0);
 	crc = crc32(crc, chunk, written+4);
 	set_ul(chunk+written+4, crc);
+	png_trace(png, "write", 1);
 	file_write_ul(png, written);
 	file_write(png, chunk, 1, written+8);
-	png_free(chunk);
-
-	file_write_ul(png, 0);
-	file_write(png, "IEND", 1, 4);
-	crc = crc32(0L, (const unsigned char *)"IEND", 4);
-	file_write_ul(png, crc);
+	png_trace(png, "write", 0);
+	png->free_fun(chunk);
 
-	return PNG_NO_ERROR;
+	return png_write_iend(png);
 }
 
 static int png_read_idat(png_t* png, unsigned length)
 {
-#if DO_CRC_CHECKS
 	unsigned orig_crc;
+	size_t nread;
+	int result;
+#if DO_CRC_CHECKS
 	unsigned calc_crc;
 #endif
 
@@ -519,9 +809,9 @@ static int png_read_idat(png_t* png, unsigned length)
 	{
 		if (png->readbuf)
 		{
-			png_free(png->readbuf);
+			png->free_fun(png->readbuf);
 		}
-		png->readbuf = png_alloc(length);
+		png->readbuf = png->alloc_fun(length);
 		png->readbuflen = length;
 	}
 
@@ -530,27 +820,220 @@ static int png_read_idat(png_t* png, unsigned length)
 		return PNG_MEMORY_ERROR;
 	}
 
-	if(file_read(png, png->readbuf, 1, length) != length)
+	png_trace(png, "read", 1);
+	nread = file_read(png, png->readbuf, 1, length);
+	png_trace(png, "read", 0);
+	if(nread != length)
 	{
 		return PNG_FILE_ERROR;
 	}
 
+	file_read_ul(png, &orig_crc);
+
 #if DO_CRC_CHECKS
-	calc_crc = crc32(0L, Z_NULL, 0);
-	calc_crc = crc32(calc_crc, (unsigned char*)"IDAT", 4);
-	calc_crc = crc32(calc_crc, (unsigned char*)png->readbuf, length);
+	if(png->crc_checks)
+	{
+		calc_crc = crc32(0L, Z_NULL, 0);
+		calc_crc = crc32(calc_crc, (unsigned char*)"IDAT", 4);
+		calc_crc = crc32(calc_crc, (unsigned char*)png->readbuf, length);
 
-	file_read_ul(png, &orig_crc);
+		if(orig_crc != calc_crc)
+		{
+			return PNG_CRC_ERROR;
+		}
+	}
+#endif
 
-	if(orig_crc != calc_crc)
+	/* the bands are inflated once all the image data is read */
+	if(png->restarts && png->parallel_for)
 	{
+		if(png->idatlen + length > png->idatcap)
+		{
+			unsigned cap = png->idatcap ? png->idatcap * 2 : length;
+			unsigned char *idat;
+
+			while(cap < png->idatlen + length)
+				cap *= 2;
+			idat = png->alloc_fun(cap);
+			if(!idat)
+				return PNG_MEMORY_ERROR;
+			if(png->idat)
+			{
+				memcpy(idat, png->idat, png->idatlen);
+				png->free_fun(png->idat);
+			}
+			png->idat = idat;
+			png->idatcap = cap;
+		}
+		memcpy(png->idat + png->idatlen, png->readbuf, length);
+		png->idatlen += length;
+		return PNG_NO_ERROR;
+	}
+
+	png_trace(png, "inflate", 1);
+	result = png_inflate(png, png->readbuf, length);
+	png_trace(png, "inflate", 0);
+	return result;
+}
+
+/* Read the rest of a chunk of the given type into a new buffer, as the type, the data (at chunk+4)
+   and the CRC, and check the CRC. On error nothing is allocated. */
+static int png_read_chunk(png_t* png, const char* type, unsigned length, unsigned char** chunk)
+{
+	unsigned char *buf;
+
+	if(length > 0x7fffffff - 8)
+		return PNG_CRC_ERROR;
+
+	buf = png->alloc_fun(length + 8);
+	if(!buf)
+		return PNG_MEMORY_ERROR;
+
+	memcpy(buf, type, 4);
+	if(file_read(png, buf + 4, 1, length + 4) != length + 4)
+	{
+		png->free_fun(buf);
+		return PNG_EOF_ERROR;
+	}
+
+#if DO_CRC_CHECKS
+	if(png->crc_checks && get_ul(buf + 4 + length) != crc32(crc32(0L, Z_NULL, 0), buf, length + 4))
+	{
+		png->free_fun(buf);
 		return PNG_CRC_ERROR;
 	}
-#else
-	file_read_ul(png);
 #endif
 
-	return png_inflate(png, png->readbuf, length);
+	*chunk = buf;
+	return PNG_NO_ERROR;
+}
+
+/* Read a PLTE chunk. Entries are stored as RGBA, opaque until a tRNS chunk says otherwise. */
+static int png_read_plte(png_t* png, unsigned length)
+{
+	unsigned char *chunk;
+	unsigned i;
+	int result;
+
+	if(length % 3 != 0 || length / 3 > 256 || length == 0)
+		return PNG_CRC_ERROR;
+
+	result = png_read_chunk(png, "PLTE", length, &chunk);
+	if(result != PNG_NO_ERROR)
+		return result;
+
+	for(i = 0; i < length / 3; i++)
+	{
+		png->palette[i*4] = chunk[4 + i*3];
+		png->palette[i*4 + 1] = chunk[4 + i*3 + 1];
+		png->palette[i*4 + 2] = chunk[4 + i*3 + 2];
+		png->palette[i*4 + 3] = 255;
+	}
+	png->palette_size = length / 3;
+
+	png->free_fun(chunk);
+	return PNG_NO_ERROR;
+}
+
+/* Read a tRNS chunk: alpha values for palette entries, or the one transparent color of a greyscale
+   or truecolor image */
+static int png_read_trns(png_t* png, unsigned length)
+{
+	unsigned char *chunk;
+	unsigned i;
+	int result;
+
+	if(png->color_type == PNG_INDEXED ? length > png->palette_size :
+	   png->color_type == PNG_GREYSCALE ? length != 2 :
+	   png->color_type == PNG_TRUECOLOR ? length != 6 : 1)
+		return PNG_CRC_ERROR;
+
+	result = png_read_chunk(png, "tRNS", length, &chunk);
+	if(result != PNG_NO_ERROR)
+		return result;
+
+	if(png->color_type == PNG_INDEXED)
+	{
+		for(i = 0; i < length; i++)
+			png->palette[i*4 + 3] = chunk[4 + i];
+	}
+	else
+	{
+		for(i = 0; i < length / 2; i++)
+			png->transparent[i] = (unsigned short)((chunk[4 + i*2] << 8) | chunk[4 + i*2 + 1]);
+		png->has_transparent = 1;
+	}
+
+	png->free_fun(chunk);
+	return PNG_NO_ERROR;
+}
+
+/* Read an rsPT chunk (restart points). The chunk is ignored if it is damaged. */
+static int png_read_restarts(png_t* png, unsigned length)
+{
+	unsigned char *chunk;
+	unsigned count = length / 8;
+	unsigned i;
+	int valid;
+	int result;
+
+	result = png_read_chunk(png, "rsPT", length, &chunk);
+	if(result == PNG_CRC_ERROR)
+		return PNG_NO_ERROR;
+	if(result != PNG_NO_ERROR)
+		return result;
+
+	valid = count > 0 && length % 8 == 0;
+
+	/* rows and offsets must increase, starting with row 0 */
+	for(i = 0; valid && i < count; i++)
+	{
+		unsigned row = get_ul(chunk + 4 + i*8);
+		unsigned offset = get_ul(chunk + 8 + i*8);
+
+		if(i == 0)
+			valid = row == 0 && offset >= 2;
+		else
+			valid = row > get_ul(chunk + 4 + (i-1)*8) && offset > get_ul(chunk + 8 + (i-1)*8);
+		valid = valid && row < png->height;
+	}
+
+	if(valid)
+	{
+		png->restarts = png->alloc_fun(count * 2 * sizeof(unsigned));
+		if(png->restarts)
+		{
+			for(i = 0; i < count*2; i++)
+				png->restarts[i] = get_ul(chunk + 4 + i*4);
+			png->num_restarts = count;
+		}
+	}
+
+	png->free_fun(chunk);
+	return PNG_NO_ERROR;
+}
+
+/* Process a chunk other than IDAT and IEND, whose length and type have been read */
+static int png_process_other_chunk(png_t* png, unsigned type, unsigned length)
+{
+	if(type == *(unsigned int*)"rsPT" && !png->png_data && !png->restarts && !png->interlace_method)
+	{
+		return png_read_restarts(png, length);
+	}
+	else if(type == *(unsigned int*)"PLTE" && !png->png_data && !png->palette_size)
+	{
+		return png_read_plte(png, length);
+	}
+	else if(type == *(unsigned int*)"tRNS" && !png->png_data && !png->has_transparent)
+	{
+		return png_read_trns(png, length);
+	}
+	else
+	{
+		file_read(png, 0, 1, length + 4); /* unknown chunk */
+	}
+
+	return PNG_NO_ERROR;
 }
 
 static int png_process_chunk(png_t* png)
@@ -568,8 +1051,23 @@ static int png_process_chunk(png_t* png)
 	{
 		if(!png->png_data) /* first IDAT */
 		{
-			png->png_datalen = png->width * png->height * png->bpp + png->height;
-			png->png_data = png_alloc(png->png_datalen);
+			unsigned long long len = (unsigned long long)(png_row_len(png) + 1) * png->height;
+			int pass;
+
+			if(png->color_type == PNG_INDEXED && !png->palette_size)
+				return PNG_FILE_ERROR;
+
+			/* interlaced data holds the passes one after another */
+			if(png->interlace_method)
+			{
+				len = 0;
+				for(pass = 0; pass < png->passes; pass++)
+					len += png_pass_len(png, pass);
+			}
+			if(!len || len > 0xffffffffu)
+				return PNG_MEMORY_ERROR;
+			png->png_datalen = (unsigned)len;
+			png->png_data = png->alloc_fun(png->png_datalen);
 		}
 
 		if(!png->png_data)
@@ -588,12 +1086,8 @@ static int png_process_chunk(png_t* png)
 	{
 		return PNG_DONE;
 	}
-	else
-	{
-		file_read(png, 0, 1, length + 4); /* unknown chunk */
-	}
 
-	return result;
+	return png_process_other_chunk(png, type, length);
 }
 
 static void png_filter_sub(int stride, unsigned char* in, unsigned char* out, int len)
@@ -707,70 +1201,308 @@ static int png_filter(png_t* png, unsigned char* data)
 	return PNG_NO_ERROR;
 }
 
-static int png_unfilter(png_t* png, unsigned char* data)
+/* Unfilter a row of rowlen bytes from in (after its filter type byte) into out, given the previous
+   row, or 0 for the first row. */
+static int png_unfilter_line(png_t* png, unsigned char filter, unsigned char* in, unsigned char* out,
+			     unsigned char* prev_line, unsigned rowlen)
 {
 	unsigned i;
-	unsigned pos = 0;
-	unsigned outpos = 0;
+	int stride = png->bpp;
+
+	if(png->depth == 16)
+	{
+		for(i = 0; i < rowlen; i+=2)
+		{
+			*(short*)(in+i) = (in[i] << 8) | in[i+1];
+		}
+	}
+
+	switch(filter)
+	{
+	case 0: /* none */
+		memcpy(out, in, rowlen);
+		break;
+	case 1: /* sub */
+		png_filter_sub(stride, in, out, rowlen);
+		break;
+	case 2: /* up */
+		png_filter_up(stride, in, out, prev_line, rowlen);
+		break;
+	case 3: /* average */
+		png_filter_average(stride, in, out, prev_line, rowlen);
+		break;
+	case 4: /* paeth */
+		png_filter_paeth(stride, in, out, prev_line, rowlen);
+		break;
+	default:
+		return PNG_UNKNOWN_FILTER;
+	}
+
+	return PNG_NO_ERROR;
+}
+
+/* Unfilter rows of rowlen bytes from filtered into data. The first row is unfiltered without a
+   previous row. */
+static int png_unfilter_block(png_t* png, unsigned char* filtered, unsigned char* data, unsigned rowlen, unsigned rows)
+{
+	unsigned row;
+	int result;
+
+	for(row = 0; row < rows; row++)
+	{
+		unsigned char* in = filtered + row * (rowlen + 1);
+		unsigned char* out = data + row * rowlen;
+
+		if(row % PNG_CANCEL_ROWS == 0 && png_cancelled(png))
+			return PNG_CANCELLED;
+
+		result = png_unfilter_line(png, in[0], in + 1, out, row ? out - rowlen : 0, rowlen);
+		if(result != PNG_NO_ERROR)
+			return result;
+	}
+
+	return PNG_NO_ERROR;
+}
+
+/* Unfilter rows [first, last). The row before first isn't used, so a band can only start with an
+   unfiltered or Sub row unless first is 0. */
+static int png_unfilter_rows(png_t* png, unsigned char* data, unsigned first, unsigned last)
+{
+	unsigned rowlen = png_row_len(png);
+
+	return png_unfilter_block(png, png->png_data + first * (rowlen + 1), data + first * rowlen, rowlen, last - first);
+}
+
+/* Unfilter the passes of interlaced data and put their pixels where they belong in data */
+static int png_unfilter_interlaced(png_t* png, unsigned char* data)
+{
+	unsigned bits = png_pixel_bits(png);
+	unsigned rowlen = png_row_len(png);
 	unsigned char *filtered = png->png_data;
+	unsigned char *pass_data;
+	int pass;
+	int result = PNG_NO_ERROR;
 
-	int stride = png->bpp;
+	/* no pass has more than half the rows, or wider rows than the image */
+	pass_data = png->alloc_fun(rowlen * ((png->height + 1) / 2));
+	if(!pass_data)
+		return PNG_MEMORY_ERROR;
 
-	while(pos < png->png_datalen)
+	for(pass = 0; pass < png->passes && result == PNG_NO_ERROR; pass++)
 	{
-		unsigned char filter = filtered[pos];
+		const unsigned char *p = png_adam7[pass];
+		unsigned width, height, pass_rowlen, x, y;
+
+		png_pass_size(png, pass, &width, &height);
+		if(!width || !height)
+			continue;
+		pass_rowlen = png_row_len_for(png, width);
 
-		pos++;
+		result = png_unfilter_block(png, filtered, pass_data, pass_rowlen, height);
+		filtered += (pass_rowlen + 1) * height;
 
-		if(png->depth == 16)
+		for(y = 0; y < height && result == PNG_NO_ERROR; y++)
 		{
-			for(i = 0; i < png->width * stride; i+=2)
+			unsigned char *in = pass_data + y * pass_rowlen;
+			unsigned char *out = data + (p[1] + y * p[3]) * rowlen;
+
+			if(bits >= 8)
 			{
-				*(short*)(filtered+pos+i) = (filtered[pos+i] << 8) | filtered[pos+i+1];
+				unsigned bytes = bits / 8;
+
+				for(x = 0; x < width; x++)
+					memcpy(out + (p[0] + x * p[2]) * bytes, in + x * bytes, bytes);
 			}
+			else
+			{
+				/* pixels are packed into bytes, most significant bits first */
+				unsigned mask = (1u << bits) - 1;
+
+				for(x = 0; x < width; x++)
+				{
+					unsigned in_bit = x * bits;
+					unsigned out_bit = (p[0] + x * p[2]) * bits;
+					unsigned value = (in[in_bit / 8] >> (8 - bits - in_bit % 8)) & mask;
+					unsigned shift = 8 - bits - out_bit % 8;
+
+					out[out_bit / 8] = (unsigned char)((out[out_bit / 8] & ~(mask << shift)) | (value << shift));
+				}
+			}
+		}
+	}
+
+	png->free_fun(pass_data);
+	return result;
+}
+
+static int png_unfilter(png_t* png, unsigned char* data)
+{
+	if(png->interlace_method)
+		return png_unfilter_interlaced(png, data);
+	return png_unfilter_rows(png, data, 0, png->height);
+}
+
+/* Context for decoding bands in parallel */
+typedef struct
+{
+	png_t*			png;
+	unsigned char*		data;
+	int			result;
+} png_bands_t;
+
+/* Record the failure of a band (bands run on several threads) */
+static void png_set_bands_result(png_bands_t* ctx, int result)
+{
+	__atomic_store_n(&ctx->result, result, __ATOMIC_RELAXED);
+}
+
+static void png_inflate_bands(void* arg, int begin, int end)
+{
+	png_bands_t *ctx = arg;
+	png_t *png = ctx->png;
+	unsigned rowlen = png_row_len(png) + 1;
+	int b;
+
+	for(b = begin; b < end; b++)
+	{
+		unsigned first = png->restarts[b*2];
+		unsigned last = (unsigned)b + 1 < png->num_restarts ? png->restarts[b*2 + 2] : png->height;
+		unsigned offset = png->restarts[b*2 + 1];
+		unsigned end_offset = (unsigned)b + 1 < png->num_restarts ? png->restarts[b*2 + 3] : png->idatlen;
+		z_stream stream;
+		int result;
+
+		if(png_cancelled(png))
+		{
+			png_set_bands_result(ctx, PNG_CANCELLED);
+			return;
 		}
 
-		switch(filter)
+		if(offset >= end_offset || end_offset > png->idatlen)
 		{
-		case 0: /* none */
-			memcpy(data+outpos, filtered+pos, png->width * stride);
-			break;
-		case 1: /* sub */
-			png_filter_sub(stride, filtered+pos, data+outpos, png->width * stride);
-			break;
-		case 2: /* up */
-			if(outpos)
-				png_filter_up(stride, filtered+pos, data+outpos, data + outpos - (png->width*stride), png->width*stride);
-			else
-				png_filter_up(stride, filtered+pos, data+outpos, 0, png->width*stride);
-			break;
-		case 3: /* average */
-			if(outpos)
-				png_filter_average(stride, filtered+pos, data+outpos, data + outpos - (png->width*stride), png->width*stride);
-			else
-				png_filter_average(stride, filtered+pos, data+outpos, 0, png->width*stride);
-			break;
-		case 4: /* paeth */
-			if(outpos)
-				png_filter_paeth(stride, filtered+pos, data+outpos, data + outpos - (png->width*stride), png->width*stride);
-			else
-				png_filter_paeth(stride, filtered+pos, data+outpos, 0, png->width*stride);
-			break;
-		default:
-			return PNG_UNKNOWN_FILTER;
+			png_set_bands_result(ctx, PNG_ZLIB_ERROR);
+			return;
 		}
 
-		outpos += png->width * stride;
-		pos += png->width * stride;
+		/* each band is raw deflate data, ending at a full flush (or the end of the stream) */
+		png_zstream_init(png, &stream);
+		if(inflateInit2(&stream, -15) != Z_OK)
+		{
+			png_set_bands_result(ctx, PNG_ZLIB_ERROR);
+			return;
+		}
+		stream.next_in = png->idat + offset;
+		stream.avail_in = end_offset - offset;
+		stream.next_out = png->png_data + first * rowlen;
+		stream.avail_out = (last - first) * rowlen;
+		result = inflate(&stream, Z_SYNC_FLUSH);
+		inflateEnd(&stream);
+
+		if((result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR) || stream.avail_out != 0)
+		{
+			png_set_bands_result(ctx, PNG_ZLIB_ERROR);
+			return;
+		}
 	}
+}
 
-	return PNG_NO_ERROR;
+static void png_unfilter_bands(void* arg, int begin, int end)
+{
+	png_bands_t *ctx = arg;
+	png_t *png = ctx->png;
+	int b;
+
+	for(b = begin; b < end; b++)
+	{
+		unsigned first = png->restarts[b*2];
+		unsigned last = (unsigned)b + 1 < png->num_restarts ? png->restarts[b*2 + 2] : png->height;
+
+		int result = png_unfilter_rows(png, ctx->data, first, last);
+
+		if(result != PNG_NO_ERROR)
+			png_set_bands_result(ctx, result);
+	}
+}
+
+/* Unfilter the whole image, recording the time taken as an "unfilter" trace event */
+static int png_traced_unfilter(png_t* png, unsigned char* data)
+{
+	int result;
+
+	png_trace(png, "unfilter", 1);
+	result = png_unfilter(png, data);
+	png_trace(png, "unfilter", 0);
+	return result;
+}
+
+/* Inflate and unfilter the bands of the image data kept by png_read_idat. If the restart points
+   turn out to be wrong, the data is decoded as one stream instead. */
+static int png_decode_bands(png_t* png, unsigned char* data)
+{
+	png_bands_t ctx;
+	unsigned rowlen = png_row_len(png) + 1;
+	unsigned b;
+	int result;
+
+	ctx.png = png;
+	ctx.data = data;
+	ctx.result = PNG_NO_ERROR;
+
+	/* the offsets increase, so the last one must be inside the image data, or the restart
+	   points don't belong to it */
+	if(png->restarts[png->num_restarts*2 - 1] >= png->idatlen)
+	{
+		ctx.result = PNG_ZLIB_ERROR;
+	}
+	else
+	{
+		png_trace(png, "inflate", 1);
+		png->parallel_for(png->num_restarts, png_inflate_bands, &ctx);
+		png_trace(png, "inflate", 0);
+	}
+
+	/* the parallel loop may also have skipped bands when asked to stop */
+	if(png_cancelled(png))
+		return PNG_CANCELLED;
+
+	if(ctx.result != PNG_NO_ERROR)
+	{
+		if(png->zs)
+			png_end_inflate(png);
+		png_trace(png, "inflate", 1);
+		result = png_init_inflate(png);
+		if(result == PNG_NO_ERROR)
+			result = png_inflate(png, png->idat, png->idatlen);
+		if(png->zs)
+			png_end_inflate(png);
+		png->zs = NULL;
+		png_trace(png, "inflate", 0);
+		return result == PNG_NO_ERROR ? png_traced_unfilter(png, data) : result;
+	}
+
+	/* bands starting with a row that uses the previous row are unfiltered in order */
+	for(b = 1; b < png->num_restarts; b++)
+	{
+		if(png->png_data[png->restarts[b*2] * rowlen] > 1)
+			return png_traced_unfilter(png, data);
+	}
+
+	png_trace(png, "unfilter", 1);
+	png->parallel_for(png->num_restarts, png_unfilter_bands, &ctx);
+	png_trace(png, "unfilter", 0);
+	return png_cancelled(png) ? PNG_CANCELLED : ctx.result;
 }
 
 int png_get_data(png_t* png, unsigned char* data)
+{
+	return png_get_passes(png, data, 7);
+}
+
+int png_get_passes(png_t* png, unsigned char* data, int passes)
 {
 	int result = PNG_NO_ERROR;
 
+	png->passes = (unsigned char)(passes < 1 ? 1 : passes > 7 ? 7 : passes);
 	png->zs = NULL;
 	png->png_datalen = 0;
 	png->png_data = NULL;
@@ -784,25 +1516,31 @@ int png_get_data(png_t* png, unsigned char* data)
 
 	if (png->readbuf)
 	{
-		png_free(png->readbuf);
+		png->free_fun(png->readbuf);
 		png->readbuflen = 0;
 	}
 	if (png->zs)
 	{
 		png_end_inflate(png);
+		png->zs = NULL;
 	}
 
-	if(result != PNG_DONE)
+	if(result == PNG_DONE)
 	{
-		png_free(png->png_data);
-		return result;
+		if(png->idat)
+			result = png_decode_bands(png, data);
+		else
+			result = png_traced_unfilter(png, data);
 	}
 
-	result = png_unfilter(png, data);
+	png->free_fun(png->png_data);
+	png->free_fun(png->idat);
+	png->free_fun(png->restarts);
+	png->idat = NULL;
+	png->restarts = NULL;
+	png->num_restarts = 0;
 
-	png_free(png->png_data);
-
-	return result;
+	return result == PNG_DONE ? PNG_NO_ERROR : result;
 }
 
 int png_set_data(png_t* png, unsigned width, unsigned height, char depth, int color, unsigned char* data)
@@ -810,13 +1548,16 @@ int png_set_data(png_t* png, unsigned width, unsigned height, char depth, int co
 	//int i;
 	unsigned i;
 	unsigned char *filtered;
+	int result;
 	png->width = width;
 	png->height = height;
 	png->depth = depth;
 	png->color_type = color;
 	png->bpp = png_get_bpp(png);
 
-	filtered = png_alloc(width * height * png->bpp + height);
+	filtered = png->alloc_fun(width * height * png->bpp + height);
+	if(!filtered)
+		return PNG_MEMORY_ERROR;
 
 	for(i = 0; i < png->height; i++)
 	{
@@ -824,15 +1565,273 @@ int png_set_data(png_t* png, unsigned width, unsigned height, char depth, int co
 		memcpy(&filtered[i*png->width*png->bpp+i+1], data + i * png->width*png->bpp, png->width*png->bpp);
 	}
 
+	png_trace(png, "filter", 1);
 	png_filter(png, filtered);
+	png_trace(png, "filter", 0);
 	png_write_ihdr(png);
-	png_write_idats(png, filtered);
+	result = png_write_idats(png, filtered);
+
+	png->free_fun(filtered);
+
+	return result;
+}
+
+/* Streaming reads: give the inflate stream the next piece of image data, from the current IDAT
+   chunk or, once that is used up, the next one. The chunks before the first IDAT are processed as
+   by png_get_data, and the row buffers are allocated when it is reached. */
+static int png_stream_input(png_t* png)
+{
+	z_stream *stream;
+	unsigned length;
+	unsigned type;
+	unsigned orig_crc;
+	unsigned n;
+	int result;
+
+	while(!png->idat_left)
+	{
+		if(file_read_ul(png, &length) != PNG_NO_ERROR || file_read(png, &type, 1, 4) != 4)
+			return PNG_EOF_ERROR;
+
+		if(type == *(unsigned int*)"IEND")
+			return PNG_EOF_ERROR; /* the image data ended early */
+
+		if(type != *(unsigned int*)"IDAT")
+		{
+			if(png->png_data)
+				file_read(png, 0, 1, length + 4);
+			else if((result = png_process_other_chunk(png, type, length)) != PNG_NO_ERROR)
+				return result;
+			continue;
+		}
+
+		if(!png->png_data) /* first IDAT */
+		{
+			if(png->color_type == PNG_INDEXED && !png->palette_size)
+				return PNG_FILE_ERROR;
+
+			png->png_datalen = png_row_len(png) + 1;
+			png->png_data = png->alloc_fun(png->png_datalen);
+			png->prev_row = png->alloc_fun(png->png_datalen);
+			if(!png->png_data || !png->prev_row)
+				return PNG_MEMORY_ERROR;
+			result = png_init_inflate(png);
+			if(result != PNG_NO_ERROR)
+				return result;
+		}
+
+		png->idat_left = length;
+		png->idat_crc = crc32(crc32(0L, Z_NULL, 0), (unsigned char*)"IDAT", 4);
+		if(!length)
+			file_read_ul(png, &orig_crc);
+	}
+
+	n = png->idat_left < png->readbuflen ? png->idat_left : png->readbuflen;
+	if(file_read(png, png->readbuf, 1, n) != n)
+		return PNG_FILE_ERROR;
+	png->idat_crc = crc32(png->idat_crc, png->readbuf, n);
+	png->idat_left -= n;
+
+	if(!png->idat_left)
+	{
+		if(file_read_ul(png, &orig_crc) != PNG_NO_ERROR)
+			return PNG_EOF_ERROR;
+#if DO_CRC_CHECKS
+		if(png->crc_checks && orig_crc != png->idat_crc)
+			return PNG_CRC_ERROR;
+#endif
+	}
+
+	stream = png->zs;
+	stream->next_in = png->readbuf;
+	stream->avail_in = n;
+
+	return PNG_NO_ERROR;
+}
+
+int png_read_rows(png_t* png, unsigned char* data, unsigned rows)
+{
+	z_stream *stream;
+	unsigned rowlen = png_row_len(png);
+	unsigned i;
+	int result;
+
+	if(png->interlace_method)
+		return PNG_NOT_SUPPORTED;
+	if(rows > png->height - png->row)
+		return PNG_WRONG_ARGUMENTS;
+
+	if(!png->readbuf)
+	{
+		png->readbuflen = PNG_STREAM_BUFSIZE;
+		png->readbuf = png->alloc_fun(png->readbuflen);
+		if(!png->readbuf)
+			return PNG_MEMORY_ERROR;
+	}
+	if(!png->zs && (result = png_stream_input(png)) != PNG_NO_ERROR)
+		return result;
+	stream = png->zs;
+
+	for(i = 0; i < rows; i++)
+	{
+		unsigned char *out = data + i * rowlen;
+
+		stream->next_out = png->png_data;
+		stream->avail_out = rowlen + 1;
+		while(stream->avail_out)
+		{
+			if(!stream->avail_in && (result = png_stream_input(png)) != PNG_NO_ERROR)
+				return result;
+
+			result = inflate(stream, Z_SYNC_FLUSH);
+			if(result == Z_STREAM_END && stream->avail_out)
+				return PNG_EOF_ERROR;
+			if(result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR)
+				return PNG_ZLIB_ERROR;
+		}
 
-	png_free(filtered);
+		/* the row before the first one of this call was kept in prev_row */
+		result = png_unfilter_line(png, png->png_data[0], png->png_data + 1, out,
+					   i ? out - rowlen : png->row ? png->prev_row : 0, rowlen);
+		if(result != PNG_NO_ERROR)
+			return result;
+		png->row++;
+	}
+
+	if(rows)
+		memcpy(png->prev_row, data + (rows - 1) * rowlen, rowlen);
+
+	return PNG_NO_ERROR;
+}
+
+void png_read_end(png_t* png)
+{
+	if(png->zs)
+		png_end_inflate(png);
+	png->free_fun(png->readbuf);
+	png->free_fun(png->png_data);
+	png->free_fun(png->prev_row);
+	png->free_fun(png->restarts);
+	png->zs = 0;
+	png->readbuf = 0;
+	png->png_data = 0;
+	png->prev_row = 0;
+	png->restarts = 0;
+	png->num_restarts = 0;
+}
+
+/* Streaming writes: deflate the pending input, writing an IDAT chunk whenever the chunk buffer
+   (readbuf, after the chunk type) fills up, and the rest of the output once flush is Z_FINISH */
+static int png_stream_output(png_t* png, int flush)
+{
+	z_stream *stream = png->zs;
+	int result;
+
+	do
+	{
+		result = deflate(stream, flush);
+		if(result == Z_STREAM_ERROR)
+			return PNG_ZLIB_ERROR;
+
+		if(!stream->avail_out || result == Z_STREAM_END)
+		{
+			unsigned len = PNG_STREAM_BUFSIZE - stream->avail_out;
+
+			if(len)
+			{
+				file_write_ul(png, len);
+				if(file_write(png, png->readbuf, 1, len + 4) != len + 4)
+					return PNG_IO_ERROR;
+				if(file_write_ul(png, crc32(0L, png->readbuf, len + 4)) != PNG_NO_ERROR)
+					return PNG_IO_ERROR;
+			}
+			stream->next_out = png->readbuf + 4;
+			stream->avail_out = PNG_STREAM_BUFSIZE;
+		}
+	}
+	while(stream->avail_in || (flush == Z_FINISH && result != Z_STREAM_END));
 
 	return PNG_NO_ERROR;
 }
 
+int png_write_begin(png_t* png, unsigned width, unsigned height, char depth, int color)
+{
+	z_stream *stream;
+	int result;
+
+	png->width = width;
+	png->height = height;
+	png->depth = depth;
+	png->color_type = color;
+	png->bpp = png_get_bpp(png);
+	png->row = 0;
+
+	png->readbuf = png->alloc_fun(PNG_STREAM_BUFSIZE + 4);
+	if(!png->readbuf)
+		return PNG_MEMORY_ERROR;
+	memcpy(png->readbuf, "IDAT", 4);
+
+	result = png_init_deflate(png, 0, 0);
+	if(result != PNG_NO_ERROR)
+		return result;
+	stream = png->zs;
+	stream->next_out = png->readbuf + 4;
+	stream->avail_out = PNG_STREAM_BUFSIZE;
+
+	return png_write_ihdr(png);
+}
+
+int png_write_rows(png_t* png, unsigned char* data, unsigned rows)
+{
+	z_stream *stream = png->zs;
+	unsigned rowlen = png->width * png->bpp;
+	unsigned char filter = 0;
+	unsigned i;
+	int result;
+
+	if(rows > png->height - png->row)
+		return PNG_WRONG_ARGUMENTS;
+
+	/* the rows aren't filtered, as by png_set_data */
+	for(i = 0; i < rows; i++)
+	{
+		stream->next_in = &filter;
+		stream->avail_in = 1;
+		if((result = png_stream_output(png, Z_NO_FLUSH)) != PNG_NO_ERROR)
+			return result;
+
+		stream->next_in = data + i * rowlen;
+		stream->avail_in = rowlen;
+		if((result = png_stream_output(png, Z_NO_FLUSH)) != PNG_NO_ERROR)
+			return result;
+		png->row++;
+	}
+
+	return PNG_NO_ERROR;
+}
+
+int png_write_end(png_t* png)
+{
+	z_stream *stream = png->zs;
+	int result = PNG_WRONG_ARGUMENTS;
+
+	if(stream && png->row == png->height)
+	{
+		stream->next_in = 0;
+		stream->avail_in = 0;
+		result = png_stream_output(png, Z_FINISH);
+		if(result == PNG_NO_ERROR)
+			result = png_write_iend(png);
+	}
+
+	png_end_deflate(png);
+	png->free_fun(png->readbuf);
+	png->zs = 0;
+	png->readbuf = 0;
+
+	return result;
+}
+
 char* png_error_string(int error)
 {
 	switch(error)
@@ -861,6 +1860,8 @@ char* png_error_string(int error)
 		return "The PNG is unsupported by pnglite, too bad for you!";
 	case PNG_WRONG_ARGUMENTS:
 		return "Wrong combination of arguments passed to png_open. You must use either a read_function or supply a file pointer to use.";
+	case PNG_CANCELLED:
+		return "Decoding or encoding was cancelled.";
 	default:
 		return "Unknown error.";
 	};
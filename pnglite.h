@@ -26,7 +26,15 @@
 
 /*
  * This file was modified 22-Mar-2020 by David Hovemeyer
- * to eliminate compiler warnings.
+ * to eliminate compiler warnings. It was later modified to support
+ * restart points for decoding row bands in parallel, and to
+ * optionally skip CRC checks, to
+ * decode palette images and bit depths below 8, and to decode
+ * interlaced images, optionally only their first passes, to read and
+ * write images a few rows at a time, to keep the allocator and
+ * error messages in each png_t instead of in globals, to report
+ * the phases of decoding and encoding for tracing, and to stop
+ * decoding and encoding when asked to.
  */
 
 
@@ -57,7 +65,8 @@ enum
 	PNG_ZLIB_ERROR			= -7,
 	PNG_UNKNOWN_FILTER		= -8,
 	PNG_NOT_SUPPORTED		= -9,
-	PNG_WRONG_ARGUMENTS		= -10
+	PNG_WRONG_ARGUMENTS		= -10,
+	PNG_CANCELLED			= -11
 };
 
 /*
@@ -81,6 +90,10 @@ typedef unsigned (*png_write_callback_t)(void* input, size_t size, size_t numel,
 typedef unsigned (*png_read_callback_t)(void* output, size_t size, size_t numel, void* user_pointer);
 typedef void (*png_free_t)(void* p);
 typedef void * (*png_alloc_t)(size_t s);
+typedef void (*png_range_fn_t)(void* ctx, int begin, int end);
+typedef void (*png_parallel_for_t)(int n, png_range_fn_t fn, void* ctx);
+typedef void (*png_trace_t)(const char* name, int begin);
+typedef int (*png_cancel_t)(void);
 
 typedef struct
 {
@@ -103,24 +116,49 @@ typedef struct
 
 	unsigned char*			readbuf;
 	unsigned			readbuflen;
+	unsigned			restart_rows;	/* writing: rows per restart band, 0 for none */
+	unsigned*			restarts;	/* reading: (row, offset) pairs from the rsPT chunk */
+	unsigned			num_restarts;
+	png_parallel_for_t		parallel_for;	/* reading: runs the band decodes, 0 for none */
+	png_trace_t			trace;		/* marks the phases of decoding and encoding, 0 for none */
+	png_cancel_t			cancelled;	/* asked whether to stop decoding or encoding, 0 for never */
+	unsigned char*			idat;		/* reading: image data kept for band decoding */
+	unsigned			idatlen;
+	unsigned			idatcap;
+	unsigned char			crc_checks;	/* reading: check chunk CRCs after IHDR (the default) */
+	unsigned char			palette[256*4];	/* reading: RGBA palette entries from PLTE and tRNS */
+	unsigned			palette_size;
+	unsigned short			transparent[3];	/* reading: transparent gray or RGB from tRNS */
+	unsigned char			has_transparent;
+	unsigned char			passes;		/* reading: Adam7 passes to decode */
+	unsigned char*			prev_row;	/* streaming reads: the last row read */
+	unsigned			row;		/* streaming: rows read or written so far */
+	unsigned			idat_left;	/* streaming reads: bytes of the current IDAT not read yet */
+	unsigned			idat_crc;	/* streaming reads: CRC of the current IDAT so far */
+	png_alloc_t			alloc_fun;	/* allocator for this png (see png_set_allocator) */
+	png_free_t			free_fun;
+	const char*			zlib_msg;	/* zlib's message for the last PNG_ZLIB_ERROR, or 0 */
 } png_t;
 
 /*
-	Function: png_init
+	Function: png_set_allocator
 
-	This function initializes pnglite. The parameters can be used to set your own memory allocation routines following these formats:
+	Sets the memory allocation routines used for this png (including by zlib), following these formats:
 
 	> void* (*custom_alloc)(size_t s)
 	> void (*custom_free)(void* p)
+
+	pnglite has no global state, so different pngs can be used from different threads at the same
+	time. A png uses malloc and free from libc unless this is called after opening it, before anything
+	is decoded or encoded. The allocator must be safe to call from the threads of png_set_parallel.
+
 	Parameters:
+		png - png opened for reading or writing.
 		pngalloc - Pointer to custom allocation routine. If 0 is passed, malloc from libc will be used.
 		pngfree - Pointer to custom free routine. If 0 is passed, free from libc will be used.
-
-	Returns:
-		Always returns PNG_NO_ERROR.
 */
 
-int png_init(png_alloc_t pngalloc, png_free_t pngfree);
+void png_set_allocator(png_t* png, png_alloc_t pngalloc, png_free_t pngfree);
 
 /*
 	Function: png_open_file
@@ -204,7 +242,11 @@ char* png_error_string(int error);
 
 	This function decodes the opened png file and stores the result in data. data should be big enough to hold the decoded png. Required size will be:
 
-	> width*height*(bytes per pixel)
+	> height*png_get_row_bytes(png)
+
+	Rows are packed without padding; pixels of less than 8 bits are packed into bytes, most significant
+	bits first, and 16-bit samples are stored as native unsigned shorts. Palette images are decoded to
+	palette indices (see the palette field).
 
 	Parameters:
 		data - Where to store result.
@@ -215,8 +257,181 @@ char* png_error_string(int error);
 
 int png_get_data(png_t* png, unsigned char* data);
 
+/*
+	Function: png_get_row_bytes
+
+	Returns:
+		The number of bytes in a row of the data decoded by png_get_data.
+*/
+
+unsigned png_get_row_bytes(png_t* png);
+
+/*
+	Function: png_get_passes
+
+	Like png_get_data, but for interlaced (Adam7) images only decodes the first passes, reading and
+	inflating no more of the image data than they need. Pixels that aren't in those passes are left
+	unchanged. After pass 1 the pixels in every 8th row and column are decoded (a 1/8-scale preview),
+	after pass 3 every 4th, after pass 5 every 2nd, and after pass 7 all of them. Images that aren't
+	interlaced are decoded completely.
+
+	Parameters:
+		data - Where to store result.
+		passes - Number of passes to decode, from 1 to 7.
+
+	Returns:
+		PNG_NO_ERROR on success, otherwise an error code.
+*/
+
+int png_get_passes(png_t* png, unsigned char* data, int passes);
+
 int png_set_data(png_t* png, unsigned width, unsigned height, char depth, int color, unsigned char* data);
 
+/*
+	Function: png_set_restart_interval
+
+	Makes png_set_data compress the image in bands of the given number of rows, each ending with a
+	full flush so that it can be inflated on its own. The row and zlib stream offset of each band
+	are written to a private ancillary "rsPT" chunk before the image data; other decoders ignore it.
+
+	Parameters:
+		png - png opened for writing.
+		rows - rows per band, or 0 (the default) to compress the image as a whole.
+*/
+
+void png_set_restart_interval(png_t* png, unsigned rows);
+
+/*
+	Function: png_set_parallel
+
+	Makes png_get_data use the restart points of an "rsPT" chunk, if the file has one, to inflate
+	and unfilter the bands on multiple threads. parallel_for(n, fn, ctx) must call fn(ctx, begin, end)
+	on ranges covering [0, n) and return once they are all done.
+
+	Parameters:
+		png - png opened for reading.
+		parallel_for - the parallel loop, or 0 (the default) to decode sequentially.
+*/
+
+void png_set_parallel(png_t* png, png_parallel_for_t parallel_for);
+
+/*
+	Function: png_set_trace
+
+	Makes png_get_data and png_set_data report the phases of decoding ("read", "inflate" and
+	"unfilter") and encoding ("filter", "deflate" and "write") as they begin and end, by calling
+	trace(name, 1) and then trace(name, 0) on the calling thread. Phases may occur more than once,
+	e.g. once per chunk, and run the parallel loop of png_set_parallel inside them. name is a string
+	literal. The streaming functions (png_read_rows and png_write_rows) don't report phases.
+
+	Parameters:
+		png - png opened for reading or writing.
+		trace - the callback, or 0 (the default) for none.
+*/
+
+void png_set_trace(png_t* png, png_trace_t trace);
+
+/*
+	Function: png_set_cancel
+
+	Makes png_get_data and png_set_data call cancelled() every few hundred kilobytes inflated or
+	deflated and every few dozen rows unfiltered, on the calling thread and on those of
+	png_set_parallel, and fail with PNG_CANCELLED once it returns nonzero. The bands of a parallel
+	decode that have already started are finished first.
+
+	Parameters:
+		png - png opened for reading or writing.
+		cancelled - the callback, or 0 (the default) to never stop.
+*/
+
+void png_set_cancel(png_t* png, png_cancel_t cancelled);
+
+/*
+	Function: png_set_crc_checks
+
+	Turns the CRC checks of the chunks read by png_get_data on or off. The IHDR chunk, read when the
+	png is opened, is always checked. Only turn the checks off for trusted data, such as files this
+	program wrote itself; damaged data may then decode to wrong pixels or fail in zlib instead.
+
+	Parameters:
+		png - png opened for reading.
+		enabled - nonzero (the default) to check CRCs, 0 to skip them.
+*/
+
+void png_set_crc_checks(png_t* png, int enabled);
+
+/*
+	Function: png_read_rows
+
+	Decodes the next rows of an image that isn't interlaced, reading no more of the file than they
+	need, so that images larger than memory can be processed a band at a time. The rows are stored
+	as by png_get_data. Chunk CRCs are checked unless turned off with png_set_crc_checks; restart
+	points are ignored. Call png_read_end when done, even after an error.
+
+	Parameters:
+		png - png opened for reading.
+		data - Where to store the rows, rows*png_get_row_bytes(png) bytes.
+		rows - Number of rows to decode; the rows read so far and these must not exceed the height.
+
+	Returns:
+		PNG_NO_ERROR on success, PNG_NOT_SUPPORTED for interlaced images, otherwise an error code.
+*/
+
+int png_read_rows(png_t* png, unsigned char* data, unsigned rows);
+
+/*
+	Function: png_read_end
+
+	Frees the decoding state of png_read_rows.
+*/
+
+void png_read_end(png_t* png);
+
+/*
+	Function: png_write_begin
+
+	Starts writing an image a few rows at a time, writing its header. The rows are compressed as
+	they are passed to png_write_rows and written in IDAT chunks of up to 64 KiB, so the image
+	never has to be in memory as a whole. Call png_write_end when done, even after an error.
+
+	Parameters:
+		png - png opened for writing.
+		width, height, depth, color - as for png_set_data.
+
+	Returns:
+		PNG_NO_ERROR on success, otherwise an error code.
+*/
+
+int png_write_begin(png_t* png, unsigned width, unsigned height, char depth, int color);
+
+/*
+	Function: png_write_rows
+
+	Compresses and writes the next rows of an image started with png_write_begin.
+
+	Parameters:
+		png - png being written.
+		data - The rows, laid out as for png_set_data.
+		rows - Number of rows; the rows written so far and these must not exceed the height.
+
+	Returns:
+		PNG_NO_ERROR on success, otherwise an error code.
+*/
+
+int png_write_rows(png_t* png, unsigned char* data, unsigned rows);
+
+/*
+	Function: png_write_end
+
+	Finishes an image started with png_write_begin and frees the compression state.
+
+	Returns:
+		PNG_NO_ERROR if all the rows were written and the end of the image could be written,
+		otherwise an error code.
+*/
+
+int png_write_end(png_t* png);
+
 /*
 	Function: png_close_file
 
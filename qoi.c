@@ -0,0 +1,272 @@
+// QOI ("Quite OK Image") codec, following the QOI specification
+// (https://qoiformat.org/qoi-specification.pdf). Each pixel is coded
+// as a run of the previous pixel, a reference to a recently seen pixel,
+// a small difference from the previous pixel, or literally.
+
+#include <stdlib.h>
+#include <string.h>
+#include "qoi.h"
+
+#define QOI_OP_INDEX 0x00   // 00xxxxxx
+#define QOI_OP_DIFF  0x40   // 01xxxxxx
+#define QOI_OP_LUMA  0x80   // 10xxxxxx
+#define QOI_OP_RUN   0xc0   // 11xxxxxx
+#define QOI_OP_RGB   0xfe
+#define QOI_OP_RGBA  0xff
+#define QOI_MASK_2   0xc0
+
+// Longest run a single QOI_OP_RUN can code
+#define QOI_MAX_RUN 62
+
+// Largest number of pixels allowed (as in the reference implementation)
+#define QOI_MAX_PIXELS 400000000u
+
+// Marks the end of the data
+static const unsigned char s_end_marker[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+
+static inline uint32_t qoi_hash( uint32_t px ) {
+  uint32_t r = px >> 24, g = (px >> 16) & 0xFF, b = (px >> 8) & 0xFF, a = px & 0xFF;
+  return (r * 3 + g * 5 + b * 7 + a * 11) % 64;
+}
+
+static void state_init( struct QoiState *state ) {
+  memset( state->index, 0, sizeof( state->index ) );
+  state->prev = 0x000000FF;
+  state->run = 0;
+}
+
+static uint32_t get_be32( const unsigned char *p ) {
+  return ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void put_be32( unsigned char *p, uint32_t val ) {
+  p[0] = val >> 24;
+  p[1] = (val >> 16) & 0xFF;
+  p[2] = (val >> 8) & 0xFF;
+  p[3] = val & 0xFF;
+}
+
+int qoi_is_qoi( const void *data, size_t len ) {
+  return len >= 4 && memcmp( data, "qoif", 4 ) == 0;
+}
+
+int qoi_decode_init( struct QoiDecoder *dec, const void *data, size_t len ) {
+  const unsigned char *p = data;
+  if ( len < QOI_HEADER_SIZE + sizeof( s_end_marker ) || !qoi_is_qoi( data, len ) )
+    return QOI_ERR_FORMAT;
+
+  dec->width = get_be32( p + 4 );
+  dec->height = get_be32( p + 8 );
+  dec->channels = p[12];
+  dec->colorspace = p[13];
+  if ( dec->width == 0 || dec->height == 0 || dec->height >= QOI_MAX_PIXELS / dec->width
+       || (dec->channels != 3 && dec->channels != 4) || dec->colorspace > 1 )
+    return QOI_ERR_FORMAT;
+
+  dec->data = p;
+  // The end marker isn't pixel data
+  dec->len = len - sizeof( s_end_marker );
+  dec->pos = QOI_HEADER_SIZE;
+  dec->rows_done = 0;
+  state_init( &dec->state );
+  return QOI_OK;
+}
+
+int qoi_decode_row( struct QoiDecoder *dec, uint32_t *row ) {
+  if ( dec->rows_done == dec->height )
+    return QOI_ERR_STATE;
+
+  const unsigned char *data = dec->data;
+  size_t pos = dec->pos, len = dec->len;
+  uint32_t px = dec->state.prev, run = dec->state.run;
+  uint32_t *index = dec->state.index;
+
+  for ( uint32_t x = 0; x < dec->width; x++ ) {
+    if ( run > 0 ) {
+      run--;
+      row[x] = px;
+      continue;
+    }
+    if ( pos >= len )
+      return QOI_ERR_FORMAT;
+
+    unsigned b1 = data[pos++];
+    if ( b1 == QOI_OP_RGB ) {
+      if ( len - pos < 3 )
+        return QOI_ERR_FORMAT;
+      px = ((uint32_t) data[pos] << 24) | (data[pos + 1] << 16) | (data[pos + 2] << 8) | (px & 0xFF);
+      pos += 3;
+    } else if ( b1 == QOI_OP_RGBA ) {
+      if ( len - pos < 4 )
+        return QOI_ERR_FORMAT;
+      px = get_be32( data + pos );
+      pos += 4;
+    } else if ( (b1 & QOI_MASK_2) == QOI_OP_INDEX ) {
+      px = index[b1];
+    } else if ( (b1 & QOI_MASK_2) == QOI_OP_DIFF ) {
+      uint32_t r = (px >> 24) + ((b1 >> 4) & 3) - 2;
+      uint32_t g = (px >> 16) + ((b1 >> 2) & 3) - 2;
+      uint32_t b = (px >> 8) + (b1 & 3) - 2;
+      px = ((r & 0xFF) << 24) | ((g & 0xFF) << 16) | ((b & 0xFF) << 8) | (px & 0xFF);
+    } else if ( (b1 & QOI_MASK_2) == QOI_OP_LUMA ) {
+      if ( pos >= len )
+        return QOI_ERR_FORMAT;
+      unsigned b2 = data[pos++];
+      int vg = (int) (b1 & 0x3f) - 32;
+      uint32_t r = (px >> 24) + vg - 8 + ((b2 >> 4) & 0x0f);
+      uint32_t g = (px >> 16) + vg;
+      uint32_t b = (px >> 8) + vg - 8 + (b2 & 0x0f);
+      px = ((r & 0xFF) << 24) | ((g & 0xFF) << 16) | ((b & 0xFF) << 8) | (px & 0xFF);
+    } else {
+      // QOI_OP_RUN: this pixel and run more repeat the previous one
+      run = b1 & 0x3f;
+    }
+
+    index[qoi_hash( px )] = px;
+    row[x] = px;
+  }
+
+  dec->pos = pos;
+  dec->state.prev = px;
+  dec->state.run = run;
+  dec->rows_done++;
+  return QOI_OK;
+}
+
+// Make room for n more bytes of output
+static int reserve( struct QoiEncoder *enc, size_t n ) {
+  if ( enc->cap - enc->len >= n )
+    return 1;
+  size_t cap = enc->cap * 2;
+  if ( cap < enc->len + n )
+    cap = enc->len + n;
+  unsigned char *buf = realloc( enc->buf, cap );
+  if ( buf == NULL )
+    return 0;
+  enc->buf = buf;
+  enc->cap = cap;
+  return 1;
+}
+
+int qoi_encode_init( struct QoiEncoder *enc, uint32_t width, uint32_t height, int channels ) {
+  if ( width == 0 || height == 0 || height >= QOI_MAX_PIXELS / width || (channels != 3 && channels != 4) )
+    return QOI_ERR_FORMAT;
+
+  enc->width = width;
+  enc->height = height;
+  enc->channels = (uint8_t) channels;
+  enc->rows_done = 0;
+  // Start with room for the header, end marker and a row of RGB literals
+  enc->cap = QOI_HEADER_SIZE + sizeof( s_end_marker ) + (size_t) width * 4;
+  enc->len = 0;
+  enc->buf = malloc( enc->cap );
+  if ( enc->buf == NULL )
+    return QOI_ERR_MEMORY;
+
+  unsigned char *p = enc->buf;
+  memcpy( p, "qoif", 4 );
+  put_be32( p + 4, width );
+  put_be32( p + 8, height );
+  p[12] = (unsigned char) channels;
+  p[13] = 0;   // sRGB with linear alpha
+  enc->len = QOI_HEADER_SIZE;
+  state_init( &enc->state );
+  return QOI_OK;
+}
+
+int qoi_encode_row( struct QoiEncoder *enc, const uint32_t *row ) {
+  if ( enc->rows_done == enc->height )
+    return QOI_ERR_STATE;
+  // At most 5 bytes per pixel, plus a pending run
+  if ( !reserve( enc, (size_t) enc->width * 5 + 1 ) )
+    return QOI_ERR_MEMORY;
+
+  unsigned char *out = enc->buf + enc->len;
+  uint32_t prev = enc->state.prev, run = enc->state.run;
+  uint32_t *index = enc->state.index;
+  uint32_t alpha_mask = enc->channels == 3 ? 0xFF : 0;
+
+  for ( uint32_t x = 0; x < enc->width; x++ ) {
+    uint32_t px = row[x] | alpha_mask;
+
+    if ( px == prev ) {
+      if ( ++run == QOI_MAX_RUN ) {
+        *out++ = QOI_OP_RUN | (run - 1);
+        run = 0;
+      }
+      continue;
+    }
+    if ( run > 0 ) {
+      *out++ = QOI_OP_RUN | (run - 1);
+      run = 0;
+    }
+
+    uint32_t h = qoi_hash( px );
+    if ( index[h] == px ) {
+      *out++ = QOI_OP_INDEX | h;
+    } else {
+      index[h] = px;
+      if ( (px & 0xFF) == (prev & 0xFF) ) {
+        int8_t vr = (int8_t) ((px >> 24) - (prev >> 24));
+        int8_t vg = (int8_t) ((px >> 16) - (prev >> 16));
+        int8_t vb = (int8_t) ((px >> 8) - (prev >> 8));
+        int8_t vg_r = vr - vg, vg_b = vb - vg;
+
+        if ( vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2 ) {
+          *out++ = QOI_OP_DIFF | ((vr + 2) << 4) | ((vg + 2) << 2) | (vb + 2);
+        } else if ( vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 && vg_b > -9 && vg_b < 8 ) {
+          *out++ = QOI_OP_LUMA | (vg + 32);
+          *out++ = ((vg_r + 8) << 4) | (vg_b + 8);
+        } else {
+          *out++ = QOI_OP_RGB;
+          *out++ = px >> 24;
+          *out++ = (px >> 16) & 0xFF;
+          *out++ = (px >> 8) & 0xFF;
+        }
+      } else {
+        *out++ = QOI_OP_RGBA;
+        put_be32( out, px );
+        out += 4;
+      }
+    }
+    prev = px;
+  }
+
+  enc->len = out - enc->buf;
+  enc->state.prev = prev;
+  enc->state.run = run;
+  enc->rows_done++;
+  return QOI_OK;
+}
+
+void qoi_encode_consume( struct QoiEncoder *enc, size_t len ) {
+  memmove( enc->buf, enc->buf + len, enc->len - len );
+  enc->len -= len;
+}
+
+int qoi_encode_finish( struct QoiEncoder *enc, void **buf, size_t *len ) {
+  if ( enc->rows_done != enc->height ) {
+    qoi_encode_abort( enc );
+    return QOI_ERR_STATE;
+  }
+  if ( !reserve( enc, 1 + sizeof( s_end_marker ) ) ) {
+    qoi_encode_abort( enc );
+    return QOI_ERR_MEMORY;
+  }
+
+  // Runs may continue across rows, so the last one ends here
+  if ( enc->state.run > 0 )
+    enc->buf[enc->len++] = QOI_OP_RUN | (enc->state.run - 1);
+  memcpy( enc->buf + enc->len, s_end_marker, sizeof( s_end_marker ) );
+  enc->len += sizeof( s_end_marker );
+
+  *buf = enc->buf;
+  *len = enc->len;
+  enc->buf = NULL;
+  return QOI_OK;
+}
+
+void qoi_encode_abort( struct QoiEncoder *enc ) {
+  free( enc->buf );
+  enc->buf = NULL;
+}
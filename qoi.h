@@ -0,0 +1,87 @@
+// Header for the QOI ("Quite OK Image") codec. QOI is a simple lossless
+// format that compresses less than PNG but encodes and decodes many
+// times faster. Pixels are passed a row at a time as uint32_t values
+// in the same 0xRRGGBBAA form as struct Image.
+
+#ifndef QOI_H
+#define QOI_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+//! Return values
+#define QOI_OK          0
+#define QOI_ERR_FORMAT  -1   // not QOI data, or truncated/corrupt data
+#define QOI_ERR_MEMORY  -2
+#define QOI_ERR_STATE   -3   // too many or too few rows
+
+//! Size of the header at the start of QOI data
+#define QOI_HEADER_SIZE 14
+
+//! State of the pixel predictor, shared by the decoder and encoder
+struct QoiState {
+  uint32_t index[64];   // recently seen pixels, by hash
+  uint32_t prev;        // previous pixel
+  uint32_t run;         // pixels left in (or accumulated for) a run
+};
+
+//! Decoder for QOI data held in memory
+struct QoiDecoder {
+  uint32_t width;
+  uint32_t height;
+  uint8_t channels;     // 3 (RGB) or 4 (RGBA), as stored in the header
+  uint8_t colorspace;
+  const unsigned char *data;
+  size_t len;
+  size_t pos;
+  uint32_t rows_done;
+  struct QoiState state;
+};
+
+//! Encoder that writes QOI data to a growing memory buffer
+struct QoiEncoder {
+  uint32_t width;
+  uint32_t height;
+  uint8_t channels;
+  unsigned char *buf;
+  size_t len;
+  size_t cap;
+  uint32_t rows_done;
+  struct QoiState state;
+};
+
+//! Return 1 if data starts with the QOI magic number, 0 otherwise.
+int qoi_is_qoi( const void *data, size_t len );
+
+//! Start decoding the QOI data in data (len bytes, which must stay valid
+//! until decoding is done): check the header and fill in the width,
+//! height, channels and colorspace fields.
+int qoi_decode_init( struct QoiDecoder *dec, const void *data, size_t len );
+
+//! Decode the next row into row (width pixels). The channels field
+//! doesn't affect decoding: RGB images simply never change the alpha
+//! of the initial (opaque) pixel.
+int qoi_decode_row( struct QoiDecoder *dec, uint32_t *row );
+
+//! Start encoding an image of the given dimensions. If channels is 3,
+//! the image is stored as RGB and alpha is dropped (treated as 0xFF).
+int qoi_encode_init( struct QoiEncoder *enc, uint32_t width, uint32_t height, int channels );
+
+//! Encode the next row of the image (width pixels).
+int qoi_encode_row( struct QoiEncoder *enc, const uint32_t *row );
+
+//! Drop the first len bytes of the data encoded so far (the first len
+//! of the enc->len bytes in enc->buf), e.g. once they have been written
+//! out, so a long image can be encoded in a small buffer.
+void qoi_encode_consume( struct QoiEncoder *enc, size_t len );
+
+//! Finish encoding once every row has been encoded. On success, *buf
+//! is set to the QOI data (which the caller must free) and *len to its
+//! size (without any data dropped by qoi_encode_consume). The encoder
+//! must not be used afterwards.
+int qoi_encode_finish( struct QoiEncoder *enc, void **buf, size_t *len );
+
+//! Free the resources of an encoder that won't be finished.
+void qoi_encode_abort( struct QoiEncoder *enc );
+
+#endif // QOI_H
@@ -1,23 +1,25 @@
 #! /usr/bin/env bash
 
 # Run c_imgproc or asm_imgproc on test input and check whether
-# the correct output images are produced.
+# the correct output images are produced. The tests run in parallel
+# (as many at once as there are CPUs, or $JOBS), and their results are
+# reported in order once they are done.
 
-error_count="0"
+jobs="${JOBS:-$(nproc 2>/dev/null || echo 4)}"
+tests=()
 
+# Start a test in the background, waiting for one to finish first if
+# enough are running already
 run_test() {
-  local exe="./run_test.rb"
-  echo -n "Running '${exe} $@'..."
   local out_stem=$(echo "$@" | tr ' ./' '___')
   local out_file="actual/${out_stem}.out"
   local err_file="actual/${out_stem}.err"
-  ${exe} "$@" > ${out_file} 2> ${err_file}
-  if [[ $? -ne 0 ]]; then
-    echo "FAILED"
-    error_count=$((${error_count} + 1))
-  else
-    echo "passed"
-  fi
+  while [[ $(jobs -rp | wc -l) -ge ${jobs} ]]; do
+    wait -n
+  done
+  tests+=("$*")
+  ( ./run_test.rb "$@" > ${out_file} 2> ${err_file}
+    echo $? > "actual/${out_stem}.status" ) &
 }
 
 if [[ $# -ne 1 ]]; then
@@ -29,6 +31,7 @@ fi
 exe_version="$1"
 
 mkdir -p actual
+rm -f actual/*.status
 
 image_stems='dice ingo kittens landscape'
 
@@ -46,11 +49,24 @@ for stem in ${image_stems}; do
   run_test ${exe_version} ${stem} expand
 done
 
+wait
+
+error_count="0"
+for t in "${tests[@]}"; do
+  status_file="actual/$(echo "${t}" | tr ' ./' '___').status"
+  echo -n "Running './run_test.rb ${t}'..."
+  if [[ "$(cat ${status_file} 2>/dev/null)" != "0" ]]; then
+    echo "FAILED"
+    error_count=$((${error_count} + 1))
+  else
+    echo "passed"
+  fi
+done
 
 if [[ ${error_count} -eq 0 ]]; then
   echo "All tests passed!"
   exit 0
 else
-  echo "${error_count} test(s) failed\n"
+  echo "${error_count} test(s) failed"
   exit 1
 fi
@@ -18,6 +18,10 @@ def run(cmd)
   
   if status.exitstatus != 0
     STDERR.puts "Error: #{cmd[0]} exited with a non-zero exit code (#{status.exitstatus})"
+    if !stdout.empty?
+      STDERR.puts "Output was:"
+      STDERR.print stdout
+    end
     STDERR.puts "Error output was:"
     STDERR.print stderr
     exit 1
@@ -66,8 +70,14 @@ cmd = [exe, transformation, input_filename, actual_filename, *transformation_arg
 #puts cmd.join(' ')
 run(cmd)
 
-# use Imagemagick compare program to compare images
-cmd = ['compare', '-metric', 'mse', expected_filename, actual_filename, diff_filename]
+# compare the images with imgcmp, which writes the diff image only if
+# they differ
+if !File.executable?('./imgcmp')
+  STDERR.puts "./imgcmp doesn't exist or is not executable (maybe you need to run make?)"
+  exit 1
+end
+File.delete(diff_filename) if File.exist?(diff_filename)
+cmd = ['./imgcmp', '--diff', diff_filename, expected_filename, actual_filename]
 run(cmd)
 
 puts "Test passed!"
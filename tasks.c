@@ -0,0 +1,223 @@
+// Work-stealing task scheduler. Every worker thread owns a deque of
+// tasks protected by its own lock; the owner pushes and pops at the
+// bottom, and other threads steal from the top. Threads that aren't
+// workers queue tasks on a shared deque. Idle workers sleep until a
+// task is queued.
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include "parallel.h"
+#include "tasks.h"
+
+// Initial capacity of a deque (must be a power of 2)
+#define DEQUE_INITIAL_CAP 64
+
+struct Task {
+  task_fn fn;
+  void *arg;
+  struct TaskGroup *group;
+};
+
+// Growable ring buffer of tasks. Tasks in [top, bottom) are queued;
+// the indices only ever increase and are reduced modulo cap.
+struct Deque {
+  pthread_mutex_t lock;
+  struct Task *buf;
+  size_t cap;
+  size_t top;
+  size_t bottom;
+};
+
+static struct {
+  int num_workers;
+  struct Deque *deques;  // num_workers worker deques, then the shared one
+  int queued;            // tasks queued on all deques
+  int sleeping;          // workers waiting for tasks
+  pthread_mutex_t idle_lock;
+  pthread_cond_t idle_cond;
+} s_pool;
+
+static pthread_once_t s_pool_once = PTHREAD_ONCE_INIT;
+static __thread int t_worker = -1;
+
+// Push onto the bottom of d. Returns 0 if the deque couldn't grow.
+static int deque_push( struct Deque *d, const struct Task *task ) {
+  pthread_mutex_lock( &d->lock );
+  if ( d->bottom - d->top == d->cap ) {
+    size_t cap = d->cap * 2;
+    struct Task *buf = malloc( cap * sizeof( struct Task ) );
+    if ( buf == NULL ) {
+      pthread_mutex_unlock( &d->lock );
+      return 0;
+    }
+    for ( size_t i = d->top; i < d->bottom; i++ )
+      buf[i & (cap - 1)] = d->buf[i & (d->cap - 1)];
+    free( d->buf );
+    d->buf = buf;
+    d->cap = cap;
+  }
+  d->buf[d->bottom & (d->cap - 1)] = *task;
+  d->bottom++;
+  pthread_mutex_unlock( &d->lock );
+  return 1;
+}
+
+// Take the newest (from_bottom) or oldest task from d, if there is one
+static int deque_take( struct Deque *d, int from_bottom, struct Task *task ) {
+  int found = 0;
+  pthread_mutex_lock( &d->lock );
+  if ( d->bottom > d->top ) {
+    if ( from_bottom ) {
+      d->bottom--;
+      *task = d->buf[d->bottom & (d->cap - 1)];
+    } else {
+      *task = d->buf[d->top & (d->cap - 1)];
+      d->top++;
+    }
+    found = 1;
+  }
+  pthread_mutex_unlock( &d->lock );
+  return found;
+}
+
+// Find a task for the calling thread: its own newest task, then the
+// oldest task on the shared deque or on another worker's deque
+static int find_task( struct Task *task ) {
+  int self = t_worker;
+  int n = s_pool.num_workers;
+
+  if ( self >= 0 && deque_take( &s_pool.deques[self], 1, task ) )
+    goto found;
+  if ( deque_take( &s_pool.deques[n], 0, task ) )
+    goto found;
+  // Start at the next worker so that thieves spread over the victims
+  for ( int i = 1; i <= n; i++ ) {
+    int victim = ((self < 0 ? 0 : self) + i) % n;
+    if ( victim != self && deque_take( &s_pool.deques[victim], 0, task ) )
+      goto found;
+  }
+  return 0;
+
+found:
+  __atomic_sub_fetch( &s_pool.queued, 1, __ATOMIC_SEQ_CST );
+  return 1;
+}
+
+static void run_task( const struct Task *task ) {
+  task->fn( task->arg );
+  __atomic_sub_fetch( &task->group->pending, 1, __ATOMIC_RELEASE );
+}
+
+static void *worker_main( void *arg ) {
+  t_worker = (int) (intptr_t) arg;
+
+  int cpu = par_band_cpu( t_worker );
+  if ( cpu >= 0 ) {
+    cpu_set_t set;
+    CPU_ZERO( &set );
+    CPU_SET( cpu, &set );
+    sched_setaffinity( 0, sizeof( set ), &set );
+  }
+
+  for ( ;; ) {
+    struct Task task;
+    if ( find_task( &task ) ) {
+      run_task( &task );
+      continue;
+    }
+
+    // Sleep until something is queued. Announcing the sleep before
+    // checking queued (and tasks_spawn doing the opposite) means a
+    // wakeup can't be missed.
+    pthread_mutex_lock( &s_pool.idle_lock );
+    __atomic_add_fetch( &s_pool.sleeping, 1, __ATOMIC_SEQ_CST );
+    while ( __atomic_load_n( &s_pool.queued, __ATOMIC_SEQ_CST ) == 0 )
+      pthread_cond_wait( &s_pool.idle_cond, &s_pool.idle_lock );
+    __atomic_sub_fetch( &s_pool.sleeping, 1, __ATOMIC_SEQ_CST );
+    pthread_mutex_unlock( &s_pool.idle_lock );
+  }
+  return NULL;
+}
+
+static void start_pool( void ) {
+  int n = par_num_threads();
+
+  s_pool.deques = calloc( n + 1, sizeof( struct Deque ) );
+  if ( s_pool.deques == NULL )
+    return;
+  for ( int i = 0; i <= n; i++ ) {
+    struct Deque *d = &s_pool.deques[i];
+    pthread_mutex_init( &d->lock, NULL );
+    d->buf = malloc( DEQUE_INITIAL_CAP * sizeof( struct Task ) );
+    d->cap = d->buf != NULL ? DEQUE_INITIAL_CAP : 0;
+  }
+  pthread_mutex_init( &s_pool.idle_lock, NULL );
+  pthread_cond_init( &s_pool.idle_cond, NULL );
+
+  // Workers that can't be started are left out (their deques are still
+  // valid and get emptied by stealing threads)
+  s_pool.num_workers = n;
+  for ( int i = 0; i < n; i++ ) {
+    pthread_t thread;
+    if ( pthread_create( &thread, NULL, worker_main, (void *) (intptr_t) i ) == 0 )
+      pthread_detach( thread );
+  }
+}
+
+int tasks_num_workers( void ) {
+  pthread_once( &s_pool_once, start_pool );
+  return s_pool.num_workers;
+}
+
+int tasks_current_worker( void ) {
+  return t_worker;
+}
+
+void tasks_spawn( struct TaskGroup *group, int worker, task_fn fn, void *arg ) {
+  struct Task task = { fn, arg, group };
+  int n = tasks_num_workers();
+
+  if ( worker < 0 || worker >= n )
+    worker = t_worker >= 0 ? t_worker : n;
+
+  __atomic_add_fetch( &group->pending, 1, __ATOMIC_RELAXED );
+  if ( n == 0 || s_pool.deques[worker].cap == 0 ) {
+    // No pool: run the task right away
+    run_task( &task );
+    return;
+  }
+
+  // Count the task before queueing it, so that it can't be taken (and
+  // uncounted) before it is counted
+  __atomic_add_fetch( &s_pool.queued, 1, __ATOMIC_SEQ_CST );
+  if ( !deque_push( &s_pool.deques[worker], &task ) ) {
+    __atomic_sub_fetch( &s_pool.queued, 1, __ATOMIC_SEQ_CST );
+    run_task( &task );
+    return;
+  }
+  if ( __atomic_load_n( &s_pool.sleeping, __ATOMIC_SEQ_CST ) > 0 ) {
+    pthread_mutex_lock( &s_pool.idle_lock );
+    pthread_cond_signal( &s_pool.idle_cond );
+    pthread_mutex_unlock( &s_pool.idle_lock );
+  }
+}
+
+int tasks_run_one( void ) {
+  struct Task task;
+  if ( tasks_num_workers() == 0 || !find_task( &task ) )
+    return 0;
+  run_task( &task );
+  return 1;
+}
+
+void tasks_wait( struct TaskGroup *group ) {
+  while ( __atomic_load_n( &group->pending, __ATOMIC_ACQUIRE ) > 0 ) {
+    struct Task task;
+    if ( s_pool.num_workers > 0 && find_task( &task ) )
+      run_task( &task );
+    else
+      sched_yield();
+  }
+}
@@ -0,0 +1,47 @@
+// Header for the work-stealing task scheduler used by the threaded
+// execution layer (par_for) and the batch executor.
+
+#ifndef TASKS_H
+#define TASKS_H
+
+//! Function run by a task, with the argument given to tasks_spawn
+typedef void (*task_fn)( void *arg );
+
+//! A set of spawned tasks that can be waited for together.
+//! Initialize with TASK_GROUP_INIT (or by zeroing it).
+struct TaskGroup {
+  int pending;   // spawned tasks that haven't finished yet
+};
+
+#define TASK_GROUP_INIT { 0 }
+
+//! Return the number of worker threads in the pool, starting the pool
+//! if needed. The pool size is par_num_threads(); each worker i is
+//! pinned to par_band_cpu(i).
+int tasks_num_workers( void );
+
+//! Return the index of the calling thread in the worker pool, or -1 if
+//! it isn't a worker.
+int tasks_current_worker( void );
+
+//! Add a task to group and queue it. Each worker has its own deque:
+//! a worker takes its newest task first, and idle workers steal the
+//! oldest task from another worker's deque. If worker is a valid worker
+//! index, the task goes on that worker's deque (so that it is likely to
+//! run on that worker's CPU); if it is -1, the task goes on the calling
+//! worker's own deque, or on a shared queue if the caller is not a worker.
+void tasks_spawn( struct TaskGroup *group, int worker, task_fn fn, void *arg );
+
+//! Run one queued task on the calling thread, if there is one (its own
+//! newest task first, then a stolen one). Returns 1 if a task was run,
+//! 0 otherwise. Lets a thread that is waiting for something other than
+//! a task group help in the meantime.
+int tasks_run_one( void );
+
+//! Wait until all tasks in group have finished. While waiting, the
+//! calling thread runs queued tasks (its own first, then stolen ones),
+//! so tasks may spawn and wait for tasks of their own without tying up
+//! a worker.
+void tasks_wait( struct TaskGroup *group );
+
+#endif // TASKS_H
@@ -0,0 +1,369 @@
+// Tiled image container (.timg). Layout, with all fields little-endian:
+//
+//   header (TIMG_HEADER_SIZE bytes):
+//        0  magic "TIMG"
+//        4  version (1)
+//        8  width
+//       12  height
+//       16  tile width
+//       20  tile height
+//   tile index (TIMG_ENTRY_SIZE bytes per tile, row by row of tiles):
+//        0  offset of the tile's data (64 bits)
+//        8  size of the tile's data
+//       12  method (TIMG_STORE or TIMG_DEFLATE)
+//       16  CRC-32 of the decoded tile
+//   tile data
+//
+// A decoded tile holds the tile's rows of pixels back to back, each
+// pixel a little-endian uint32_t 0xRRGGBBAA. Tiles on the right and
+// bottom edges are narrower or shorter if the image size isn't a
+// multiple of the tile size.
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "parallel.h"
+#include "imgjob.h"
+#include "timg.h"
+
+#define TIMG_HEADER_SIZE 64
+#define TIMG_ENTRY_SIZE 24
+#define TIMG_VERSION 1
+#define TIMG_STORE 0
+#define TIMG_DEFLATE 1
+
+static void put_le32( unsigned char *p, uint32_t val ) {
+  p[0] = val & 0xFF;
+  p[1] = (val >> 8) & 0xFF;
+  p[2] = (val >> 16) & 0xFF;
+  p[3] = val >> 24;
+}
+
+static uint32_t get_le32( const unsigned char *p ) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static int host_is_little_endian( void ) {
+  uint32_t x = 1;
+  return *(const unsigned char *) &x == 1;
+}
+
+// Copy n pixels from little-endian form (src) to host form (dst), or back
+static void copy_pixels( void *dst, const void *src, size_t n ) {
+  if ( host_is_little_endian() ) {
+    memcpy( dst, src, n * sizeof( uint32_t ) );
+    return;
+  }
+  const unsigned char *s = src;
+  unsigned char *d = dst;
+  for ( size_t i = 0; i < n; i++, s += 4, d += 4 ) {
+    unsigned char b0 = s[0], b1 = s[1];
+    d[0] = s[3];
+    d[1] = s[2];
+    d[2] = b1;
+    d[3] = b0;
+  }
+}
+
+static const unsigned char *tile_entry( const struct TiledImage *ti, int32_t tx, int32_t ty ) {
+  return ti->data + TIMG_HEADER_SIZE + ((size_t) ty * ti->tiles_x + tx) * TIMG_ENTRY_SIZE;
+}
+
+static void tile_size( int32_t width, int32_t height, int32_t tile_w, int32_t tile_h,
+                       int32_t tx, int32_t ty, int32_t *tw, int32_t *th ) {
+  *tw = width - tx * tile_w < tile_w ? width - tx * tile_w : tile_w;
+  *th = height - ty * tile_h < tile_h ? height - ty * tile_h : tile_h;
+}
+
+int timg_is_timg( const void *data, size_t len ) {
+  return len >= 4 && memcmp( data, "TIMG", 4 ) == 0;
+}
+
+int timg_open_mem( const void *data, size_t len, struct TiledImage *ti ) {
+  const unsigned char *p = data;
+  if ( len < TIMG_HEADER_SIZE || !timg_is_timg( data, len ) || get_le32( p + 4 ) != TIMG_VERSION )
+    return IMG_ERR_CORRUPT;
+
+  uint32_t width = get_le32( p + 8 ), height = get_le32( p + 12 );
+  uint32_t tile_w = get_le32( p + 16 ), tile_h = get_le32( p + 20 );
+  if ( width == 0 || height == 0 || width > INT32_MAX / height || tile_w == 0 || tile_h == 0
+       || tile_w > width || tile_h > height )
+    return IMG_ERR_CORRUPT;
+
+  ti->width = (int32_t) width;
+  ti->height = (int32_t) height;
+  ti->tile_w = (int32_t) tile_w;
+  ti->tile_h = (int32_t) tile_h;
+  ti->tiles_x = (int32_t) ((width + tile_w - 1) / tile_w);
+  ti->tiles_y = (int32_t) ((height + tile_h - 1) / tile_h);
+  ti->data = p;
+  ti->len = len;
+  ti->map = NULL;
+
+  // Check that the index and every tile's data lie within the container
+  size_t num_tiles = (size_t) ti->tiles_x * ti->tiles_y;
+  if ( (len - TIMG_HEADER_SIZE) / TIMG_ENTRY_SIZE < num_tiles )
+    return IMG_ERR_CORRUPT;
+  for ( int32_t ty = 0; ty < ti->tiles_y; ty++ ) {
+    for ( int32_t tx = 0; tx < ti->tiles_x; tx++ ) {
+      const unsigned char *e = tile_entry( ti, tx, ty );
+      uint64_t offset = get_le32( e ) | ((uint64_t) get_le32( e + 4 ) << 32);
+      uint32_t size = get_le32( e + 8 ), method = get_le32( e + 12 );
+      if ( offset > len || len - offset < size || (method != TIMG_STORE && method != TIMG_DEFLATE) )
+        return IMG_ERR_CORRUPT;
+    }
+  }
+  return IMG_SUCCESS;
+}
+
+int timg_open( const char *filename, struct TiledImage *ti ) {
+  int fd = open( filename, O_RDONLY | O_CLOEXEC );
+  if ( fd < 0 )
+    return IMG_ERR_COULD_NOT_OPEN;
+  struct stat st;
+  if ( fstat( fd, &st ) != 0 || st.st_size == 0 ) {
+    close( fd );
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+
+  // Not populated: tiles are paged in as they are decoded
+  size_t len = (size_t) st.st_size;
+  void *map = mmap( NULL, len, PROT_READ, MAP_PRIVATE, fd, 0 );
+  close( fd );
+  if ( map == MAP_FAILED )
+    return IMG_ERR_COULD_NOT_OPEN;
+
+  int rc = timg_open_mem( map, len, ti );
+  if ( rc != IMG_SUCCESS ) {
+    munmap( map, len );
+    return rc;
+  }
+  ti->map = map;
+  return IMG_SUCCESS;
+}
+
+void timg_close( struct TiledImage *ti ) {
+  if ( ti->map != NULL )
+    munmap( ti->map, ti->len );
+  ti->map = NULL;
+  ti->data = NULL;
+}
+
+// Context for decoding the tiles covering a region in parallel
+struct RegionCtx {
+  const struct TiledImage *ti;
+  int32_t x, y, w, h;
+  int32_t tx0, ty0, cols;   // first tile and number of tile columns covered
+  uint32_t *out;
+  size_t out_stride;
+  int rc;                   // first error, if any
+};
+
+static void decode_tiles( void *arg, int32_t begin, int32_t end ) {
+  struct RegionCtx *ctx = arg;
+  const struct TiledImage *ti = ctx->ti;
+  unsigned char *scratch = NULL;
+
+  for ( int32_t k = begin; k < end; k++ ) {
+    int32_t tx = ctx->tx0 + k % ctx->cols, ty = ctx->ty0 + k / ctx->cols;
+    int32_t tw, th;
+    tile_size( ti->width, ti->height, ti->tile_w, ti->tile_h, tx, ty, &tw, &th );
+    uLongf raw_size = (uLongf) tw * th * sizeof( uint32_t );
+
+    const unsigned char *e = tile_entry( ti, tx, ty );
+    uint64_t offset = get_le32( e ) | ((uint64_t) get_le32( e + 4 ) << 32);
+    uint32_t size = get_le32( e + 8 );
+    const unsigned char *raw = ti->data + offset;
+    int rc = IMG_SUCCESS;
+
+    if ( get_le32( e + 12 ) == TIMG_DEFLATE ) {
+      if ( scratch == NULL )
+        scratch = malloc( (size_t) ti->tile_w * ti->tile_h * sizeof( uint32_t ) );
+      uLongf dest_len = raw_size;
+      if ( scratch == NULL )
+        rc = IMG_ERR_MALLOC_FAILED;
+      else if ( uncompress( scratch, &dest_len, raw, size ) != Z_OK || dest_len != raw_size )
+        rc = IMG_ERR_CORRUPT;
+      raw = scratch;
+    } else if ( size != raw_size ) {
+      rc = IMG_ERR_CORRUPT;
+    }
+    if ( rc == IMG_SUCCESS && crc32( crc32( 0L, Z_NULL, 0 ), raw, raw_size ) != get_le32( e + 16 ) )
+      rc = IMG_ERR_CORRUPT;
+    if ( rc != IMG_SUCCESS ) {
+      __atomic_store_n( &ctx->rc, rc, __ATOMIC_RELAXED );
+      break;
+    }
+
+    // Copy the part of the tile inside the region
+    int32_t x0 = tx * ti->tile_w, y0 = ty * ti->tile_h;
+    int32_t cx0 = x0 > ctx->x ? x0 : ctx->x;
+    int32_t cx1 = x0 + tw < ctx->x + ctx->w ? x0 + tw : ctx->x + ctx->w;
+    int32_t cy0 = y0 > ctx->y ? y0 : ctx->y;
+    int32_t cy1 = y0 + th < ctx->y + ctx->h ? y0 + th : ctx->y + ctx->h;
+    for ( int32_t row = cy0; row < cy1; row++ ) {
+      const unsigned char *src = raw + ((size_t) (row - y0) * tw + (cx0 - x0)) * sizeof( uint32_t );
+      uint32_t *dst = ctx->out + (size_t) (row - ctx->y) * ctx->out_stride + (cx0 - ctx->x);
+      copy_pixels( dst, src, cx1 - cx0 );
+    }
+  }
+
+  free( scratch );
+}
+
+int timg_read_region( const struct TiledImage *ti, int32_t x, int32_t y, int32_t w, int32_t h,
+                      uint32_t *out, size_t out_stride ) {
+  if ( x < 0 || y < 0 || w < 1 || h < 1 || x > ti->width - w || y > ti->height - h )
+    return IMG_ERR_CORRUPT;
+
+  struct RegionCtx ctx;
+  ctx.ti = ti;
+  ctx.x = x;
+  ctx.y = y;
+  ctx.w = w;
+  ctx.h = h;
+  ctx.tx0 = x / ti->tile_w;
+  ctx.ty0 = y / ti->tile_h;
+  ctx.cols = (x + w - 1) / ti->tile_w - ctx.tx0 + 1;
+  ctx.out = out;
+  ctx.out_stride = out_stride;
+  ctx.rc = IMG_SUCCESS;
+
+  int32_t rows = (y + h - 1) / ti->tile_h - ctx.ty0 + 1;
+  par_for( ctx.cols * rows, decode_tiles, &ctx );
+  // tiles are skipped once the current job is stopped
+  return ctx.rc == IMG_SUCCESS && imgjob_check() ? IMG_ERR_CANCELLED : ctx.rc;
+}
+
+// Context for encoding tiles in parallel
+struct EncodeCtx {
+  const struct Image *img;
+  int32_t tile_w, tile_h, tiles_x;
+  int level;
+  unsigned char **bufs;     // encoded data of each tile
+  uint32_t *sizes;
+  uint32_t *methods;
+  uint32_t *crcs;
+  int rc;
+};
+
+static void encode_tiles( void *arg, int32_t begin, int32_t end ) {
+  struct EncodeCtx *ctx = arg;
+  const struct Image *img = ctx->img;
+
+  for ( int32_t k = begin; k < end; k++ ) {
+    int32_t tx = k % ctx->tiles_x, ty = k / ctx->tiles_x;
+    int32_t tw, th;
+    tile_size( img->width, img->height, ctx->tile_w, ctx->tile_h, tx, ty, &tw, &th );
+    uLong raw_size = (uLong) tw * th * sizeof( uint32_t );
+
+    unsigned char *raw = malloc( raw_size );
+    if ( raw == NULL ) {
+      __atomic_store_n( &ctx->rc, IMG_ERR_MALLOC_FAILED, __ATOMIC_RELAXED );
+      return;
+    }
+    for ( int32_t row = 0; row < th; row++ ) {
+      const uint32_t *src = img->data + (size_t) (ty * ctx->tile_h + row) * img->width + tx * ctx->tile_w;
+      copy_pixels( raw + (size_t) row * tw * sizeof( uint32_t ), src, tw );
+    }
+    ctx->crcs[k] = crc32( crc32( 0L, Z_NULL, 0 ), raw, raw_size );
+    ctx->bufs[k] = raw;
+    ctx->sizes[k] = raw_size;
+    ctx->methods[k] = TIMG_STORE;
+
+    // Keep the compressed tile only if it is smaller
+    if ( ctx->level != 0 ) {
+      uLongf comp_size = compressBound( raw_size );
+      unsigned char *comp = malloc( comp_size );
+      if ( comp != NULL && compress2( comp, &comp_size, raw, raw_size, ctx->level ) == Z_OK
+           && comp_size < raw_size ) {
+        free( raw );
+        ctx->bufs[k] = comp;
+        ctx->sizes[k] = comp_size;
+        ctx->methods[k] = TIMG_DEFLATE;
+      } else {
+        free( comp );
+      }
+    }
+  }
+}
+
+int timg_encode( const struct Image *img, int32_t tile_size, int level, void **buf, size_t *len ) {
+  if ( tile_size < 1 )
+    return IMG_ERR_COULD_NOT_WRITE;
+  // Tiles are never larger than the image
+  int32_t tile_w = tile_size < img->width ? tile_size : img->width;
+  int32_t tile_h = tile_size < img->height ? tile_size : img->height;
+  int32_t tiles_x = (img->width + tile_w - 1) / tile_w;
+  int32_t tiles_y = (img->height + tile_h - 1) / tile_h;
+  size_t num_tiles = (size_t) tiles_x * tiles_y;
+
+  struct EncodeCtx ctx;
+  ctx.img = img;
+  ctx.tile_w = tile_w;
+  ctx.tile_h = tile_h;
+  ctx.tiles_x = tiles_x;
+  ctx.level = level;
+  ctx.bufs = calloc( num_tiles, sizeof( unsigned char * ) );
+  ctx.sizes = malloc( num_tiles * sizeof( uint32_t ) );
+  ctx.methods = malloc( num_tiles * sizeof( uint32_t ) );
+  ctx.crcs = malloc( num_tiles * sizeof( uint32_t ) );
+  ctx.rc = IMG_SUCCESS;
+
+  unsigned char *data = NULL;
+  size_t total = TIMG_HEADER_SIZE + num_tiles * TIMG_ENTRY_SIZE;
+  if ( ctx.bufs == NULL || ctx.sizes == NULL || ctx.methods == NULL || ctx.crcs == NULL ) {
+    ctx.rc = IMG_ERR_MALLOC_FAILED;
+  } else {
+    par_for( (int32_t) num_tiles, encode_tiles, &ctx );
+    if ( ctx.rc == IMG_SUCCESS && imgjob_check() )
+      ctx.rc = IMG_ERR_CANCELLED;
+  }
+
+  if ( ctx.rc == IMG_SUCCESS ) {
+    for ( size_t k = 0; k < num_tiles; k++ )
+      total += ctx.sizes[k];
+    data = malloc( total );
+    if ( data == NULL )
+      ctx.rc = IMG_ERR_MALLOC_FAILED;
+  }
+
+  if ( ctx.rc == IMG_SUCCESS ) {
+    memset( data, 0, TIMG_HEADER_SIZE );
+    memcpy( data, "TIMG", 4 );
+    put_le32( data + 4, TIMG_VERSION );
+    put_le32( data + 8, (uint32_t) img->width );
+    put_le32( data + 12, (uint32_t) img->height );
+    put_le32( data + 16, (uint32_t) tile_w );
+    put_le32( data + 20, (uint32_t) tile_h );
+
+    uint64_t offset = TIMG_HEADER_SIZE + num_tiles * TIMG_ENTRY_SIZE;
+    for ( size_t k = 0; k < num_tiles; k++ ) {
+      unsigned char *e = data + TIMG_HEADER_SIZE + k * TIMG_ENTRY_SIZE;
+      put_le32( e, (uint32_t) offset );
+      put_le32( e + 4, (uint32_t) (offset >> 32) );
+      put_le32( e + 8, ctx.sizes[k] );
+      put_le32( e + 12, ctx.methods[k] );
+      put_le32( e + 16, ctx.crcs[k] );
+      put_le32( e + 20, 0 );
+      memcpy( data + offset, ctx.bufs[k], ctx.sizes[k] );
+      offset += ctx.sizes[k];
+    }
+    *buf = data;
+    *len = total;
+  }
+
+  if ( ctx.bufs != NULL ) {
+    for ( size_t k = 0; k < num_tiles; k++ )
+      free( ctx.bufs[k] );
+  }
+  free( ctx.bufs );
+  free( ctx.sizes );
+  free( ctx.methods );
+  free( ctx.crcs );
+  return ctx.rc;
+}
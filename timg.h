@@ -0,0 +1,61 @@
+// Header for the tiled image container (.timg). The image is split into
+// fixed-size tiles, each compressed independently (deflate, or stored
+// if that doesn't help) and listed in a tile index, so a region can be
+// read by decoding only the tiles covering it, and tiles can be encoded
+// and decoded in parallel.
+
+#ifndef TIMG_H
+#define TIMG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "image.h" // for struct Image and the IMG_* return values
+
+//! Default tile width and height
+#define TIMG_DEFAULT_TILE 256
+
+//! An opened tiled image. The pixel data is only touched when tiles
+//! are decoded, so for files (which are mapped into memory) only the
+//! pages of the tiles that are read get loaded.
+struct TiledImage {
+  int32_t width;
+  int32_t height;
+  int32_t tile_w;
+  int32_t tile_h;
+  int32_t tiles_x;                // number of tile columns
+  int32_t tiles_y;                // number of tile rows
+  const unsigned char *data;      // the whole container
+  size_t len;
+  void *map;                      // mapping of data, if opened from a file
+};
+
+//! Return 1 if data starts with the .timg magic number, 0 otherwise.
+int timg_is_timg( const void *data, size_t len );
+
+//! Open the named .timg file by mapping it into memory and checking
+//! its header and tile index. Returns IMG_SUCCESS or an IMG_ERR_* value.
+int timg_open( const char *filename, struct TiledImage *ti );
+
+//! Open .timg data held in memory (which must stay valid until
+//! timg_close). Returns IMG_SUCCESS or an IMG_ERR_* value.
+int timg_open_mem( const void *data, size_t len, struct TiledImage *ti );
+
+//! Close an opened tiled image.
+void timg_close( struct TiledImage *ti );
+
+//! Decode the region of w x h pixels whose top left pixel is (x, y),
+//! which must lie within the image, into out (whose rows are
+//! out_stride pixels apart). Only the tiles covering the region are
+//! decoded, in parallel. Returns IMG_SUCCESS, IMG_ERR_CORRUPT if a
+//! tile is damaged, IMG_ERR_MALLOC_FAILED, or IMG_ERR_CANCELLED if the
+//! current job (see imgjob.h) was stopped.
+int timg_read_region( const struct TiledImage *ti, int32_t x, int32_t y, int32_t w, int32_t h,
+                      uint32_t *out, size_t out_stride );
+
+//! Encode img as .timg data with tiles of tile_size x tile_size pixels,
+//! compressed (in parallel) at the given zlib level (0 stores every
+//! tile). On success, *buf is set to the data (which the caller must
+//! free) and *len to its size. Returns IMG_SUCCESS or an IMG_ERR_* value.
+int timg_encode( const struct Image *img, int32_t tile_size, int level, void **buf, size_t *len );
+
+#endif // TIMG_H